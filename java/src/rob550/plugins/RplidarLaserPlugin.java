@@ -77,13 +77,17 @@ public class RplidarLaserPlugin implements lcm.spy.SpyPlugin
             return T.getScaleX();
         }
 
-        public void setData(rplidar_laser_t l)
+        /** Display l and hand back the scan it replaces (or null) so
+         * the caller can decode the next message into it. **/
+        public synchronized rplidar_laser_t swapData(rplidar_laser_t l)
         {
+            rplidar_laser_t old = this.l;
             this.l = l;
             repaint();
+            return old;
         }
 
-        public void paint(Graphics gin)
+        public synchronized void paint(Graphics gin)
         {
             Graphics2D g = (Graphics2D) gin;
 
@@ -137,7 +141,7 @@ public class RplidarLaserPlugin implements lcm.spy.SpyPlugin
                 min_intensity = Double.MAX_VALUE;
                 max_intensity = -Double.MAX_VALUE;
 
-                for (int i = 0; i < l.intensities.length; i++) {
+                for (int i = 0; i < l.nintensities; i++) {
                     min_intensity = Math.min(min_intensity, l.intensities[i]);
                     max_intensity = Math.max(max_intensity, l.intensities[i]);
                 }
@@ -369,11 +373,44 @@ public class RplidarLaserPlugin implements lcm.spy.SpyPlugin
         }
     }
 
+    /** Decode into l, reusing its arrays when they are large enough.
+     * The arrays may be longer than nranges/nintensities afterwards. **/
+    static void decode(DataInput ins, rplidar_laser_t l) throws IOException
+    {
+        if (ins.readLong() != rplidar_laser_t.LCM_FINGERPRINT)
+            throw new IOException("LCM Decode error: bad fingerprint");
+
+        l.utime = ins.readLong();
+        l.nranges = ins.readInt();
+        if (l.nranges < 0)
+            throw new IOException("LCM Decode error: bad nranges");
+        if (l.ranges == null || l.ranges.length < l.nranges) {
+            l.ranges = new float[l.nranges];
+            l.thetas = new float[l.nranges];
+            l.times = new long[l.nranges];
+        }
+        for (int i = 0; i < l.nranges; i++)
+            l.ranges[i] = ins.readFloat();
+        for (int i = 0; i < l.nranges; i++)
+            l.thetas[i] = ins.readFloat();
+        for (int i = 0; i < l.nranges; i++)
+            l.times[i] = ins.readLong();
+
+        l.nintensities = ins.readInt();
+        if (l.nintensities < 0)
+            throw new IOException("LCM Decode error: bad nintensities");
+        if (l.intensities == null || l.intensities.length < l.nintensities)
+            l.intensities = new float[l.nintensities];
+        for (int i = 0; i < l.nintensities; i++)
+            l.intensities[i] = ins.readFloat();
+    }
+
     class Viewer extends JInternalFrame implements lcm.lcm.LCMSubscriber
     {
         ChannelData cd;
         LaserPane lp;
         ParameterGUI pg;
+        rplidar_laser_t spare = new rplidar_laser_t();
 
         public Viewer(ChannelData cd)
         {
@@ -399,8 +436,10 @@ public class RplidarLaserPlugin implements lcm.spy.SpyPlugin
         public void messageReceived(lcm.lcm.LCM lcm, String channel, LCMDataInputStream ins)
         {
             try {
-                rplidar_laser_t l = new rplidar_laser_t(ins);
-                lp.setData(l);
+                decode(ins, spare);
+                spare = lp.swapData(spare);
+                if (spare == null)
+                    spare = new rplidar_laser_t();
             } catch (IOException ex) {
                 System.out.println("ex: "+ex);
                 return;
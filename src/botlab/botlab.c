@@ -35,6 +35,7 @@
 #include "lcmtypes/pose_xyt_t.h"
 #include "lcmtypes/rplidar_laser_t.h"
 
+#include "rplidar_scan.h"
 #include "xyt.h"
 
 #define JOYSTICK_REVERSE_SPEED1 -0.25f
@@ -84,7 +85,9 @@ struct state
     zarray_t* past_poses;
 
     // lidar
-    rplidar_laser_t *lidar;
+    rplidar_scan_t *lidar;
+    float *lidar_points;        // 3*lidar_points_capacity floats for rendering
+    int lidar_points_capacity;
 
     // covariance ellipse
     ellipse_t* ellipse;
@@ -545,8 +548,12 @@ static void * render_thread (void *data)
 					break;
 				}
 			}
-					
-			float *points = malloc ( (3 * num_points) * sizeof(float));
+
+			if (num_points > state->lidar_points_capacity) {
+				state->lidar_points = realloc (state->lidar_points, 3 * num_points * sizeof(float));
+				state->lidar_points_capacity = num_points;
+			}
+			float *points = state->lidar_points;
 
 			if (pose_idx >= 0)
 			{
@@ -554,17 +561,8 @@ static void * render_thread (void *data)
 				zarray_get( state->past_poses, pose_idx, cur_p);
 				
 				//Set x,y positions of each point based off the one pose chosen
-				int l, m=0;
 				printf("number of lidar points: %d\n", num_points);
-				for(l = 0; l < num_points; l++)
-				{
-					points[m] = state->lidar->ranges[l] * cos(state->lidar->thetas[l]);
-					m++;
-					points[m] = -state->lidar->ranges[l] * sin(state->lidar->thetas[l]);
-					m++;
-					points[m] = 0;
-					m++;
-				}
+				rplidar_scan_to_points (state->lidar, points, 3);
 
 			//render lidar dots
 			vx_buffer_t *vblidaronepose = vx_world_get_buffer (state->vw, "lidaronepose");
@@ -641,7 +639,6 @@ static void * render_thread (void *data)
 				double y_diff = end_y - start_y;
 				double y_slope = y_diff / num_points;
 
-				float *points = malloc ( (3 * num_points) * sizeof(float));
 				//Set x,y positions of each point based off linear interpolation of poses
 				int l, m=0;
 				printf("number of lidar points: %d\n", num_points);
@@ -736,13 +733,15 @@ static void pose_xyt_handler (const lcm_recv_buf_t *rbuf, const char *channel, c
 /**
  * @brief RP LIDAR LCM Handler
  */
-static void rplidar_laser_handler (const lcm_recv_buf_t *rbuf, const char *channel, const rplidar_laser_t *msg, void *user)
+static void rplidar_laser_handler (const lcm_recv_buf_t *rbuf, const char *channel, void *user)
 {
     state_t *state = user;
 
     pthread_mutex_lock (&state->mutex);
     {
-		*(state->lidar) = *msg; // update current lidar reading
+		// update current lidar reading in place
+		if (rplidar_scan_decode (state->lidar, rbuf->data, rbuf->data_size))
+			printf ("WRN: bad rplidar_laser_t on %s\n", channel);
     }
     pthread_mutex_unlock (&state->mutex);
 }
@@ -772,7 +771,7 @@ state_t *state_create (void)
 	state->past_ellipses = zarray_create(sizeof(ellipse_t));
 
 	// lidar
-	state->lidar = calloc(1, sizeof(rplidar_laser_t));
+	state->lidar = rplidar_scan_create(RPLIDAR_SCAN_MAX_RETURNS);
 
     state->vw = vx_world_create ();
     state->app.display_finished = display_finished;
@@ -805,7 +804,8 @@ void state_destroy(state_t *state)
 	zarray_destroy(state->past_poses);
 	zarray_destroy(state->past_ellipses);
 	free(state->pose);
-	free(state->lidar);
+	rplidar_scan_destroy(state->lidar);
+	free(state->lidar_points);
 	free(state->ellipse);
 	//TODO: Everything else...
 }
@@ -980,9 +980,9 @@ int main (int argc, char *argv[])
     pose_xyt_t_subscribe (state->lcm,
                           getopt_get_string (state->gopt, "odometry-channel"),
                           pose_xyt_handler, state);
-    rplidar_laser_t_subscribe (state->lcm,
-                               getopt_get_string (state->gopt, "rplidar-laser-channel"),
-                               rplidar_laser_handler, state);
+    lcm_subscribe (state->lcm,
+                   getopt_get_string (state->gopt, "rplidar-laser-channel"),
+                   rplidar_laser_handler, state);
 
     // Launch worker threads
     pthread_create (&state->command_thread, NULL, command_thread, state);
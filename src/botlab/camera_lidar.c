@@ -30,6 +30,8 @@
 #include "lcmtypes/maebot_diff_drive_t.h"
 #include "lcmtypes/rplidar_laser_t.h"
 
+#include "rplidar_scan.h"
+
 #define JOYSTICK_REVERSE_SPEED1 -0.25f
 #define JOYSTICK_FORWARD_SPEED1  0.35f
 
@@ -79,6 +81,7 @@ struct state
     gsl_matrix *H;
     gsl_matrix *cal_matrix;
     
+    rplidar_scan_t *scan;   // last scan, reused by every rplidar_handler call
     zarray_t *laser_points; // zarray of float[3] {x, y, z} elements
 
     
@@ -140,10 +143,17 @@ static uint32_t hsv2rgb (float h, float s, float v)
     return abgr;
 }
 
-static void rplidar_handler (const lcm_recv_buf_t *rbuf, const char *channel, const rplidar_laser_t *msg, void *user)
+static void rplidar_handler (const lcm_recv_buf_t *rbuf, const char *channel, void *user)
 {
     state_t *state = user;
 
+    // only this handler touches state->scan
+    if (rplidar_scan_decode (state->scan, rbuf->data, rbuf->data_size)) {
+        printf ("WRN: bad rplidar_laser_t on %s\n", channel);
+        return;
+    }
+    const rplidar_scan_t *msg = state->scan;
+
     pthread_mutex_lock (&state->mutex);
     {
         zarray_clear (state->laser_points);
@@ -645,6 +655,7 @@ state_t * state_create (void)
     state->lcm = lcm_create (NULL);
     state->vw = vx_world_create ();
     state->layer_map = zhash_create (sizeof(vx_display_t *), sizeof(vx_layer_t *), zhash_ptr_hash, zhash_ptr_equals);
+    state->scan = rplidar_scan_create (RPLIDAR_SCAN_MAX_RETURNS);
     state->laser_points = zarray_create (sizeof(float[3]));
 
     // Camera linear calibration matrices
@@ -763,7 +774,7 @@ int main (int argc, char *argv[])
     pthread_create (&state->render_thread,  NULL, render_thread, state);
 
     // Subscribe to rplidar scans
-    rplidar_laser_t_subscribe (state->lcm, "RPLIDAR_LASER", rplidar_handler, state);
+    lcm_subscribe (state->lcm, "RPLIDAR_LASER", rplidar_handler, state);
 
     while (state->running)
         lcm_handle_timeout (state->lcm, 250);
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "lcmtypes/rplidar_laser_t.h"
+
+#include "rplidar_scan.h"
+
+// LCM encodes everything big-endian
+static inline uint32_t
+decode_u32 (const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline int64_t
+decode_i64 (const uint8_t *p)
+{
+    return (int64_t) (((uint64_t) decode_u32 (p) << 32) | decode_u32 (p + 4));
+}
+
+static inline float
+decode_float (const uint8_t *p)
+{
+    uint32_t u = decode_u32 (p);
+    float f;
+    memcpy (&f, &u, sizeof(f));
+    return f;
+}
+
+static void
+decode_floats (float *dst, const uint8_t *p, int n)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = decode_float (p + 4*i);
+}
+
+static void
+scan_reserve (rplidar_scan_t *scan, int nranges, int nintensities)
+{
+    if (nranges > scan->capacity) {
+        scan->ranges = realloc (scan->ranges, nranges * sizeof(float));
+        scan->thetas = realloc (scan->thetas, nranges * sizeof(float));
+        scan->times = realloc (scan->times, nranges * sizeof(int64_t));
+        scan->capacity = nranges;
+    }
+    if (nintensities > scan->intensities_capacity) {
+        scan->intensities = realloc (scan->intensities, nintensities * sizeof(float));
+        scan->intensities_capacity = nintensities;
+    }
+}
+
+rplidar_scan_t *
+rplidar_scan_create (int capacity)
+{
+    rplidar_scan_t *scan = calloc (1, sizeof(*scan));
+    scan_reserve (scan, capacity, capacity);
+    return scan;
+}
+
+void
+rplidar_scan_destroy (rplidar_scan_t *scan)
+{
+    if (!scan)
+        return;
+
+    free (scan->ranges);
+    free (scan->thetas);
+    free (scan->times);
+    free (scan->intensities);
+    free (scan);
+}
+
+int
+rplidar_scan_decode (rplidar_scan_t *scan, const void *buf, int len)
+{
+    const uint8_t *p = buf;
+
+    // fingerprint, utime, nranges, nintensities
+    if (len < 24 || decode_i64 (p) != __rplidar_laser_t_get_hash ())
+        return -1;
+
+    int32_t nranges = (int32_t) decode_u32 (p + 16);
+    if (nranges < 0 || nranges > (len - 24) / 16)
+        return -1;
+
+    // ranges, thetas and times are 16 bytes per return
+    int pos = 20 + 16*nranges;
+    int32_t nintensities = (int32_t) decode_u32 (p + pos);
+    if (nintensities < 0 || nintensities > (len - pos - 4) / 4)
+        return -1;
+
+    scan_reserve (scan, nranges, nintensities);
+
+    scan->utime = decode_i64 (p + 8);
+    scan->nranges = nranges;
+    scan->nintensities = nintensities;
+
+    decode_floats (scan->ranges, p + 20, nranges);
+    decode_floats (scan->thetas, p + 20 + 4*nranges, nranges);
+    const uint8_t *t = p + 20 + 8*nranges;
+    for (int i = 0; i < nranges; i++)
+        scan->times[i] = decode_i64 (t + 8*i);
+    decode_floats (scan->intensities, p + pos + 4, nintensities);
+
+    return 0;
+}
+
+void
+rplidar_scan_to_points (const rplidar_scan_t *scan, float *points, int dim)
+{
+    for (int i = 0; i < scan->nranges; i++) {
+        points[dim*i + 0] = scan->ranges[i] * cosf (scan->thetas[i]);
+        points[dim*i + 1] = -scan->ranges[i] * sinf (scan->thetas[i]);
+        if (dim == 3)
+            points[dim*i + 2] = 0;
+    }
+}
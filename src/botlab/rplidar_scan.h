@@ -0,0 +1,61 @@
+#ifndef __RPLIDAR_SCAN_H__
+#define __RPLIDAR_SCAN_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A caller-owned rplidar_laser_t. The lcm-gen decoder mallocs every array
+ * of every message; rplidar_scan_decode() instead fills these buffers
+ * from the raw LCM payload and only reallocates when a scan is larger
+ * than any seen before, so a steady-state scan handler never touches the
+ * heap. Subscribe with lcm_subscribe() and pass rbuf->data along. */
+typedef struct rplidar_scan rplidar_scan_t;
+struct rplidar_scan
+{
+    int64_t utime;
+
+    int32_t nranges;
+    float *ranges;          // [m]
+    float *thetas;          // [rad]
+    int64_t *times;         // [usec]
+
+    int32_t nintensities;
+    float *intensities;
+
+    // allocated lengths of the arrays above
+    int capacity;
+    int intensities_capacity;
+};
+
+/* Returns in a boost mode revolution, a good default capacity. Larger
+ * scans still decode; the buffers grow to fit. */
+#define RPLIDAR_SCAN_MAX_RETURNS 4096
+
+/* Preallocate room for capacity returns. 0 defers allocation to the
+ * first decode. */
+rplidar_scan_t *
+rplidar_scan_create (int capacity);
+
+void
+rplidar_scan_destroy (rplidar_scan_t *scan);
+
+/* Decode an encoded rplidar_laser_t (fingerprint included) into scan.
+ * Returns 0 on success, -1 if the buffer is truncated or is not an
+ * rplidar_laser_t, in which case scan is left untouched. */
+int
+rplidar_scan_decode (rplidar_scan_t *scan, const void *buf, int len);
+
+/* Convert returns to points in the sensor frame: x forward, y left. The
+ * rplidar measures thetas clockwise, so y = -range*sin(theta). points
+ * receives nranges points of dim floats each; dim is 2 or 3 (z = 0). */
+void
+rplidar_scan_to_points (const rplidar_scan_t *scan, float *points, int dim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__RPLIDAR_SCAN_H__
@@ -13,7 +13,9 @@
 #include <sys/ioctl.h>
 #include <linux/i2c-dev.h>
 
+#include "common/getopt.h"
 #include "common/timestamp.h"
+#include "common/timesync.h"
 
 #include <lcm/lcm.h>
 #include "lcmtypes/maebot_diff_drive_t.h"
@@ -73,6 +75,15 @@ lcm_t *lcm;
 int port;
 int i2c_leds_fd;
 
+// Maps sama5 utimes onto the host clock. The sama5 counts microseconds;
+// its crystal is good to well under 0.1%, so 1e-3 keeps the bound loose
+// enough never to diverge. A jump of more than half a second means the
+// bottom board was reset.
+#define SAMA5_RATE_ERROR 0.001
+#define SAMA5_RESET_TIME 0.5
+timesync_t *sama5_sync;
+int raw_utime;
+
 int
 writen (int fd, const void *buf, size_t count);
 
@@ -115,13 +126,13 @@ send_command (command_t command, int port)
 }
 
 int
-open_port (void)
+open_port (const char *device)
 {
     //attempt to open port
     int fd;
 
-    if ((fd = open ("/dev/ttyO1", O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1)
-	    printf ("error opening /dev/ttyO1\r\n");
+    if ((fd = open (device, O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1)
+	    printf ("error opening %s\r\n", device);
     else
 	    fcntl (fd, F_SETFL, 0);
 
@@ -180,8 +191,12 @@ writen (int fd, const void* buf, size_t count)
 	return i;
 }
 
+// Blocks until a valid state packet arrives. first_byte_utime receives
+// the host time at which the first magic byte was read: the read is
+// blocked waiting for it, so this is as close to the arrival time as we
+// can get without the parse and copy time of the rest of the packet.
 state_t
-get_state (int port)
+get_state (int port, int64_t *first_byte_utime)
 {
 	state_t state;
 
@@ -196,8 +211,13 @@ get_state (int port)
 
         while (num_magic != 4) {
             readn (port, (void *)&magic_check, 1);
-            if (magic_check == 0xFD)
+            if (magic_check == 0xFD) {
+                if (num_magic == 0)
+                    *first_byte_utime = utime_now ();
                 num_magic++;
+            }
+            else
+                num_magic = 0;
         }
 
         uint32_t size = 0;
@@ -249,14 +269,27 @@ sama5_state_thread (void *arg)
 
 	while(1) {
 		// Telemetry handling
-		state = get_state (port);
+		int64_t first_byte_utime;
+		state = get_state (port, &first_byte_utime);
+
+        // published utimes should be from the variscite. The sama5 stamps
+        // each sample before sending it, so the first byte can only arrive
+        // later; timesync tracks the minimum of that latency and maps the
+        // sama5 clock onto ours, removing the serial and scheduling jitter.
+        int64_t utime = first_byte_utime;
+        if (!raw_utime) {
+            int resyncs = sama5_sync->resync_count;
+            timesync_update (sama5_sync, first_byte_utime, state.utime);
+            if (sama5_sync->resync_count != resyncs && resyncs > 0)
+                printf ("WRN: sama5 clock jumped by %.3f s, resynchronizing\n",
+                        sama5_sync->last_sync_error);
+            utime = timesync_get_host_utime (sama5_sync, state.utime);
+        }
 
 		pthread_mutex_lock (&statelock);
 
-        // published utimes should be from the variscite
-        int64_t now = utime_now ();
-        shared_state.motor_feedback.utime = now;
-        shared_state.sensor_data.utime = now;
+        shared_state.motor_feedback.utime = utime;
+        shared_state.sensor_data.utime = utime;
 
         shared_state.motor_feedback.utime_sama5 = state.utime;
         shared_state.sensor_data.utime_sama5 = state.utime;
@@ -498,8 +531,22 @@ main (int argc, char *argv[])
     // so that redirected stdout won't be insanely buffered.
     setvbuf (stdout, (char *) NULL, _IONBF, 0);
 
+    getopt_t *gopt = getopt_create ();
+    getopt_add_bool (gopt, 'h', "help", 0, "Show this help screen");
+    getopt_add_string (gopt, 'd', "device", "/dev/ttyO1", "SAMA5 serial device (maebot_sim provides a pty)");
+    getopt_add_bool (gopt, '\0', "raw-utime", 0, "Publish first-byte arrival times instead of synchronized sama5 times");
+
+    if (!getopt_parse (gopt, argc, argv, 1) || getopt_get_bool (gopt, "help")) {
+        printf ("Usage: %s [options]\n\n", argv[0]);
+        getopt_do_usage (gopt);
+        return 0;
+    }
+
     maebot_shared_state_init (&shared_state);
 
+    raw_utime = getopt_get_bool (gopt, "raw-utime");
+    sama5_sync = timesync_create (1e6, 0, SAMA5_RATE_ERROR, SAMA5_RESET_TIME);
+
 	lcm = lcm_create (NULL);
 	if (!lcm)
 		exit (EXIT_FAILURE);
@@ -509,7 +556,7 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
     }
 
-	port = open_port ();
+	port = open_port (getopt_get_string (gopt, "device"));
 	if (port == -1) {
 		printf ("error opening port\n");
 		exit (EXIT_FAILURE);
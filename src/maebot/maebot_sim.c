@@ -0,0 +1,744 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <termios.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+#include <lcm/lcm.h>
+
+#include "common/getopt.h"
+#include "common/timestamp.h"
+
+#include "types.h"
+#include "rplidar.h"
+
+/* Simulated SAMA5 bottom board and RPLidar, each behind a pseudo-terminal,
+ * so maebot_driver and rplidar_driver can be exercised without a robot.
+ *
+ * Both endpoints pace their output to the configured baud rate and can
+ * drop or corrupt individual bytes and insert runs of garbage between
+ * packets, to exercise the framing and resync code. Telemetry utimes are
+ * stamped from the host clock at transmission. By default the driver
+ * publishes sama5 times mapped through its clock sync, so utime -
+ * utime_sama5 is only the estimated offset, about the minimum latency;
+ * run it with --raw-utime to publish first-byte arrival times instead,
+ * and utime - utime_sama5 is then each packet's latency to its first
+ * byte. */
+
+const uint32_t HEADER_BYTES = 12;
+const uint32_t UART_MAGIC_NUMBER = 0xFDFDFDFD;
+
+#define TICKS_PER_SEC_FULL  6000.0  // encoder rate at full commanded speed
+#define YAW_RATE_FULL       4.0     // [rad/s] turning rate, wheels at full and opposite
+#define GYRO_LSB_PER_RAD    938.7   // 16.4 LSB/(deg/s)
+#define ACCEL_1G            16384   // +/- 2g full scale
+#define MOTOR_CURRENT_FULL  400
+
+#define MAX_GARBAGE         16      // longest desync run
+#define MAX_PACKET          256
+
+typedef struct sim_stats sim_stats_t;
+struct sim_stats
+{
+    int64_t packets;
+    int64_t bytes;
+    int64_t dropped;        // bytes
+    int64_t corrupted;      // bytes
+    int64_t desyncs;        // garbage runs inserted
+    int64_t overruns;       // bytes lost because nobody was reading
+    int64_t requests;       // valid packets from the driver
+    int64_t bad_requests;
+};
+
+typedef struct endpoint endpoint_t;
+struct endpoint
+{
+    const char *name;
+    const char *link;
+    char path[64];
+    int master;
+    int slave;
+
+    int bytes_per_sec;
+    int64_t line_free_utime;
+
+    double drop_rate;
+    double corrupt_rate;
+    double desync_rate;
+    unsigned int rand_state;
+
+    pthread_mutex_t lock;
+    sim_stats_t stats;
+};
+
+typedef struct sama5_sim sama5_sim_t;
+struct sama5_sim
+{
+    endpoint_t ep;
+    int state_hz;
+    double imu_noise;       // [LSB]
+
+    state_t state;
+    command_t cmd;
+    double ticks[2];
+
+    uint8_t rx[64];
+    int rx_have;
+};
+
+enum { LIDAR_IDLE, LIDAR_SCAN, LIDAR_EXPRESS };
+
+typedef struct lidar_sim lidar_sim_t;
+struct lidar_sim
+{
+    endpoint_t ep;
+    double rpm;
+    int samples_per_rev;
+    double range_noise;     // [m]
+    double invalid_rate;    // fraction of returns with no echo
+
+    int mode;
+    int sample;             // index of the next sample within the revolution
+    int first_packet;
+
+    uint8_t rx[MAX_PACKET+4];
+    int rx_have;
+};
+
+// === Random numbers ============================================
+static int
+roll (unsigned int *state, double p)
+{
+    return p > 0 && rand_r (state) < p * ((double) RAND_MAX + 1);
+}
+
+static double
+gaussian (unsigned int *state, double sigma)
+{
+    if (sigma <= 0)
+        return 0;
+
+    double u1 = (rand_r (state) + 1.0) / ((double) RAND_MAX + 2);
+    double u2 = rand_r (state) / ((double) RAND_MAX + 1);
+    return sigma * sqrt (-2 * log (u1)) * cos (2 * M_PI * u2);
+}
+
+// === PTY endpoints =============================================
+static int
+endpoint_open (endpoint_t *ep)
+{
+    ep->master = posix_openpt (O_RDWR | O_NOCTTY);
+    if (ep->master < 0 || grantpt (ep->master) || unlockpt (ep->master) ||
+        ptsname_r (ep->master, ep->path, sizeof (ep->path))) {
+        printf ("ERR: %s: could not allocate a pty: %m\n", ep->name);
+        return -1;
+    }
+
+    // Hold the slave open ourselves. This keeps the master usable across
+    // driver restarts and lets us put the line in raw mode before anyone
+    // connects; otherwise the tty echoes our own output back at us.
+    ep->slave = open (ep->path, O_RDWR | O_NOCTTY);
+    struct termios opts;
+    if (ep->slave < 0 || tcgetattr (ep->slave, &opts)) {
+        printf ("ERR: %s: could not configure %s: %m\n", ep->name, ep->path);
+        return -1;
+    }
+    cfmakeraw (&opts);
+    tcsetattr (ep->slave, TCSANOW, &opts);
+
+    // A UART with nobody listening just loses bytes
+    fcntl (ep->master, F_SETFL, O_NONBLOCK);
+
+    if (ep->link != NULL && strlen (ep->link) > 0) {
+        unlink (ep->link);
+        if (symlink (ep->path, ep->link)) {
+            printf ("ERR: %s: could not link %s: %m\n", ep->name, ep->link);
+            return -1;
+        }
+        printf ("%s: %s -> %s\n", ep->name, ep->link, ep->path);
+    }
+    else
+        printf ("%s: %s\n", ep->name, ep->path);
+
+    pthread_mutex_init (&ep->lock, NULL);
+    return 0;
+}
+
+static void
+endpoint_close (endpoint_t *ep)
+{
+    if (ep->link != NULL && strlen (ep->link) > 0)
+        unlink (ep->link);
+    close (ep->slave);
+    close (ep->master);
+}
+
+/* Block until fd is readable or until utime. Returns > 0 if readable. */
+static int
+wait_readable (int fd, int64_t until)
+{
+    int64_t dt = until - utime_now ();
+    if (dt < 0)
+        dt = 0;
+
+    fd_set fds;
+    FD_ZERO (&fds);
+    FD_SET (fd, &fds);
+    struct timeval tv = { .tv_sec = dt / 1000000, .tv_usec = dt % 1000000 };
+    return select (fd+1, &fds, NULL, NULL, &tv);
+}
+
+/* Transmit one packet through the fault model, paced to the baud rate */
+static void
+endpoint_write (endpoint_t *ep, const uint8_t *buf, int len)
+{
+    uint8_t out[MAX_GARBAGE + MAX_PACKET];
+    sim_stats_t delta = { .packets = 1 };
+    int n = 0;
+
+    if (roll (&ep->rand_state, ep->desync_rate)) {
+        int garbage = 1 + rand_r (&ep->rand_state) % MAX_GARBAGE;
+        for (int i = 0; i < garbage; i++)
+            out[n++] = rand_r (&ep->rand_state);
+        delta.desyncs++;
+    }
+
+    for (int i = 0; i < len && i < MAX_PACKET; i++) {
+        if (roll (&ep->rand_state, ep->drop_rate)) {
+            delta.dropped++;
+            continue;
+        }
+        out[n] = buf[i];
+        if (roll (&ep->rand_state, ep->corrupt_rate)) {
+            out[n] ^= 1 << (rand_r (&ep->rand_state) % 8);
+            delta.corrupted++;
+        }
+        n++;
+    }
+
+    // Wait for the line to drain the previous packet
+    int64_t now = utime_now ();
+    if (ep->line_free_utime > now)
+        usleep (ep->line_free_utime - now);
+    else
+        ep->line_free_utime = now;
+    ep->line_free_utime += (int64_t) n * 1000000 / ep->bytes_per_sec;
+
+    int res = write (ep->master, out, n);
+    delta.bytes = res > 0 ? res : 0;
+    delta.overruns = n - delta.bytes;
+
+    pthread_mutex_lock (&ep->lock);
+    ep->stats.packets += delta.packets;
+    ep->stats.bytes += delta.bytes;
+    ep->stats.dropped += delta.dropped;
+    ep->stats.corrupted += delta.corrupted;
+    ep->stats.desyncs += delta.desyncs;
+    ep->stats.overruns += delta.overruns;
+    pthread_mutex_unlock (&ep->lock);
+}
+
+static void
+endpoint_count_request (endpoint_t *ep, int ok)
+{
+    pthread_mutex_lock (&ep->lock);
+    if (ok)
+        ep->stats.requests++;
+    else
+        ep->stats.bad_requests++;
+    pthread_mutex_unlock (&ep->lock);
+}
+
+static void
+endpoint_report (endpoint_t *ep, sim_stats_t *last, double dt)
+{
+    pthread_mutex_lock (&ep->lock);
+    sim_stats_t s = ep->stats;
+    pthread_mutex_unlock (&ep->lock);
+
+    printf ("%-6s %7.1f pkt/s %8.0f B/s  drop %-5ld corrupt %-5ld desync %-4ld overrun %-6ld req %-5ld bad %ld\n",
+            ep->name,
+            (s.packets - last->packets) / dt,
+            (s.bytes - last->bytes) / dt,
+            (long) (s.dropped - last->dropped),
+            (long) (s.corrupted - last->corrupted),
+            (long) (s.desyncs - last->desyncs),
+            (long) (s.overruns - last->overruns),
+            (long) (s.requests - last->requests),
+            (long) (s.bad_requests - last->bad_requests));
+    *last = s;
+}
+
+// === SAMA5 bottom board ========================================
+/* Command packets use the same framing as telemetry: four magic bytes,
+ * size, type, payload, XOR checksum of the payload */
+static void
+sama5_parse_byte (sama5_sim_t *sim, uint8_t b)
+{
+    const int msg_sz = HEADER_BYTES + COMMAND_T_BUFFER_BYTES + 1;
+
+    if (sim->rx_have < 4) {
+        if (b == 0xFD)
+            sim->rx[sim->rx_have++] = b;
+        else
+            sim->rx_have = 0;
+        return;
+    }
+
+    sim->rx[sim->rx_have++] = b;
+    if (sim->rx_have == HEADER_BYTES) {
+        uint32_t size = read32 (sim->rx + 4);
+        uint32_t type = read32 (sim->rx + 8);
+        if (size != COMMAND_T_BUFFER_BYTES || type != COMMAND_TYPE) {
+            endpoint_count_request (&sim->ep, 0);
+            sim->rx_have = 0;
+        }
+        return;
+    }
+    if (sim->rx_have < msg_sz)
+        return;
+
+    sim->rx_have = 0;
+    uint8_t *payload = sim->rx + HEADER_BYTES;
+    if (calc_checksum (payload, COMMAND_T_BUFFER_BYTES) != sim->rx[msg_sz-1]) {
+        endpoint_count_request (&sim->ep, 0);
+        return;
+    }
+    deserialize_command (payload, &sim->cmd);
+    endpoint_count_request (&sim->ep, 1);
+}
+
+static void
+sama5_step (sama5_sim_t *sim, int64_t now, double dt)
+{
+    state_t *state = &sim->state;
+    command_t *cmd = &sim->cmd;
+    unsigned int *rs = &sim->ep.rand_state;
+
+    double left = cmd->motor_left_speed / (double) UINT16_MAX;
+    double right = cmd->motor_right_speed / (double) UINT16_MAX;
+    state->flags = 0;
+    if (cmd->flags & flags_motor_left_reverse_mask) {
+        left = -left;
+        state->flags |= flags_motor_left_reverse_cmd_mask;
+    }
+    if (cmd->flags & flags_motor_right_reverse_mask) {
+        right = -right;
+        state->flags |= flags_motor_right_reverse_cmd_mask;
+    }
+    if (cmd->flags & flags_motor_left_coast_mask)
+        state->flags |= flags_motor_left_coast_cmd_mask;
+    if (cmd->flags & flags_motor_right_coast_mask)
+        state->flags |= flags_motor_right_coast_cmd_mask;
+
+    sim->ticks[0] += left * TICKS_PER_SEC_FULL * dt;
+    sim->ticks[1] += right * TICKS_PER_SEC_FULL * dt;
+
+    state->utime = now;
+    state->encoder_left_ticks = (int32_t) sim->ticks[0];
+    state->encoder_right_ticks = (int32_t) sim->ticks[1];
+    state->motor_left_speed_cmd = cmd->motor_left_speed;
+    state->motor_right_speed_cmd = cmd->motor_right_speed;
+
+    double yaw_rate = (right - left) / 2 * YAW_RATE_FULL;
+    state->accel[0] = (int16_t) gaussian (rs, sim->imu_noise);
+    state->accel[1] = (int16_t) gaussian (rs, sim->imu_noise);
+    state->accel[2] = (int16_t) (ACCEL_1G + gaussian (rs, sim->imu_noise));
+    state->gyro[0] = (int16_t) gaussian (rs, sim->imu_noise);
+    state->gyro[1] = (int16_t) gaussian (rs, sim->imu_noise);
+    state->gyro[2] = (int16_t) (yaw_rate * GYRO_LSB_PER_RAD + gaussian (rs, sim->imu_noise));
+    for (int i = 0; i < 3; i++)
+        state->gyro_int[i] += (int64_t) (state->gyro[i] * dt * 1e6);
+
+    for (int i = 0; i < 3; i++)
+        state->line_sensors[i] = 1000 + (int) gaussian (rs, 20);
+    state->range = 500 + (int) gaussian (rs, 5);
+    state->motor_current_left = fabs (left) * MOTOR_CURRENT_FULL;
+    state->motor_current_right = fabs (right) * MOTOR_CURRENT_FULL;
+
+    state->pwm_prea = cmd->pwm_prea;
+    state->pwm_diva = cmd->pwm_diva;
+    state->pwm_prd = cmd->pwm_prd;
+}
+
+static void *
+sama5_thread (void *arg)
+{
+    sama5_sim_t *sim = arg;
+    endpoint_t *ep = &sim->ep;
+
+    const int msg_sz = HEADER_BYTES + STATE_T_BUFFER_BYTES + 1;
+    uint8_t buf[msg_sz];
+    write32 (buf + 0, UART_MAGIC_NUMBER);
+    write32 (buf + 4, STATE_T_BUFFER_BYTES);
+    write32 (buf + 8, STATE_TYPE);
+
+    const int64_t period = 1000000 / sim->state_hz;
+    int64_t last = utime_now ();
+    int64_t next = last;
+
+    while (1) {
+        if (wait_readable (ep->master, next) > 0) {
+            uint8_t rx[256];
+            int res = read (ep->master, rx, sizeof (rx));
+            for (int i = 0; i < res; i++)
+                sama5_parse_byte (sim, rx[i]);
+            continue;
+        }
+
+        int64_t now = utime_now ();
+        sama5_step (sim, now, (now - last) * 1e-6);
+        last = now;
+
+        serialize_state (&sim->state, buf + HEADER_BYTES);
+        buf[msg_sz-1] = calc_checksum (buf + HEADER_BYTES, STATE_T_BUFFER_BYTES);
+        endpoint_write (ep, buf, msg_sz);
+
+        // Don't try to catch up after a stall; the real board doesn't
+        next += period;
+        if (next < now)
+            next = now + period;
+    }
+
+    return NULL;
+}
+
+// === RPLidar ===================================================
+/* Ranges inside a 4 x 3 m room, seen from slightly off center */
+static double
+lidar_world_range (double theta)
+{
+    const double px = 0.3, py = -0.2;
+    const double xmin = -2.0, xmax = 2.0, ymin = -1.5, ymax = 1.5;
+
+    double dx = cos (theta), dy = sin (theta);
+    double t = HUGE_VAL;
+    if (dx > 1e-9)
+        t = fmin (t, (xmax - px) / dx);
+    if (dx < -1e-9)
+        t = fmin (t, (xmin - px) / dx);
+    if (dy > 1e-9)
+        t = fmin (t, (ymax - py) / dy);
+    if (dy < -1e-9)
+        t = fmin (t, (ymin - py) / dy);
+    return t;
+}
+
+/* Next simulated return in q2 millimeters, 0 for no echo */
+static uint16_t
+lidar_next_sample (lidar_sim_t *sim, int32_t *angle_q6)
+{
+    double theta = 2 * M_PI * sim->sample / sim->samples_per_rev;
+    *angle_q6 = (int32_t) (sim->sample * (360 << 6) / sim->samples_per_rev);
+    sim->sample = (sim->sample + 1) % sim->samples_per_rev;
+
+    if (roll (&sim->ep.rand_state, sim->invalid_rate))
+        return 0;
+
+    double r = lidar_world_range (theta) + gaussian (&sim->ep.rand_state, sim->range_noise);
+    int q2 = (int) (r * 1000 * 4);
+    return q2 < 0 ? 0 : (q2 > 0xfffc ? 0xfffc : q2);
+}
+
+static void
+lidar_send_descriptor (lidar_sim_t *sim, uint32_t len, int send_mode, uint8_t data_type)
+{
+    uint32_t v = (len & 0x3fffffff) | ((uint32_t) send_mode << 30);
+    uint8_t buf[7] = { MAGIC_0, MAGIC_1, v, v >> 8, v >> 16, v >> 24, data_type };
+    endpoint_write (&sim->ep, buf, sizeof (buf));
+}
+
+static void
+lidar_handle_request (lidar_sim_t *sim, uint8_t request, const uint8_t *payload, int len)
+{
+    switch (request) {
+        case REQUEST_STOP:
+        case REQUEST_RESET:
+            sim->mode = LIDAR_IDLE;
+            break;
+
+        case REQUEST_GET_HEALTH: {
+            uint8_t buf[3] = { HEALTH_GOOD, 0, 0 };
+            lidar_send_descriptor (sim, 3, SEND_MODE_SINGLE_RESPONSE, 0x06);
+            endpoint_write (&sim->ep, buf, sizeof (buf));
+            break;
+        }
+
+        case REQUEST_GET_INFO: {
+            // Model, firmware minor/major, hardware, 16 byte serial
+            uint8_t buf[20] = { 0x18, 24, 1, 5 };
+            for (int i = 4; i < 20; i++)
+                buf[i] = 0xa0 + i;
+            lidar_send_descriptor (sim, 20, SEND_MODE_SINGLE_RESPONSE, 0x04);
+            endpoint_write (&sim->ep, buf, sizeof (buf));
+            break;
+        }
+
+        case REQUEST_SCAN:
+        case REQUEST_FORCE_SCAN:
+            lidar_send_descriptor (sim, 5, SEND_MODE_MULTI_RESPONSE, ANS_TYPE_MEASUREMENT);
+            sim->mode = LIDAR_SCAN;
+            sim->sample = 0;
+            break;
+
+        case REQUEST_EXPRESS_SCAN:
+            // Every working mode answers in the legacy capsule format
+            lidar_send_descriptor (sim, EXPRESS_PACKET_LEN, SEND_MODE_MULTI_RESPONSE,
+                                   ANS_TYPE_MEASUREMENT_CAPSULED);
+            sim->mode = LIDAR_EXPRESS;
+            sim->sample = 0;
+            sim->first_packet = 1;
+            break;
+
+        default:
+            endpoint_count_request (&sim->ep, 0);
+            return;
+    }
+    endpoint_count_request (&sim->ep, 1);
+}
+
+/* Requests are 0xA5 and a command byte. Commands with the top bit set
+ * carry a length, payload and XOR checksum. */
+static void
+lidar_parse_byte (lidar_sim_t *sim, uint8_t b)
+{
+    uint8_t *rx = sim->rx;
+
+    if (sim->rx_have == 0) {
+        if (b == MAGIC_0)
+            rx[sim->rx_have++] = b;
+        return;
+    }
+
+    rx[sim->rx_have++] = b;
+    if (sim->rx_have == 2 && !(rx[1] & 0x80)) {
+        lidar_handle_request (sim, rx[1], NULL, 0);
+        sim->rx_have = 0;
+        return;
+    }
+    if (sim->rx_have < 3 || sim->rx_have < 4 + rx[2])
+        return;
+
+    sim->rx_have = 0;
+    uint8_t cs = 0;
+    for (int i = 0; i < 3 + rx[2]; i++)
+        cs ^= rx[i];
+    if (cs != rx[3 + rx[2]]) {
+        endpoint_count_request (&sim->ep, 0);
+        return;
+    }
+    lidar_handle_request (sim, rx[1], rx + 3, rx[2]);
+}
+
+static void
+lidar_send_node (lidar_sim_t *sim)
+{
+    int start = sim->sample == 0;
+    int32_t angle_q6;
+    uint16_t dist_q2 = lidar_next_sample (sim, &angle_q6);
+    int quality = dist_q2 ? 47 : 0;
+
+    uint8_t buf[5] = {
+        (quality << 2) | (!start << 1) | start,
+        ((angle_q6 & 0x7f) << 1) | 0x1,
+        angle_q6 >> 7,
+        dist_q2,
+        dist_q2 >> 8,
+    };
+    endpoint_write (&sim->ep, buf, sizeof (buf));
+}
+
+/* Capsule of the next EXPRESS_NODES samples. Angles are exact, so every
+ * angle compensation code is zero. */
+static void
+lidar_send_capsule (lidar_sim_t *sim)
+{
+    uint8_t buf[EXPRESS_PACKET_LEN];
+    int32_t start_q6 = 0;
+
+    uint8_t *cabin = buf + 4;
+    for (int c = 0; c < EXPRESS_CABINS; c++, cabin += EXPRESS_CABIN_LEN) {
+        int32_t angle_q6;
+        uint16_t d0 = lidar_next_sample (sim, &angle_q6);
+        if (c == 0)
+            start_q6 = angle_q6;
+        uint16_t d1 = lidar_next_sample (sim, &angle_q6);
+
+        d0 &= 0xfffc;
+        d1 &= 0xfffc;
+        cabin[0] = d0;
+        cabin[1] = d0 >> 8;
+        cabin[2] = d1;
+        cabin[3] = d1 >> 8;
+        cabin[4] = 0;
+    }
+
+    buf[2] = start_q6;
+    buf[3] = ((start_q6 >> 8) & 0x7f) | (sim->first_packet ? 0x80 : 0);
+    sim->first_packet = 0;
+
+    uint8_t cs = 0;
+    for (int i = 2; i < EXPRESS_PACKET_LEN; i++)
+        cs ^= buf[i];
+    buf[0] = (EXPRESS_SYNC_0 << 4) | (cs & 0xf);
+    buf[1] = (EXPRESS_SYNC_1 << 4) | (cs >> 4);
+
+    endpoint_write (&sim->ep, buf, sizeof (buf));
+}
+
+static void *
+lidar_thread (void *arg)
+{
+    lidar_sim_t *sim = arg;
+    endpoint_t *ep = &sim->ep;
+
+    const double sample_us = 60e6 / (sim->rpm * sim->samples_per_rev);
+    double next = utime_now ();
+
+    while (1) {
+        int64_t deadline = sim->mode == LIDAR_IDLE ? utime_now () + 100000 : (int64_t) next;
+        if (wait_readable (ep->master, deadline) > 0) {
+            uint8_t rx[256];
+            int res = read (ep->master, rx, sizeof (rx));
+            for (int i = 0; i < res; i++)
+                lidar_parse_byte (sim, rx[i]);
+            continue;
+        }
+
+        int64_t now = utime_now ();
+        if (sim->mode == LIDAR_IDLE) {
+            next = now;
+            continue;
+        }
+
+        if (sim->mode == LIDAR_SCAN) {
+            lidar_send_node (sim);
+            next += sample_us;
+        }
+        else {
+            lidar_send_capsule (sim);
+            next += sample_us * EXPRESS_NODES;
+        }
+        if (next < now)
+            next = now;
+    }
+
+    return NULL;
+}
+
+// === Main ======================================================
+static volatile sig_atomic_t running = 1;
+
+static void
+sig_handler (int signo)
+{
+    running = 0;
+}
+
+static void
+endpoint_setup (endpoint_t *ep, const char *name, getopt_t *gopt, const char *link_opt, int stream)
+{
+    ep->name = name;
+    ep->link = getopt_get_string (gopt, link_opt);
+    ep->bytes_per_sec = getopt_get_int (gopt, "baud") / 10;
+    ep->drop_rate = getopt_get_double (gopt, "drop-rate");
+    ep->corrupt_rate = getopt_get_double (gopt, "corrupt-rate");
+    ep->desync_rate = getopt_get_double (gopt, "desync-rate");
+    ep->rand_state = getopt_get_int (gopt, "seed") * 2 + stream;
+}
+
+int
+main (int argc, char *argv[])
+{
+    // so that redirected stdout won't be insanely buffered.
+    setvbuf (stdout, (char *) NULL, _IONBF, 0);
+
+    getopt_t *gopt = getopt_create ();
+    getopt_add_bool (gopt, 'h', "help", 0, "Show this help screen");
+    getopt_add_string (gopt, '\0', "sama5-link", "/tmp/ttySAMA5", "Symlink to the SAMA5 pty, empty for none");
+    getopt_add_string (gopt, '\0', "lidar-link", "/tmp/ttyRPLIDAR", "Symlink to the RPLidar pty, empty for none");
+    getopt_add_bool (gopt, '\0', "no-sama5", 0, "Don't simulate the SAMA5");
+    getopt_add_bool (gopt, '\0', "no-lidar", 0, "Don't simulate the RPLidar");
+    getopt_add_int (gopt, 'b', "baud", "115200", "Simulated line rate, both endpoints");
+
+    getopt_add_spacer (gopt, "---------------");
+    getopt_add_int (gopt, '\0', "state-hz", "100", "SAMA5 telemetry rate");
+    getopt_add_double (gopt, '\0', "imu-noise", "10", "IMU noise std dev [LSB]");
+    getopt_add_double (gopt, '\0', "rpm", "330", "RPLidar rotation rate");
+    getopt_add_int (gopt, '\0', "samples-per-rev", "360", "RPLidar returns per revolution");
+    getopt_add_double (gopt, '\0', "range-noise", "0.01", "RPLidar range noise std dev [m]");
+    getopt_add_double (gopt, '\0', "invalid-rate", "0.02", "Fraction of RPLidar returns with no echo");
+
+    getopt_add_spacer (gopt, "---------------");
+    getopt_add_double (gopt, '\0', "drop-rate", "0", "Probability a transmitted byte is lost");
+    getopt_add_double (gopt, '\0', "corrupt-rate", "0", "Probability a transmitted byte has a bit flipped");
+    getopt_add_double (gopt, '\0', "desync-rate", "0", "Probability of garbage before a packet");
+    getopt_add_int (gopt, '\0', "seed", "1", "Random seed");
+    getopt_add_double (gopt, '\0', "report-period", "1", "Seconds between statistics reports, 0 disables");
+
+    if (!getopt_parse (gopt, argc, argv, 1) || getopt_get_bool (gopt, "help")) {
+        printf ("Usage: %s [options]\n\n", argv[0]);
+        getopt_do_usage (gopt);
+        return 0;
+    }
+
+    signal (SIGTERM, sig_handler);
+    signal (SIGINT, sig_handler);
+
+    sama5_sim_t *sama5 = NULL;
+    lidar_sim_t *lidar = NULL;
+    pthread_t sama5_pid, lidar_pid;
+
+    if (!getopt_get_bool (gopt, "no-sama5")) {
+        sama5 = calloc (1, sizeof (*sama5));
+        endpoint_setup (&sama5->ep, "sama5", gopt, "sama5-link", 0);
+        sama5->state_hz = getopt_get_int (gopt, "state-hz");
+        sama5->imu_noise = getopt_get_double (gopt, "imu-noise");
+        if (sama5->state_hz <= 0 || endpoint_open (&sama5->ep))
+            return -1;
+        pthread_create (&sama5_pid, NULL, sama5_thread, sama5);
+    }
+
+    if (!getopt_get_bool (gopt, "no-lidar")) {
+        lidar = calloc (1, sizeof (*lidar));
+        endpoint_setup (&lidar->ep, "lidar", gopt, "lidar-link", 1);
+        lidar->rpm = getopt_get_double (gopt, "rpm");
+        lidar->samples_per_rev = getopt_get_int (gopt, "samples-per-rev");
+        lidar->range_noise = getopt_get_double (gopt, "range-noise");
+        lidar->invalid_rate = getopt_get_double (gopt, "invalid-rate");
+        if (lidar->rpm <= 0 || lidar->samples_per_rev <= 0 || endpoint_open (&lidar->ep))
+            return -1;
+        pthread_create (&lidar_pid, NULL, lidar_thread, lidar);
+    }
+
+    double period = getopt_get_double (gopt, "report-period");
+    sim_stats_t sama5_last = { 0 }, lidar_last = { 0 };
+    while (running) {
+        if (period <= 0) {
+            pause ();
+            continue;
+        }
+        usleep (period * 1e6);
+        if (!running)
+            break;
+        if (sama5)
+            endpoint_report (&sama5->ep, &sama5_last, period);
+        if (lidar)
+            endpoint_report (&lidar->ep, &lidar_last, period);
+    }
+
+    // The endpoint threads die with the process
+    if (sama5)
+        endpoint_close (&sama5->ep);
+    if (lidar)
+        endpoint_close (&lidar->ep);
+    getopt_destroy (gopt);
+    return 0;
+}
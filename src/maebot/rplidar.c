@@ -2,6 +2,8 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "common/serial.h"
 #include "common/ioutils.h"
@@ -94,9 +96,147 @@ void rp_lidar_reset(int dev)
     send_command_raw(dev, REQUEST_RESET, NULL, 0);
 }
 
-void rp_lidar_scan(int dev, lcm_t *lcm, const char *channel)
+// === Scan assembly, filtering and diagnostics =================
+typedef struct rp_node
+{
+    float range;        // [m], 0 if no return
+    float theta;        // [rad]
+    int64_t utime;
+    int quality;        // [0, 63]
+} rp_node_t;
+
+typedef struct scan_state
+{
+    rplidar_laser_t laser;
+    int32_t count;
+
+    // Streaming filter window. A node is judged once both of its angular
+    // neighbors have arrived, so output lags input by one node.
+    rp_node_t prev, pending;
+    int have_pending;
+
+    rplidar_diagnostics_t diag;
+    int64_t last_scan_utime;
+} scan_state_t;
+
+static rp_filter_t filter = { .min_quality = 0, .isolation_gap = 0 };
+static const char *diag_channel = NULL;
+
+void rp_lidar_set_filter(const rp_filter_t *f)
+{
+    filter = *f;
+}
+
+void rp_lidar_set_diagnostics_channel(const char *channel)
+{
+    diag_channel = channel;
+}
+
+static void scan_state_init(scan_state_t *ss)
+{
+    memset(ss, 0, sizeof(*ss));
+    ss->laser.ranges = calloc(RP_MAX_SCAN_NODES, sizeof(*ss->laser.ranges));
+    ss->laser.thetas = calloc(RP_MAX_SCAN_NODES, sizeof(*ss->laser.thetas));
+    ss->laser.times = calloc(RP_MAX_SCAN_NODES, sizeof(*ss->laser.times));
+    ss->laser.intensities = calloc(RP_MAX_SCAN_NODES, sizeof(*ss->laser.intensities));
+}
+
+static void scan_state_destroy(scan_state_t *ss)
+{
+    free(ss->laser.ranges);
+    free(ss->laser.thetas);
+    free(ss->laser.times);
+    free(ss->laser.intensities);
+}
+
+
+static int node_ok(const rp_node_t *n)
 {
-    send_command_raw(dev, REQUEST_SCAN, NULL, 0);
+    return n->range > 0 && n->quality >= filter.min_quality;
+}
+
+static int node_near(const rp_node_t *n, const rp_node_t *b)
+{
+    return node_ok(n) && fabsf(n->range - b->range) <= filter.isolation_gap;
+}
+
+// Decide whether b, with neighbors a and c, goes into the scan
+static void scan_emit(scan_state_t *ss, const rp_node_t *a, const rp_node_t *b, const rp_node_t *c)
+{
+    ss->diag.nsamples++;
+    if (b->range <= 0)
+        return;
+
+    if (b->quality < filter.min_quality) {
+        ss->diag.nlow_quality++;
+        return;
+    }
+
+    if (filter.isolation_gap > 0 && !node_near(a, b) && !node_near(c, b)) {
+        ss->diag.nisolated++;
+        return;
+    }
+
+    if (ss->count >= RP_MAX_SCAN_NODES)
+        return;
+
+    ss->laser.ranges[ss->count] = b->range;
+    ss->laser.thetas[ss->count] = b->theta;
+    ss->laser.times[ss->count] = b->utime;
+    ss->laser.intensities[ss->count] = ((float)b->quality)/0x3f;
+    ss->count++;
+}
+
+// Forget the filter window, e.g. after a gap in the data. The pending node
+// is judged without its successor so it is still published or counted.
+static void scan_state_reset_window(scan_state_t *ss)
+{
+    if (ss->have_pending) {
+        rp_node_t none = { .range = 0 };
+        scan_emit(ss, &ss->prev, &ss->pending, &none);
+    }
+    ss->have_pending = 0;
+    ss->prev.range = 0;
+}
+
+static void scan_push(scan_state_t *ss, const rp_node_t *n)
+{
+    if (ss->have_pending) {
+        scan_emit(ss, &ss->prev, &ss->pending, n);
+        ss->prev = ss->pending;
+    }
+    ss->pending = *n;
+    ss->have_pending = 1;
+}
+
+// Close out the current revolution. The pending node belongs to the next one.
+static void scan_publish(scan_state_t *ss, lcm_t *lcm, const char *channel, int64_t utime)
+{
+    if (ss->count) {
+        ss->laser.utime = utime;
+        ss->laser.nranges = ss->count;
+        ss->laser.nintensities = ss->count;
+        rplidar_laser_t_publish(lcm, channel, &ss->laser);
+    }
+
+    if (diag_channel != NULL) {
+        ss->diag.utime = utime;
+        ss->diag.npublished = ss->count;
+        ss->diag.rpm = 0;
+        if (ss->last_scan_utime > 0 && utime > ss->last_scan_utime)
+            ss->diag.rpm = 60.0e6f / (utime - ss->last_scan_utime);
+        rplidar_diagnostics_t_publish(lcm, diag_channel, &ss->diag);
+    }
+
+    memset(&ss->diag, 0, sizeof(ss->diag));
+    ss->last_scan_utime = utime;
+    ss->count = 0;
+}
+
+/* Standard (and forced) scans. Each return is a 5 byte node. */
+static void scan_standard(int dev, lcm_t *lcm, const char *channel, uint8_t request)
+{
+    send_command_raw(dev, request, NULL, 0);
 
     // Reading info back. Multiple response. Loops forever!
     rp_descriptor_t rd;
@@ -110,62 +250,260 @@ void rp_lidar_scan(int dev, lcm_t *lcm, const char *channel)
 
     // Gather information forever and broadcast complete scans
     // Scan packets are 5 bytes
-    rplidar_laser_t laser = {
-        .ranges = calloc(1000, sizeof(*laser.ranges)),
-        .thetas = calloc(1000, sizeof(*laser.thetas)),
-        .times = calloc(1000, sizeof(*laser.times)),
-        .intensities = calloc(1000, sizeof(*laser.intensities)),
-    };
-
-    int32_t count = 0;
+    scan_state_t ss;
+    scan_state_init(&ss);
+
+    uint8_t buf[5];
+    int have = 0;
+    float last_theta = 0;
     const int64_t startup = utime_now();
     while (!halt) {
         // Read in bytes
-        uint8_t buf[5];
-        int res = read_fully_timeout(dev, buf, 5, TIMEOUT_MS);
+        int res = read_fully_timeout(dev, buf+have, 5-have, TIMEOUT_MS);
         int64_t now = utime_now();
-        if (res < 5) {
+        if (res < 5-have) {
             if (VERBOSE && (now-startup>1000000))
                 printf("ERR: Could not read range return\n");
+            ss.diag.dropped_packets++;
+            scan_state_reset_window(&ss);
+            have = 0;
+            continue;
+        }
+
+        // S and !S must disagree and the check bit must be set. Otherwise
+        // we are misaligned: drop a byte and try again.
+        if (((buf[0] ^ (buf[0] >> 1)) & 0x01) == 0 || !(buf[1] & 0x01)) {
+            ss.diag.sync_losses++;
+            scan_state_reset_window(&ss);
+            memmove(buf, buf+1, 4);
+            have = 4;
             continue;
         }
+        have = 0;
+
+        rp_node_t node = {
+            .range = ((buf[3] | (buf[4] << 8))/4.0f)/1000.0f,
+            .theta = ((((buf[1] & 0xfe) >> 1) | (buf[2] << 7))/64.0f)*d2r,
+            .utime = now,
+            .quality = (buf[0] & 0xfc) >> 2,
+        };
+        scan_push(&ss, &node);
+
+        // Check for new scan. A misaligned or corrupted node can carry a
+        // bogus start flag, so the angle must also have wrapped around.
+        if ((buf[0] & 0x01) && last_theta - node.theta > M_PI)
+            scan_publish(&ss, lcm, channel, now);
+        last_theta = node.theta;
+    }
 
-        int8_t quality = (buf[0] & 0xfc) >> 2;
-        int16_t angle = ((buf[1] & 0xfe) >> 1) | (buf[2] << 7);
-        int16_t range = buf[3] | (buf[4] << 8);
+    halt = 0;
+    scan_state_destroy(&ss);
+}
 
-        if (range > 0) {
-            laser.ranges[count] = (range/4.0f)/1000.0f;
-            laser.thetas[count] = (angle/64.0f)*d2r;
-            laser.times[count] = now;
-            laser.intensities[count] = ((float)quality)/0x3f;
+void rp_lidar_scan(int dev, lcm_t *lcm, const char *channel)
+{
+    scan_standard(dev, lcm, channel, REQUEST_SCAN);
+}
 
-            count++;
-        }
+void rp_lidar_force_scan(int dev, lcm_t *lcm, const char *channel)
+{
+    scan_standard(dev, lcm, channel, REQUEST_FORCE_SCAN);
+}
 
-        // Check for new scan
-        if ((buf[0] & 0x01) && !(buf[0] & 0x02)) {
-            if (count) {
-                laser.utime = now;
-                laser.nranges = count;
-                laser.nintensities = count;
-                rplidar_laser_t_publish(lcm, channel, &laser);
-                count = 0;
-            }
+// === Express scans ===========================================
+typedef struct express_packet
+{
+    int64_t utime;                      // host time packet was completed
+    int start;                          // first packet of a new scan
+    int32_t start_q6;                   // angle of first sample [deg, q6]
+    uint16_t dist_q2[EXPRESS_NODES];    // [mm, q2]
+    uint8_t dtheta[EXPRESS_NODES];      // 6-bit angle offset code
+} express_packet_t;
+
+/* Read the next 84 byte packet, resynchronizing on the sync nibbles if the
+ * stream is misaligned. Returns 0 on success, -1 on timeout. */
+static int express_read_packet(int dev, uint8_t *buf, int32_t *sync_losses)
+{
+    int have = 0;
+    while (!halt) {
+        int res = read_fully_timeout(dev, buf+have, EXPRESS_PACKET_LEN-have, TIMEOUT_MS);
+        if (res < 1)
+            return -1;
+        have += res;
+        if (have < EXPRESS_PACKET_LEN)
+            continue;
+
+        if ((buf[0] >> 4) == EXPRESS_SYNC_0 && (buf[1] >> 4) == EXPRESS_SYNC_1)
+            return 0;
+
+        // Lost sync. Slide forward to the next plausible packet start and
+        // read in only the bytes we are missing.
+        (*sync_losses)++;
+        int i;
+        for (i = 1; i < have; i++) {
+            if ((buf[i] >> 4) == EXPRESS_SYNC_0 &&
+                (i+1 == have || (buf[i+1] >> 4) == EXPRESS_SYNC_1))
+                break;
         }
+        memmove(buf, buf+i, have-i);
+        have -= i;
     }
 
-    halt = 0;
-    free(laser.ranges);
-    free(laser.thetas);
-    free(laser.times);
-    free(laser.intensities);
+    return -1;
 }
 
-void rp_lidar_force_scan(int dev, lcm_t *lcm, const char *channel)
+/* Validate and unpack a raw packet. Returns 0 on success, -1 on a bad checksum */
+static int express_parse(const uint8_t *buf, express_packet_t *pkt)
 {
-    printf("NOT FULLY IMPLEMENTED\n");
-    send_command_raw(dev, REQUEST_FORCE_SCAN, NULL, 0);
+    uint8_t cs = 0;
+    for (int i = 2; i < EXPRESS_PACKET_LEN; i++)
+        cs ^= buf[i];
+    if (cs != ((buf[0] & 0xf) | ((buf[1] & 0xf) << 4)))
+        return -1;
+
+    pkt->start_q6 = buf[2] | ((buf[3] & 0x7f) << 8);
+    pkt->start = (buf[3] & 0x80) != 0;
+
+    const uint8_t *cabin = buf + 4;
+    for (int c = 0; c < EXPRESS_CABINS; c++, cabin += EXPRESS_CABIN_LEN) {
+        uint16_t w0 = cabin[0] | (cabin[1] << 8);
+        uint16_t w1 = cabin[2] | (cabin[3] << 8);
+
+        pkt->dist_q2[2*c+0] = w0 & 0xfffc;
+        pkt->dist_q2[2*c+1] = w1 & 0xfffc;
+        pkt->dtheta[2*c+0] = (cabin[4] & 0xf) | ((w0 & 0x3) << 4);
+        pkt->dtheta[2*c+1] = (cabin[4] >> 4) | ((w1 & 0x3) << 4);
+    }
+
+    return 0;
+}
+
+void rp_lidar_express_scan(int dev, lcm_t *lcm, const char *channel, uint8_t working_mode)
+{
+    uint8_t payload[5] = { working_mode, 0, 0, 0, 0 };
+    send_command_raw(dev, REQUEST_EXPRESS_SCAN, payload, sizeof(payload));
+
+    rp_descriptor_t rd;
+    read_response_descriptor(dev, &rd);
+    if (rd.len < 0) {
+        printf("ERR: Could not read back express scan descriptor\n");
+        return;
+    }
+    if (rd.data_type == ANS_TYPE_MEASUREMENT_ULTRA) {
+        printf("ERR: Firmware answers mode %d with ultra capsules, which are not "
+               "supported. Use express mode instead\n", working_mode);
+        rp_lidar_stop(dev);
+        halt = 0;
+        return;
+    }
+    if (rd.data_type != ANS_TYPE_MEASUREMENT_CAPSULED) {
+        printf("ERR: Unsupported express scan answer type %x\n", rd.data_type);
+        rp_lidar_stop(dev);
+        halt = 0;
+        return;
+    }
+
+    const float d2r = 2.0f*M_PI/360.0f;
+    const int32_t rev_q16 = 360 << 16;
+
+    scan_state_t ss;
+    scan_state_init(&ss);
+
+    // Samples in a packet lie between its start angle and the start angle
+    // of the next packet, so decoding always runs one packet behind.
+    express_packet_t pkts[2];
+    express_packet_t *prev = &pkts[0], *cur = &pkts[1];
+    int have_prev = 0;
+
+    // Base angle of the last decoded sample, -1 after a reset. A scan is
+    // done when the base angle goes backwards; a packet may start exactly
+    // at zero, so the packet's own angle range can't be relied on.
+    int32_t last_q16 = -1;
+
+    uint8_t buf[EXPRESS_PACKET_LEN];
+    const int64_t startup = utime_now();
+    while (!halt) {
+        int res = express_read_packet(dev, buf, &ss.diag.sync_losses);
+        int64_t now = utime_now();
+        if (res < 0) {
+            if (VERBOSE && (now-startup>1000000))
+                printf("ERR: Could not read express packet\n");
+            ss.diag.dropped_packets++;
+            scan_state_reset_window(&ss);
+            have_prev = 0;
+            last_q16 = -1;
+            continue;
+        }
+
+        if (express_parse(buf, cur) < 0) {
+            if (VERBOSE)
+                printf("ERR: Bad express packet checksum\n");
+            ss.diag.checksum_errors++;
+            scan_state_reset_window(&ss);
+            have_prev = 0;
+            last_q16 = -1;
+            continue;
+        }
+        cur->utime = now;
+
+        // The device restarted its scan: close out whatever we had
+        if (cur->start) {
+            scan_state_reset_window(&ss);
+            if (ss.diag.nsamples > 0)
+                scan_publish(&ss, lcm, channel, now);
+            have_prev = 0;
+            last_q16 = -1;
+        }
+
+        if (have_prev) {
+            int32_t diff_q6 = cur->start_q6 - prev->start_q6;
+            if (diff_q6 < 0)
+                diff_q6 += 360 << 6;
+
+            // Assume the previous packet took as long to arrive as this one
+            int64_t dt = cur->utime - prev->utime;
+            int64_t t0 = prev->utime - dt;
+
+            int32_t inc_q16 = (diff_q6 << 10) / EXPRESS_NODES;
+            int32_t angle_q16 = prev->start_q6 << 10;
+            for (int k = 0; k < EXPRESS_NODES; k++) {
+                if (angle_q16 >= rev_q16)
+                    angle_q16 -= rev_q16;
+
+                // Base angle crossed zero: the previous revolution is done
+                int wrap = angle_q16 < last_q16;
+                last_q16 = angle_q16;
+
+                // Offset codes are unsigned q3 degrees, always subtracted
+                int32_t theta_q16 = angle_q16 - ((int32_t) prev->dtheta[k] << 13);
+                if (theta_q16 < 0)
+                    theta_q16 += rev_q16;
+                else if (theta_q16 >= rev_q16)
+                    theta_q16 -= rev_q16;
+                angle_q16 += inc_q16;
+
+                // Capsules carry no quality, so every return is full quality
+                rp_node_t node = {
+                    .range = (prev->dist_q2[k]/4.0f)/1000.0f,
+                    .theta = (theta_q16/65536.0f)*d2r,
+                    .utime = t0 + dt*k/EXPRESS_NODES,
+                    .quality = 0x3f,
+                };
+                scan_push(&ss, &node);
+
+                if (wrap)
+                    scan_publish(&ss, lcm, channel, node.utime);
+            }
+        }
+
+        express_packet_t *tmp = prev;
+        prev = cur;
+        cur = tmp;
+        have_prev = 1;
+    }
+
+    halt = 0;
+    scan_state_destroy(&ss);
 }
 
 void rp_lidar_check_info(int dev)
@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #include "lcmtypes/rplidar_laser_t.h"
+#include "lcmtypes/rplidar_diagnostics_t.h"
 
 #define TIMEOUT_MS 50
 
@@ -33,18 +34,64 @@
 #define REQUEST_FORCE_SCAN  0x21
 #define REQUEST_GET_INFO    0x50
 #define REQUEST_GET_HEALTH  0x52
+#define REQUEST_EXPRESS_SCAN 0x82
+
+// Data types reported in the response descriptor of a scan request
+#define ANS_TYPE_MEASUREMENT            0x81
+#define ANS_TYPE_MEASUREMENT_CAPSULED   0x82
+#define ANS_TYPE_MEASUREMENT_ULTRA      0x84    // A2/A3 boost, not decoded
 
 #define HEALTH_GOOD         0x0
 #define HEALTH_WARN         0x1
 #define HEALTH_ERROR        0x2
 
+// Express scan packet format. Checksum is XOR of bytes 2-83, split across
+// the low nibbles of the two sync bytes. S marks the first packet of a scan.
+// | SYNC 0xA + CS lo | SYNC 0x5 + CS hi | START ANGLE (15 bits, q6) + S | 16 CABINS  |
+// ----------------------------------------------------------------------------------
+// | 1 byte           | 1 byte           | 2 bytes                       | 5 bytes ea |
+//
+// Each cabin holds two samples: two 16-bit words, each a 14-bit q2 distance
+// [mm] with the top 2 bits of a 6-bit q3 angle offset [deg] packed in the low
+// bits, followed by a byte holding the low 4 bits of both offsets. Offsets
+// are unsigned and subtracted from the interpolated base angle.
+#define EXPRESS_SYNC_0          0xA
+#define EXPRESS_SYNC_1          0x5
+#define EXPRESS_PACKET_LEN      84
+#define EXPRESS_CABINS          16
+#define EXPRESS_CABIN_LEN       5
+#define EXPRESS_NODES           (2*EXPRESS_CABINS)
+
+// Working modes for the express scan request payload. Firmware that
+// supports multiple scan modes takes the mode id here; only modes that
+// answer with capsuled measurements are decoded. A2/A3 firmware answers
+// boost with ultra capsules, which are refused; use legacy express there.
+#define EXPRESS_MODE_LEGACY     0x0
+#define EXPRESS_MODE_BOOST      0x2
+
+// Upper bound on returns in a single revolution (boost mode at 5 Hz is ~1600)
+#define RP_MAX_SCAN_NODES       4096
+
 typedef struct rp_descriptor
 {
-    uint32_t len;
+    int32_t len;
     uint8_t send_mode;
     uint8_t data_type;
 } rp_descriptor_t;
 
+// Streaming filter applied to every return before it is published
+typedef struct rp_filter
+{
+    int min_quality;        // [0, 63] drop returns below this quality
+    float isolation_gap;    // [m] drop returns this far from both neighbors, 0 disables
+} rp_filter_t;
+
+/* Set the filter used by subsequent scans. Defaults to passing every return */
+void rp_lidar_set_filter(const rp_filter_t *filter);
+
+/* Publish per-revolution rplidar_diagnostics_t on channel. NULL disables */
+void rp_lidar_set_diagnostics_channel(const char *channel);
+
 /* Exit current device state */
 void rp_lidar_stop(int dev);
 
@@ -57,6 +104,10 @@ void rp_lidar_scan(int dev, lcm_t *lcm, const char *channel);
 /* Force a scan regardless of rotation speed */
 void rp_lidar_force_scan(int dev, lcm_t *lcm, const char *channel);
 
+/* Scan using the express protocol (angle-compressed capsules) in the given
+ * working mode. Like rp_lidar_scan, this loops until rp_lidar_stop. */
+void rp_lidar_express_scan(int dev, lcm_t *lcm, const char *channel, uint8_t working_mode);
+
 /* Check the information for the device (serial #, etc) and print it to term */
 void rp_lidar_check_info(int dev);
 
@@ -26,6 +26,10 @@ struct state {
     pthread_t scan_thread;
     pthread_t stop_thread;
 
+    // Scan mode
+    const char *mode;
+    int working_mode;
+
     // LCM stuff
     const char *channel;
     lcm_t *lcm;
@@ -48,7 +52,14 @@ scan_loop (void *args)
         printf ("Error starting rplidar motor\n");
     }
     // This loops forever, barring an error
-    rp_lidar_scan (state->dev, state->lcm, state->channel);
+    if (!strcmp (state->mode, "express"))
+        rp_lidar_express_scan (state->dev, state->lcm, state->channel, EXPRESS_MODE_LEGACY);
+    else if (!strcmp (state->mode, "boost"))
+        rp_lidar_express_scan (state->dev, state->lcm, state->channel, state->working_mode);
+    else if (!strcmp (state->mode, "force"))
+        rp_lidar_force_scan (state->dev, state->lcm, state->channel);
+    else
+        rp_lidar_scan (state->dev, state->lcm, state->channel);
     printf ("Terminating rplidar...\n");
     if (system ("echo 0 > /sys/class/gpio/gpio122/value")) {
         printf ("Error Stopping rplidar motor\n");
@@ -70,6 +81,11 @@ main (int argc, char *argv[])
     getopt_add_string (state->gopt, 'd', "device", "/dev/ttyO0", "Serial device");
     getopt_add_int (state->gopt, 'b', "baud", "115200", "Baud rate");
     getopt_add_string( state->gopt, 'c', "channel", "RPLIDAR_LASER", "LCM channel name");
+    getopt_add_string (state->gopt, 'm', "mode", "standard", "Scan mode: standard, force, express or boost");
+    getopt_add_int (state->gopt, '\0', "boost-mode-id", "2", "Express working mode id used by boost mode");
+    getopt_add_int (state->gopt, 'q', "min-quality", "0", "Drop returns below this quality [0, 63]");
+    getopt_add_double (state->gopt, '\0', "isolation-gap", "0", "Drop returns this far [m] from both neighbors, 0 disables");
+    getopt_add_string (state->gopt, '\0', "diag-channel", "RPLIDAR_DIAGNOSTICS", "LCM diagnostics channel name");
 
     if (!getopt_parse (state->gopt, argc, argv, 1) || getopt_get_bool (state->gopt, "help")) {
         printf ("Usage: %s [options]\n\n", argv[0]);
@@ -77,6 +93,14 @@ main (int argc, char *argv[])
         return 0;
     }
 
+    state->mode = getopt_get_string (state->gopt, "mode");
+    if (strcmp (state->mode, "standard") && strcmp (state->mode, "force") &&
+        strcmp (state->mode, "express") && strcmp (state->mode, "boost")) {
+        printf ("ERR: Unknown scan mode '%s'\n\n", state->mode);
+        getopt_do_usage (state->gopt);
+        return -1;
+    }
+
     signal (SIGTERM, sig_handler);
     signal (SIGINT, sig_handler);
 
@@ -92,6 +116,14 @@ main (int argc, char *argv[])
 
     state->lcm = lcm_create (NULL);
     state->channel = getopt_get_string (state->gopt, "channel");
+    state->working_mode = getopt_get_int (state->gopt, "boost-mode-id");
+
+    rp_filter_t filter = {
+        .min_quality = getopt_get_int (state->gopt, "min-quality"),
+        .isolation_gap = getopt_get_double (state->gopt, "isolation-gap"),
+    };
+    rp_lidar_set_filter (&filter);
+    rp_lidar_set_diagnostics_channel (getopt_get_string (state->gopt, "diag-channel"));
 
     // Check device health
     if (rp_lidar_check_health (state->dev) != HEALTH_GOOD)
@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+#include <assert.h>
+
+#include "smatd.h"
+
+// Approximate minimum degree ordering (Amestoy, Davis and Duff).
+//
+// Unlike exact_minimum_degree_ordering, eliminating a node does not
+// connect its neighbors to each other. Instead, the node becomes an
+// "element" whose list of variables stands for the clique that would
+// have been formed; a variable's neighbors are its remaining original
+// neighbors plus the variables of the elements it belongs to (the
+// quotient graph). Its degree is bounded from above using the element
+// sizes rather than computed exactly, which costs time proportional
+// to the pivot's neighborhood instead of to the fill. Variables with
+// identical neighborhoods are merged into supervariables and ordered
+// together, and elements whose variables are all covered by the new
+// pivot's element are absorbed into it.
+
+enum { VARIABLE, MERGED, ELEMENT, ABSORBED };
+
+struct list
+{
+    int *v;
+    int n;
+    int alloc;
+};
+
+static void list_add(struct list *l, int v)
+{
+    if (l->n == l->alloc) {
+        l->alloc = l->alloc ? 2*l->alloc : 4;
+        l->v = realloc(l->v, l->alloc * sizeof(int));
+    }
+    l->v[l->n++] = v;
+}
+
+static void list_clear(struct list *l)
+{
+    free(l->v);
+    l->v = NULL;
+    l->n = l->alloc = 0;
+}
+
+int *approx_minimum_degree_ordering(smatd_t *mat)
+{
+    int n = mat->nrows;
+
+    int *ordering = calloc(n, sizeof(int));
+    if (n == 0)
+        return ordering;
+
+    int *status = calloc(n, sizeof(int));
+    int *nv = malloc(n * sizeof(int));         // supervariable size
+    int *degree = malloc(n * sizeof(int));     // approximate external degree
+    int *esize = calloc(n, sizeof(int));       // weighted |L_e| of element e
+    int *w = calloc(n, sizeof(int));           // |L_e \ L_p| + wflg
+    int *mark = calloc(n, sizeof(int));
+    int *svnext = malloc(n * sizeof(int));     // members of each supervariable
+    int *svlast = malloc(n * sizeof(int));
+
+    // For a variable, adj are its original neighbors still needed and
+    // elts the elements it belongs to. For an element, adj is L_e.
+    struct list *adj = calloc(n, sizeof(struct list));
+    struct list *elts = calloc(n, sizeof(struct list));
+
+    // degree lists
+    int *head = malloc((n+1) * sizeof(int));
+    int *next = malloc(n * sizeof(int));
+    int *prev = malloc(n * sizeof(int));
+
+    // supervariable hash buckets
+    int *hhead = malloc(n * sizeof(int));
+    int *hnext = malloc(n * sizeof(int));
+    unsigned int *hash = malloc(n * sizeof(unsigned int));
+
+    for (int i = 0; i <= n; i++)
+        head[i] = -1;
+    for (int i = 0; i < n; i++)
+        hhead[i] = -1;
+
+    for (int i = 0; i < n; i++) {
+        svecd_t *vec = &mat->rows[i];
+        for (int k = 0; k < vec->nz; k++)
+            if (vec->indices[k] != i)
+                list_add(&adj[i], vec->indices[k]);
+
+        nv[i] = 1;
+        degree[i] = adj[i].n;
+        svnext[i] = -1;
+        svlast[i] = i;
+    }
+
+#define DEGREE_INSERT(i) do {                           \
+        int _d = degree[i];                             \
+        prev[i] = -1;                                   \
+        next[i] = head[_d];                             \
+        if (head[_d] >= 0)                              \
+            prev[head[_d]] = i;                         \
+        head[_d] = i;                                   \
+        if (_d < mindeg)                                \
+            mindeg = _d;                                \
+    } while (0)
+
+#define DEGREE_REMOVE(i) do {                           \
+        if (prev[i] >= 0)                               \
+            next[prev[i]] = next[i];                    \
+        else                                            \
+            head[degree[i]] = next[i];                  \
+        if (next[i] >= 0)                               \
+            prev[next[i]] = prev[i];                    \
+    } while (0)
+
+    int mindeg = n;
+    for (int i = 0; i < n; i++)
+        DEGREE_INSERT(i);
+
+    int tag = 0;        // mark[] tokens
+    int wflg = 1;       // w[] base
+    int nel = 0;        // scalar variables eliminated
+    int norder = 0;
+
+    while (nel < n) {
+        // select the pivot
+        while (head[mindeg] < 0)
+            mindeg++;
+        int p = head[mindeg];
+        DEGREE_REMOVE(p);
+
+        int nvp = nv[p];
+        nel += nvp;
+        for (int j = p; j >= 0; j = svnext[j])
+            ordering[norder++] = j;
+
+        // form the new element L_p from p's neighbors and the
+        // elements it belongs to, which are absorbed into it.
+        tag++;
+        mark[p] = tag;
+        struct list lp = { 0 };
+        int lpsize = 0;
+
+        for (int k = 0; k < elts[p].n; k++) {
+            int e = elts[p].v[k];
+            if (status[e] != ELEMENT)
+                continue;
+
+            for (int q = 0; q < adj[e].n; q++) {
+                int i = adj[e].v[q];
+                if (status[i] != VARIABLE || mark[i] == tag)
+                    continue;
+                mark[i] = tag;
+                list_add(&lp, i);
+                lpsize += nv[i];
+            }
+
+            status[e] = ABSORBED;
+            list_clear(&adj[e]);
+        }
+
+        for (int q = 0; q < adj[p].n; q++) {
+            int i = adj[p].v[q];
+            if (status[i] != VARIABLE || mark[i] == tag)
+                continue;
+            mark[i] = tag;
+            list_add(&lp, i);
+            lpsize += nv[i];
+        }
+
+        status[p] = ELEMENT;
+        list_clear(&adj[p]);
+        list_clear(&elts[p]);
+        int lptag = tag;
+
+        for (int k = 0; k < lp.n; k++)
+            DEGREE_REMOVE(lp.v[k]);
+
+        // w[e] - wflg = |L_e \ L_p| for every element e touching L_p.
+        if (wflg > INT_MAX - 2*n - 2) {
+            for (int e = 0; e < n; e++)
+                w[e] = 0;
+            wflg = 1;
+        }
+
+        for (int k = 0; k < lp.n; k++) {
+            int i = lp.v[k];
+            for (int q = 0; q < elts[i].n; q++) {
+                int e = elts[i].v[q];
+                if (status[e] != ELEMENT)
+                    continue;
+                if (w[e] < wflg)
+                    w[e] = esize[e] + wflg;
+                w[e] -= nv[i];
+            }
+        }
+
+        // update the degrees, pruning each variable's lists: elements
+        // inside L_p are absorbed, neighbors inside L_p are covered by
+        // p.
+        for (int k = 0; k < lp.n; k++) {
+            int i = lp.v[k];
+            unsigned int h = 0;
+
+            int dege = 0, nelts = 0;
+            for (int q = 0; q < elts[i].n; q++) {
+                int e = elts[i].v[q];
+                if (status[e] != ELEMENT)
+                    continue;
+
+                int we = w[e] - wflg;
+                if (we == 0) {
+                    status[e] = ABSORBED;
+                    list_clear(&adj[e]);
+                    continue;
+                }
+
+                dege += we;
+                elts[i].v[nelts++] = e;
+                h += e;
+            }
+            elts[i].n = nelts;
+            list_add(&elts[i], p);
+            h += p;
+
+            int dega = 0, nadj = 0;
+            for (int q = 0; q < adj[i].n; q++) {
+                int j = adj[i].v[q];
+                if (status[j] != VARIABLE || mark[j] == lptag)
+                    continue;
+
+                dega += nv[j];
+                adj[i].v[nadj++] = j;
+                h += j;
+            }
+            adj[i].n = nadj;
+
+            int ext = lpsize - nv[i];
+            int d = n - nel - nv[i];
+            if (degree[i] + ext < d)
+                d = degree[i] + ext;
+            if (dega + dege + ext < d)
+                d = dega + dege + ext;
+            degree[i] = d;
+
+            hash[i] = h % n;
+            hnext[i] = hhead[hash[i]];
+            hhead[hash[i]] = i;
+        }
+
+        wflg += n + 1;
+
+        // merge indistinguishable variables: those with the same
+        // neighbors and elements.
+        for (int k = 0; k < lp.n; k++) {
+            int bucket = hash[lp.v[k]];
+            int i = hhead[bucket];
+            hhead[bucket] = -1;
+
+            for (; i >= 0; i = hnext[i]) {
+                if (status[i] != VARIABLE)
+                    continue;
+
+                tag++;
+                for (int q = 0; q < adj[i].n; q++)
+                    mark[adj[i].v[q]] = tag;
+                for (int q = 0; q < elts[i].n; q++)
+                    mark[elts[i].v[q]] = tag;
+
+                for (int j = hnext[i]; j >= 0; j = hnext[j]) {
+                    if (status[j] != VARIABLE ||
+                        adj[j].n != adj[i].n || elts[j].n != elts[i].n)
+                        continue;
+
+                    int same = 1;
+                    for (int q = 0; same && q < adj[j].n; q++)
+                        same = mark[adj[j].v[q]] == tag;
+                    for (int q = 0; same && q < elts[j].n; q++)
+                        same = mark[elts[j].v[q]] == tag;
+                    if (!same)
+                        continue;
+
+                    degree[i] -= nv[j];
+                    nv[i] += nv[j];
+                    nv[j] = 0;
+                    status[j] = MERGED;
+                    list_clear(&adj[j]);
+                    list_clear(&elts[j]);
+
+                    svnext[svlast[i]] = j;
+                    svlast[i] = svlast[j];
+                }
+            }
+        }
+
+        // L_p keeps only the principal variables; its weight is
+        // unchanged by the merges.
+        int nlp = 0;
+        for (int k = 0; k < lp.n; k++) {
+            int i = lp.v[k];
+            if (status[i] != VARIABLE)
+                continue;
+
+            if (degree[i] < 0)
+                degree[i] = 0;
+            DEGREE_INSERT(i);
+            lp.v[nlp++] = i;
+        }
+        lp.n = nlp;
+
+        adj[p] = lp;
+        esize[p] = lpsize;
+    }
+
+#undef DEGREE_INSERT
+#undef DEGREE_REMOVE
+
+    assert(norder == n);
+
+    for (int i = 0; i < n; i++) {
+        list_clear(&adj[i]);
+        list_clear(&elts[i]);
+    }
+
+    free(adj);
+    free(elts);
+    free(status);
+    free(nv);
+    free(degree);
+    free(esize);
+    free(w);
+    free(mark);
+    free(svnext);
+    free(svlast);
+    free(head);
+    free(next);
+    free(prev);
+    free(hhead);
+    free(hnext);
+    free(hash);
+
+    return ordering;
+}
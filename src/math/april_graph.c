@@ -1,15 +1,21 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "common/string_util.h"
 #include "common/timeprofile.h"
+#include "common/timestamp.h"
 
 #include "math_util.h"
 #include "smatd.h"
+#include "bsmatd.h"
 #include "april_graph.h"
 
 int *exact_minimum_degree_ordering(smatd_t *mat);
+int *approx_minimum_degree_ordering(smatd_t *mat);
+static void april_graph_cholesky_cache_destroy(struct april_graph_cholesky_cache *cache);
 
 double alt_mod2pi(double v)
 {
@@ -115,6 +121,7 @@ april_graph_t *april_graph_create()
 
     graph->factors = zarray_create(sizeof(april_graph_factor_t*));
     graph->nodes = zarray_create(sizeof(april_graph_node_t*));
+    graph->arena = matd_arena_create(0);
 
     return graph;
 }
@@ -137,6 +144,8 @@ void april_graph_destroy(april_graph_t *graph)
 
     zarray_destroy(graph->nodes);
     zarray_destroy(graph->factors);
+    matd_arena_destroy(graph->arena);
+    april_graph_cholesky_cache_destroy(graph->cholesky_cache);
 
     free(graph);
 }
@@ -162,6 +171,38 @@ int april_graph_dof(april_graph_t *graph)
     return factor_dof - state_dof;
 }
 
+double april_graph_factor_robust_cost(const april_graph_factor_t *factor, double chi2, double *weight)
+{
+    double p = factor->robust_param;
+    *weight = 1;
+
+    if (p <= 0)
+        return chi2;
+
+    switch (factor->robust) {
+        case APRIL_GRAPH_ROBUST_HUBER:
+            if (chi2 <= p*p)
+                return chi2;
+            *weight = p / sqrt(chi2);
+            return 2*p*sqrt(chi2) - p*p;
+
+        case APRIL_GRAPH_ROBUST_CAUCHY:
+            *weight = 1.0 / (1 + chi2 / (p*p));
+            return p*p * log1p(chi2 / (p*p));
+
+        case APRIL_GRAPH_ROBUST_DCS:
+            // the switch variable is min(1, 2 phi / (phi + chi2)) and
+            // scales the information matrix by its square.
+            if (chi2 <= p)
+                return chi2;
+            *weight = 4*p*p / ((p + chi2) * (p + chi2));
+            return p * (3*chi2 - p) / (chi2 + p);
+
+        default:
+            return chi2;
+    }
+}
+
 double april_graph_chi2(april_graph_t *graph)
 {
     double chi2 = 0;
@@ -171,7 +212,7 @@ double april_graph_chi2(april_graph_t *graph)
         zarray_get(graph->factors, i, &factor);
         april_graph_factor_eval_t *eval = factor->eval(factor, graph, NULL);
 
-        chi2 += eval->chi2;
+        chi2 += april_graph_factor_robust_cost(factor, eval->chi2, &factor->robust_weight);
 
         april_graph_factor_eval_destroy(eval);
     }
@@ -368,6 +409,7 @@ april_graph_factor_t *april_graph_factor_xyt_create(int a, int b, double *z, dou
     factor->z = doubles_copy(z, 3);
     factor->ztruth = doubles_copy(ztruth, 3);
     factor->W = matd_copy(W);
+    factor->robust_weight = 1;
 
     return factor;
 }
@@ -449,6 +491,7 @@ april_graph_factor_t *april_graph_factor_xytpos_create(int a, double *z, double
     factor->z = doubles_copy(z, 3);
     factor->ztruth = doubles_copy(ztruth, 3);
     factor->W = matd_copy(W);
+    factor->robust_weight = 1;
 
     return factor;
 }
@@ -504,27 +547,132 @@ void april_graph_cholesky_param_init(april_graph_cholesky_param_t *param)
     memset(param, 0, sizeof(april_graph_cholesky_param_t));
 
     param->ordering = NULL;
+    param->ordering_method = APRIL_GRAPH_ORDERING_AMD;
     param->max_cond = 1e16;
+    param->min_lambda = 1e-3;
+    param->nthreads = 0;
     param->show_timing = 0;
 }
 
-// Compute a Gauss-Newton update on the graph, using the specified
-// node ordering. NULL can be passed in for parameters.
-void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_param)
+// Everything april_graph_cholesky computes from the topology alone.
+struct april_graph_cholesky_cache
 {
-    april_graph_cholesky_param_t param;
-    april_graph_cholesky_param_init(&param);
+    // what it was computed from: node sizes, each factor's nodes, and
+    // the ordering parameters.
+    int *key;
+    int nkey;
+
+    int *pos;   // pos[j]: the block of node j in the ordering.
+    int *bsize;
+
+    bsmatd_t *A;
+    bsmatd_chol_t *chol;
+
+    // where block (z0, z1) of each factor lives in A->values: entry
+    // factor_blocks[factor_blocks_ptr[i] + z0*nnodes + z1] for factor
+    // i, or -1 if that block is in the lower triangle.
+    int *factor_blocks_ptr;
+    int *factor_blocks;
+
+    // each factor's evaluation, recycled from one iteration to the
+    // next as long as the same factor object, of the same type, is at
+    // that index and the eval still has the shape it produces.
+    int nfactors;
+    april_graph_factor_t **eval_factors;
+    int *eval_types;
+    april_graph_factor_eval_t **evals;
+
+    // per-thread accumulators for A->values and B, and arenas, for
+    // every thread but the caller's.
+    int nworkers;
+    double **worker_values;
+    double **worker_B;
+    matd_arena_t **worker_arenas;
+};
 
-    if (_param) {
-        memcpy(&param, _param, sizeof(april_graph_cholesky_param_t));
+static int *april_graph_cholesky_key(april_graph_t *graph, const april_graph_cholesky_param_t *param, int *_nkey)
+{
+    int nnodes = zarray_size(graph->nodes);
+    int nfactors = zarray_size(graph->factors);
+
+    int nkey = 1 + nnodes + 1 + 3 + (param->ordering ? nnodes : 0);
+    for (int i = 0; i < nfactors; i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        nkey += 1 + factor->nnodes;
     }
 
-    timeprofile_t *tp = timeprofile_create();
-    timeprofile_stamp(tp, "begin");
+    int *key = malloc(nkey * sizeof(int));
+    int k = 0;
+
+    key[k++] = nnodes;
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        key[k++] = node->length;
+    }
+
+    key[k++] = nfactors;
+    for (int i = 0; i < nfactors; i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        key[k++] = factor->nnodes;
+        for (int z = 0; z < factor->nnodes; z++)
+            key[k++] = factor->nodes[z];
+    }
+
+    key[k++] = param->ordering_method;
+    key[k++] = param->ordering != NULL;
+    key[k++] = param->ordering ? nnodes : 0;
+    if (param->ordering)
+        for (int i = 0; i < nnodes; i++)
+            key[k++] = param->ordering[i];
+
+    assert(k == nkey);
+    *_nkey = nkey;
+    return key;
+}
+
+static void april_graph_cholesky_cache_destroy(struct april_graph_cholesky_cache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    free(cache->key);
+    free(cache->pos);
+    free(cache->bsize);
+    bsmatd_destroy(cache->A);
+    bsmatd_chol_destroy(cache->chol);
+    free(cache->factor_blocks_ptr);
+    free(cache->factor_blocks);
+
+    for (int i = 0; i < cache->nfactors; i++)
+        april_graph_factor_eval_destroy(cache->evals[i]);
+    free(cache->eval_factors);
+    free(cache->eval_types);
+    free(cache->evals);
+
+    for (int t = 0; t < cache->nworkers; t++) {
+        free(cache->worker_values[t]);
+        free(cache->worker_B[t]);
+        matd_arena_destroy(cache->worker_arenas[t]);
+    }
+    free(cache->worker_values);
+    free(cache->worker_B);
+    free(cache->worker_arenas);
+
+    free(cache);
+}
+
+static struct april_graph_cholesky_cache *
+april_graph_cholesky_cache_create(april_graph_t *graph, const april_graph_cholesky_param_t *param,
+                                  timeprofile_t *tp)
+{
+    struct april_graph_cholesky_cache *cache = calloc(1, sizeof(struct april_graph_cholesky_cache));
 
-    int *ordering = NULL;
+    int *ordering = param->ordering;
 
-    if (param.ordering == NULL) {
+    if (ordering == NULL) {
         // make symbolic matrix for variable reordering.
         smatd_t *Asym = smatd_create(zarray_size(graph->nodes), zarray_size(graph->nodes));
         for (int fidx = 0; fidx < zarray_size(graph->factors); fidx++) {
@@ -540,118 +688,697 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
 
         timeprofile_stamp(tp, "make symbolic");
 
-        ordering = exact_minimum_degree_ordering(Asym);
+        if (param->ordering_method == APRIL_GRAPH_ORDERING_EXACT_MINIMUM_DEGREE)
+            ordering = exact_minimum_degree_ordering(Asym);
+        else
+            ordering = approx_minimum_degree_ordering(Asym);
         smatd_destroy(Asym);
     }
 
-    // idxs[j]: what index in x do the state variables for node j start at?
-    int *idxs = calloc(zarray_size(graph->nodes), sizeof(int));
-    int xlen = 0;
-    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+    int nnodes = zarray_size(graph->nodes);
+    int *pos = calloc(nnodes, sizeof(int));
+    int *bsize = calloc(nnodes, sizeof(int));
+    for (int i = 0; i < nnodes; i++) {
         april_graph_node_t *node;
         zarray_get(graph->nodes, ordering[i], &node);
-        idxs[ordering[i]] = xlen;
-        xlen += node->length;
+        pos[ordering[i]] = i;
+        bsize[i] = node->length;
     }
 
-    if (_param == NULL || _param->ordering == NULL)
-        free(param.ordering);
+    if (param->ordering == NULL)
+        free(ordering);
 
     timeprofile_stamp(tp, "compute ordering");
 
-    // we'll solve normal equations, Ax = B
-    smatd_t *A = smatd_create(xlen, xlen);
-    double  *B = calloc(xlen, sizeof(double));
+    // we'll solve normal equations, Ax = B. A has a block for every
+    // pair of nodes that share a factor.
+    int nfactors = zarray_size(graph->factors);
+    int nedges = 0, nblocks = 0;
+    for (int i = 0; i < nfactors; i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        nedges += factor->nnodes * (factor->nnodes - 1) / 2;
+        nblocks += factor->nnodes * factor->nnodes;
+    }
 
-    for (int i = 0; i < zarray_size(graph->factors); i++) {
+    int *edges = calloc(2*nedges + 1, sizeof(int));
+    nedges = 0;
+    for (int i = 0; i < nfactors; i++) {
         april_graph_factor_t *factor;
         zarray_get(graph->factors, i, &factor);
-        april_graph_factor_eval_t *eval = factor->eval(factor, graph, NULL);
 
         for (int z0 = 0; z0 < factor->nnodes; z0++) {
-            int n0 = factor->nodes[z0];
+            for (int z1 = z0+1; z1 < factor->nnodes; z1++) {
+                edges[2*nedges+0] = pos[factor->nodes[z0]];
+                edges[2*nedges+1] = pos[factor->nodes[z1]];
+                nedges++;
+            }
+        }
+    }
 
-            matd_t *JatW = matd_op("M'*M", eval->jacobians[z0], eval->W);
+    cache->A = bsmatd_create(nnodes, bsize, nedges, edges);
+    free(edges);
+
+    cache->factor_blocks_ptr = calloc(nfactors + 1, sizeof(int));
+    cache->factor_blocks = calloc(nblocks + 1, sizeof(int));
+    nblocks = 0;
+    for (int i = 0; i < nfactors; i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
 
+        cache->factor_blocks_ptr[i] = nblocks;
+        for (int z0 = 0; z0 < factor->nnodes; z0++) {
             for (int z1 = 0; z1 < factor->nnodes; z1++) {
-                int n1 = factor->nodes[z1];
+                int b0 = pos[factor->nodes[z0]], b1 = pos[factor->nodes[z1]];
+                cache->factor_blocks[nblocks++] = b0 > b1 ? -1 :
+                    bsmatd_block(cache->A, b0, b1) - cache->A->values;
+            }
+        }
+    }
+    cache->factor_blocks_ptr[nfactors] = nblocks;
 
-                matd_t *JatWJb = matd_op("M*M", JatW, eval->jacobians[z1]);
+    cache->nfactors = nfactors;
+    cache->eval_factors = calloc(nfactors + 1, sizeof(april_graph_factor_t*));
+    cache->eval_types = calloc(nfactors + 1, sizeof(int));
+    cache->evals = calloc(nfactors + 1, sizeof(april_graph_factor_eval_t*));
 
-                for (int row = 0; row < JatWJb->nrows; row++) {
-                    for (int col = 0; col < JatWJb->ncols; col++) {
-                        double v = smatd_get(A, row+idxs[n0], col+idxs[n1]);
-                        smatd_set(A, row+idxs[n0], col+idxs[n1], v + MATD_EL(JatWJb, row, col));
-                    }
-                }
+    timeprofile_stamp(tp, "build structure");
+
+    cache->chol = bsmatd_chol_analyze(cache->A, 1);
+    cache->pos = pos;
+    cache->bsize = bsize;
+
+    timeprofile_stamp(tp, "analyze");
+
+    return cache;
+}
+
+// Below this many factors, evaluation stays on the calling thread.
+#define APRIL_GRAPH_PARALLEL_FACTORS 1024
 
-                matd_destroy(JatWJb);
+struct april_graph_eval_work
+{
+    april_graph_t *graph;
+    struct april_graph_cholesky_cache *cache;
+    int f0, f1;             // factors f0 .. f1-1
+
+    // where to accumulate A->values and B; NULL to compute chi2 only.
+    double *values;
+    double *B;
+    matd_arena_t *arena;
+
+    double chi2;
+};
+
+// 1 if eval has the residual, information and jacobian sizes that
+// factor produces, so it can be handed back to factor->eval.
+static int april_graph_eval_fits(april_graph_t *graph, const april_graph_factor_t *factor,
+                                 const april_graph_factor_eval_t *eval)
+{
+    if (eval->length != factor->length || eval->W == NULL ||
+        eval->W->nrows != factor->length || eval->W->ncols != factor->length)
+        return 0;
+
+    for (int z = 0; z < factor->nnodes; z++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, factor->nodes[z], &node);
+
+        const matd_t *J = eval->jacobians[z];
+        if (J == NULL || J->nrows != factor->length || J->ncols != node->length)
+            return 0;
+    }
+
+    return eval->jacobians[factor->nnodes] == NULL;
+}
+
+static void *april_graph_eval_worker(void *_w)
+{
+    struct april_graph_eval_work *w = _w;
+    april_graph_t *graph = w->graph;
+    struct april_graph_cholesky_cache *cache = w->cache;
+    int *pos = cache->pos;
+    int *bsize = cache->bsize;
+    bsmatd_t *A = cache->A;
+
+    for (int i = w->f0; i < w->f1; i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+
+        if (cache->evals[i] != NULL &&
+            (cache->eval_factors[i] != factor || cache->eval_types[i] != factor->type ||
+             !april_graph_eval_fits(graph, factor, cache->evals[i]))) {
+            april_graph_factor_eval_destroy(cache->evals[i]);
+            cache->evals[i] = NULL;
+        }
+        cache->eval_factors[i] = factor;
+        cache->eval_types[i] = factor->type;
+
+        // The eval is kept in the cache, so it must not come from an
+        // arena the caller may have pushed.
+        matd_arena_t *caller_arena = matd_arena_suspend();
+        april_graph_factor_eval_t *eval = factor->eval(factor, graph, cache->evals[i]);
+        matd_arena_resume(caller_arena);
+        cache->evals[i] = eval;
+        w->chi2 += april_graph_factor_robust_cost(factor, eval->chi2, &factor->robust_weight);
+
+        if (w->values == NULL)
+            continue;
+
+        const int *blocks = &cache->factor_blocks[cache->factor_blocks_ptr[i]];
+
+        // the products below live only for this factor
+        matd_arena_push(w->arena);
+
+        for (int z0 = 0; z0 < factor->nnodes; z0++) {
+            int b0 = pos[factor->nodes[z0]];
+
+            matd_t *JatW = matd_multiply_at_b(eval->jacobians[z0], eval->W);
+            if (factor->robust_weight != 1)
+                matd_scale_inplace(JatW, factor->robust_weight);
+
+            // A is symmetric; accumulate J0'WJ1 straight into the
+            // upper triangle.
+            for (int z1 = 0; z1 < factor->nnodes; z1++) {
+                int b1 = pos[factor->nodes[z1]];
+                if (blocks[z0*factor->nnodes + z1] < 0)
+                    continue;
+
+                matd_t blk = { .nrows = bsize[b0], .ncols = bsize[b1],
+                               .data = &w->values[blocks[z0*factor->nnodes + z1]] };
+                matd_gemm(&blk, 1, JatW, 0, eval->jacobians[z1], 0, 1);
             }
 
             matd_t *R = matd_create_data(eval->length, 1, eval->r);
-            matd_t *JatWr = matd_op("M*M", JatW, R);
+            matd_t *JatWr = matd_multiply(JatW, R);
             for (int row = 0; row < JatWr->nrows; row++)
-                B[idxs[n0]+row] += MATD_EL(JatWr, row, 0);
+                w->B[A->boff[b0]+row] += MATD_EL(JatWr, row, 0);
 
             matd_destroy(R);
             matd_destroy(JatW);
             matd_destroy(JatWr);
         }
 
-        april_graph_factor_eval_destroy(eval);
+        matd_arena_pop(w->arena);
     }
 
-    // tikhanov regularization
-    // Ensure a maximum condition number of no more than maxcond.
-    // trace(A) = sum of eigenvalues. worst-case scenario is that
-    // we're rank 1 and that one eigenvalue is trace(A). Thus,
-    // ensure all other eigenvalues are at least trace(A)/maxcond.
-    if (param.max_cond > 0) {
+    return NULL;
+}
 
-        double trace = 0;
-        for (int i = 0; i < xlen; i++) {
-            double v = smatd_get(A, i, i);
-            trace += v;
+// Evaluate every factor at the current state, on up to nthreads
+// threads (<= 0: one per core), recycling the evaluations in the
+// cache. If B is not NULL, J'WJ is also accumulated into cache->A and
+// J'Wr into B. Each thread accumulates a contiguous range of factors
+// into its own copy of A and B, which are summed afterwards. Returns
+// chi2.
+static double april_graph_evaluate(april_graph_t *graph, struct april_graph_cholesky_cache *cache,
+                                   int nthreads, double *B)
+{
+    bsmatd_t *A = cache->A;
+    int nfactors = cache->nfactors;
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nfactors < APRIL_GRAPH_PARALLEL_FACTORS)
+        nthreads = 1;
+
+    if (nthreads - 1 > cache->nworkers) {
+        cache->worker_values = realloc(cache->worker_values, (nthreads - 1) * sizeof(double*));
+        cache->worker_B = realloc(cache->worker_B, (nthreads - 1) * sizeof(double*));
+        cache->worker_arenas = realloc(cache->worker_arenas, (nthreads - 1) * sizeof(matd_arena_t*));
+
+        for (int t = cache->nworkers; t < nthreads - 1; t++) {
+            cache->worker_values[t] = malloc(A->nvalues * sizeof(double));
+            cache->worker_B[t] = malloc(A->n * sizeof(double));
+            cache->worker_arenas[t] = matd_arena_create(0);
         }
+        cache->nworkers = nthreads - 1;
+    }
 
-        if (trace == 0) {
-            printf("warning: trace is zero!");
-            trace = 1;
+    struct april_graph_eval_work work[nthreads];
+    pthread_t threads[nthreads];
+
+    for (int t = 0; t < nthreads; t++) {
+        work[t] = (struct april_graph_eval_work) {
+            .graph = graph, .cache = cache,
+            .f0 = (int) ((int64_t) nfactors * t / nthreads),
+            .f1 = (int) ((int64_t) nfactors * (t+1) / nthreads),
+            .values = B ? A->values : NULL, .B = B,
+            .arena = graph->arena };
+
+        if (t > 0) {
+            work[t].arena = cache->worker_arenas[t-1];
+            if (B) {
+                work[t].values = cache->worker_values[t-1];
+                work[t].B = cache->worker_B[t-1];
+                memset(work[t].values, 0, A->nvalues * sizeof(double));
+                memset(work[t].B, 0, A->n * sizeof(double));
+            }
+            pthread_create(&threads[t], NULL, april_graph_eval_worker, &work[t]);
         }
+    }
 
-        double lambda = trace / param.max_cond;
+    april_graph_eval_worker(&work[0]);
 
-        lambda = .001;
+    double chi2 = work[0].chi2;
+    for (int t = 1; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+        chi2 += work[t].chi2;
 
-        for (int i = 0; i < xlen; i++) {
-            double v = smatd_get(A, i, i);
-            smatd_set(A, i, i, v + lambda);
+        if (B) {
+            for (int i = 0; i < A->nvalues; i++)
+                A->values[i] += work[t].values[i];
+            for (int i = 0; i < A->n; i++)
+                B[i] += work[t].B[i];
         }
     }
 
-    timeprofile_stamp(tp, "build A, B");
+    return chi2;
+}
 
-    smatd_chol_t *chol = smatd_chol(A);
-    double *x = calloc(xlen, sizeof(double));
-    smatd_chol_solve(chol, B, x);
+// Assemble the normal equations A x = B, where A = J'WJ lives in the
+// graph's cholesky cache and B = J'Wr is returned in *_B, at the
+// current state. Returns the cache; *_chi2 is the current chi2.
+static struct april_graph_cholesky_cache *
+april_graph_linearize(april_graph_t *graph, const april_graph_cholesky_param_t *param,
+                      timeprofile_t *tp, double **_B, double *_chi2)
+{
+    // the ordering and structure only depend on the topology, which
+    // rarely changes between iterations.
+    int nkey;
+    int *key = april_graph_cholesky_key(graph, param, &nkey);
+    struct april_graph_cholesky_cache *cache = graph->cholesky_cache;
+
+    if (cache && cache->nkey == nkey && !memcmp(cache->key, key, nkey * sizeof(int))) {
+        free(key);
+        bsmatd_zero(cache->A);
+        timeprofile_stamp(tp, "reuse structure");
+    } else {
+        april_graph_cholesky_cache_destroy(cache);
+        cache = april_graph_cholesky_cache_create(graph, param, tp);
+        cache->key = key;
+        cache->nkey = nkey;
+        graph->cholesky_cache = cache;
+    }
+
+    double *B = calloc(cache->A->n, sizeof(double));
+    double chi2 = april_graph_evaluate(graph, cache, param->nthreads, B);
+
+    *_B = B;
+    *_chi2 = chi2;
+    return cache;
+}
+
+// Tikhonov regularization: ensure a maximum condition number of no
+// more than max_cond. trace(A) = sum of eigenvalues. worst-case
+// scenario is that we're rank 1 and that one eigenvalue is trace(A).
+// Thus, ensure all other eigenvalues are at least trace(A)/max_cond.
+// That alone is far too little to pin down a graph with no prior (its
+// gauge directions have zero eigenvalues), so never add less than
+// min_lambda.
+static void april_graph_regularize(bsmatd_t *A, double max_cond, double min_lambda)
+{
+    if (max_cond <= 0)
+        return;
 
+    double trace = bsmatd_trace(A);
+
+    if (trace == 0) {
+        printf("WRN: trace is zero!\n");
+        trace = 1;
+    }
+
+    bsmatd_add_diagonal(A, fmax(trace / max_cond, min_lambda));
+}
+
+// state += dx for every node, with dx in the cache's block order.
+static void april_graph_apply_step(april_graph_t *graph, const struct april_graph_cholesky_cache *cache,
+                                   double *dx)
+{
     for (int i = 0; i < zarray_size(graph->nodes); i++) {
         april_graph_node_t *node;
         zarray_get(graph->nodes, i, &node);
 
-        node->update(node, &x[idxs[i]]);
+        node->update(node, &dx[cache->A->boff[cache->pos[i]]]);
     }
+}
 
-    timeprofile_stamp(tp, "solve");
+// Compute a Gauss-Newton update on the graph, using the specified
+// node ordering. NULL can be passed in for parameters.
+void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_param)
+{
+    april_graph_cholesky_param_t param;
+    april_graph_cholesky_param_init(&param);
 
-    smatd_chol_destroy(chol);
-    smatd_destroy(A);
+    if (_param) {
+        memcpy(&param, _param, sizeof(april_graph_cholesky_param_t));
+    }
+
+    timeprofile_t *tp = timeprofile_create();
+    timeprofile_stamp(tp, "begin");
+
+    double *B, chi2;
+    struct april_graph_cholesky_cache *cache = april_graph_linearize(graph, &param, tp, &B, &chi2);
+    bsmatd_t *A = cache->A;
+
+    april_graph_regularize(A, param.max_cond, param.min_lambda);
+
+    timeprofile_stamp(tp, "build A, B");
+
+    bsmatd_chol_factor(cache->chol, A, param.nthreads);
+    double *x = calloc(A->n, sizeof(double));
+    bsmatd_chol_solve(cache->chol, B, x);
+
+    april_graph_apply_step(graph, cache, x);
+
+    timeprofile_stamp(tp, "solve");
 
     free(B);
     free(x);
-    free(idxs);
 
     if (param.show_timing)
         timeprofile_display(tp);
     timeprofile_destroy(tp);
 }
+
+void april_graph_marginals(april_graph_t *graph, april_graph_cholesky_param_t *_param,
+                           int npairs, const int *pairs, matd_t **cov)
+{
+    april_graph_cholesky_param_t param;
+    april_graph_cholesky_param_init(&param);
+
+    if (_param) {
+        memcpy(&param, _param, sizeof(april_graph_cholesky_param_t));
+    }
+
+    timeprofile_t *tp = timeprofile_create();
+    timeprofile_stamp(tp, "begin");
+
+    double *B, chi2;
+    struct april_graph_cholesky_cache *cache = april_graph_linearize(graph, &param, tp, &B, &chi2);
+    free(B);
+
+    // Only the conditioning term: a damping floor would bias the
+    // covariances of a well-constrained graph.
+    april_graph_regularize(cache->A, param.max_cond, 0);
+
+    timeprofile_stamp(tp, "build A, B");
+
+    bsmatd_chol_factor(cache->chol, cache->A, param.nthreads);
+
+    timeprofile_stamp(tp, "factor");
+
+    int *blocks = malloc(2 * (npairs > 0 ? npairs : 1) * sizeof(int));
+    double **out = malloc((npairs > 0 ? npairs : 1) * sizeof(double*));
+    for (int p = 0; p < npairs; p++) {
+        april_graph_node_t *na, *nb;
+        zarray_get(graph->nodes, pairs[2*p+0], &na);
+        zarray_get(graph->nodes, pairs[2*p+1], &nb);
+
+        blocks[2*p+0] = cache->pos[pairs[2*p+0]];
+        blocks[2*p+1] = cache->pos[pairs[2*p+1]];
+        cov[p] = matd_create(na->length, nb->length);
+        out[p] = cov[p]->data;
+    }
+
+    bsmatd_chol_inverse_blocks(cache->chol, npairs, blocks, out);
+
+    timeprofile_stamp(tp, "marginals");
+
+    free(blocks);
+    free(out);
+
+    if (param.show_timing)
+        timeprofile_display(tp);
+    timeprofile_destroy(tp);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Nonlinear least-squares driver
+void april_graph_optimize_param_init(april_graph_optimize_param_t *param)
+{
+    memset(param, 0, sizeof(april_graph_optimize_param_t));
+
+    april_graph_cholesky_param_init(&param->cholesky);
+    param->method = APRIL_GRAPH_OPTIMIZE_LEVENBERG_MARQUARDT;
+    param->max_iters = 100;
+    param->chi2_tol = 1e-6;
+    param->step_tol = 1e-9;
+    param->grad_tol = 1e-9;
+    param->lambda0 = 1e-4;
+    param->radius0 = 0;
+    param->verbose = 0;
+}
+
+static double dot(const double *a, const double *b, int n)
+{
+    double acc = 0;
+    for (int i = 0; i < n; i++)
+        acc += a[i]*b[i];
+    return acc;
+}
+
+static double april_graph_state_norm(april_graph_t *graph)
+{
+    double acc = 0;
+    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        acc += dot(node->state, node->state, node->length);
+    }
+    return sqrt(acc);
+}
+
+static double *april_graph_save_state(april_graph_t *graph, double *saved)
+{
+    int len = 0;
+    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        if (saved)
+            memcpy(&saved[len], node->state, node->length * sizeof(double));
+        len += node->length;
+    }
+
+    if (saved == NULL)
+        return april_graph_save_state(graph, malloc((len > 0 ? len : 1) * sizeof(double)));
+    return saved;
+}
+
+static void april_graph_restore_state(april_graph_t *graph, const double *saved)
+{
+    int len = 0;
+    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        memcpy(node->state, &saved[len], node->length * sizeof(double));
+        len += node->length;
+    }
+}
+
+// Try dx: returns the gain ratio (actual over predicted decrease of
+// chi2) and leaves dx applied if it is positive. *chi2 is updated if
+// the step is kept.
+static double april_graph_try_step(april_graph_t *graph, struct april_graph_cholesky_cache *cache, int nthreads,
+                                   double *dx, double predicted, double *saved, double *chi2)
+{
+    april_graph_save_state(graph, saved);
+    april_graph_apply_step(graph, cache, dx);
+
+    double new_chi2 = april_graph_evaluate(graph, cache, nthreads, NULL);
+    double rho = (*chi2 - new_chi2) / predicted;
+
+    if (!isfinite(new_chi2) || !(predicted > 0) || !(rho > 0)) {
+        april_graph_restore_state(graph, saved);
+        return isfinite(rho) && predicted > 0 ? rho : -1;
+    }
+
+    *chi2 = new_chi2;
+    return rho;
+}
+
+int april_graph_optimize(april_graph_t *graph, april_graph_optimize_param_t *_param)
+{
+    april_graph_optimize_param_t param;
+    april_graph_optimize_param_init(&param);
+
+    if (_param) {
+        memcpy(&param, _param, sizeof(april_graph_optimize_param_t));
+    }
+
+    int dogleg = param.method == APRIL_GRAPH_OPTIMIZE_DOGLEG;
+    double lambda = param.lambda0, nu = 2;
+    double radius = param.radius0;
+
+    double *saved = april_graph_save_state(graph, NULL);
+    double chi2 = 0;
+    const char *reason = "iteration limit";
+
+    int iter;
+    for (iter = 0; iter < param.max_iters; iter++) {
+        int64_t utime0 = utime_now();
+
+        timeprofile_t *tp = timeprofile_create();
+        timeprofile_stamp(tp, "begin");
+
+        double *B;
+        struct april_graph_cholesky_cache *cache = april_graph_linearize(graph, &param.cholesky, tp, &B, &chi2);
+        bsmatd_t *A = cache->A;
+        int n = A->n;
+
+        if (iter == 0 && param.verbose)
+            printf("april_graph_optimize: initial chi2 %.6f\n", chi2);
+
+        double gmax = 0;
+        for (int i = 0; i < n; i++)
+            gmax = fmax(gmax, fabs(B[i]));
+
+        double *dx = calloc(n > 0 ? n : 1, sizeof(double));
+        double xtol = param.step_tol * (april_graph_state_norm(graph) + param.step_tol);
+        double old_chi2 = chi2, rho = -1;
+        int stop = 0;
+
+        if (gmax <= param.grad_tol) {
+            reason = "gradient tolerance";
+            stop = 1;
+        } else if (!dogleg) {
+            // Levenberg-Marquardt: solve (A + lambda diag(A)) dx = B,
+            // raising lambda until the step reduces chi2.
+            double *D = malloc(n * sizeof(double));
+            double *Dl = malloc(n * sizeof(double));
+            bsmatd_get_diagonal(A, D);
+            for (int i = 0; i < n; i++)
+                D[i] = fmax(D[i], 1e-9);
+
+            timeprofile_stamp(tp, "build A, B");
+
+            while (1) {
+                for (int i = 0; i < n; i++)
+                    Dl[i] = D[i] * (1 + lambda);
+                bsmatd_set_diagonal(A, Dl);
+
+                bsmatd_chol_factor(cache->chol, A, param.cholesky.nthreads);
+                bsmatd_chol_solve(cache->chol, B, dx);
+
+                if (sqrt(dot(dx, dx, n)) <= xtol) {
+                    reason = "step tolerance";
+                    stop = 1;
+                    break;
+                }
+
+                // decrease of chi2 predicted by the linear model
+                double predicted = dot(dx, B, n);
+                for (int i = 0; i < n; i++)
+                    predicted += lambda * D[i] * dx[i] * dx[i];
+
+                rho = april_graph_try_step(graph, cache, param.cholesky.nthreads, dx, predicted, saved, &chi2);
+                if (rho > 0) {
+                    double t = 2*rho - 1;
+                    lambda *= fmax(1.0 / 3, 1 - t*t*t);
+                    nu = 2;
+                    break;
+                }
+
+                lambda *= nu;
+                nu *= 2;
+                if (lambda > 1e16) {
+                    reason = "damping limit";
+                    stop = 1;
+                    break;
+                }
+            }
+
+            free(D);
+            free(Dl);
+        } else {
+            // Powell's dogleg: blend the Gauss-Newton and steepest
+            // descent steps within a trust region, shrinking it until
+            // the step reduces chi2.
+            april_graph_regularize(A, param.cholesky.max_cond, param.cholesky.min_lambda);
+
+            timeprofile_stamp(tp, "build A, B");
+
+            double *hgn = malloc(n * sizeof(double));
+            double *Ah = malloc(n * sizeof(double));
+
+            bsmatd_chol_factor(cache->chol, A, param.cholesky.nthreads);
+            bsmatd_chol_solve(cache->chol, B, hgn);
+
+            // the Cauchy point along g = B
+            bsmatd_multiply_vector(A, B, Ah);
+            double gg = dot(B, B, n), alpha = gg / dot(B, Ah, n);
+            double gnorm = sqrt(gg), hgn_norm = sqrt(dot(hgn, hgn, n));
+
+            if (radius <= 0)
+                radius = hgn_norm;
+
+            while (1) {
+                if (hgn_norm <= radius) {
+                    memcpy(dx, hgn, n * sizeof(double));
+                } else if (alpha * gnorm >= radius) {
+                    for (int i = 0; i < n; i++)
+                        dx[i] = radius / gnorm * B[i];
+                } else {
+                    // dx = a + beta (b - a), with ||dx|| = radius
+                    double aa = alpha*alpha*gg, ab = 0, bb = hgn_norm*hgn_norm;
+                    for (int i = 0; i < n; i++)
+                        ab += alpha*B[i] * hgn[i];
+                    double c = ab - aa, d = bb - 2*ab + aa;
+                    double beta = (-c + sqrt(c*c + d*(radius*radius - aa))) / d;
+                    for (int i = 0; i < n; i++)
+                        dx[i] = alpha*B[i] + beta*(hgn[i] - alpha*B[i]);
+                }
+
+                double dx_norm = sqrt(dot(dx, dx, n));
+                if (dx_norm <= xtol || dx_norm == 0) {
+                    reason = "step tolerance";
+                    stop = 1;
+                    break;
+                }
+
+                bsmatd_multiply_vector(A, dx, Ah);
+                double predicted = 2*dot(dx, B, n) - dot(dx, Ah, n);
+
+                rho = april_graph_try_step(graph, cache, param.cholesky.nthreads, dx, predicted, saved, &chi2);
+                if (rho > 0.75)
+                    radius = fmax(radius, 3*dx_norm);
+                else if (rho < 0.25)
+                    radius = dx_norm / 2;
+
+                if (rho > 0)
+                    break;
+            }
+
+            free(hgn);
+            free(Ah);
+        }
+
+        timeprofile_stamp(tp, "solve");
+
+        free(B);
+        free(dx);
+
+        if (param.cholesky.show_timing)
+            timeprofile_display(tp);
+        timeprofile_destroy(tp);
+
+        if (param.verbose && !stop)
+            printf("april_graph_optimize: iter %3d chi2 %.6f %s %.3g rho %.3f %.1f ms\n",
+                   iter, chi2, dogleg ? "radius" : "lambda", dogleg ? radius : lambda,
+                   rho, (utime_now() - utime0) / 1.0e3);
+
+        if (stop)
+            break;
+
+        if (old_chi2 - chi2 <= param.chi2_tol * old_chi2) {
+            reason = "chi2 tolerance";
+            iter++;
+            break;
+        }
+    }
+
+    if (param.verbose)
+        printf("april_graph_optimize: %d iterations, chi2 %.6f (%s)\n", iter, chi2, reason);
+
+    free(saved);
+    return iter;
+}
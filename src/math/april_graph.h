@@ -15,6 +15,13 @@ struct april_graph
     zarray_t *nodes;
 
     zhash_t *attr;  // string (char*) to arbitrary pointer
+
+    // scratch for the per-factor matrices built during an iteration
+    matd_arena_t *arena;
+
+    // the ordering and symbolic factorization of the last
+    // april_graph_cholesky; reused while the topology is unchanged.
+    struct april_graph_cholesky_cache *cholesky_cache;
 };
 
 typedef struct april_graph_factor_eval april_graph_factor_eval_t;
@@ -38,6 +45,15 @@ struct april_graph_factor_eval
 
 #define APRIL_GRAPH_NODE_XYT_TYPE 100
 
+// robust costs for a factor, as functions of its chi2 (the squared
+// Mahalanobis distance of its residual) s.
+enum {
+    APRIL_GRAPH_ROBUST_NONE = 0,    // s
+    APRIL_GRAPH_ROBUST_HUBER,       // s <= k^2 ? s : 2k sqrt(s) - k^2
+    APRIL_GRAPH_ROBUST_CAUCHY,      // c^2 log(1 + s/c^2)
+    APRIL_GRAPH_ROBUST_DCS          // s <= phi ? s : phi (3s - phi) / (s + phi)
+};
+
 typedef struct april_graph_factor april_graph_factor_t;
 struct april_graph_factor
 {
@@ -68,6 +84,19 @@ struct april_graph_factor
     double *ztruth;
     matd_t *W;
 
+    // robust cost (APRIL_GRAPH_ROBUST_*) and its parameter (k, c or
+    // phi). The solvers minimize the sum of the factors' costs; each
+    // factor's contribution to the normal equations is weighted by the
+    // derivative of its cost (iteratively reweighted least squares).
+    // DCS is dynamic covariance scaling, the closed form of
+    // switchable constraints.
+    int robust;
+    double robust_param;
+
+    // that weight at the last evaluation: 1 for an inlier, towards 0
+    // for a factor being treated as an outlier.
+    double robust_weight;
+
     void *impl;
 };
 
@@ -100,17 +129,35 @@ void april_graph_destroy(april_graph_t *graph);
 
 void april_graph_factor_eval_destroy(april_graph_factor_eval_t *eval);
 
+// fill-reducing orderings for april_graph_cholesky
+enum {
+    APRIL_GRAPH_ORDERING_AMD = 0,              // approximate minimum degree
+    APRIL_GRAPH_ORDERING_EXACT_MINIMUM_DEGREE
+};
+
 typedef struct april_graph_cholesky_param april_graph_cholesky_param_t;
 struct april_graph_cholesky_param
 {
     // if non-zero, apply tikhanov regularization to improve the
-    // condition number of the matrix. (The default behavior is
-    // max_cond = 100000.
+    // condition number of the matrix: trace(A)/max_cond, but at least
+    // min_lambda, is added to the diagonal. (The defaults are max_cond
+    // = 1e16 and min_lambda = 1e-3, so in practice 1e-3 is added, as
+    // it always has been; that keeps a graph without a prior from
+    // drifting.) april_graph_marginals ignores min_lambda.
     double max_cond;
+    double min_lambda;
 
     // Use the specified node ordering to reduce fill-in. If not
-    // specified, an ordering is computed automatically.
+    // specified, an ordering is computed automatically using
+    // ordering_method (one of APRIL_GRAPH_ORDERING_*).
     int *ordering;
+    int ordering_method;
+
+    // Threads used to evaluate the factors and to factor independent
+    // parts of the system. If zero, one per core. With more than one
+    // thread, factor eval functions are called concurrently (on
+    // different factors and evals).
+    int nthreads;
 
     int show_timing;
 };
@@ -124,9 +171,66 @@ void april_graph_cholesky_param_init(april_graph_cholesky_param_t *param);
 // ordering passed in belongs to the caller.
 void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *param);
 
+enum {
+    APRIL_GRAPH_OPTIMIZE_LEVENBERG_MARQUARDT = 0,
+    APRIL_GRAPH_OPTIMIZE_DOGLEG
+};
+
+typedef struct april_graph_optimize_param april_graph_optimize_param_t;
+struct april_graph_optimize_param
+{
+    // APRIL_GRAPH_OPTIMIZE_*. Levenberg-Marquardt damps the normal
+    // equations with lambda*diag(A); Powell's dogleg blends the
+    // Gauss-Newton and steepest descent steps within a trust region.
+    // Either way, a step that does not reduce chi2 is undone and
+    // retried with more damping or a smaller region.
+    int method;
+
+    // stop after max_iters linearizations, when an accepted step
+    // reduces chi2 by less than chi2_tol * chi2, when the step is
+    // shorter than step_tol * |state|, or when the largest element of
+    // the gradient J'Wr is below grad_tol.
+    int max_iters;
+    double chi2_tol;
+    double step_tol;
+    double grad_tol;
+
+    double lambda0;     // initial Levenberg-Marquardt damping
+    double radius0;     // initial dogleg radius; 0: the first Gauss-Newton step
+
+    // print chi2, damping and time for every iteration
+    int verbose;
+
+    // ordering, threads and timing for the linear solves. max_cond and
+    // min_lambda are only used by the dogleg method.
+    april_graph_cholesky_param_t cholesky;
+};
+
+void april_graph_optimize_param_init(april_graph_optimize_param_t *param);
+
+// Optimize the graph's state to a local minimum of chi2. NULL can be
+// passed in for parameters. Returns the number of iterations.
+int april_graph_optimize(april_graph_t *graph, april_graph_optimize_param_t *param);
+
+// Marginal covariances at the current state: cov[p] is set to the
+// block of (J'WJ)^-1 for nodes (a, b) = (pairs[2*p], pairs[2*p+1]),
+// which is node a's covariance if a == b and the cross-covariance of
+// a and b otherwise. The blocks are recovered from the sparse
+// factorization; the inverse is never formed. NULL can be passed in
+// for parameters. The caller destroys the matrices.
+void april_graph_marginals(april_graph_t *graph, april_graph_cholesky_param_t *param,
+                           int npairs, const int *pairs, matd_t **cov);
+
 int april_graph_dof(april_graph_t *graph);
+
+// The sum of the factors' robust costs; the plain chi2 if no factor
+// is robust. Updates each factor's robust_weight.
 double april_graph_chi2(april_graph_t *graph);
 
+// The robust cost of a factor with the given chi2, and its derivative
+// (the factor's weight) in *weight.
+double april_graph_factor_robust_cost(const april_graph_factor_t *factor, double chi2, double *weight);
+
 void april_graph_postscript(april_graph_t *graph, const char *path);
 
 april_graph_factor_t *april_graph_factor_xyt_create(int a, int b, double *z, double *ztruth, matd_t *W);
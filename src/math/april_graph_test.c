@@ -1,14 +1,211 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 
 #include "smatd.h"
+#include "math_util.h"
 #include "april_graph.h"
 #include "timeprofile.h"
 
 int *exact_minimum_degree_ordering(smatd_t *mat);
+int *approx_minimum_degree_ordering(smatd_t *mat);
+
+static double randn()
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = rand() / (RAND_MAX + 1.0);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// the pose of b in a's frame
+static void xyt_relative(const double *a, const double *b, double *z)
+{
+    double c = cos(a[2]), s = sin(a[2]);
+    double dx = b[0] - a[0], dy = b[1] - a[1];
+
+    z[0] =  c*dx + s*dy;
+    z[1] = -s*dx + c*dy;
+    z[2] = mod2pi(b[2] - a[2]);
+}
+
+static void xyt_compose(const double *a, const double *z, double *b)
+{
+    double c = cos(a[2]), s = sin(a[2]);
+
+    b[0] = a[0] + c*z[0] - s*z[1];
+    b[1] = a[1] + s*z[0] + c*z[1];
+    b[2] = mod2pi(a[2] + z[2]);
+}
+
+static void add_xyt_factor(april_graph_t *graph, const double *truth, int a, int b,
+                           double sigma_xy, double sigma_t)
+{
+    double ztruth[3], z[3];
+    xyt_relative(&truth[3*a], &truth[3*b], ztruth);
+    z[0] = ztruth[0] + sigma_xy * randn();
+    z[1] = ztruth[1] + sigma_xy * randn();
+    z[2] = mod2pi(ztruth[2] + sigma_t * randn());
+
+    double w_xy = 1 / (sigma_xy * sigma_xy), w_t = 1 / (sigma_t * sigma_t);
+    matd_t *W = matd_create_data(3, 3, (double[]) {
+            w_xy, 0, 0,
+            0, w_xy, 0,
+            0, 0, w_t });
+
+    april_graph_factor_t *factor = april_graph_factor_xyt_create(a, b, z, ztruth, W);
+    zarray_add(graph->factors, &factor);
+    matd_destroy(W);
+}
+
+// A robot driving laps of a circle, one meter per step and lap steps
+// per lap: noisy odometry between consecutive poses, a noisy loop
+// closure to the same spot on the previous lap, and a prior on the
+// first pose. The state starts at dead reckoning from the odometry,
+// which drifts well away from the truth.
+static april_graph_t *make_loop_graph(int nnodes, int lap)
+{
+    april_graph_t *graph = april_graph_create();
+    double *truth = malloc(3 * nnodes * sizeof(double));
+    double radius = lap / (2 * M_PI);
+
+    for (int i = 0; i < nnodes; i++) {
+        double a = 2 * M_PI * i / lap;
+        truth[3*i+0] = radius * cos(a);
+        truth[3*i+1] = radius * sin(a);
+        truth[3*i+2] = mod2pi(a + M_PI / 2);
+    }
+
+    // pinned to the truth, so that errors are not just a rigid offset
+    matd_t *W = matd_identity(3);
+    matd_scale_inplace(W, 1e6);
+    april_graph_factor_t *prior = april_graph_factor_xytpos_create(0, &truth[0], &truth[0], W);
+    zarray_add(graph->factors, &prior);
+    matd_destroy(W);
+
+    for (int i = 1; i < nnodes; i++)
+        add_xyt_factor(graph, truth, i-1, i, 0.05, 0.02);
+    for (int i = lap; i < nnodes; i++)
+        add_xyt_factor(graph, truth, i-lap, i, 0.05, 0.02);
+
+    double state[3] = { truth[0], truth[1], truth[2] };
+    for (int i = 0; i < nnodes; i++) {
+        if (i > 0) {
+            april_graph_factor_t *odom;
+            zarray_get(graph->factors, i, &odom);
+            double prev[3] = { state[0], state[1], state[2] };
+            xyt_compose(prev, odom->z, state);
+        }
+
+        april_graph_node_t *node = april_graph_node_xyt_create(state, state, &truth[3*i]);
+        zarray_add(graph->nodes, &node);
+    }
+
+    free(truth);
+    return graph;
+}
+
+// rms distance [m] of the nodes from their true positions
+static double position_error(april_graph_t *graph)
+{
+    double acc = 0;
+
+    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        double dx = node->state[0] - node->truth[0], dy = node->state[1] - node->truth[1];
+        acc += dx*dx + dy*dy;
+    }
+
+    return sqrt(acc / zarray_size(graph->nodes));
+}
+
+// 1 if ordering holds each of 0 .. n-1 exactly once
+static int is_permutation(const int *ordering, int n)
+{
+    char *seen = calloc(n > 0 ? n : 1, 1);
+    int ok = 1;
+
+    for (int i = 0; i < n; i++) {
+        if (ordering[i] < 0 || ordering[i] >= n || seen[ordering[i]]) {
+            ok = 0;
+            break;
+        }
+        seen[ordering[i]] = 1;
+    }
+
+    free(seen);
+    return ok;
+}
+
+// nonzeros in the Cholesky factor of the symmetric pattern mat when
+// its rows are eliminated in the given order, by symbolic elimination.
+static long cholesky_nnz(smatd_t *mat, const int *ordering)
+{
+    int n = mat->nrows;
+    int *pos = malloc((n > 0 ? n : 1) * sizeof(int));
+    int *nbrs = malloc((n > 0 ? n : 1) * sizeof(int));
+    char *adj = calloc((size_t) n * n + 1, 1);
+
+    for (int i = 0; i < n; i++)
+        pos[ordering[i]] = i;
+
+    for (int r = 0; r < n; r++) {
+        svecd_t *row = &mat->rows[r];
+        for (int k = 0; k < row->nz; k++) {
+            int c = row->indices[k];
+            adj[pos[r]*n + pos[c]] = 1;
+            adj[pos[c]*n + pos[r]] = 1;
+        }
+    }
+
+    long nnz = 0;
+    for (int k = 0; k < n; k++) {
+        int m = 0;
+        for (int j = k+1; j < n; j++)
+            if (adj[k*n + j])
+                nbrs[m++] = j;
+
+        nnz += m + 1;
+
+        // the remaining neighbors of k become a clique
+        for (int a = 0; a < m; a++)
+            for (int b = 0; b < m; b++)
+                adj[nbrs[a]*n + nbrs[b]] = 1;
+    }
+
+    free(pos);
+    free(nbrs);
+    free(adj);
+    return nnz;
+}
+
+// Compare the approximate and exact minimum degree orderings of the
+// pattern mat: whether the approximate one is a valid permutation, and
+// the fill of each in *amd_nnz and *exact_nnz.
+static int check_ordering(smatd_t *mat, long *amd_nnz, long *exact_nnz)
+{
+    int *amd = approx_minimum_degree_ordering(mat);
+    int *exact = exact_minimum_degree_ordering(mat);
+    int ok = is_permutation(amd, mat->nrows);
+
+    if (ok) {
+        *amd_nnz += cholesky_nnz(mat, amd);
+        *exact_nnz += cholesky_nnz(mat, exact);
+    }
+
+    free(amd);
+    free(exact);
+    return ok;
+}
 
 int main(int argc, char *argv[])
 {
-    if (0) {
+    int failed = 0;
+
+    // A chain with no prior: nothing fixes the gauge, so only the
+    // regularization keeps the Gauss-Newton step bounded. The nodes
+    // should end up about 1.5 apart, centered on the origin.
+    if (1) {
         april_graph_t *graph = april_graph_create();
 
         for (int i = 0; i < 3; i++) {
@@ -50,11 +247,294 @@ int main(int argc, char *argv[])
         }
 
         april_graph_cholesky(graph, NULL);
+
+        for (int i = 0; i < zarray_size(graph->nodes); i++) {
+            april_graph_node_t *node;
+            zarray_get(graph->nodes, i, &node);
+            printf("gauge-free node %d: %10.4f %10.4f %10.4f\n", i,
+                   node->state[0], node->state[1], node->state[2]);
+            if (!(fabs(node->state[0]) < 2)) {
+                printf("ERR: gauge-free node %d drifted to x = %f\n", i, node->state[0]);
+                failed = 1;
+            }
+        }
+        printf("gauge-free chi2: %15f\n", april_graph_chi2(graph));
+
+        april_graph_destroy(graph);
+    }
+
+    // approx_minimum_degree_ordering, the default ordering, on random
+    // symmetric patterns (sparse random graphs and chains with short
+    // jumps) and on the loop graph below: it must return a permutation
+    // with nearly the fill of the exact minimum degree ordering.
+    if (1) {
+        srand(1);
+        long amd_nnz = 0, exact_nnz = 0;
+        int bad = 0;
+
+        for (int t = 0; t < 200; t++) {
+            int n = 1 + rand() % 200;
+            smatd_t *mat = smatd_create(n, n);
+
+            for (int i = 0; i < n; i++)
+                smatd_set(mat, i, i, 1);
+            for (int e = 0; e < (t % 2 ? 3*n : n + n/5); e++) {
+                int a, b;
+                if (t % 2) {
+                    a = rand() % n;
+                    b = rand() % n;
+                } else {
+                    a = e % n;
+                    b = (a + 1 + (e < n ? 0 : rand() % (n/10 + 1))) % n;
+                }
+                smatd_set(mat, a, b, 1);
+                smatd_set(mat, b, a, 1);
+            }
+
+            if (!check_ordering(mat, &amd_nnz, &exact_nnz))
+                bad++;
+            smatd_destroy(mat);
+        }
+
+        printf("approximate minimum degree: %d/200 random patterns not a permutation, "
+               "nnz(L) %ld vs %ld exact\n", bad, amd_nnz, exact_nnz);
+        if (bad > 0 || !(amd_nnz < 1.02 * exact_nnz)) {
+            printf("ERR: approximate minimum degree ordering failed on random patterns\n");
+            failed = 1;
+        }
+
+        april_graph_t *graph = make_loop_graph(600, 100);
+        int nnodes = zarray_size(graph->nodes);
+        smatd_t *mat = smatd_create(nnodes, nnodes);
+        for (int i = 0; i < zarray_size(graph->factors); i++) {
+            april_graph_factor_t *factor;
+            zarray_get(graph->factors, i, &factor);
+            for (int a = 0; a < factor->nnodes; a++)
+                for (int b = 0; b < factor->nnodes; b++)
+                    smatd_set(mat, factor->nodes[a], factor->nodes[b], 1);
+        }
+
+        amd_nnz = exact_nnz = 0;
+        int ok = check_ordering(mat, &amd_nnz, &exact_nnz);
+        printf("approximate minimum degree: loop graph nnz(L) %ld vs %ld exact\n", amd_nnz, exact_nnz);
+        if (!ok || !(amd_nnz < 1.05 * exact_nnz)) {
+            printf("ERR: approximate minimum degree ordering failed on the loop graph\n");
+            failed = 1;
+        }
+
+        smatd_destroy(mat);
+        april_graph_destroy(graph);
+    }
+
+    // Both optimizer methods on a drifted loop graph, big enough that
+    // factors are evaluated in parallel: chi2 and the error against
+    // the truth must fall, and more threads must not change the result.
+    if (1) {
+        int nnodes = 600, lap = 100;
+        double *reference = malloc(3 * nnodes * sizeof(double));
+
+        for (int method = APRIL_GRAPH_OPTIMIZE_LEVENBERG_MARQUARDT; method <= APRIL_GRAPH_OPTIMIZE_DOGLEG; method++) {
+            for (int nthreads = 1; nthreads <= 4; nthreads += 3) {
+                srand(1);
+                april_graph_t *graph = make_loop_graph(nnodes, lap);
+                double chi2_0 = april_graph_chi2(graph), err_0 = position_error(graph);
+
+                april_graph_optimize_param_t param;
+                april_graph_optimize_param_init(&param);
+                param.method = method;
+                param.cholesky.nthreads = nthreads;
+                int iters = april_graph_optimize(graph, &param);
+
+                double chi2 = april_graph_chi2(graph), err = position_error(graph);
+                const char *name = method == APRIL_GRAPH_OPTIMIZE_DOGLEG ? "dogleg" : "levenberg-marquardt";
+                printf("%s, %d thread(s), %d factors: chi2 %.1f -> %.1f, rms error %.3f -> %.3f m in %d iterations\n",
+                       name, nthreads, zarray_size(graph->factors), chi2_0, chi2, err_0, err, iters);
+
+                // chi2 should end near the number of degrees of freedom
+                if (!(chi2 < 2 * april_graph_dof(graph)) || !(err < 0.1 * err_0)) {
+                    printf("ERR: %s did not converge\n", name);
+                    failed = 1;
+                }
+
+                double diff = 0;
+                for (int i = 0; i < nnodes; i++) {
+                    april_graph_node_t *node;
+                    zarray_get(graph->nodes, i, &node);
+                    for (int k = 0; k < 3; k++) {
+                        if (nthreads == 1)
+                            reference[3*i+k] = node->state[k];
+                        else
+                            diff = fmax(diff, fabs(node->state[k] - reference[3*i+k]));
+                    }
+                }
+                if (!(diff < 1e-6)) {
+                    printf("ERR: %s with %d threads differs from 1 thread by %g\n", name, nthreads, diff);
+                    failed = 1;
+                }
+
+                april_graph_destroy(graph);
+            }
+        }
+
+        free(reference);
+    }
+
+    // The robust kernels: each factor's weight is the derivative of its
+    // cost, and the costs are continuous where they leave the quadratic.
+    if (1) {
+        const char *names[] = { "huber", "cauchy", "dcs" };
+        april_graph_factor_t factor = { .robust_param = 3 };
+        double err = 0;
+
+        for (int robust = APRIL_GRAPH_ROBUST_HUBER; robust <= APRIL_GRAPH_ROBUST_DCS; robust++) {
+            factor.robust = robust;
+
+            for (double chi2 = 0.01; chi2 < 1000; chi2 *= 1.1) {
+                double w, w0, w1, h = 1e-6 * chi2;
+                double cost = april_graph_factor_robust_cost(&factor, chi2, &w);
+                double d = (april_graph_factor_robust_cost(&factor, chi2 + h, &w1) -
+                            april_graph_factor_robust_cost(&factor, chi2 - h, &w0)) / (2*h);
+
+                err = fmax(err, fabs(d - w));
+                if (!(cost <= chi2 + 1e-12) || !(w > 0 && w <= 1)) {
+                    printf("ERR: %s cost %f, weight %f at chi2 %f\n", names[robust-1], cost, w, chi2);
+                    failed = 1;
+                }
+            }
+        }
+
+        printf("robust kernels: weight vs derivative of cost, max error %g\n", err);
+        if (!(err < 1e-6)) {
+            printf("ERR: robust weights do not match their costs\n");
+            failed = 1;
+        }
     }
 
+    // False loop closures between far apart poses: without a kernel
+    // they drag the loop graph out of shape; with DCS they should end up
+    // weighted below 0.1 and the solution near the outlier-free one.
     if (1) {
-//        april_graph_t *g = april_graph_create_from_file("/tmp/out.graph");
-        april_graph_t *g = april_graph_create_from_file("/home/ebolson/csw0.graph");
+        int nnodes = 600, lap = 100, noutliers = 20;
+        double err_clean = 0;
+
+        for (int pass = 0; pass < 3; pass++) {
+            srand(1);
+            april_graph_t *graph = make_loop_graph(nnodes, lap);
+            int nclean = zarray_size(graph->factors);
+
+            if (pass > 0) {
+                for (int i = 0; i < noutliers; i++) {
+                    int a = rand() % nnodes, b = (a + lap/4 + rand() % (lap/2)) % nnodes;
+                    double z[3] = { 10 * randn(), 10 * randn(), M_PI * (2.0 * rand() / RAND_MAX - 1) };
+                    matd_t *W = matd_create_data(3, 3, (double[]) {
+                            400, 0, 0,
+                            0, 400, 0,
+                            0, 0, 2500 });
+                    april_graph_factor_t *factor = april_graph_factor_xyt_create(a, b, z, NULL, W);
+                    zarray_add(graph->factors, &factor);
+                    matd_destroy(W);
+                }
+            }
+
+            if (pass == 2) {
+                for (int i = 0; i < zarray_size(graph->factors); i++) {
+                    april_graph_factor_t *factor;
+                    zarray_get(graph->factors, i, &factor);
+                    factor->robust = APRIL_GRAPH_ROBUST_DCS;
+                    factor->robust_param = 10;
+                }
+            }
+
+            april_graph_optimize(graph, NULL);
+            april_graph_chi2(graph);
+            double err = position_error(graph);
+
+            double max_weight = 0;
+            for (int i = nclean; i < zarray_size(graph->factors); i++) {
+                april_graph_factor_t *factor;
+                zarray_get(graph->factors, i, &factor);
+                max_weight = fmax(max_weight, factor->robust_weight);
+            }
+
+            const char *names[] = { "no outliers", "outliers, no kernel", "outliers, dcs" };
+            printf("%s: rms error %.3f m, largest outlier weight %.3g\n", names[pass], err,
+                   pass > 0 ? max_weight : 0);
+
+            if (pass == 0)
+                err_clean = err;
+            if (pass == 2 && (!(max_weight < 0.1) || !(err < 1.5 * err_clean))) {
+                printf("ERR: dcs did not reject the false loop closures\n");
+                failed = 1;
+            }
+
+            april_graph_destroy(graph);
+        }
+    }
+
+    // Marginal covariances of a small loop graph against the inverse of
+    // the dense J'WJ: node covariances, and cross-covariances in both
+    // orders, which are recovered from the transposed block.
+    if (1) {
+        srand(1);
+        april_graph_t *graph = make_loop_graph(40, 10);
+        april_graph_optimize(graph, NULL);
+
+        int nnodes = zarray_size(graph->nodes), n = 3 * nnodes;
+        matd_t *A = matd_create(n, n);
+
+        for (int i = 0; i < zarray_size(graph->factors); i++) {
+            april_graph_factor_t *factor;
+            zarray_get(graph->factors, i, &factor);
+            april_graph_factor_eval_t *eval = factor->eval(factor, graph, NULL);
+
+            for (int z0 = 0; z0 < factor->nnodes; z0++) {
+                for (int z1 = 0; z1 < factor->nnodes; z1++) {
+                    matd_t *JWJ = matd_op("M'*M*M", eval->jacobians[z0], eval->W, eval->jacobians[z1]);
+                    for (int r = 0; r < 3; r++)
+                        for (int c = 0; c < 3; c++)
+                            MATD_EL(A, 3*factor->nodes[z0] + r, 3*factor->nodes[z1] + c) += MATD_EL(JWJ, r, c);
+                    matd_destroy(JWJ);
+                }
+            }
+
+            april_graph_factor_eval_destroy(eval);
+        }
+
+        matd_t *Ainv = matd_inverse(A);
+
+        int pairs[] = { 0, 0,  7, 7,  23, 23,  39, 39,
+                        3, 4,  4, 3,  5, 15,  15, 5,  2, 31,  31, 2,  17, 36,  36, 17 };
+        int npairs = sizeof(pairs) / sizeof(pairs[0]) / 2;
+        matd_t *cov[npairs];
+        april_graph_marginals(graph, NULL, npairs, pairs, cov);
+
+        double err = 0;
+        for (int p = 0; p < npairs; p++) {
+            double diff = 0, scale = 0;
+            for (int r = 0; r < 3; r++) {
+                for (int c = 0; c < 3; c++) {
+                    double ref = MATD_EL(Ainv, 3*pairs[2*p] + r, 3*pairs[2*p+1] + c);
+                    diff = fmax(diff, fabs(MATD_EL(cov[p], r, c) - ref));
+                    scale = fmax(scale, fabs(ref));
+                }
+            }
+            err = fmax(err, diff / scale);
+            matd_destroy(cov[p]);
+        }
+
+        printf("marginals: %d blocks, max relative error vs dense inverse %g\n", npairs, err);
+        if (!(err < 1e-6)) {
+            printf("ERR: marginal covariances do not match the dense inverse\n");
+            failed = 1;
+        }
+
+        matd_destroy(A);
+        matd_destroy(Ainv);
+        april_graph_destroy(graph);
+    }
+
+    if (argc > 1) {
+        april_graph_t *g = april_graph_create_from_file(argv[1]);
 
         april_graph_factor_t *factor = april_graph_factor_xytpos_create(0,
                                                                         (double[]) { 0, 0, 0 },
@@ -81,5 +561,5 @@ int main(int argc, char *argv[])
         april_graph_destroy(g);
     }
 
-    return 0;
+    return failed;
 }
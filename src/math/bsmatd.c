@@ -0,0 +1,1143 @@
+/*$LICENSE*/
+
+// block-sparse symmetric matrix
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "matd.h"
+#include "bsmatd.h"
+
+#define TYPE double
+
+/////////////////////////////////////////////////
+// structure
+
+static int int_compare(const void *_a, const void *_b)
+{
+    int a = *(const int*) _a, b = *(const int*) _b;
+    return (a > b) - (a < b);
+}
+
+// Build a matrix around a finished block structure (rowptr, colidx),
+// taking ownership of both.
+static bsmatd_t *bsmatd_create_structure(int nblocks, const int *bsize, int *rowptr, int *colidx)
+{
+    bsmatd_t *a = calloc(1, sizeof(bsmatd_t));
+    a->nblocks = nblocks;
+    a->bsize = malloc(sizeof(int) * (nblocks > 0 ? nblocks : 1));
+    a->boff = malloc(sizeof(int) * (nblocks + 1));
+    memcpy(a->bsize, bsize, sizeof(int) * nblocks);
+
+    a->boff[0] = 0;
+    for (int i = 0; i < nblocks; i++)
+        a->boff[i+1] = a->boff[i] + bsize[i];
+    a->n = a->boff[nblocks];
+
+    a->rowptr = rowptr;
+    a->colidx = colidx;
+    a->nnzb = rowptr[nblocks];
+    a->valptr = malloc(sizeof(int) * (a->nnzb > 0 ? a->nnzb : 1));
+
+    int nvalues = 0;
+    for (int i = 0; i < nblocks; i++) {
+        for (int p = rowptr[i]; p < rowptr[i+1]; p++) {
+            a->valptr[p] = nvalues;
+            nvalues += bsize[i] * bsize[colidx[p]];
+        }
+    }
+
+    a->nvalues = nvalues;
+    a->values = calloc(nvalues > 0 ? nvalues : 1, sizeof(TYPE));
+
+    return a;
+}
+
+bsmatd_t *bsmatd_create(int nblocks, const int *bsize, int nedges, const int *edges)
+{
+    // count the blocks in each row, duplicates included
+    int *rowptr = calloc(nblocks + 1, sizeof(int));
+    for (int i = 0; i < nblocks; i++)
+        rowptr[i+1] = 1;
+
+    for (int e = 0; e < nedges; e++) {
+        int i = edges[2*e+0], j = edges[2*e+1];
+        assert(i >= 0 && i < nblocks && j >= 0 && j < nblocks);
+        if (i != j)
+            rowptr[(i < j ? i : j) + 1]++;
+    }
+
+    for (int i = 0; i < nblocks; i++)
+        rowptr[i+1] += rowptr[i];
+
+    int *colidx = malloc(sizeof(int) * (rowptr[nblocks] > 0 ? rowptr[nblocks] : 1));
+    int *fill = malloc(sizeof(int) * (nblocks > 0 ? nblocks : 1));
+
+    for (int i = 0; i < nblocks; i++) {
+        colidx[rowptr[i]] = i;
+        fill[i] = rowptr[i] + 1;
+    }
+
+    for (int e = 0; e < nedges; e++) {
+        int i = edges[2*e+0], j = edges[2*e+1];
+        if (i == j)
+            continue;
+        int lo = i < j ? i : j, hi = i < j ? j : i;
+        colidx[fill[lo]++] = hi;
+    }
+
+    // sort each row and squeeze out the duplicates
+    int nnzb = 0;
+    for (int i = 0; i < nblocks; i++) {
+        int p0 = rowptr[i], p1 = fill[i];
+        qsort(&colidx[p0], p1 - p0, sizeof(int), int_compare);
+
+        rowptr[i] = nnzb;
+        for (int p = p0; p < p1; p++)
+            if (p == p0 || colidx[p] != colidx[p-1])
+                colidx[nnzb++] = colidx[p];
+    }
+    rowptr[nblocks] = nnzb;
+
+    free(fill);
+
+    return bsmatd_create_structure(nblocks, bsize, rowptr, colidx);
+}
+
+bsmatd_t *bsmatd_create_like(const bsmatd_t *a)
+{
+    int *rowptr = malloc(sizeof(int) * (a->nblocks + 1));
+    int *colidx = malloc(sizeof(int) * (a->nnzb > 0 ? a->nnzb : 1));
+    memcpy(rowptr, a->rowptr, sizeof(int) * (a->nblocks + 1));
+    memcpy(colidx, a->colidx, sizeof(int) * a->nnzb);
+
+    return bsmatd_create_structure(a->nblocks, a->bsize, rowptr, colidx);
+}
+
+void bsmatd_destroy(bsmatd_t *a)
+{
+    if (a == NULL)
+        return;
+
+    free(a->bsize);
+    free(a->boff);
+    free(a->rowptr);
+    free(a->colidx);
+    free(a->valptr);
+    free(a->values);
+    free(a);
+}
+
+void bsmatd_zero(bsmatd_t *a)
+{
+    memset(a->values, 0, sizeof(TYPE) * a->nvalues);
+}
+
+// position of block (i, j) in colidx, or -1
+static int bsmatd_find(const bsmatd_t *a, int i, int j)
+{
+    int lo = a->rowptr[i], hi = a->rowptr[i+1] - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = a->colidx[mid];
+
+        if (c == j)
+            return mid;
+        if (c < j)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -1;
+}
+
+double *bsmatd_block(const bsmatd_t *a, int i, int j)
+{
+    assert(i <= j);
+
+    int p = bsmatd_find(a, i, j);
+    if (p < 0)
+        return NULL;
+
+    return &a->values[a->valptr[p]];
+}
+
+void bsmatd_add_block(bsmatd_t *a, int i, int j, const double *v)
+{
+    int ni = a->bsize[i], nj = a->bsize[j];
+
+    if (i <= j) {
+        double *blk = bsmatd_block(a, i, j);
+        assert(blk != NULL);
+
+        for (int k = 0; k < ni*nj; k++)
+            blk[k] += v[k];
+    } else {
+        double *blk = bsmatd_block(a, j, i);
+        assert(blk != NULL);
+
+        for (int r = 0; r < nj; r++)
+            for (int c = 0; c < ni; c++)
+                blk[r*ni + c] += v[c*nj + r];
+    }
+}
+
+void bsmatd_add_diagonal(bsmatd_t *a, double lambda)
+{
+    for (int i = 0; i < a->nblocks; i++) {
+        int ni = a->bsize[i];
+        double *blk = &a->values[a->valptr[a->rowptr[i]]];
+
+        for (int k = 0; k < ni; k++)
+            blk[k*ni + k] += lambda;
+    }
+}
+
+void bsmatd_get_diagonal(const bsmatd_t *a, double *d)
+{
+    for (int i = 0; i < a->nblocks; i++) {
+        int ni = a->bsize[i];
+        const double *blk = &a->values[a->valptr[a->rowptr[i]]];
+
+        for (int k = 0; k < ni; k++)
+            d[a->boff[i] + k] = blk[k*ni + k];
+    }
+}
+
+void bsmatd_set_diagonal(bsmatd_t *a, const double *d)
+{
+    for (int i = 0; i < a->nblocks; i++) {
+        int ni = a->bsize[i];
+        double *blk = &a->values[a->valptr[a->rowptr[i]]];
+
+        for (int k = 0; k < ni; k++)
+            blk[k*ni + k] = d[a->boff[i] + k];
+    }
+}
+
+double bsmatd_trace(const bsmatd_t *a)
+{
+    double trace = 0;
+
+    for (int i = 0; i < a->nblocks; i++) {
+        int ni = a->bsize[i];
+        const double *blk = &a->values[a->valptr[a->rowptr[i]]];
+
+        for (int k = 0; k < ni; k++)
+            trace += blk[k*ni + k];
+    }
+
+    return trace;
+}
+
+void bsmatd_multiply_vector(const bsmatd_t *a, const double *x, double *y)
+{
+    memset(y, 0, sizeof(TYPE) * a->n);
+
+    for (int i = 0; i < a->nblocks; i++) {
+        int ni = a->bsize[i];
+        const double *xi = &x[a->boff[i]];
+        double *yi = &y[a->boff[i]];
+
+        for (int p = a->rowptr[i]; p < a->rowptr[i+1]; p++) {
+            int j = a->colidx[p], nj = a->bsize[j];
+            const double *blk = &a->values[a->valptr[p]];
+            const double *xj = &x[a->boff[j]];
+            double *yj = &y[a->boff[j]];
+
+            for (int r = 0; r < ni; r++)
+                for (int c = 0; c < nj; c++)
+                    yi[r] += blk[r*nj + c] * xj[c];
+
+            if (j != i) {
+                for (int r = 0; r < ni; r++)
+                    for (int c = 0; c < nj; c++)
+                        yj[c] += blk[r*nj + c] * xi[r];
+            }
+        }
+    }
+}
+
+matd_t *bsmatd_to_matd(const bsmatd_t *a)
+{
+    matd_t *m = matd_create(a->n, a->n);
+
+    for (int i = 0; i < a->nblocks; i++) {
+        for (int p = a->rowptr[i]; p < a->rowptr[i+1]; p++) {
+            int j = a->colidx[p];
+            const double *blk = &a->values[a->valptr[p]];
+
+            for (int r = 0; r < a->bsize[i]; r++) {
+                for (int c = 0; c < a->bsize[j]; c++) {
+                    MATD_EL(m, a->boff[i] + r, a->boff[j] + c) = blk[r*a->bsize[j] + c];
+                    MATD_EL(m, a->boff[j] + c, a->boff[i] + r) = blk[r*a->bsize[j] + c];
+                }
+            }
+        }
+    }
+
+    return m;
+}
+
+/////////////////////////////////////////////////
+// Cholesky
+//
+// A supernodal, multifrontal factorization. The symbolic analysis
+// finds the elimination tree of the blocks, reorders them by a
+// postorder of that tree (which changes nothing about the fill, but
+// makes every chain of columns with nested patterns contiguous),
+// counts the blocks in each row of U, and groups consecutive rows with
+// the same pattern into supernodes.
+//
+// The numeric phase visits the supernodes children-first. Each one
+// gathers its rows of A and the update matrices of its children into a
+// dense frontal matrix, factors its own rows in place and leaves an
+// update matrix for its parent. Supernodes in disjoint subtrees never
+// touch the same memory, so they are handed to a pool of threads as
+// soon as all their children are done.
+
+// Below this many flops the threads cost more than they save.
+#define BSMATD_CHOL_PARALLEL_FLOPS 2e6
+
+// The rows r < j holding block column j, from a block row structure
+// (rowptr, colidx); returns ptr[nb+1], with the rows in *_idx.
+static int *transpose_structure(int nb, const int *rowptr, const int *colidx, int **_idx)
+{
+    int *ptr = calloc(nb + 1, sizeof(int));
+
+    for (int i = 0; i < nb; i++)
+        for (int p = rowptr[i]; p < rowptr[i+1]; p++)
+            if (colidx[p] != i)
+                ptr[colidx[p] + 1]++;
+
+    for (int j = 0; j < nb; j++)
+        ptr[j+1] += ptr[j];
+
+    int *idx = malloc(sizeof(int) * (ptr[nb] > 0 ? ptr[nb] : 1));
+    int *fill = malloc(sizeof(int) * (nb > 0 ? nb : 1));
+    memcpy(fill, ptr, sizeof(int) * nb);
+
+    for (int i = 0; i < nb; i++)
+        for (int p = rowptr[i]; p < rowptr[i+1]; p++)
+            if (colidx[p] != i)
+                idx[fill[colidx[p]]++] = i;
+
+    free(fill);
+    *_idx = idx;
+    return ptr;
+}
+
+bsmatd_chol_t *bsmatd_chol_analyze(const bsmatd_t *a, int postorder)
+{
+    int nb = a->nblocks;
+    int nb1 = nb > 0 ? nb : 1;
+
+    bsmatd_chol_t *chol = calloc(1, sizeof(bsmatd_chol_t));
+    chol->nblocks = nb;
+    chol->annzb = a->nnzb;
+
+    // elimination tree in A's order (Liu's algorithm, with path
+    // compression through 'ancestor').
+    int *lidx;
+    int *lptr = transpose_structure(nb, a->rowptr, a->colidx, &lidx);
+
+    int *parent0 = malloc(sizeof(int) * nb1);
+    int *ancestor = malloc(sizeof(int) * nb1);
+
+    for (int j = 0; j < nb; j++) {
+        parent0[j] = -1;
+        ancestor[j] = -1;
+
+        for (int q = lptr[j]; q < lptr[j+1]; q++) {
+            int r = lidx[q];
+            while (ancestor[r] != -1 && ancestor[r] != j) {
+                int t = ancestor[r];
+                ancestor[r] = j;
+                r = t;
+            }
+            if (ancestor[r] == -1) {
+                ancestor[r] = j;
+                parent0[r] = j;
+            }
+        }
+    }
+
+    free(lptr);
+    free(lidx);
+
+    // perm[k]: the block of A that becomes block k of the factor
+    int *perm = malloc(sizeof(int) * nb1);
+    int *iperm = malloc(sizeof(int) * nb1);
+
+    if (postorder) {
+        // children lists, in increasing order
+        int *head = ancestor;
+        int *next = malloc(sizeof(int) * nb1);
+        for (int j = 0; j < nb; j++)
+            head[j] = -1;
+        for (int j = nb - 1; j >= 0; j--) {
+            if (parent0[j] >= 0) {
+                next[j] = head[parent0[j]];
+                head[parent0[j]] = j;
+            }
+        }
+
+        // depth-first from each root; 'stack' holds the path
+        int *stack = malloc(sizeof(int) * nb1);
+        int k = 0;
+        for (int root = 0; root < nb; root++) {
+            if (parent0[root] >= 0)
+                continue;
+
+            int top = 0;
+            stack[0] = root;
+            while (top >= 0) {
+                int j = stack[top];
+                int c = head[j];
+                if (c >= 0) {
+                    head[j] = next[c];
+                    stack[++top] = c;
+                } else {
+                    perm[k++] = j;
+                    top--;
+                }
+            }
+        }
+        assert(k == nb);
+
+        free(stack);
+        free(next);
+    } else {
+        for (int k = 0; k < nb; k++)
+            perm[k] = k;
+    }
+
+    free(ancestor);
+
+    for (int k = 0; k < nb; k++)
+        iperm[perm[k]] = k;
+
+    chol->perm = perm;
+    chol->parent = malloc(sizeof(int) * nb1);
+    chol->bsize = malloc(sizeof(int) * nb1);
+    chol->boff = malloc(sizeof(int) * nb1);
+
+    for (int k = 0; k < nb; k++) {
+        int j = perm[k];
+        chol->parent[k] = parent0[j] >= 0 ? iperm[parent0[j]] : -1;
+        chol->bsize[k] = a->bsize[j];
+        chol->boff[k] = a->boff[j];
+    }
+    free(parent0);
+
+    // A in factor order: block (i, j) of A lands in factor block row
+    // min(iperm[i], iperm[j]), transposed if the order flipped.
+    chol->amap_ptr = calloc(nb + 1, sizeof(int));
+    for (int i = 0; i < nb; i++) {
+        for (int p = a->rowptr[i]; p < a->rowptr[i+1]; p++) {
+            int r = iperm[i], c = iperm[a->colidx[p]];
+            chol->amap_ptr[(r < c ? r : c) + 1]++;
+        }
+    }
+    for (int k = 0; k < nb; k++)
+        chol->amap_ptr[k+1] += chol->amap_ptr[k];
+
+    int nnzb1 = a->nnzb > 0 ? a->nnzb : 1;
+    chol->amap_src = malloc(sizeof(int) * nnzb1);
+    chol->amap_col = malloc(sizeof(int) * nnzb1);
+    chol->amap_trans = malloc(sizeof(int) * nnzb1);
+
+    int *fill = malloc(sizeof(int) * nb1);
+    memcpy(fill, chol->amap_ptr, sizeof(int) * nb);
+    for (int i = 0; i < nb; i++) {
+        for (int p = a->rowptr[i]; p < a->rowptr[i+1]; p++) {
+            int r = iperm[i], c = iperm[a->colidx[p]];
+            int q = fill[r < c ? r : c]++;
+            chol->amap_src[q] = p;
+            chol->amap_col[q] = r < c ? c : r;
+            chol->amap_trans[q] = r > c;
+        }
+    }
+    free(fill);
+    free(iperm);
+
+    // colcount[k]: blocks in row k of U, diagonal included. Row i of
+    // L = U' is the subtree of the etree spanned by the nonzeros in
+    // column i of A; walk it, counting each node once.
+    int *cidx;
+    int *cptr = transpose_structure(nb, chol->amap_ptr, chol->amap_col, &cidx);
+
+    int *colcount = malloc(sizeof(int) * nb1);
+    int *mark = malloc(sizeof(int) * nb1);
+    for (int k = 0; k < nb; k++) {
+        colcount[k] = 1;
+        mark[k] = -1;
+    }
+
+    for (int c = 0; c < nb; c++) {
+        mark[c] = c;
+        for (int q = cptr[c]; q < cptr[c+1]; q++) {
+            for (int x = cidx[q]; mark[x] != c; x = chol->parent[x]) {
+                mark[x] = c;
+                colcount[x]++;
+            }
+        }
+    }
+
+    free(cptr);
+    free(cidx);
+
+    // supernodes: block k joins k-1's supernode if it is k-1's parent
+    // and its row is k-1's row without the diagonal.
+    int nsuper = 0;
+    int *super_of = malloc(sizeof(int) * nb1);
+    chol->super_start = malloc(sizeof(int) * (nb + 1));
+
+    for (int k = 0; k < nb; k++) {
+        if (k == 0 || chol->parent[k-1] != k || colcount[k-1] != colcount[k] + 1)
+            chol->super_start[nsuper++] = k;
+        super_of[k] = nsuper - 1;
+    }
+    chol->super_start[nsuper] = nb;
+    chol->nsuper = nsuper;
+
+    int ns1 = nsuper > 0 ? nsuper : 1;
+    chol->super_parent = malloc(sizeof(int) * ns1);
+    chol->super_child = malloc(sizeof(int) * ns1);
+    chol->super_sibling = malloc(sizeof(int) * ns1);
+
+    for (int s = 0; s < nsuper; s++)
+        chol->super_child[s] = -1;
+
+    for (int s = nsuper - 1; s >= 0; s--) {
+        int last = chol->super_start[s+1] - 1;
+        int p = chol->parent[last] >= 0 ? super_of[chol->parent[last]] : -1;
+        chol->super_parent[s] = p;
+        if (p >= 0) {
+            chol->super_sibling[s] = chol->super_child[p];
+            chol->super_child[p] = s;
+        }
+    }
+
+    // pattern of each supernode: the blocks past its own in its rows,
+    // from its rows of A and its children's patterns.
+    chol->pattern_ptr = malloc(sizeof(int) * (nsuper + 1));
+    int npattern = 0;
+    for (int s = 0; s < nsuper; s++) {
+        int first = chol->super_start[s], last = chol->super_start[s+1] - 1;
+        npattern += colcount[first] - (last - first + 1);
+    }
+    chol->pattern = malloc(sizeof(int) * (npattern > 0 ? npattern : 1));
+
+    for (int k = 0; k < nb; k++)
+        mark[k] = -1;
+
+    int np = 0;
+    for (int s = 0; s < nsuper; s++) {
+        int first = chol->super_start[s], last = chol->super_start[s+1] - 1;
+        chol->pattern_ptr[s] = np;
+
+        for (int k = first; k <= last; k++) {
+            for (int q = chol->amap_ptr[k]; q < chol->amap_ptr[k+1]; q++) {
+                int j = chol->amap_col[q];
+                if (j > last && mark[j] != s) {
+                    mark[j] = s;
+                    chol->pattern[np++] = j;
+                }
+            }
+        }
+
+        for (int c = chol->super_child[s]; c >= 0; c = chol->super_sibling[c]) {
+            for (int q = chol->pattern_ptr[c]; q < chol->pattern_ptr[c+1]; q++) {
+                int j = chol->pattern[q];
+                if (j > last && mark[j] != s) {
+                    mark[j] = s;
+                    chol->pattern[np++] = j;
+                }
+            }
+        }
+
+        qsort(&chol->pattern[chol->pattern_ptr[s]], np - chol->pattern_ptr[s], sizeof(int), int_compare);
+        assert(np - chol->pattern_ptr[s] == colcount[first] - (last - first + 1));
+    }
+    chol->pattern_ptr[nsuper] = np;
+
+    free(colcount);
+    free(mark);
+    free(super_of);
+
+    // panel layout: supernode s owns nrows[s] scalar rows of U, stored
+    // densely over ncols[s] columns (its own, then its pattern's);
+    // panel_idx lists where in x each of those columns lives.
+    chol->super_nrows = malloc(sizeof(int) * ns1);
+    chol->super_ncols = malloc(sizeof(int) * ns1);
+    chol->panel_ptr = malloc(sizeof(size_t) * (nsuper + 1));
+    chol->panel_idx_ptr = malloc(sizeof(int) * (nsuper + 1));
+
+    size_t nvalues = 0;
+    int nidx = 0;
+    for (int s = 0; s < nsuper; s++) {
+        int nk = 0, m;
+        for (int k = chol->super_start[s]; k < chol->super_start[s+1]; k++)
+            nk += chol->bsize[k];
+        m = nk;
+        for (int q = chol->pattern_ptr[s]; q < chol->pattern_ptr[s+1]; q++)
+            m += chol->bsize[chol->pattern[q]];
+
+        chol->super_nrows[s] = nk;
+        chol->super_ncols[s] = m;
+        chol->panel_ptr[s] = nvalues;
+        chol->panel_idx_ptr[s] = nidx;
+        nvalues += (size_t) nk * m;
+        nidx += m;
+
+        if (m > chol->max_ncols)
+            chol->max_ncols = m;
+
+        // partial factorization of the front plus the update matrix
+        chol->flops += (double) nk * nk * m + (double) nk * (m - nk) * (m - nk);
+    }
+    chol->panel_ptr[nsuper] = nvalues;
+    chol->panel_idx_ptr[nsuper] = nidx;
+
+    chol->panel_idx = malloc(sizeof(int) * (nidx > 0 ? nidx : 1));
+    for (int s = 0; s < nsuper; s++) {
+        int *idx = &chol->panel_idx[chol->panel_idx_ptr[s]];
+        int n = 0;
+
+        for (int k = chol->super_start[s]; k < chol->super_start[s+1]; k++)
+            for (int r = 0; r < chol->bsize[k]; r++)
+                idx[n++] = chol->boff[k] + r;
+        for (int q = chol->pattern_ptr[s]; q < chol->pattern_ptr[s+1]; q++)
+            for (int r = 0; r < chol->bsize[chol->pattern[q]]; r++)
+                idx[n++] = chol->boff[chol->pattern[q]] + r;
+    }
+
+    chol->values = malloc(sizeof(TYPE) * (nvalues > 0 ? nvalues : 1));
+
+    return chol;
+}
+
+// Assemble, factor and save supernode s. relpos is scratch of
+// nblocks ints; updates[] holds the children's update matrices, and
+// receives this one's. Returns 0 if a pivot was not positive.
+static int chol_supernode(bsmatd_chol_t *chol, const bsmatd_t *a, int s, int *relpos, double **updates)
+{
+    int nk = chol->super_nrows[s], m = chol->super_ncols[s], ns = m - nk;
+    int first = chol->super_start[s], last = chol->super_start[s+1] - 1;
+    int is_spd = 1;
+
+    // where each block starts in the front
+    int pos = 0;
+    for (int k = first; k <= last; k++) {
+        relpos[k] = pos;
+        pos += chol->bsize[k];
+    }
+    for (int q = chol->pattern_ptr[s]; q < chol->pattern_ptr[s+1]; q++) {
+        relpos[chol->pattern[q]] = pos;
+        pos += chol->bsize[chol->pattern[q]];
+    }
+
+    // the front; only its upper triangle is used
+    TYPE *F = calloc((size_t) m * m, sizeof(TYPE));
+
+    for (int k = first; k <= last; k++) {
+        int nr = chol->bsize[k];
+
+        for (int q = chol->amap_ptr[k]; q < chol->amap_ptr[k+1]; q++) {
+            int j = chol->amap_col[q], nc = chol->bsize[j];
+            const TYPE *blk = &a->values[a->valptr[chol->amap_src[q]]];
+            TYPE *f = &F[relpos[k] * m + relpos[j]];
+
+            if (j == k) {
+                for (int r = 0; r < nr; r++)
+                    for (int c = r; c < nc; c++)
+                        f[r*m + c] += blk[r*nc + c];
+            } else if (chol->amap_trans[q]) {
+                for (int r = 0; r < nr; r++)
+                    for (int c = 0; c < nc; c++)
+                        f[r*m + c] += blk[c*nr + r];
+            } else {
+                for (int r = 0; r < nr; r++)
+                    for (int c = 0; c < nc; c++)
+                        f[r*m + c] += blk[r*nc + c];
+            }
+        }
+    }
+
+    // extend-add the children's update matrices
+    for (int c = chol->super_child[s]; c >= 0; c = chol->super_sibling[c]) {
+        const TYPE *U = updates[c];
+        int nu = chol->super_ncols[c] - chol->super_nrows[c];
+        int p0 = chol->pattern_ptr[c], p1 = chol->pattern_ptr[c+1];
+
+        int ui = 0;
+        for (int pi = p0; pi < p1; pi++) {
+            int bi = chol->pattern[pi], ni = chol->bsize[bi];
+
+            for (int r = 0; r < ni; r++) {
+                const TYPE *urow = &U[(ui + r) * nu];
+                TYPE *frow = &F[(relpos[bi] + r) * m];
+
+                int uj = ui;
+                for (int pj = pi; pj < p1; pj++) {
+                    int bj = chol->pattern[pj], nj = chol->bsize[bj];
+                    int c0 = (pj == pi) ? r : 0;
+
+                    for (int cc = c0; cc < nj; cc++)
+                        frow[relpos[bj] + cc] += urow[uj + cc];
+                    uj += nj;
+                }
+            }
+            ui += ni;
+        }
+
+        free(updates[c]);
+        updates[c] = NULL;
+    }
+
+    // factor the supernode's own rows
+    for (int i = 0; i < nk; i++) {
+        TYPE *fi = &F[i*m];
+        double d = fi[i];
+        is_spd &= (d > 0);
+
+        if (d < MATD_EPS)
+            d = MATD_EPS;
+        d = 1.0 / sqrt(d);
+
+        for (int j = i; j < m; j++)
+            fi[j] *= d;
+
+        for (int j = i+1; j < nk; j++) {
+            double v = fi[j];
+            if (v == 0)
+                continue;
+
+            TYPE *restrict fj = &F[j*m];
+            for (int k = j; k < m; k++)
+                fj[k] -= v * fi[k];
+        }
+    }
+
+    // update matrix: F_SS -= P'P, with P the factored rows' pattern
+    // columns. Rows of F_SS are taken a slab at a time so that they
+    // stay in cache while all of P streams past. This is not a
+    // matd_gemm call on purpose: pose graph supernodes are mostly a
+    // single 3x3 block, so P'P is a rank-3 update bound by the traffic
+    // through F_SS. matd_gemm would need P and F_SS copied out of the
+    // front, fill the whole square rather than the upper triangle and
+    // could not skip P's structural zeros; it factored 60x60 and
+    // 120x120 grid graphs 25-30% slower. The diagonal rows above are
+    // row-at-a-time for the same reason.
+    for (int i0 = nk; i0 < m; i0 += 32) {
+        int i1 = i0 + 32 < m ? i0 + 32 : m;
+
+        for (int k = 0; k < nk; k++) {
+            const TYPE *restrict pk = &F[k*m];
+
+            for (int i = i0; i < i1; i++) {
+                double v = pk[i];
+                if (v == 0)
+                    continue;
+
+                TYPE *restrict fi = &F[i*m];
+                for (int j = i; j < m; j++)
+                    fi[j] -= v * pk[j];
+            }
+        }
+    }
+
+    memcpy(&chol->values[chol->panel_ptr[s]], F, sizeof(TYPE) * nk * m);
+
+    if (ns > 0 && chol->super_parent[s] >= 0) {
+        // compact F_SS to the front of F; the rows only move down
+        for (int i = 0; i < ns; i++)
+            memmove(&F[i*ns], &F[(nk + i)*m + nk], sizeof(TYPE) * ns);
+        updates[s] = F;
+    } else {
+        free(F);
+    }
+
+    return is_spd;
+}
+
+typedef struct
+{
+    bsmatd_chol_t *chol;
+    const bsmatd_t *a;
+    double **updates;
+
+    // supernodes whose children are all done
+    int *pending;
+    int *queue;
+    int qhead, qtail;
+    int done;
+    int is_spd;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} chol_work_t;
+
+static void *chol_worker(void *arg)
+{
+    chol_work_t *w = arg;
+    bsmatd_chol_t *chol = w->chol;
+    int *relpos = malloc(sizeof(int) * (chol->nblocks > 0 ? chol->nblocks : 1));
+    int is_spd = 1;
+
+    pthread_mutex_lock(&w->mutex);
+    for (;;) {
+        while (w->qhead == w->qtail && w->done < chol->nsuper)
+            pthread_cond_wait(&w->cond, &w->mutex);
+
+        if (w->qhead == w->qtail)
+            break;
+
+        int s = w->queue[w->qhead++];
+        pthread_mutex_unlock(&w->mutex);
+
+        is_spd &= chol_supernode(chol, w->a, s, relpos, w->updates);
+
+        pthread_mutex_lock(&w->mutex);
+        w->done++;
+
+        int p = chol->super_parent[s];
+        if (p >= 0 && --w->pending[p] == 0) {
+            w->queue[w->qtail++] = p;
+            pthread_cond_signal(&w->cond);
+        }
+
+        if (w->done == chol->nsuper)
+            pthread_cond_broadcast(&w->cond);
+    }
+
+    w->is_spd &= is_spd;
+    pthread_mutex_unlock(&w->mutex);
+
+    free(relpos);
+    return NULL;
+}
+
+int bsmatd_chol_factor(bsmatd_chol_t *chol, const bsmatd_t *a, int nthreads)
+{
+    assert(a->nblocks == chol->nblocks && a->nnzb == chol->annzb);
+
+    int nsuper = chol->nsuper;
+    double **updates = calloc(nsuper > 0 ? nsuper : 1, sizeof(double*));
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > nsuper)
+        nthreads = nsuper;
+    if (chol->flops < BSMATD_CHOL_PARALLEL_FLOPS)
+        nthreads = 1;
+
+    if (nthreads <= 1) {
+        // supernodes are numbered children-first
+        int *relpos = malloc(sizeof(int) * (chol->nblocks > 0 ? chol->nblocks : 1));
+        chol->is_spd = 1;
+        for (int s = 0; s < nsuper; s++)
+            chol->is_spd &= chol_supernode(chol, a, s, relpos, updates);
+        free(relpos);
+    } else {
+        chol_work_t w = { .chol = chol, .a = a, .updates = updates, .is_spd = 1 };
+        w.pending = calloc(nsuper, sizeof(int));
+        w.queue = malloc(sizeof(int) * nsuper);
+
+        for (int s = 0; s < nsuper; s++)
+            if (chol->super_parent[s] >= 0)
+                w.pending[chol->super_parent[s]]++;
+        for (int s = 0; s < nsuper; s++)
+            if (w.pending[s] == 0)
+                w.queue[w.qtail++] = s;
+
+        pthread_mutex_init(&w.mutex, NULL);
+        pthread_cond_init(&w.cond, NULL);
+
+        pthread_t threads[nthreads];
+        for (int t = 0; t < nthreads; t++)
+            pthread_create(&threads[t], NULL, chol_worker, &w);
+        for (int t = 0; t < nthreads; t++)
+            pthread_join(threads[t], NULL);
+
+        pthread_mutex_destroy(&w.mutex);
+        pthread_cond_destroy(&w.cond);
+
+        chol->is_spd = w.is_spd;
+        free(w.pending);
+        free(w.queue);
+    }
+
+    free(updates);
+
+    return chol->is_spd;
+}
+
+bsmatd_chol_t *bsmatd_chol(const bsmatd_t *a)
+{
+    bsmatd_chol_t *chol = bsmatd_chol_analyze(a, 1);
+    bsmatd_chol_factor(chol, a, 1);
+
+    return chol;
+}
+
+void bsmatd_chol_solve(const bsmatd_chol_t *chol, const double *b, double *x)
+{
+    int n = 0;
+    for (int k = 0; k < chol->nblocks; k++)
+        n += chol->bsize[k];
+
+    if (x != b)
+        memcpy(x, b, sizeof(TYPE) * n);
+
+    TYPE xs[chol->max_ncols > 0 ? chol->max_ncols : 1];
+
+    // U'y = b
+    for (int s = 0; s < chol->nsuper; s++) {
+        int nk = chol->super_nrows[s], m = chol->super_ncols[s];
+        const TYPE *P = &chol->values[chol->panel_ptr[s]];
+        const int *idx = &chol->panel_idx[chol->panel_idx_ptr[s]];
+
+        for (int j = 0; j < m; j++)
+            xs[j] = x[idx[j]];
+
+        for (int i = 0; i < nk; i++) {
+            xs[i] /= P[i*m + i];
+            for (int j = i+1; j < m; j++)
+                xs[j] -= P[i*m + j] * xs[i];
+        }
+
+        for (int j = 0; j < m; j++)
+            x[idx[j]] = xs[j];
+    }
+
+    // Ux = y
+    for (int s = chol->nsuper - 1; s >= 0; s--) {
+        int nk = chol->super_nrows[s], m = chol->super_ncols[s];
+        const TYPE *P = &chol->values[chol->panel_ptr[s]];
+        const int *idx = &chol->panel_idx[chol->panel_idx_ptr[s]];
+
+        for (int j = 0; j < m; j++)
+            xs[j] = x[idx[j]];
+
+        for (int i = nk - 1; i >= 0; i--) {
+            double acc = xs[i];
+            for (int j = i+1; j < m; j++)
+                acc -= P[i*m + j] * xs[j];
+            xs[i] = acc / P[i*m + i];
+        }
+
+        for (int i = 0; i < nk; i++)
+            x[idx[i]] = xs[i];
+    }
+}
+
+// Takahashi's recursion: with S = A^-1 and U'U = A, US = U'^-1, whose
+// upper triangle is diag(1/u_ii). Row i of that gives, for j > i,
+//
+//   S_ij = -1/u_ii sum_{k > i} u_ik S_kj,
+//   S_ii = 1/u_ii^2 - 1/u_ii sum_{k > i} u_ik S_ki,
+//
+// where k only runs over U's structure in row i. Per supernode that is
+// a dense recursion over its columns (own, then pattern), needing S
+// between its pattern columns; those are all columns of its parent,
+// whose block of S is therefore computed first.
+void bsmatd_chol_inverse_blocks(const bsmatd_chol_t *chol, int npairs, const int *pairs, double **out)
+{
+    int nb = chol->nblocks, nsuper = chol->nsuper;
+
+    int n = 0;
+    for (int k = 0; k < nb; k++)
+        n += chol->bsize[k];
+
+    int *iperm = malloc(sizeof(int) * (nb > 0 ? nb : 1));
+    int *super_of = malloc(sizeof(int) * (nb > 0 ? nb : 1));
+    for (int k = 0; k < nb; k++)
+        iperm[chol->perm[k]] = k;
+    for (int s = 0; s < nsuper; s++)
+        for (int k = chol->super_start[s]; k < chol->super_start[s+1]; k++)
+            super_of[k] = s;
+
+    // where[x] is the column of scalar x in the supernode being
+    // looked at, if stamp[x] says it is current.
+    int *where = malloc(sizeof(int) * (n > 0 ? n : 1));
+    int *stamp = calloc(n > 0 ? n : 1, sizeof(int));
+    int tag = 0;
+
+    // each pair goes to the lowest supernode containing both blocks,
+    // or is solved for directly if there is none.
+    int *pair_super = malloc(sizeof(int) * (npairs > 0 ? npairs : 1));
+    int *need = calloc(nsuper > 0 ? nsuper : 1, sizeof(int));
+    int *nchildren = calloc(nsuper > 0 ? nsuper : 1, sizeof(int));
+
+    for (int p = 0; p < npairs; p++) {
+        int ki = iperm[pairs[2*p+0]], kj = iperm[pairs[2*p+1]];
+        int s = super_of[ki < kj ? ki : kj];
+        const int *idx = &chol->panel_idx[chol->panel_idx_ptr[s]];
+
+        tag++;
+        for (int c = 0; c < chol->super_ncols[s]; c++)
+            stamp[idx[c]] = tag;
+
+        if (stamp[chol->boff[ki]] != tag || stamp[chol->boff[kj]] != tag) {
+            pair_super[p] = -1;
+            continue;
+        }
+
+        pair_super[p] = s;
+        for (; s >= 0 && !need[s]; s = chol->super_parent[s]) {
+            need[s] = 1;
+            if (chol->super_parent[s] >= 0)
+                nchildren[chol->super_parent[s]]++;
+        }
+    }
+
+    TYPE **S = calloc(nsuper > 0 ? nsuper : 1, sizeof(TYPE*));
+
+    // parents have higher indices than their children.
+    for (int s = nsuper - 1; s >= 0; s--) {
+        if (!need[s])
+            continue;
+
+        int nk = chol->super_nrows[s], m = chol->super_ncols[s];
+        const TYPE *P = &chol->values[chol->panel_ptr[s]];
+        const int *idx = &chol->panel_idx[chol->panel_idx_ptr[s]];
+        TYPE *Ss = malloc(sizeof(TYPE) * ((size_t) m * m > 0 ? (size_t) m * m : 1));
+
+        // S between the pattern columns, from the parent.
+        int sp = chol->super_parent[s];
+        if (m > nk) {
+            assert(sp >= 0 && S[sp] != NULL);
+            int mp = chol->super_ncols[sp];
+            const int *pidx = &chol->panel_idx[chol->panel_idx_ptr[sp]];
+
+            tag++;
+            for (int c = 0; c < mp; c++) {
+                where[pidx[c]] = c;
+                stamp[pidx[c]] = tag;
+            }
+
+            for (int r = nk; r < m; r++) {
+                assert(stamp[idx[r]] == tag);
+                const TYPE *row = &S[sp][(size_t) where[idx[r]] * mp];
+                for (int c = nk; c < m; c++)
+                    Ss[(size_t) r*m + c] = row[where[idx[c]]];
+            }
+        }
+
+        for (int i = nk - 1; i >= 0; i--) {
+            const TYPE *u = &P[(size_t) i*m];
+
+            for (int j = m - 1; j > i; j--) {
+                double acc = 0;
+                for (int k = i+1; k < m; k++)
+                    acc += u[k] * Ss[(size_t) k*m + j];
+                Ss[(size_t) i*m + j] = Ss[(size_t) j*m + i] = -acc / u[i];
+            }
+
+            double acc = 0;
+            for (int k = i+1; k < m; k++)
+                acc += u[k] * Ss[(size_t) k*m + i];
+            Ss[(size_t) i*m + i] = (1.0 / u[i] - acc) / u[i];
+        }
+
+        S[s] = Ss;
+
+        if (sp >= 0 && --nchildren[sp] == 0) {
+            free(S[sp]);
+            S[sp] = NULL;
+        }
+
+        // the pairs that are answered here
+        tag++;
+        for (int c = 0; c < m; c++) {
+            where[idx[c]] = c;
+            stamp[idx[c]] = tag;
+        }
+
+        for (int p = 0; p < npairs; p++) {
+            if (pair_super[p] != s)
+                continue;
+
+            int ki = iperm[pairs[2*p+0]], kj = iperm[pairs[2*p+1]];
+            int ni = chol->bsize[ki], nj = chol->bsize[kj];
+            int ri = where[chol->boff[ki]], cj = where[chol->boff[kj]];
+
+            for (int r = 0; r < ni; r++)
+                for (int c = 0; c < nj; c++)
+                    out[p][r*nj + c] = Ss[(size_t) (ri + r)*m + cj + c];
+        }
+
+        if (nchildren[s] == 0) {
+            free(S[s]);
+            S[s] = NULL;
+        }
+    }
+
+    // blocks outside U's structure: solve for the columns of block j.
+    TYPE *x = NULL;
+    for (int p = 0; p < npairs; p++) {
+        if (pair_super[p] >= 0)
+            continue;
+
+        if (x == NULL)
+            x = malloc(sizeof(TYPE) * (n > 0 ? n : 1));
+
+        int ki = iperm[pairs[2*p+0]], kj = iperm[pairs[2*p+1]];
+        int ni = chol->bsize[ki], nj = chol->bsize[kj];
+
+        for (int c = 0; c < nj; c++) {
+            memset(x, 0, sizeof(TYPE) * n);
+            x[chol->boff[kj] + c] = 1;
+            bsmatd_chol_solve(chol, x, x);
+
+            for (int r = 0; r < ni; r++)
+                out[p][r*nj + c] = x[chol->boff[ki] + r];
+        }
+    }
+
+    free(x);
+    free(S);
+    free(iperm);
+    free(super_of);
+    free(where);
+    free(stamp);
+    free(pair_super);
+    free(need);
+    free(nchildren);
+}
+
+void bsmatd_chol_destroy(bsmatd_chol_t *chol)
+{
+    if (chol == NULL)
+        return;
+
+    free(chol->perm);
+    free(chol->parent);
+    free(chol->bsize);
+    free(chol->boff);
+    free(chol->amap_ptr);
+    free(chol->amap_src);
+    free(chol->amap_col);
+    free(chol->amap_trans);
+    free(chol->super_start);
+    free(chol->super_parent);
+    free(chol->super_child);
+    free(chol->super_sibling);
+    free(chol->pattern_ptr);
+    free(chol->pattern);
+    free(chol->super_nrows);
+    free(chol->super_ncols);
+    free(chol->panel_ptr);
+    free(chol->panel_idx_ptr);
+    free(chol->panel_idx);
+    free(chol->values);
+    free(chol);
+}
@@ -0,0 +1,148 @@
+/*$LICENSE*/
+
+#ifndef _BSMATD_H
+#define _BSMATD_H
+
+#include "matd.h"
+
+// Block-sparse symmetric matrix, for the normal equations of pose
+// graphs. Every node contributes a dense block of rows and columns (3
+// for xyt, 6 for a 6-dof pose), and every factor touches whole blocks,
+// so the sparsity pattern lives at the block level. Only the upper
+// triangle is stored: block row i holds its diagonal block followed
+// by blocks (i, j > i) in increasing j, each dense and row-major.
+//
+// The structure is fixed when the matrix is created, which makes
+// assembly a matter of locating a block and adding into it; nothing
+// is ever inserted or moved.
+
+typedef struct
+{
+    int nblocks;
+    int *bsize;     // [nblocks] rows (= columns) in each block
+    int *boff;      // [nblocks+1] offset of each block's first row; boff[nblocks] = n
+    int n;          // scalar rows (= columns)
+
+    // upper-triangular block CSR
+    int *rowptr;    // [nblocks+1]
+    int *colidx;    // [nnzb] block column of each stored block, sorted per row
+    int *valptr;    // [nnzb] offset of each block in values
+    int nnzb;
+
+    double *values;
+    int nvalues;
+} bsmatd_t;
+
+// Create a zero matrix with nblocks diagonal blocks of sizes bsize[]
+// and an off-diagonal block wherever a node pair (edges[2*e+0],
+// edges[2*e+1]) appears; either order and duplicates are fine.
+bsmatd_t *bsmatd_create(int nblocks, const int *bsize, int nedges, const int *edges);
+
+// Create a zero matrix with the same structure as a.
+bsmatd_t *bsmatd_create_like(const bsmatd_t *a);
+
+void bsmatd_destroy(bsmatd_t *a);
+
+// Set all values to zero, keeping the structure.
+void bsmatd_zero(bsmatd_t *a);
+
+// The bsize[i] x bsize[j] row-major block (i, j), i <= j, or NULL if
+// it is not part of the structure.
+double *bsmatd_block(const bsmatd_t *a, int i, int j);
+
+// Add the bsize[i] x bsize[j] row-major block v to block (i, j). For
+// i > j, v' is added to block (j, i). The block must be part of the
+// structure.
+void bsmatd_add_block(bsmatd_t *a, int i, int j, const double *v);
+
+// Add lambda to every diagonal element.
+void bsmatd_add_diagonal(bsmatd_t *a, double lambda);
+
+// Copy the diagonal into (from) d, which has n elements.
+void bsmatd_get_diagonal(const bsmatd_t *a, double *d);
+void bsmatd_set_diagonal(bsmatd_t *a, const double *d);
+
+double bsmatd_trace(const bsmatd_t *a);
+
+// y = A*x, using both triangles.
+void bsmatd_multiply_vector(const bsmatd_t *a, const double *x, double *y);
+
+// Convert to a dense matrix (for debugging). Both triangles are filled.
+matd_t *bsmatd_to_matd(const bsmatd_t *a);
+
+// A supernodal Cholesky factorization U'U = P A P'. P reorders the
+// blocks by a postorder of the elimination tree, which leaves the fill
+// unchanged but lets consecutive rows with nested patterns merge into
+// supernodes; each supernode's rows of U are stored as one dense panel.
+// The analysis depends only on A's structure and can be reused for
+// any matrix with the same structure.
+typedef struct
+{
+    int nblocks;
+    int annzb;          // blocks in the analyzed A, as a sanity check
+
+    // Everything below is in factor order: block k of the factor is
+    // block perm[k] of A.
+    int *perm;
+    int *parent;        // elimination tree; -1 for roots
+    int *bsize;
+    int *boff;          // where block k lives in A's (unpermuted) vectors
+
+    // the blocks of A that are assembled into factor block row k:
+    // A's block amap_src[q] lands at (k, amap_col[q]), transposed if
+    // amap_trans[q], for q in amap_ptr[k] .. amap_ptr[k+1]-1.
+    int *amap_ptr, *amap_src, *amap_col, *amap_trans;
+
+    // supernode s is blocks super_start[s] .. super_start[s+1]-1. Its
+    // rows of U are nonzero in its own blocks and in the blocks
+    // pattern[pattern_ptr[s] .. pattern_ptr[s+1]-1].
+    int nsuper;
+    int *super_start;
+    int *super_parent;  // supernodal elimination tree; -1 for roots
+    int *super_child, *super_sibling; // its children, as linked lists
+    int *pattern_ptr, *pattern;
+
+    // Supernode s's panel is super_nrows[s] x super_ncols[s], row-major,
+    // at values[panel_ptr[s]]; column j of it is element
+    // panel_idx[panel_idx_ptr[s] + j] of x.
+    int *super_nrows, *super_ncols;
+    size_t *panel_ptr;
+    int *panel_idx_ptr, *panel_idx;
+    int max_ncols;
+
+    double flops;       // for one numeric factorization
+    double *values;
+
+    int is_spd;
+} bsmatd_chol_t;
+
+// Symbolic analysis: elimination tree, row counts, supernodes and
+// storage. With postorder = 0, the blocks are kept in A's order, so
+// that the panels are rows of the Cholesky factor of A itself.
+bsmatd_chol_t *bsmatd_chol_analyze(const bsmatd_t *a, int postorder);
+
+// Numeric factorization of a, which must have the structure that was
+// analyzed. Independent subtrees are factored in parallel on up to
+// nthreads threads (<= 0: one per core); small problems use one.
+// Diagonal pivots below MATD_EPS are clamped, as in matd_chol. Returns
+// is_spd. As with smatd_chol, no pivoting is performed so that an
+// externally-applied fill-reducing ordering is respected.
+int bsmatd_chol_factor(bsmatd_chol_t *chol, const bsmatd_t *a, int nthreads);
+
+// Analyze and factor on one thread.
+bsmatd_chol_t *bsmatd_chol(const bsmatd_t *a);
+
+// Solve Ax = b. User provides storage for x, which may alias b.
+void bsmatd_chol_solve(const bsmatd_chol_t *chol, const double *b, double *x);
+
+// Blocks of A^-1, without forming it: out[p] receives the
+// bsize[i] x bsize[j] row-major block (i, j) for (i, j) = (pairs[2*p],
+// pairs[2*p+1]). Blocks inside U's structure, which includes every
+// diagonal block and every block of A, come from Takahashi's recursion
+// over the supernodes between them and the root; any others are
+// solved for column by column.
+void bsmatd_chol_inverse_blocks(const bsmatd_chol_t *chol, int npairs, const int *pairs, double **out);
+
+void bsmatd_chol_destroy(bsmatd_chol_t *chol);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "common/config.h"
+#include "common/timestamp.h"
+#include "math/kinematics.h"
+
+// Checks the RexArm chain: Jacobian columns against finite differences
+// of forward kinematics, both IK solvers against the poses they were
+// asked to reach, and reports what a batched FK + Jacobian costs. Pass
+// a config file to check kin_chain_create_config as well.
+
+#define FD_STEP 1e-6
+
+static double
+urand (double lo, double hi)
+{
+    return lo + (hi - lo) * rand () / (double) RAND_MAX;
+}
+
+static void
+random_config (const kin_chain_t *chain, double *q)
+{
+    for (int i = 0; i < chain->njoints; i++)
+        q[i] = urand (chain->joints[i].min, chain->joints[i].max);
+}
+
+static double
+position_error (const double *A, const double *B)
+{
+    return sqrt ((A[3]-B[3])*(A[3]-B[3]) + (A[7]-B[7])*(A[7]-B[7]) +
+                 (A[11]-B[11])*(A[11]-B[11]));
+}
+
+// Largest difference between J and forward differences of kin_fk at q.
+// The angular rows are compared against the skew part of dR R'.
+static double
+jacobian_error (const kin_chain_t *chain, const double *q)
+{
+    int n = chain->njoints;
+    double J[6*KIN_MAX_JOINTS], T0[16], T1[16], qq[KIN_MAX_JOINTS];
+    kin_jacobian (chain, q, J);
+    kin_fk (chain, q, T0, NULL);
+
+    double err = 0;
+    for (int k = 0; k < n; k++) {
+        for (int i = 0; i < n; i++)
+            qq[i] = q[i];
+        qq[k] += FD_STEP;
+        kin_fk (chain, qq, T1, NULL);
+
+        double W[9];
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b < 3; b++) {
+                double acc = 0;
+                for (int m = 0; m < 3; m++)
+                    acc += (T1[a*4+m] - T0[a*4+m]) / FD_STEP * T0[b*4+m];
+                W[a*3+b] = acc;
+            }
+
+        double fd[6] = { (T1[3] - T0[3]) / FD_STEP,
+                         (T1[7] - T0[7]) / FD_STEP,
+                         (T1[11] - T0[11]) / FD_STEP,
+                         W[7], W[2], W[3] };
+        for (int i = 0; i < 6; i++)
+            err = fmax (err, fabs (fd[i] - J[i*n + k]));
+    }
+    return err;
+}
+
+int
+main (int argc, char *argv[])
+{
+    // Same geometry and limits as config/rexarm.config
+    kin_chain_t *chain = kin_chain_create_yaw_planar (0.116, 0.099, 0.099, 0.110);
+    int n = chain->njoints;
+    for (int i = 0; i < n; i++) {
+        double lim = (i == 0 ? 180 : 120) * M_PI / 180;
+        chain->joints[i].min = -lim;
+        chain->joints[i].max = lim;
+    }
+    kin_chain_update (chain);
+    int trials = 1000;
+    double q[KIN_MAX_JOINTS], qs[KIN_MAX_JOINTS], q0[KIN_MAX_JOINTS] = { 0 };
+    double T[16], Ts[16];
+
+    double jac_err = 0;
+    for (int t = 0; t < trials; t++) {
+        random_config (chain, q);
+        jac_err = fmax (jac_err, jacobian_error (chain, q));
+    }
+    printf ("jacobian: max error vs finite differences %g\n", jac_err);
+
+    // Closed form: aim at the tip of a random configuration with its own
+    // wrist pitch. phi can't tell a wrist tipped back past vertical from
+    // one facing the other way, so some targets need the opposite yaw and
+    // are outside the pitch limits; the rest must land exactly.
+    int cf_fail = 0;
+    double cf_err = 0;
+    for (int t = 0; t < trials; t++) {
+        random_config (chain, q);
+        kin_fk (chain, q, T, NULL);
+        double phi = asin (fmax (-1, fmin (1, T[8])));
+        double best = INFINITY;
+        for (int up = 0; up < 2; up++) {
+            if (kin_ik_yaw_planar (chain, T[3], T[7], T[11], phi, up, qs) < 0)
+                continue;
+            kin_fk (chain, qs, Ts, NULL);
+            best = fmin (best, position_error (T, Ts));
+        }
+        if (isinf (best))
+            cf_fail++;
+        else
+            cf_err = fmax (cf_err, best);
+    }
+    printf ("closed-form IK: %d/%d solved, max position error %g m\n",
+            trials - cf_fail, trials, cf_err);
+
+    // Damped least squares from the zero pose
+    kin_ik_params_t params;
+    kin_ik_params_init (&params);
+    for (int position_only = 1; position_only >= 0; position_only--) {
+        params.position_only = position_only;
+        int fail = 0, iters = 0;
+        double err = 0;
+        for (int t = 0; t < trials; t++) {
+            random_config (chain, q);
+            kin_fk (chain, q, T, NULL);
+            int it = kin_ik (chain, T, q0, &params, qs);
+            if (it < 0) {
+                fail++;
+                continue;
+            }
+            iters += it;
+            kin_fk (chain, qs, Ts, NULL);
+            err = fmax (err, position_error (T, Ts));
+        }
+        printf ("DLS IK (%s): %d/%d converged, %.1f iterations on average, "
+                "max position error %g m\n",
+                position_only ? "position" : "full pose", trials - fail, trials,
+                iters / (double) (trials - fail > 0 ? trials - fail : 1), err);
+    }
+
+    int nbatch = 100000;
+    double *Q = malloc (nbatch * n * sizeof(*Q));
+    double *TT = malloc (nbatch * 16 * sizeof(*TT));
+    double *JJ = malloc (nbatch * 6 * n * sizeof(*JJ));
+    for (int i = 0; i < nbatch; i++)
+        random_config (chain, Q + i*n);
+    int64_t t0 = utime_now ();
+    kin_fk_batch (chain, nbatch, Q, TT, JJ);
+    int64_t t1 = utime_now ();
+    printf ("kin_fk_batch: %.3f us per configuration for FK + Jacobian\n",
+            (t1 - t0) / (double) nbatch);
+    free (Q);
+    free (TT);
+    free (JJ);
+
+    if (argc > 1) {
+        FILE *f = fopen (argv[1], "r");
+        config_t *config = f ? config_parse_file (f, argv[1]) : NULL;
+        if (f)
+            fclose (f);
+        kin_chain_t *cfg_chain = config ? kin_chain_create_config (config, "rexarm") : NULL;
+        if (cfg_chain == NULL) {
+            printf ("ERR: could not read a rexarm chain from %s\n", argv[1]);
+            exit (-1);
+        }
+        double err = 0;
+        for (int t = 0; t < trials; t++) {
+            random_config (chain, q);
+            kin_fk (chain, q, T, NULL);
+            kin_fk (cfg_chain, q, Ts, NULL);
+            for (int i = 0; i < 16; i++)
+                err = fmax (err, fabs (T[i] - Ts[i]));
+        }
+        printf ("%s: max pose difference vs kin_chain_create_yaw_planar %g\n", argv[1], err);
+        kin_chain_destroy (cfg_chain);
+        config_free (config);
+    }
+
+    kin_chain_destroy (chain);
+    return 0;
+}
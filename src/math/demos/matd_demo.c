@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "common/timestamp.h"
+#include "math/matd.h"
+
+// Checks the matd product kernels, including the fused transpose
+// products on rectangular shapes, against a reference triple loop,
+// compiled expression plans against matd_op and the small dense
+// solvers against their residuals, and reports how long each takes,
+// with and without an arena.
+
+static matd_t *
+random_matrix (int rows, int cols)
+{
+    matd_t *m = matd_create (rows, cols);
+    for (int i = 0; i < rows*cols; i++)
+        m->data[i] = rand () / (double) RAND_MAX - 0.5;
+    return m;
+}
+
+static matd_t *
+naive_multiply (const matd_t *a, const matd_t *b)
+{
+    matd_t *m = matd_create (a->nrows, b->ncols);
+    for (int i = 0; i < m->nrows; i++)
+        for (int j = 0; j < m->ncols; j++) {
+            double acc = 0;
+            for (int k = 0; k < a->ncols; k++)
+                acc += MATD_EL(a, i, k) * MATD_EL(b, k, j);
+            MATD_EL(m, i, j) = acc;
+        }
+    return m;
+}
+
+// Check the fused transpose products on an m x k by k x n product
+// against the reference loop on explicit transposes and against matd_op.
+static void
+check_products (int m, int k, int n)
+{
+    matd_t *a = random_matrix (m, k);
+    matd_t *at = random_matrix (k, m);
+    matd_t *b = random_matrix (k, n);
+    matd_t *bt = random_matrix (n, k);
+    matd_t *w = random_matrix (k, k);
+
+    matd_t *at_t = matd_transpose (at);
+    matd_t *bt_t = matd_transpose (bt);
+
+    matd_t *ref = naive_multiply (a, b);
+    matd_t *res = matd_multiply (a, b);
+    printf ("%3d x %3d x %3d: A*B     error vs naive %8.2g\n", m, k, n,
+            matd_err_inf (ref, res));
+    matd_destroy (ref);
+    matd_destroy (res);
+
+    ref = naive_multiply (at_t, b);
+    res = matd_multiply_at_b (at, b);
+    matd_t *op = matd_op ("M'*M", at, b);
+    printf ("%3d x %3d x %3d: A'*B    error vs naive %8.2g, vs matd_op %8.2g\n", m, k, n,
+            matd_err_inf (ref, res), matd_err_inf (op, res));
+    matd_destroy (ref);
+    matd_destroy (res);
+    matd_destroy (op);
+
+    ref = naive_multiply (a, bt_t);
+    res = matd_multiply_a_bt (a, bt);
+    op = matd_op ("M*M'", a, bt);
+    printf ("%3d x %3d x %3d: A*B'    error vs naive %8.2g, vs matd_op %8.2g\n", m, k, n,
+            matd_err_inf (ref, res), matd_err_inf (op, res));
+    matd_destroy (ref);
+    matd_destroy (res);
+    matd_destroy (op);
+
+    matd_t *wb = naive_multiply (w, b);
+    ref = naive_multiply (at_t, wb);
+    res = matd_multiply_at_w_b (at, w, b);
+    op = matd_op ("M'*M*M", at, w, b);
+    printf ("%3d x %3d x %3d: A'*W*B  error vs naive %8.2g, vs matd_op %8.2g\n", m, k, n,
+            matd_err_inf (ref, res), matd_err_inf (op, res));
+    matd_destroy (wb);
+    matd_destroy (ref);
+    matd_destroy (res);
+    matd_destroy (op);
+
+    matd_destroy (a);
+    matd_destroy (at);
+    matd_destroy (b);
+    matd_destroy (bt);
+    matd_destroy (w);
+    matd_destroy (at_t);
+    matd_destroy (bt_t);
+}
+
+// microseconds per call of expr, repeated until ~0.2 s have passed
+#define TIME_IT(label, expr) do {                                       \
+        int64_t t0 = utime_now (), t1;                                  \
+        int iters = 0;                                                  \
+        do {                                                            \
+            expr;                                                       \
+            iters++;                                                    \
+            t1 = utime_now ();                                          \
+        } while (t1 - t0 < 200000);                                     \
+        printf ("  %-24s %12.2f us\n", label, (t1 - t0) / (double) iters); \
+    } while (0)
+
+static void
+bench_products (int n)
+{
+    matd_t *a = random_matrix (n, n);
+    matd_t *b = random_matrix (n, n);
+    matd_t *w = random_matrix (n, n);
+    matd_t *c = matd_create (n, n);
+
+    matd_t *ref = naive_multiply (a, b);
+    matd_t *m = matd_multiply (a, b);
+    printf ("%d x %d: max error vs naive %g\n", n, n, matd_err_inf (ref, m));
+    matd_destroy (ref);
+    matd_destroy (m);
+
+    TIME_IT ("naive A*B", matd_destroy (naive_multiply (a, b)));
+    TIME_IT ("matd_multiply A*B", matd_destroy (matd_multiply (a, b)));
+    TIME_IT ("matd_multiply_into A*B", matd_multiply_into (c, a, b));
+    TIME_IT ("matd_op A'*B", matd_destroy (matd_op ("M'*M", a, b)));
+    TIME_IT ("matd_multiply_at_b", matd_destroy (matd_multiply_at_b (a, b)));
+    TIME_IT ("matd_op A*B'", matd_destroy (matd_op ("M*M'", a, b)));
+    TIME_IT ("matd_multiply_a_bt", matd_destroy (matd_multiply_a_bt (a, b)));
+    TIME_IT ("matd_op A'*W*B", matd_destroy (matd_op ("M'*M*M", a, w, b)));
+    TIME_IT ("matd_multiply_at_w_b", matd_destroy (matd_multiply_at_w_b (a, w, b)));
+
+    matd_destroy (a);
+    matd_destroy (b);
+    matd_destroy (w);
+    matd_destroy (c);
+}
+
+static void
+bench_plans (int n)
+{
+    matd_t *J = random_matrix (n, n);
+    matd_t *W = random_matrix (n, n);
+    matd_t *JtWJ = matd_create (n, n);
+
+    matd_plan_t *plan = matd_plan_create ("M'*M*M");
+    matd_t *ref = matd_op ("M'*M*M", J, W, J);
+    printf ("%d x %d J'*W*J: plan error vs matd_op %g\n", n, n,
+            matd_err_inf (ref, matd_plan_eval (plan, J, W, J)));
+    matd_destroy (ref);
+
+    TIME_IT ("matd_op", matd_destroy (matd_op ("M'*M*M", J, W, J)));
+    TIME_IT ("matd_plan_eval", matd_plan_eval (plan, J, W, J));
+    TIME_IT ("matd_plan_eval_into", matd_plan_eval_into (plan, JtWJ, J, W, J));
+
+    matd_plan_destroy (plan);
+    matd_destroy (J);
+    matd_destroy (W);
+    matd_destroy (JtWJ);
+}
+
+static void
+bench_small (int n)
+{
+    matd_t *a = random_matrix (n, n);
+    matd_t *b = random_matrix (n, 1);
+    matd_t *I = matd_identity (n);
+    matd_t *spd = matd_op ("M'*M + M", a, a, I);
+
+    matd_t *inv = matd_inverse (a);
+    matd_t *ainv = matd_multiply (a, inv);
+    matd_t *x = matd_solve (a, b);
+    matd_t *ax = matd_multiply (a, x);
+    matd_chol_t *chol = matd_chol (spd);
+    matd_t *y = matd_chol_solve (chol, b);
+    matd_t *sy = matd_multiply (spd, y);
+    printf ("%d x %d: inverse residual %g, solve residual %g, chol residual %g\n",
+            n, n, matd_err_inf (ainv, I), matd_err_inf (ax, b), matd_err_inf (sy, b));
+
+    TIME_IT ("matd_multiply A*B", matd_destroy (matd_multiply (a, spd)));
+    TIME_IT ("matd_multiply A*b", matd_destroy (matd_multiply (a, b)));
+    TIME_IT ("matd_det", matd_det (a));
+    TIME_IT ("matd_inverse", matd_destroy (matd_inverse (a)));
+    TIME_IT ("matd_solve", matd_destroy (matd_solve (a, b)));
+    TIME_IT ("matd_chol", matd_chol_destroy (matd_chol (spd)));
+    TIME_IT ("matd_chol_solve", matd_destroy (matd_chol_solve (chol, b)));
+
+    matd_destroy (a);
+    matd_destroy (b);
+    matd_destroy (I);
+    matd_destroy (spd);
+    matd_destroy (inv);
+    matd_destroy (ainv);
+    matd_destroy (x);
+    matd_destroy (ax);
+    matd_chol_destroy (chol);
+    matd_destroy (y);
+    matd_destroy (sy);
+}
+
+static void
+svd_reconstruct (matd_t *out, matd_t *a)
+{
+    matd_svd_t svd = matd_svd (a);
+    matd_t *us = matd_multiply (svd.U, svd.S);
+    matd_gemm (out, 1, us, 0, svd.V, 1, 0);
+
+    matd_destroy (svd.U);
+    matd_destroy (svd.S);
+    matd_destroy (svd.V);
+    matd_destroy (us);
+}
+
+static void
+bench_arena (int rows, int cols)
+{
+    matd_t *a = random_matrix (rows, cols);
+    matd_t *usv = matd_create (rows, cols);
+    matd_arena_t *arena = matd_arena_create (0);
+
+    matd_arena_push (arena);
+    svd_reconstruct (usv, a);
+    matd_arena_pop (arena);
+    printf ("%d x %d USV': error in arena %g, arena size %zu bytes\n",
+            rows, cols, matd_err_inf (usv, a), matd_arena_size (arena));
+
+    TIME_IT ("heap", svd_reconstruct (usv, a));
+    TIME_IT ("arena", matd_arena_push (arena); svd_reconstruct (usv, a); matd_arena_pop (arena));
+
+    matd_arena_destroy (arena);
+    matd_destroy (a);
+    matd_destroy (usv);
+}
+
+int
+main (int argc, char *argv[])
+{
+    int shapes[][3] = { { 1, 1, 1 }, { 3, 4, 5 }, { 7, 3, 6 }, { 17, 33, 9 },
+                        { 70, 130, 45 }, { 257, 129, 300 } };
+    for (int i = 0; i < sizeof(shapes)/sizeof(shapes[0]); i++)
+        check_products (shapes[i][0], shapes[i][1], shapes[i][2]);
+
+    int sizes[] = { 3, 6, 16, 64, 200, 500 };
+
+    for (int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++)
+        bench_products (sizes[i]);
+
+    bench_plans (3);
+    bench_plans (6);
+
+    int small[] = { 2, 3, 4, 6, 8 };
+    for (int i = 0; i < sizeof(small)/sizeof(small[0]); i++)
+        bench_small (small[i]);
+
+    bench_arena (6, 6);
+    bench_arena (30, 12);
+
+    return 0;
+}
@@ -283,7 +283,7 @@ matd_t *homography_to_pose(const matd_t *H, double fx, double fy, double cx, dou
         matd_svd_t svd = matd_svd(R);
         matd_destroy(R);
 
-        R = matd_op("M*M'", svd.U, svd.V);
+        R = matd_multiply_a_bt(svd.U, svd.V);
 
         matd_destroy(svd.U);
         matd_destroy(svd.S);
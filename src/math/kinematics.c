@@ -0,0 +1,428 @@
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "math_util.h"
+#include "kinematics.h"
+
+// === 4x4 homogeneous transforms ===============================
+static void
+identity44 (double *X)
+{
+    memset (X, 0, 16*sizeof (double));
+    X[0] = X[5] = X[10] = X[15] = 1;
+}
+
+/* X = A*B for rigid transforms; the bottom row is assumed [0 0 0 1].
+ * X must not alias A or B. */
+static void
+mul44 (const double *A, const double *B, double *X)
+{
+    for (int i = 0; i < 3; i++) {
+        const double *a = A + 4*i;
+        double *x = X + 4*i;
+        x[0] = a[0]*B[0] + a[1]*B[4] + a[2]*B[8];
+        x[1] = a[0]*B[1] + a[1]*B[5] + a[2]*B[9];
+        x[2] = a[0]*B[2] + a[1]*B[6] + a[2]*B[10];
+        x[3] = a[0]*B[3] + a[1]*B[7] + a[2]*B[11] + a[3];
+    }
+    X[12] = X[13] = X[14] = 0;
+    X[15] = 1;
+}
+
+/* X = A*T_i, appending one DH link without forming T_i */
+static void
+append_link (const double *A, const kin_joint_t *j, double q, double *X)
+{
+    double th = q + j->theta_offset;
+    double ct = cos (th), st = sin (th);
+
+    // T_i = [ ct  -st*ca   st*sa  a*ct ]
+    //       [ st   ct*ca  -ct*sa  a*st ]
+    //       [  0      sa      ca     d ]
+    for (int i = 0; i < 3; i++) {
+        const double *a = A + 4*i;
+        double *x = X + 4*i;
+        double c0 = a[0]*ct + a[1]*st;     // A * column 0 of Rz
+        double c1 = -a[0]*st + a[1]*ct;    // A * column 1 of Rz
+        x[0] = c0;
+        x[1] = c1*j->ca + a[2]*j->sa;
+        x[2] = -c1*j->sa + a[2]*j->ca;
+        x[3] = j->a*c0 + a[2]*j->d + a[3];
+    }
+    X[12] = X[13] = X[14] = 0;
+    X[15] = 1;
+}
+
+/* Inverse of a rigid transform */
+static void
+inv44 (const double *A, double *X)
+{
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            X[4*i+j] = A[4*j+i];
+        X[4*i+3] = -(A[i]*A[3] + A[4+i]*A[7] + A[8+i]*A[11]);
+    }
+    X[12] = X[13] = X[14] = 0;
+    X[15] = 1;
+}
+
+// === Chain creation and destruction ===========================
+kin_chain_t *
+kin_chain_create (int njoints)
+{
+    assert (njoints > 0 && njoints <= KIN_MAX_JOINTS);
+
+    kin_chain_t *chain = calloc (1, sizeof (*chain));
+    chain->njoints = njoints;
+    chain->joints = calloc (njoints, sizeof (*chain->joints));
+    for (int i = 0; i < njoints; i++) {
+        chain->joints[i].min = -HUGE_VAL;
+        chain->joints[i].max = HUGE_VAL;
+    }
+    identity44 (chain->base);
+    identity44 (chain->tool);
+    kin_chain_update (chain);
+
+    return chain;
+}
+
+kin_chain_t *
+kin_chain_create_config (config_t *config, const char *prefix)
+{
+    char key[256];
+    double v[KIN_MAX_JOINTS];
+
+    snprintf (key, sizeof (key), "%s.a", prefix);
+    int n = config_get_array_len (config, key);
+    if (n <= 0 || n > KIN_MAX_JOINTS) {
+        printf ("ERR: %s: need between 1 and %d joints\n", key, KIN_MAX_JOINTS);
+        return NULL;
+    }
+
+    kin_chain_t *chain = kin_chain_create (n);
+
+    // Field name, scale, destination offset in kin_joint_t, required
+    const struct {
+        const char *name;
+        double scale;
+        size_t offset;
+        int required;
+    } fields[] = {
+        { "a", 1, offsetof (kin_joint_t, a), 1 },
+        { "d", 1, offsetof (kin_joint_t, d), 1 },
+        { "alpha_degrees", M_PI/180, offsetof (kin_joint_t, alpha), 1 },
+        { "theta_offset_degrees", M_PI/180, offsetof (kin_joint_t, theta_offset), 0 },
+        { "min_degrees", M_PI/180, offsetof (kin_joint_t, min), 0 },
+        { "max_degrees", M_PI/180, offsetof (kin_joint_t, max), 0 },
+    };
+
+    for (int f = 0; f < sizeof (fields) / sizeof (fields[0]); f++) {
+        snprintf (key, sizeof (key), "%s.%s", prefix, fields[f].name);
+        if (!config_has_key (config, key)) {
+            if (!fields[f].required)
+                continue;
+            printf ("ERR: %s missing\n", key);
+            kin_chain_destroy (chain);
+            return NULL;
+        }
+        if (config_get_array_len (config, key) != n ||
+            config_get_double_array (config, key, v, n) != n) {
+            printf ("ERR: %s must have %d values\n", key, n);
+            kin_chain_destroy (chain);
+            return NULL;
+        }
+        for (int i = 0; i < n; i++)
+            *(double *) ((char *) &chain->joints[i] + fields[f].offset) = v[i] * fields[f].scale;
+    }
+
+    snprintf (key, sizeof (key), "%s.base_xyz", prefix);
+    if (config_has_key (config, key) && config_get_double_array (config, key, v, 3) == 3) {
+        chain->base[3] = v[0];
+        chain->base[7] = v[1];
+        chain->base[11] = v[2];
+    }
+
+    kin_chain_update (chain);
+    return chain;
+}
+
+kin_chain_t *
+kin_chain_create_yaw_planar (double h, double l1, double l2, double l3)
+{
+    kin_chain_t *chain = kin_chain_create (4);
+    kin_joint_t *j = chain->joints;
+
+    // Frame 1 has x radial and y up, so the pitch joints rotate in its
+    // x-y plane. The shoulder offset makes zero point straight up.
+    j[0].d = h;
+    j[0].alpha = M_PI/2;
+    j[1].a = l1;
+    j[1].theta_offset = M_PI/2;
+    j[2].a = l2;
+    j[3].a = l3;
+
+    kin_chain_update (chain);
+    return chain;
+}
+
+void
+kin_chain_destroy (kin_chain_t *chain)
+{
+    if (chain == NULL)
+        return;
+
+    free (chain->joints);
+    free (chain);
+}
+
+void
+kin_chain_update (kin_chain_t *chain)
+{
+    for (int i = 0; i < chain->njoints; i++) {
+        chain->joints[i].ca = cos (chain->joints[i].alpha);
+        chain->joints[i].sa = sin (chain->joints[i].alpha);
+    }
+}
+
+int
+kin_chain_in_limits (const kin_chain_t *chain, const double *q)
+{
+    for (int i = 0; i < chain->njoints; i++) {
+        if (q[i] < chain->joints[i].min || q[i] > chain->joints[i].max)
+            return 0;
+    }
+    return 1;
+}
+
+// === Forward kinematics and Jacobians =========================
+/* frames must hold njoints+1 transforms */
+static void
+fk_frames (const kin_chain_t *chain, const double *q, double *frames, double *T)
+{
+    memcpy (frames, chain->base, 16*sizeof (double));
+    for (int i = 0; i < chain->njoints; i++)
+        append_link (frames + 16*i, &chain->joints[i], q[i], frames + 16*(i+1));
+    mul44 (frames + 16*chain->njoints, chain->tool, T);
+}
+
+/* Column i: z_{i-1} x (p_tool - p_{i-1}) over z_{i-1} */
+static void
+jacobian_from_frames (const kin_chain_t *chain, const double *frames, const double *T,
+                      double *J)
+{
+    int n = chain->njoints;
+
+    for (int i = 0; i < n; i++) {
+        const double *F = frames + 16*i;
+        double z[3] = { F[2], F[6], F[10] };
+        double r[3] = { T[3] - F[3], T[7] - F[7], T[11] - F[11] };
+
+        J[0*n+i] = z[1]*r[2] - z[2]*r[1];
+        J[1*n+i] = z[2]*r[0] - z[0]*r[2];
+        J[2*n+i] = z[0]*r[1] - z[1]*r[0];
+        J[3*n+i] = z[0];
+        J[4*n+i] = z[1];
+        J[5*n+i] = z[2];
+    }
+}
+
+void
+kin_fk (const kin_chain_t *chain, const double *q, double *T, double *frames)
+{
+    double tmp[16*(KIN_MAX_JOINTS+1)];
+    fk_frames (chain, q, frames != NULL ? frames : tmp, T);
+}
+
+void
+kin_jacobian (const kin_chain_t *chain, const double *q, double *J)
+{
+    double frames[16*(KIN_MAX_JOINTS+1)];
+    double T[16];
+
+    fk_frames (chain, q, frames, T);
+    jacobian_from_frames (chain, frames, T, J);
+}
+
+void
+kin_fk_batch (const kin_chain_t *chain, int n, const double *q, double *T, double *J)
+{
+    int nj = chain->njoints;
+    double frames[16*(KIN_MAX_JOINTS+1)];
+    double Ttmp[16];
+
+    for (int k = 0; k < n; k++) {
+        double *Tk = T != NULL ? T + 16*k : Ttmp;
+        fk_frames (chain, q + nj*k, frames, Tk);
+        if (J != NULL)
+            jacobian_from_frames (chain, frames, Tk, J + 6*nj*k);
+    }
+}
+
+// === Inverse kinematics =======================================
+void
+kin_ik_params_init (kin_ik_params_t *params)
+{
+    params->max_iterations = 100;
+    params->tolerance = 1e-4;
+    params->lambda = 0.01;
+    params->max_step = 0.2;
+    params->position_only = 0;
+}
+
+/* Solve A x = b in place for symmetric positive definite m x m A.
+ * Returns -1 if A is not positive definite. */
+static int
+solve_spd (double *A, double *b, int m)
+{
+    // Cholesky, lower triangle
+    for (int j = 0; j < m; j++) {
+        double s = A[j*m+j];
+        for (int k = 0; k < j; k++)
+            s -= A[j*m+k]*A[j*m+k];
+        if (s <= 0)
+            return -1;
+        A[j*m+j] = sqrt (s);
+        for (int i = j+1; i < m; i++) {
+            double t = A[i*m+j];
+            for (int k = 0; k < j; k++)
+                t -= A[i*m+k]*A[j*m+k];
+            A[i*m+j] = t / A[j*m+j];
+        }
+    }
+
+    for (int i = 0; i < m; i++) {
+        for (int k = 0; k < i; k++)
+            b[i] -= A[i*m+k]*b[k];
+        b[i] /= A[i*m+i];
+    }
+    for (int i = m-1; i >= 0; i--) {
+        for (int k = i+1; k < m; k++)
+            b[i] -= A[k*m+i]*b[k];
+        b[i] /= A[i*m+i];
+    }
+    return 0;
+}
+
+/* Pose error: position, then orientation as half the sum of the cross
+ * products of corresponding axes. Returns the error norm. */
+static double
+pose_error (const double *T, const double *G, int m, double *e)
+{
+    e[0] = G[3] - T[3];
+    e[1] = G[7] - T[7];
+    e[2] = G[11] - T[11];
+
+    if (m == 6) {
+        e[3] = e[4] = e[5] = 0;
+        for (int k = 0; k < 3; k++) {
+            double a[3] = { T[k], T[4+k], T[8+k] };
+            double g[3] = { G[k], G[4+k], G[8+k] };
+            e[3] += 0.5*(a[1]*g[2] - a[2]*g[1]);
+            e[4] += 0.5*(a[2]*g[0] - a[0]*g[2]);
+            e[5] += 0.5*(a[0]*g[1] - a[1]*g[0]);
+        }
+    }
+
+    double norm = 0;
+    for (int i = 0; i < m; i++)
+        norm += e[i]*e[i];
+    return sqrt (norm);
+}
+
+int
+kin_ik (const kin_chain_t *chain, const double *T_goal, const double *q0,
+        const kin_ik_params_t *params, double *q)
+{
+    int n = chain->njoints;
+    int m = params->position_only ? 3 : 6;
+
+    double frames[16*(KIN_MAX_JOINTS+1)];
+    double T[16], J[6*KIN_MAX_JOINTS], A[36], e[6];
+    double best_q[KIN_MAX_JOINTS];
+    double best_err = HUGE_VAL;
+
+    if (q != q0)
+        memcpy (q, q0, n*sizeof (double));
+    for (int i = 0; i < n; i++)
+        q[i] = fclamp (q[i], chain->joints[i].min, chain->joints[i].max);
+
+    for (int iter = 0; iter <= params->max_iterations; iter++) {
+        fk_frames (chain, q, frames, T);
+        double err = pose_error (T, T_goal, m, e);
+        if (err < best_err) {
+            best_err = err;
+            memcpy (best_q, q, n*sizeof (double));
+        }
+        if (err < params->tolerance)
+            return iter;
+        if (iter == params->max_iterations)
+            break;
+
+        // dq = J' (J J' + lambda^2 I)^-1 e, using the first m rows of J
+        jacobian_from_frames (chain, frames, T, J);
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j <= i; j++) {
+                double s = 0;
+                for (int k = 0; k < n; k++)
+                    s += J[i*n+k]*J[j*n+k];
+                A[i*m+j] = A[j*m+i] = s;
+            }
+            A[i*m+i] += params->lambda*params->lambda;
+        }
+        if (solve_spd (A, e, m) < 0)
+            break;
+
+        for (int k = 0; k < n; k++) {
+            double dq = 0;
+            for (int i = 0; i < m; i++)
+                dq += J[i*n+k]*e[i];
+            dq = fclamp (dq, -params->max_step, params->max_step);
+            q[k] = fclamp (q[k] + dq, chain->joints[k].min, chain->joints[k].max);
+        }
+    }
+
+    memcpy (q, best_q, n*sizeof (double));
+    return -1;
+}
+
+int
+kin_ik_yaw_planar (const kin_chain_t *chain, double x, double y, double z,
+                   double phi, int elbow_up, double *q)
+{
+    assert (chain->njoints == 4);
+
+    // Work in the base frame
+    double Binv[16];
+    inv44 (chain->base, Binv);
+    double p[3] = {
+        Binv[0]*x + Binv[1]*y + Binv[2]*z + Binv[3],
+        Binv[4]*x + Binv[5]*y + Binv[6]*z + Binv[7],
+        Binv[8]*x + Binv[9]*y + Binv[10]*z + Binv[11],
+    };
+
+    double h = chain->joints[0].d;
+    double l1 = chain->joints[1].a, l2 = chain->joints[2].a, l3 = chain->joints[3].a;
+
+    // Wrist center in the arm plane
+    double r = sqrt (sq (p[0]) + sq (p[1]));
+    double rw = r - l3*cos (phi);
+    double zw = p[2] - h - l3*sin (phi);
+
+    double c3 = (sq (rw) + sq (zw) - sq (l1) - sq (l2)) / (2*l1*l2);
+    if (c3 < -1 || c3 > 1)
+        return -1;
+
+    double q3 = elbow_up ? -acos (c3) : acos (c3);
+    double th2 = atan2 (zw, rw) - atan2 (l2*sin (q3), l1 + l2*cos (q3));
+
+    q[0] = atan2 (p[1], p[0]) - chain->joints[0].theta_offset;
+    q[1] = mod2pi (th2 - chain->joints[1].theta_offset);
+    q[2] = q3 - chain->joints[2].theta_offset;
+    q[3] = mod2pi (phi - th2 - q3 - chain->joints[3].theta_offset);
+
+    return kin_chain_in_limits (chain, q) ? 0 : -1;
+}
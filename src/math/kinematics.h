@@ -0,0 +1,136 @@
+#ifndef __MATH_KINEMATICS_H__
+#define __MATH_KINEMATICS_H__
+
+#include "common/config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Serial chains of revolute joints described by standard
+ * Denavit-Hartenberg parameters. Link i is reached from link i-1 by
+ *
+ *     T_i = Rz(q_i + theta_offset) Tz(d) Tx(a) Rx(alpha)
+ *
+ * Poses are 4x4 homogeneous transforms stored row-major in double[16].
+ * Nothing here allocates after the chain is created, so the batch calls
+ * are cheap enough for sampling-based planners.
+ */
+
+#define KIN_MAX_JOINTS 16
+
+typedef struct kin_joint kin_joint_t;
+struct kin_joint
+{
+    double d;               // [m] offset along the previous z
+    double a;               // [m] length along the new x
+    double alpha;           // [rad] twist about the new x
+    double theta_offset;    // [rad] added to the joint angle
+    double min, max;        // [rad] joint limits
+
+    // cached for speed
+    double ca, sa;
+};
+
+typedef struct kin_chain kin_chain_t;
+struct kin_chain
+{
+    int njoints;
+    kin_joint_t *joints;
+
+    double base[16];        // world <- joint 0 frame
+    double tool[16];        // last link <- tool
+};
+
+/* A chain of njoints with zero DH parameters, identity base and tool and
+ * no joint limits. Call kin_chain_update() after editing the joints. */
+kin_chain_t *
+kin_chain_create (int njoints);
+
+/* Read a chain from a config block such as
+ *
+ *   rexarm {
+ *       d = [ 0.116, 0, 0, 0 ];
+ *       a = [ 0, 0.099, 0.099, 0.110 ];
+ *       alpha_degrees = [ 90, 0, 0, 0 ];
+ *       theta_offset_degrees = [ 0, 90, 0, 0 ];
+ *       min_degrees = [ -180, -120, -120, -120 ];
+ *       max_degrees = [ 180, 120, 120, 120 ];
+ *       base_xyz = [ 0, 0, 0 ];     // optional
+ *   }
+ *
+ * The joint count is the length of "a". Limits and offsets are optional.
+ * Returns NULL if the block is missing or inconsistent. */
+kin_chain_t *
+kin_chain_create_config (config_t *config, const char *prefix);
+
+/* The RexArm geometry: a base yaw joint of height h followed by three
+ * parallel pitch joints with links l1, l2, l3. Zero is straight up. */
+kin_chain_t *
+kin_chain_create_yaw_planar (double h, double l1, double l2, double l3);
+
+void
+kin_chain_destroy (kin_chain_t *chain);
+
+/* Refresh cached values after the joints have been edited */
+void
+kin_chain_update (kin_chain_t *chain);
+
+/* 1 if every joint of q is within its limits */
+int
+kin_chain_in_limits (const kin_chain_t *chain, const double *q);
+
+/* Forward kinematics. T receives the world pose of the tool. frames, if
+ * not NULL, receives njoints+1 poses: the base and every link frame
+ * (before the tool transform). */
+void
+kin_fk (const kin_chain_t *chain, const double *q, double *T, double *frames);
+
+/* Geometric Jacobian of the tool origin, 6 x njoints row-major. Rows 0-2
+ * are linear velocity, rows 3-5 angular velocity, both in world axes. */
+void
+kin_jacobian (const kin_chain_t *chain, const double *q, double *J);
+
+/* Evaluate n configurations at once. q is n x njoints row-major. T
+ * receives n poses (16 doubles each) and J, if not NULL, n Jacobians
+ * (6*njoints doubles each). Either output may be NULL. */
+void
+kin_fk_batch (const kin_chain_t *chain, int n, const double *q, double *T, double *J);
+
+
+/* Damped least squares inverse kinematics */
+typedef struct kin_ik_params kin_ik_params_t;
+struct kin_ik_params
+{
+    int max_iterations;
+    double tolerance;       // on the (position [m], orientation [rad]) error norm
+    double lambda;          // damping [m]
+    double max_step;        // [rad] per joint per iteration
+    int position_only;      // ignore the goal orientation
+};
+
+void
+kin_ik_params_init (kin_ik_params_t *params);
+
+/* Solve for q reaching goal T from the seed q0 (q and q0 may alias).
+ * Joint limits are enforced at every step. Returns the number of
+ * iterations taken, or -1 if the tolerance was not reached; q holds the
+ * best configuration found either way. */
+int
+kin_ik (const kin_chain_t *chain, const double *T_goal, const double *q0,
+        const kin_ik_params_t *params, double *q);
+
+/* Closed-form IK for kin_chain_create_yaw_planar() arms. Reaches
+ * (x, y, z) with the last link at pitch phi above horizontal (-pi/2 points
+ * straight down). elbow_up picks between the two solutions. Returns 0 on
+ * success, -1 if the point is out of reach or the solution violates the
+ * chain's joint limits (q is still filled in the latter case). */
+int
+kin_ik_yaw_planar (const kin_chain_t *chain, double x, double y, double z,
+                   double phi, int elbow_up, double *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__MATH_KINEMATICS_H__
@@ -14,6 +14,204 @@
 // to ease creating mati, matf, etc. in the future.
 #define TYPE double
 
+////////////////////////////////
+// Arena allocation
+//
+// While a frame is pushed, everything matd allocates for its own use
+// (matrices, LU and Cholesky factorizations, scratch) is bumped off the
+// active arena instead of the heap, and freeing it does nothing. Popping
+// the frame rewinds the arena; its chunks are kept for the next frame,
+// so once they have grown to fit a workload it runs without malloc.
+
+#define MATD_ARENA_ALIGN 16
+
+typedef struct matd_arena_chunk matd_arena_chunk_t;
+struct matd_arena_chunk
+{
+    matd_arena_chunk_t *next;
+    size_t size, used;
+    char *data;
+};
+
+typedef struct
+{
+    matd_arena_chunk_t *chunk;
+    size_t used;
+    matd_arena_t *prev;
+} matd_arena_frame_t;
+
+struct matd_arena
+{
+    matd_arena_chunk_t *chunks; // first chunk
+    matd_arena_chunk_t *cur;    // chunk being allocated from
+
+    matd_arena_frame_t *frames;
+    int nframes, frames_alloc;
+
+    matd_arena_t *live_next;    // next arena in matd_arena_live
+};
+
+static __thread matd_arena_t *matd_arena_active;
+
+// Every arena with a frame pushed on this thread, whether or not it is
+// the active one. A matrix may be destroyed while another arena's frame
+// (or none, see plan_create_matrix) is active, so matd_free has to look
+// at all of them.
+static __thread matd_arena_t *matd_arena_live;
+
+static matd_arena_chunk_t *arena_chunk_create(size_t size)
+{
+    matd_arena_chunk_t *chunk = calloc(1, sizeof(matd_arena_chunk_t));
+    chunk->size = size;
+    chunk->data = malloc(size);
+    return chunk;
+}
+
+matd_arena_t *matd_arena_create(size_t capacity)
+{
+    matd_arena_t *arena = calloc(1, sizeof(matd_arena_t));
+    arena->chunks = arena_chunk_create(capacity > 0 ? capacity : 4096);
+    arena->cur = arena->chunks;
+    return arena;
+}
+
+void matd_arena_destroy(matd_arena_t *arena)
+{
+    if (arena == NULL)
+        return;
+
+    assert(arena->nframes == 0);
+
+    matd_arena_chunk_t *chunk = arena->chunks;
+    while (chunk) {
+        matd_arena_chunk_t *next = chunk->next;
+        free(chunk->data);
+        free(chunk);
+        chunk = next;
+    }
+
+    free(arena->frames);
+    free(arena);
+}
+
+void matd_arena_push(matd_arena_t *arena)
+{
+    assert(arena != NULL);
+
+    if (arena->nframes == arena->frames_alloc) {
+        arena->frames_alloc = arena->frames_alloc ? 2*arena->frames_alloc : 8;
+        arena->frames = realloc(arena->frames, arena->frames_alloc * sizeof(matd_arena_frame_t));
+    }
+
+    if (arena->nframes == 0) {
+        arena->live_next = matd_arena_live;
+        matd_arena_live = arena;
+    }
+
+    matd_arena_frame_t *frame = &arena->frames[arena->nframes++];
+    frame->chunk = arena->cur;
+    frame->used = arena->cur->used;
+    frame->prev = matd_arena_active;
+
+    matd_arena_active = arena;
+}
+
+void matd_arena_pop(matd_arena_t *arena)
+{
+    assert(arena != NULL && arena->nframes > 0);
+    assert(matd_arena_active == arena);
+
+    matd_arena_frame_t *frame = &arena->frames[--arena->nframes];
+    arena->cur = frame->chunk;
+    arena->cur->used = frame->used;
+
+    matd_arena_active = frame->prev;
+
+    if (arena->nframes == 0) {
+        matd_arena_t **link = &matd_arena_live;
+        while (*link != arena)
+            link = &(*link)->live_next;
+        *link = arena->live_next;
+    }
+}
+
+matd_arena_t *matd_arena_suspend(void)
+{
+    matd_arena_t *arena = matd_arena_active;
+    matd_arena_active = NULL;
+    return arena;
+}
+
+void matd_arena_resume(matd_arena_t *arena)
+{
+    matd_arena_active = arena;
+}
+
+size_t matd_arena_size(const matd_arena_t *arena)
+{
+    size_t size = 0;
+    for (matd_arena_chunk_t *chunk = arena->chunks; chunk; chunk = chunk->next)
+        size += chunk->size;
+    return size;
+}
+
+static void *arena_alloc(matd_arena_t *arena, size_t size)
+{
+    size = (size + MATD_ARENA_ALIGN - 1) & ~(size_t) (MATD_ARENA_ALIGN - 1);
+
+    matd_arena_chunk_t *cur = arena->cur;
+    if (cur->used + size > cur->size) {
+        // Move on to the next chunk, inserting a bigger one if it
+        // does not exist or is too small.
+        if (cur->next == NULL || cur->next->size < size) {
+            size_t chunk_size = 2 * cur->size;
+            if (chunk_size < size)
+                chunk_size = size;
+
+            matd_arena_chunk_t *chunk = arena_chunk_create(chunk_size);
+            chunk->next = cur->next;
+            cur->next = chunk;
+        }
+
+        cur = cur->next;
+        cur->used = 0;
+        arena->cur = cur;
+    }
+
+    void *p = &cur->data[cur->used];
+    cur->used += size;
+    return p;
+}
+
+static int arena_owns(const matd_arena_t *arena, const void *p)
+{
+    const char *c = p;
+    for (matd_arena_chunk_t *chunk = arena->chunks; chunk; chunk = chunk->next)
+        if (c >= chunk->data && c < chunk->data + chunk->size)
+            return 1;
+    return 0;
+}
+
+// calloc(1, size), from the active arena if there is one
+static void *matd_alloc(size_t size)
+{
+    if (matd_arena_active == NULL)
+        return calloc(1, size);
+
+    void *p = arena_alloc(matd_arena_active, size);
+    memset(p, 0, size);
+    return p;
+}
+
+static void matd_free(void *p)
+{
+    for (matd_arena_t *arena = matd_arena_live; arena != NULL; arena = arena->live_next)
+        if (arena_owns(arena, p))
+            return;
+
+    free(p);
+}
+
 matd_t *matd_create(int rows, int cols)
 {
     assert(rows >= 0);
@@ -22,20 +220,20 @@ matd_t *matd_create(int rows, int cols)
     if (rows == 0 || cols == 0)
         return matd_create_scalar(0);
 
-    matd_t *m = calloc(1, sizeof(matd_t));
+    matd_t *m = matd_alloc(sizeof(matd_t));
     m->nrows = rows;
     m->ncols = cols;
-    m->data = calloc(m->nrows * m->ncols, sizeof(TYPE));
+    m->data = matd_alloc(m->nrows * m->ncols * sizeof(TYPE));
 
     return m;
 }
 
 matd_t *matd_create_scalar(TYPE v)
 {
-    matd_t *m = calloc(1, sizeof(matd_t));
+    matd_t *m = matd_alloc(sizeof(matd_t));
     m->nrows = 0;
     m->ncols = 0;
-    m->data = calloc(1, sizeof(TYPE));
+    m->data = matd_alloc(sizeof(TYPE));
     m->data[0] = v;
 
     return m;
@@ -196,14 +394,363 @@ void matd_destroy(matd_t *m)
 {
     assert(m != NULL);
 
-    free(m->data);
+    matd_free(m->data);
 
     // set data pointer to NULL to cause segfault if used
     // after the destroy call (hard to catch failure mode)
     m->data = NULL;
 
     memset(m, 0, sizeof(matd_t));
-    free(m);
+    matd_free(m);
+}
+
+////////////////////////////////
+// Dense kernels
+//
+// The factorizations below are written once for a general n, but
+// they are forced inline so that callers can switch on the sizes that
+// dominate in practice (2x2 and 3x3 for xyt poses, 4x4 homogeneous
+// transforms, 6x6 for 6-dof poses) and call them with a constant n.
+// Each such call compiles to its own fully unrolled, allocation-free
+// copy working on the stack; any other n runs the same code as loops.
+
+#define MATD_SMALL_MAX 6
+
+#define MATD_INLINE static inline __attribute__((always_inline))
+
+// In-place LU factorization of the n x n row-major a with partial
+// pivoting: row i of the result is row perm[i] of a, L is unit lower
+// triangular. Near-zero pivots are replaced by +/-MATD_EPS, as in
+// matd_lu(). Returns 1 if that happened.
+MATD_INLINE int lu_inplace(int n, TYPE *a, int *perm, int *pivsign)
+{
+    int singular = 0;
+
+    *pivsign = 1;
+    for (int i = 0; i < n; i++)
+        perm[i] = i;
+
+    for (int j = 0; j < n; j++) {
+        int p = j;
+        for (int i = j+1; i < n; i++)
+            if (fabs(a[i*n+j]) > fabs(a[p*n+j]))
+                p = i;
+
+        if (p != j) {
+            for (int c = 0; c < n; c++) {
+                TYPE t = a[p*n+c];
+                a[p*n+c] = a[j*n+c];
+                a[j*n+c] = t;
+            }
+            int t = perm[p];
+            perm[p] = perm[j];
+            perm[j] = t;
+            *pivsign = -*pivsign;
+        }
+
+        TYPE d = a[j*n+j];
+        if (fabs(d) < MATD_EPS) {
+            d = d < 0 ? -MATD_EPS : MATD_EPS;
+            a[j*n+j] = d;
+            singular = 1;
+        }
+
+        TYPE dinv = 1.0 / d;
+        for (int i = j+1; i < n; i++) {
+            TYPE l = a[i*n+j] *= dinv;
+            for (int c = j+1; c < n; c++)
+                a[i*n+c] -= l * a[j*n+c];
+        }
+    }
+
+    return singular;
+}
+
+// Solve LU x = b in place for the nrhs columns of x, where x holds b
+// with its rows already permuted by perm.
+MATD_INLINE void lu_solve_inplace(int n, int nrhs, const TYPE *lu, TYPE *x)
+{
+    for (int k = 0; k < n; k++)
+        for (int i = k+1; i < n; i++)
+            for (int t = 0; t < nrhs; t++)
+                x[i*nrhs+t] -= lu[i*n+k] * x[k*nrhs+t];
+
+    for (int k = n-1; k >= 0; k--) {
+        TYPE dinv = 1.0 / lu[k*n+k];
+        for (int t = 0; t < nrhs; t++)
+            x[k*nrhs+t] *= dinv;
+
+        for (int i = 0; i < k; i++)
+            for (int t = 0; t < nrhs; t++)
+                x[i*nrhs+t] -= lu[i*n+k] * x[k*nrhs+t];
+    }
+}
+
+// Determinant of a, destroying it.
+MATD_INLINE double det_inplace(int n, TYPE *a)
+{
+    int perm[n], pivsign;
+    lu_inplace(n, a, perm, &pivsign);
+
+    double det = pivsign;
+    for (int i = 0; i < n; i++)
+        det *= a[i*n+i];
+    return det;
+}
+
+// inv = x^-1, using lu (n*n) as scratch
+MATD_INLINE void inverse_lu(int n, const TYPE *x, TYPE *lu, TYPE *inv)
+{
+    int perm[n], pivsign;
+    memcpy(lu, x, n*n*sizeof(TYPE));
+    lu_inplace(n, lu, perm, &pivsign);
+
+    // the identity with its rows permuted
+    memset(inv, 0, n*n*sizeof(TYPE));
+    for (int i = 0; i < n; i++)
+        inv[i*n+perm[i]] = 1;
+
+    lu_solve_inplace(n, n, lu, inv);
+}
+
+// In-place upper Cholesky factor U'U = A of the n x n row-major u; the
+// lower triangle is left alone. Returns 0 if A was not positive
+// definite, in which case small pivots were clamped to MATD_EPS.
+MATD_INLINE int chol_inplace(int n, TYPE *u)
+{
+    int is_spd = 1;
+
+    for (int i = 0; i < n; i++) {
+        double d = u[i*n+i];
+        is_spd &= (d > 0);
+
+        if (d < MATD_EPS)
+            d = MATD_EPS;
+        d = 1.0 / sqrt(d);
+
+        for (int j = i; j < n; j++)
+            u[i*n+j] *= d;
+
+        for (int j = i+1; j < n; j++) {
+            double s = u[i*n+j];
+
+            if (s == 0)
+                continue;
+
+            for (int k = j; k < n; k++)
+                u[j*n+k] -= u[i*n+k]*s;
+        }
+    }
+
+    return is_spd;
+}
+
+// Solve U'U x = b in place for the nrhs columns of x.
+MATD_INLINE void chol_solve_inplace(int n, int nrhs, const TYPE *u, TYPE *x)
+{
+    // U'y = b
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < i; j++)
+            for (int t = 0; t < nrhs; t++)
+                x[i*nrhs+t] -= u[j*n+i] * x[j*nrhs+t];
+
+        TYPE dinv = 1.0 / u[i*n+i];
+        for (int t = 0; t < nrhs; t++)
+            x[i*nrhs+t] *= dinv;
+    }
+
+    // Ux = y
+    for (int k = n-1; k >= 0; k--) {
+        TYPE dinv = 1.0 / u[k*n+k];
+        for (int t = 0; t < nrhs; t++)
+            x[k*nrhs+t] *= dinv;
+
+        for (int i = 0; i < k; i++)
+            for (int t = 0; t < nrhs; t++)
+                x[i*nrhs+t] -= u[i*n+k] * x[k*nrhs+t];
+    }
+}
+
+// C[0:m, 0:n] += alpha * op(A) * op(B) for small operands, one dot
+// product per element. Both operands are read through strides, so
+// neither transpose costs anything.
+MATD_INLINE void gemm_small(int m, int n, int k, double alpha,
+                            const TYPE *A, int ars, int acs,
+                            const TYPE *B, int brs, int bcs,
+                            TYPE *restrict C)
+{
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < n; j++) {
+            TYPE acc = 0;
+            for (int kk = 0; kk < k; kk++)
+                acc += A[i*ars + kk*acs] * B[kk*brs + j*bcs];
+            C[i*n+j] += alpha * acc;
+        }
+    }
+}
+
+////////////////////////////////
+// Matrix products
+//
+// Every product funnels into one kernel that computes C += op(A)*B
+// for a row-major B as a sum of scaled rows of B. Its inner loops have
+// no reductions and unit strides, so the compiler vectorizes them for
+// whatever SIMD the target has (SSE/AVX, NEON) without intrinsics. op(A) is read
+// through a pair of strides, which makes A' free. B' is packed a
+// block at a time into a scratch buffer so that the kernel always
+// sees contiguous rows.
+//
+// The loops are blocked so that a KC x NC panel of B stays in cache
+// while all rows of C stream past it, and each load of B feeds four
+// rows of C.
+
+#define MATD_GEMM_KC 64
+#define MATD_GEMM_NC 256
+
+// C[0:m, 0:n] += alpha * op(A)[0:m, 0:k] * B[0:k, 0:n], where
+// op(A)[i][k] = A[i*ars + k*acs]. (Accumulating a tile of C in
+// registers across k spills on SSE2 and NEON and measured slower than
+// these axpys, which keep four rows of C hot in L1.)
+static void gemm_kernel(int m, int n, int k, double alpha,
+                        const TYPE *A, int ars, int acs,
+                        const TYPE *restrict B, int ldb,
+                        TYPE *restrict C, int ldc)
+{
+    int i = 0;
+    for (; i + 4 <= m; i += 4) {
+        TYPE *restrict c0 = &C[(i+0)*ldc];
+        TYPE *restrict c1 = &C[(i+1)*ldc];
+        TYPE *restrict c2 = &C[(i+2)*ldc];
+        TYPE *restrict c3 = &C[(i+3)*ldc];
+
+        for (int kk = 0; kk < k; kk++) {
+            TYPE a0 = alpha * A[(i+0)*ars + kk*acs];
+            TYPE a1 = alpha * A[(i+1)*ars + kk*acs];
+            TYPE a2 = alpha * A[(i+2)*ars + kk*acs];
+            TYPE a3 = alpha * A[(i+3)*ars + kk*acs];
+            const TYPE *restrict b = &B[kk*ldb];
+
+            for (int j = 0; j < n; j++) {
+                TYPE bj = b[j];
+                c0[j] += a0 * bj;
+                c1[j] += a1 * bj;
+                c2[j] += a2 * bj;
+                c3[j] += a3 * bj;
+            }
+        }
+    }
+
+    for (; i < m; i++) {
+        TYPE *restrict c = &C[i*ldc];
+        for (int kk = 0; kk < k; kk++) {
+            TYPE a = alpha * A[i*ars + kk*acs];
+            const TYPE *restrict b = &B[kk*ldb];
+            for (int j = 0; j < n; j++)
+                c[j] += a * b[j];
+        }
+    }
+}
+
+void matd_gemm(matd_t *C, double alpha, const matd_t *A, int transA,
+               const matd_t *B, int transB, double beta)
+{
+    assert(C != NULL && A != NULL && B != NULL);
+    assert(!matd_is_scalar(A) && !matd_is_scalar(B) && !matd_is_scalar(C));
+    assert(C != A && C != B);
+
+    int m = transA ? A->ncols : A->nrows;
+    int k = transA ? A->nrows : A->ncols;
+    int n = transB ? B->nrows : B->ncols;
+
+    assert(k == (transB ? B->ncols : B->nrows));
+    assert(C->nrows == m && C->ncols == n);
+
+    int len = m * n;
+    if (beta == 0)
+        memset(C->data, 0, len * sizeof(TYPE));
+    else if (beta != 1)
+        for (int i = 0; i < len; i++)
+            C->data[i] *= beta;
+
+    if (alpha == 0)
+        return;
+
+    int ars = transA ? 1 : A->ncols;
+    int acs = transA ? A->ncols : 1;
+
+    if (m <= MATD_SMALL_MAX && n <= MATD_SMALL_MAX && k <= MATD_SMALL_MAX) {
+        int brs = transB ? 1 : B->ncols;
+        int bcs = transB ? B->ncols : 1;
+
+        // square products and matrix-vector products, unrolled
+        int sz = (m == k && (n == m || n == 1)) ? m : 0;
+
+        switch (n == 1 ? -sz : sz) {
+            case 2:  gemm_small(2, 2, 2, alpha, A->data, ars, acs, B->data, brs, bcs, C->data); break;
+            case 3:  gemm_small(3, 3, 3, alpha, A->data, ars, acs, B->data, brs, bcs, C->data); break;
+            case 4:  gemm_small(4, 4, 4, alpha, A->data, ars, acs, B->data, brs, bcs, C->data); break;
+            case 6:  gemm_small(6, 6, 6, alpha, A->data, ars, acs, B->data, brs, bcs, C->data); break;
+            case -2: gemm_small(2, 1, 2, alpha, A->data, ars, acs, B->data, brs, bcs, C->data); break;
+            case -3: gemm_small(3, 1, 3, alpha, A->data, ars, acs, B->data, brs, bcs, C->data); break;
+            case -4: gemm_small(4, 1, 4, alpha, A->data, ars, acs, B->data, brs, bcs, C->data); break;
+            case -6: gemm_small(6, 1, 6, alpha, A->data, ars, acs, B->data, brs, bcs, C->data); break;
+            default: gemm_small(m, n, k, alpha, A->data, ars, acs, B->data, brs, bcs, C->data); break;
+        }
+        return;
+    }
+
+    TYPE *pack = NULL;
+    if (transB)
+        pack = matd_alloc(sizeof(TYPE) * (k < MATD_GEMM_KC ? k : MATD_GEMM_KC) *
+                      (n < MATD_GEMM_NC ? n : MATD_GEMM_NC));
+
+    for (int k0 = 0; k0 < k; k0 += MATD_GEMM_KC) {
+        int kb = k - k0 < MATD_GEMM_KC ? k - k0 : MATD_GEMM_KC;
+
+        for (int j0 = 0; j0 < n; j0 += MATD_GEMM_NC) {
+            int nb = n - j0 < MATD_GEMM_NC ? n - j0 : MATD_GEMM_NC;
+
+            const TYPE *b;
+            int ldb;
+
+            if (transB) {
+                // pack the kb x nb block of B'
+                for (int kk = 0; kk < kb; kk++)
+                    for (int j = 0; j < nb; j++)
+                        pack[kk*nb + j] = MATD_EL(B, j0 + j, k0 + kk);
+                b = pack;
+                ldb = nb;
+            } else {
+                b = &MATD_EL(B, k0, j0);
+                ldb = B->ncols;
+            }
+
+            gemm_kernel(m, nb, kb, alpha, &A->data[k0*acs], ars, acs,
+                        b, ldb, &C->data[j0], n);
+        }
+    }
+
+    matd_free(pack);
+}
+
+void matd_multiply_into(matd_t *c, const matd_t *a, const matd_t *b)
+{
+    assert(a != NULL);
+    assert(b != NULL);
+    assert(c != NULL);
+
+    if (matd_is_scalar(a) || matd_is_scalar(b)) {
+        const matd_t *m = matd_is_scalar(a) ? b : a;
+        double s = matd_is_scalar(a) ? a->data[0] : b->data[0];
+        int len = matd_is_scalar(m) ? 1 : m->nrows * m->ncols;
+
+        assert(c->nrows == m->nrows && c->ncols == m->ncols);
+        for (int i = 0; i < len; i++)
+            c->data[i] = s * m->data[i];
+        return;
+    }
+
+    matd_gemm(c, 1, a, 0, b, 0, 0);
 }
 
 matd_t *matd_multiply(const matd_t *a, const matd_t *b)
@@ -218,15 +765,73 @@ matd_t *matd_multiply(const matd_t *a, const matd_t *b)
 
     assert(a->ncols == b->nrows);
     matd_t *m = matd_create(a->nrows, b->ncols);
+    matd_gemm(m, 1, a, 0, b, 0, 0);
 
-    for (int i = 0; i < m->nrows; i++) {
-        for (int j = 0; j < m->ncols; j++) {
-            TYPE acc = 0;
-            for (int k = 0; k < a->ncols; k++) {
-                acc += MATD_EL(a, i, k) * MATD_EL(b, k, j);
-            }
-            MATD_EL(m, i, j) = acc;
-        }
+    return m;
+}
+
+matd_t *matd_multiply_at_b(const matd_t *a, const matd_t *b)
+{
+    assert(a != NULL);
+    assert(b != NULL);
+
+    if (matd_is_scalar(a))
+        return matd_scale(b, a->data[0]);
+    if (matd_is_scalar(b)) {
+        matd_t *m = matd_transpose(a);
+        matd_scale_inplace(m, b->data[0]);
+        return m;
+    }
+
+    assert(a->nrows == b->nrows);
+    matd_t *m = matd_create(a->ncols, b->ncols);
+    matd_gemm(m, 1, a, 1, b, 0, 0);
+
+    return m;
+}
+
+matd_t *matd_multiply_a_bt(const matd_t *a, const matd_t *b)
+{
+    assert(a != NULL);
+    assert(b != NULL);
+
+    if (matd_is_scalar(a)) {
+        matd_t *m = matd_transpose(b);
+        matd_scale_inplace(m, a->data[0]);
+        return m;
+    }
+    if (matd_is_scalar(b))
+        return matd_scale(a, b->data[0]);
+
+    assert(a->ncols == b->ncols);
+    matd_t *m = matd_create(a->nrows, b->nrows);
+    matd_gemm(m, 1, a, 0, b, 1, 0);
+
+    return m;
+}
+
+matd_t *matd_multiply_at_w_b(const matd_t *a, const matd_t *w, const matd_t *b)
+{
+    assert(a != NULL && w != NULL && b != NULL);
+    assert(!matd_is_scalar(a) && !matd_is_scalar(w) && !matd_is_scalar(b));
+    assert(a->nrows == w->nrows && w->ncols == b->nrows);
+
+    // Pick the cheaper association: (A'W)B or A'(WB).
+    double cost_left = (double) a->ncols * w->ncols * (a->nrows + b->ncols);
+    double cost_right = (double) w->nrows * b->ncols * (w->ncols + a->ncols);
+
+    matd_t *m = matd_create(a->ncols, b->ncols);
+
+    if (cost_left <= cost_right) {
+        matd_t *atw = matd_create(a->ncols, w->ncols);
+        matd_gemm(atw, 1, a, 1, w, 0, 0);
+        matd_gemm(m, 1, atw, 0, b, 0, 0);
+        matd_destroy(atw);
+    } else {
+        matd_t *wb = matd_create(w->nrows, b->ncols);
+        matd_gemm(wb, 1, w, 0, b, 0, 0);
+        matd_gemm(m, 1, a, 1, wb, 0, 0);
+        matd_destroy(wb);
     }
 
     return m;
@@ -365,33 +970,24 @@ matd_t *matd_transpose(const matd_t *a)
     return m;
 }
 
-static
-double matd_det_general(const matd_t *a)
+// det(a) for n > 4 by LU
+static double matd_det_lu(const matd_t *a)
 {
-    // Use LU decompositon to calculate the determinant
-    matd_lu_t *mlu = matd_lu(a);
-    matd_t *L = matd_lu_l(mlu);
-    matd_t *U = matd_lu_u(mlu);
+    int n = a->nrows;
 
-    // The determinants of the L and U matrices are the products of
-    // their respective diagonal elements
-    double detL = 1; double detU = 1;
-    for (int i = 0; i < a->nrows; i++) {
-        detL *= matd_get(L, i, i);
-        detU *= matd_get(U, i, i);
+    if (n <= MATD_SMALL_MAX) {
+        TYPE lu[MATD_SMALL_MAX*MATD_SMALL_MAX];
+        memcpy(lu, a->data, n*n*sizeof(TYPE));
+
+        if (n == 6)
+            return det_inplace(6, lu);
+        return det_inplace(n, lu);
     }
 
-    // The determinant of a can be calculated as
-    //     epsilon*det(L)*det(U),
-    // where epsilon is just the sign of the corresponding permutation
-    // (which is +1 for an even number of permutations and is −1
-    // for an uneven number of permutations).
-    double det = mlu->pivsign * detL * detU;
-
-    // Cleanup
-    matd_lu_destroy(mlu);
-    matd_destroy(L);
-    matd_destroy(U);
+    TYPE *lu = matd_alloc(n*n*sizeof(TYPE));
+    memcpy(lu, a->data, n*n*sizeof(TYPE));
+    double det = det_inplace(n, lu);
+    matd_free(lu);
 
     return det;
 }
@@ -446,7 +1042,7 @@ double matd_det(const matd_t *a)
         }
 
         default:
-            return matd_det_general(a);
+            return matd_det_lu(a);
     }
 
     assert(0);
@@ -464,52 +1060,6 @@ static double make_non_zero(double v)
     return v;
 }
 
-static matd_t *matd_naive_inverse(const matd_t *x, double invdet)
-{
-    // Implementation as described in
-    // http://www.mathsisfun.com/algebra/matrix-inverse-minors-cofactors-adjugate.html
-
-    // Calculate the matrix of cofactors of x
-    matd_t *cof = matd_create(x->nrows, x->ncols);
-    for (int i = 0; i < x->nrows; i++) {
-        for (int j = 0; j < x->ncols; j++) {
-
-            int nelms = (x->nrows-1)*(x->ncols-1);
-            double *reduced_data = calloc(nelms, sizeof(double));
-            int idx = 0;
-            for (int p = 0; p < x->nrows; p++) {
-                for (int q = 0; q < x->ncols; q++) {
-                    if (p != i && q != j) {
-                        reduced_data[idx] = matd_get(x, p, q);
-                        idx++;
-                    }
-                }
-            }
-            matd_t *reduced = matd_create_data(x->nrows-1, x->ncols-1, reduced_data);
-
-            //printf("reduced matrix:\n");
-            //matd_print(reduced, "%5.2f "); printf("\n");
-            //printf("----------\n");
-
-            free(reduced_data);
-            matd_put(cof, i, j, pow(-1, i+j)*matd_det(reduced));
-            matd_destroy(reduced);
-        }
-    }
-
-    //printf("cofactors matrix: \n"); matd_print(cof, "%5.2f "); printf("\n");
-
-    // Calculate the adjugate (a.k.a. adjoint): just the transposed matrix of cofactors
-    matd_t *adj = matd_transpose(cof);
-    matd_destroy(cof);
-
-    // Multiply each element of adj by 1/det(x) and we are done
-    for (int i = 0; i < adj->nrows; i++)
-        for (int j = 0; j < adj->ncols; j++)
-            matd_put(adj, i, j, matd_get(adj, i, j)*invdet);
-    return adj;
-}
-
 matd_t *matd_inverse(const matd_t *x)
 {
     matd_t *m = NULL;
@@ -520,9 +1070,31 @@ matd_t *matd_inverse(const matd_t *x)
     if (matd_is_scalar(x))
         return matd_create_scalar(1.0 / x->data[0]);
 
+    int n = x->nrows;
+
+    if (n > 4) {
+        // Gauss-Jordan by LU; small pivots are clamped to MATD_EPS
+        // just as the determinant is below.
+        m = matd_create(n, n);
+
+        if (n <= MATD_SMALL_MAX) {
+            TYPE lu[MATD_SMALL_MAX*MATD_SMALL_MAX];
+            if (n == 6)
+                inverse_lu(6, x->data, lu, m->data);
+            else
+                inverse_lu(n, x->data, lu, m->data);
+        } else {
+            TYPE *lu = matd_alloc(n*n*sizeof(TYPE));
+            inverse_lu(n, x->data, lu, m->data);
+            matd_free(lu);
+        }
+
+        return m;
+    }
+
     double invdet = 1.0 / make_non_zero(matd_det(x));
 
-    switch(x->nrows) {
+    switch(n) {
         case 1:
             // a 1x1 matrix
             m = matd_create(x->nrows, x->nrows);
@@ -585,10 +1157,6 @@ matd_t *matd_inverse(const matd_t *x)
 
             return m;
         }
-
-        default:
-            // TODO: implement better inversion method
-            return matd_naive_inverse(x, invdet);
     }
 
     return NULL; // unreachable
@@ -596,301 +1164,477 @@ matd_t *matd_inverse(const matd_t *x)
 
 
 
-// TODO Optimization: Some operations we could perform in-place,
-// saving some memory allocation work. E.g., ADD, SUBTRACT. Just need
-// to make sure that we don't do an in-place modification on a matrix
-// that was an input argument!
+////////////////////////////////
+// Expression plans
+//
+// An expression is parsed once into a tree of nodes. Every node that
+// produces a new value owns a result matrix, which is kept between
+// evaluations and only reallocated when the argument dimensions
+// change, so evaluating a plan again costs no parsing and (for
+// products, sums and transposes) no allocation.
+//
+// Transposes are never formed for products: a chain of ' operators
+// under a multiply is folded into the trans flags of matd_gemm(), so
+// M'*M*M runs as two GEMMs and nothing else. The same folding applies
+// to sums, negation and plain copies.
+
+enum { MATD_PLAN_ARG, MATD_PLAN_CONST, MATD_PLAN_ADD, MATD_PLAN_SUB, MATD_PLAN_MUL,
+       MATD_PLAN_NEG, MATD_PLAN_TRANS, MATD_PLAN_INV };
 
-// handle right-associative operators, greedily consuming them. These
-// include transpose and inverse. This is called by the main recursion
-// method.
-static inline matd_t *matd_op_gobble_right(const char *expr, int *pos, matd_t *acc, matd_t **garb, int *garbpos)
+struct matd_plan_node
 {
-    while (expr[*pos] != 0) {
+    int type;
+    int a, b;           // child node indices
+    int arg;            // MATD_PLAN_ARG: argument index
+    matd_t *res;        // this node's result (MATD_PLAN_CONST: the constant)
+};
 
-        switch (expr[*pos]) {
+struct matd_plan
+{
+    int nnodes, alloc;
+    struct matd_plan_node *nodes;
+    int root;
 
-            case '\'': {
-                assert(acc != NULL); // either a syntax error or a math op failed, producing null
-                matd_t *res = matd_transpose(acc);
-                garb[*garbpos] = res;
-                (*garbpos)++;
-                acc = res;
+    int nargs;
+    char *free_arg;     // free_arg[i]: argument i was given as 'F'
 
-                (*pos)++;
-                break;
-            }
+    matd_t *result;     // used when the root is a bare argument
+};
 
-                // handle inverse ^-1. No other exponents are allowed.
-            case '^': {
-                assert(acc != NULL);
-                assert(expr[*pos+1] == '-');
-                assert(expr[*pos+2] == '1');
+typedef struct
+{
+    const char *expr;
+    int pos;
+    matd_plan_t *plan;
+    int error;
+} plan_parser_t;
+
+// A plan outlives any arena frame it is used in, so the matrices it
+// keeps always come from the heap.
+static matd_t *plan_create_matrix(int rows, int cols)
+{
+    matd_arena_t *arena = matd_arena_suspend();
+    matd_t *m = matd_create(rows, cols);
+    matd_arena_resume(arena);
+    return m;
+}
 
-                matd_t *res = matd_inverse(acc);
-                garb[*garbpos] = res;
-                (*garbpos)++;
-                acc = res;
+static int plan_add_node(matd_plan_t *plan, int type, int a, int b)
+{
+    if (plan->nnodes == plan->alloc) {
+        plan->alloc = plan->alloc ? 2*plan->alloc : 16;
+        plan->nodes = realloc(plan->nodes, plan->alloc * sizeof(struct matd_plan_node));
+    }
 
-                (*pos)+=3;
-                break;
+    struct matd_plan_node *node = &plan->nodes[plan->nnodes];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->a = a;
+    node->b = b;
+
+    return plan->nnodes++;
+}
+
+static char plan_peek(plan_parser_t *pp)
+{
+    // spaces are meaningless.
+    while (pp->expr[pp->pos] == ' ')
+        pp->pos++;
+    return pp->expr[pp->pos];
+}
+
+static int plan_parse_expr(plan_parser_t *pp);
+
+// primary := M | F | number | '(' expr ')', followed by any number of
+// right-associative ' and ^-1 operators.
+static int plan_parse_factor(plan_parser_t *pp)
+{
+    int idx = -1;
+    char c = plan_peek(pp);
+
+    if (c == 'M' || c == 'F') {
+        matd_plan_t *plan = pp->plan;
+        idx = plan_add_node(plan, MATD_PLAN_ARG, -1, -1);
+        plan->nodes[idx].arg = plan->nargs;
+        plan->free_arg = realloc(plan->free_arg, plan->nargs + 1);
+        plan->free_arg[plan->nargs] = (c == 'F');
+        plan->nargs++;
+        pp->pos++;
+    } else if ((c >= '0' && c <= '9') || c == '.') {
+        // a constant (SCALAR) defined inline.
+        const char *start = &pp->expr[pp->pos];
+        char *end;
+        double s = strtod(start, &end);
+        pp->pos += (end - start);
+        idx = plan_add_node(pp->plan, MATD_PLAN_CONST, -1, -1);
+        pp->plan->nodes[idx].res = plan_create_matrix(0, 0);
+        pp->plan->nodes[idx].res->data[0] = s;
+    } else if (c == '(') {
+        pp->pos++;
+        idx = plan_parse_expr(pp);
+        if (plan_peek(pp) != ')') {
+            fprintf(stderr, "matd_op(): Expected ')' at position %d of \"%s\"\n", pp->pos, pp->expr);
+            pp->error = 1;
+            return -1;
+        }
+        pp->pos++;
+    } else {
+        fprintf(stderr, "matd_op(): Unknown character: '%c'\n", c);
+        pp->error = 1;
+        return -1;
+    }
+
+    while (!pp->error) {
+        c = plan_peek(pp);
+
+        if (c == '\'') {
+            idx = plan_add_node(pp->plan, MATD_PLAN_TRANS, idx, -1);
+            pp->pos++;
+        } else if (c == '^') {
+            // handle inverse ^-1. No other exponents are allowed.
+            if (pp->expr[pp->pos+1] != '-' || pp->expr[pp->pos+2] != '1') {
+                fprintf(stderr, "matd_op(): Only ^-1 is supported: \"%s\"\n", pp->expr);
+                pp->error = 1;
+                return -1;
             }
+            idx = plan_add_node(pp->plan, MATD_PLAN_INV, idx, -1);
+            pp->pos += 3;
+        } else {
+            break;
+        }
+    }
+
+    return idx;
+}
 
-            default:
-                return acc;
+// term := ['-'] factor { ['*'] ['-'] factor }
+static int plan_parse_term(plan_parser_t *pp)
+{
+    if (plan_peek(pp) == '-') {
+        // unary minus negates the rest of the product
+        pp->pos++;
+        return plan_add_node(pp->plan, MATD_PLAN_NEG, plan_parse_term(pp), -1);
+    }
+
+    int lhs = plan_parse_factor(pp);
+
+    while (!pp->error) {
+        char c = plan_peek(pp);
+        int rhs;
+
+        if (c == '*') {
+            pp->pos++;
+            if (plan_peek(pp) == '-') {
+                pp->pos++;
+                rhs = plan_add_node(pp->plan, MATD_PLAN_NEG, plan_parse_factor(pp), -1);
+            } else {
+                rhs = plan_parse_factor(pp);
+            }
+        } else if (c == 'M' || c == 'F' || c == '(' || c == '.' || (c >= '0' && c <= '9')) {
+            // juxtaposition: MM is a product
+            rhs = plan_parse_factor(pp);
+        } else {
+            break;
         }
+
+        lhs = plan_add_node(pp->plan, MATD_PLAN_MUL, lhs, rhs);
     }
 
-    return acc;
+    return lhs;
 }
 
-// @garb, garbpos  A list of every matrix allocated during evaluation... used to assist cleanup.
-// @oneterm: we should return at the end of this term (i.e., stop at a PLUS, MINUS, LPAREN).
-static matd_t *matd_op_recurse(const char *expr, int *pos, matd_t *acc, matd_t **args, int *argpos,
-                               matd_t **garb, int *garbpos, int oneterm)
+// expr := term { ('+' | '-') term }
+static int plan_parse_expr(plan_parser_t *pp)
 {
-    while (expr[*pos] != 0) {
+    int lhs = plan_parse_term(pp);
 
-        switch (expr[*pos]) {
+    while (!pp->error) {
+        char c = plan_peek(pp);
+        if (c != '+' && c != '-')
+            break;
 
-            case '(': {
-                if (oneterm && acc != NULL)
-                    return acc;
-                (*pos)++;
-                matd_t *rhs = matd_op_recurse(expr, pos, NULL, args, argpos, garb, garbpos, 0);
-                rhs = matd_op_gobble_right(expr, pos, rhs, garb, garbpos);
+        pp->pos++;
+        int rhs = plan_parse_term(pp);
+        lhs = plan_add_node(pp->plan, c == '+' ? MATD_PLAN_ADD : MATD_PLAN_SUB, lhs, rhs);
+    }
 
-                if (acc == NULL) {
-                    acc = rhs;
-                } else {
-                    matd_t *res = matd_multiply(acc, rhs);
-                    garb[*garbpos] = res;
-                    (*garbpos)++;
-                    acc = res;
-                }
+    return lhs;
+}
 
-                break;
-            }
+matd_plan_t *matd_plan_create(const char *expr)
+{
+    assert(expr != NULL);
 
-            case ')': {
-                if (oneterm)
-                    return acc;
+    matd_plan_t *plan = calloc(1, sizeof(matd_plan_t));
+    plan_parser_t pp = { .expr = expr, .pos = 0, .plan = plan, .error = 0 };
 
-                (*pos)++;
-                return acc;
-            }
+    if (plan_peek(&pp) == 0)
+        pp.error = 1;
+    else
+        plan->root = plan_parse_expr(&pp);
 
-            case '*': {
-                (*pos)++;
+    if (!pp.error && plan_peek(&pp) != 0) {
+        fprintf(stderr, "matd_op(): Unexpected '%c' at position %d of \"%s\"\n",
+                plan_peek(&pp), pp.pos, expr);
+        pp.error = 1;
+    }
 
-                matd_t *rhs = matd_op_recurse(expr, pos, NULL, args, argpos, garb, garbpos, 1);
-                rhs = matd_op_gobble_right(expr, pos, rhs, garb, garbpos);
+    if (pp.error) {
+        matd_plan_destroy(plan);
+        return NULL;
+    }
 
-                if (acc == NULL) {
-                    acc = rhs;
-                } else {
-                    matd_t *res = matd_multiply(acc, rhs);
-                    garb[*garbpos] = res;
-                    (*garbpos)++;
-                    acc = res;
-                }
+    return plan;
+}
 
-                break;
-            }
+void matd_plan_destroy(matd_plan_t *plan)
+{
+    if (plan == NULL)
+        return;
 
-            case 'F': {
-                matd_t *rhs = args[*argpos];
-                garb[*garbpos] = rhs;
-                (*garbpos)++;
+    for (int i = 0; i < plan->nnodes; i++)
+        if (plan->nodes[i].res)
+            matd_destroy(plan->nodes[i].res);
 
-                (*pos)++;
-                (*argpos)++;
+    if (plan->result)
+        matd_destroy(plan->result);
 
-                rhs = matd_op_gobble_right(expr, pos, rhs, garb, garbpos);
+    free(plan->nodes);
+    free(plan->free_arg);
+    free(plan);
+}
 
-                if (acc == NULL) {
-                    acc = rhs;
-                } else {
-                    matd_t *res = matd_multiply(acc, rhs);
-                    garb[*garbpos] = res;
-                    (*garbpos)++;
-                    acc = res;
-                }
+int matd_plan_nargs(const matd_plan_t *plan)
+{
+    return plan->nargs;
+}
 
-                break;
-            }
+// Skip over transposes, returning the node underneath. *trans is set
+// if an odd number of them was skipped.
+static int plan_peel(const matd_plan_t *plan, int idx, int *trans)
+{
+    *trans = 0;
+    while (plan->nodes[idx].type == MATD_PLAN_TRANS) {
+        *trans ^= 1;
+        idx = plan->nodes[idx].a;
+    }
+    return idx;
+}
 
-            case 'M': {
-                matd_t *rhs = args[*argpos];
+// The matrix a node should write into: the caller's 'dst' if given,
+// otherwise the node's own buffer, (re)created to size if necessary.
+static matd_t *plan_output(matd_t **buf, matd_t *dst, int rows, int cols)
+{
+    if (dst != NULL) {
+        assert(dst->nrows == rows && dst->ncols == cols);
+        return dst;
+    }
 
-                (*pos)++;
-                (*argpos)++;
+    if (*buf == NULL || (*buf)->nrows != rows || (*buf)->ncols != cols) {
+        if (*buf)
+            matd_destroy(*buf);
+        *buf = plan_create_matrix(rows, cols);
+    }
 
-                rhs = matd_op_gobble_right(expr, pos, rhs, garb, garbpos);
+    return *buf;
+}
 
-                if (acc == NULL) {
-                    acc = rhs;
-                } else {
-                    matd_t *res = matd_multiply(acc, rhs);
-                    garb[*garbpos] = res;
-                    (*garbpos)++;
-                    acc = res;
-                }
+#define PLAN_EL(m, t, i, j) ((t) ? MATD_EL(m, j, i) : MATD_EL(m, i, j))
 
-                break;
-            }
+// out = s * op(x)
+static matd_t *plan_scale(matd_t **buf, matd_t *dst, const matd_t *x, int tx, double s)
+{
+    if (matd_is_scalar(x)) {
+        matd_t *out = plan_output(buf, dst, 0, 0);
+        out->data[0] = s * x->data[0];
+        return out;
+    }
 
-/*
-  case 'D': {
-  int rows = expr[*pos+1]-'0';
-  int cols = expr[*pos+2]-'0';
+    int rows = tx ? x->ncols : x->nrows;
+    int cols = tx ? x->nrows : x->ncols;
+    matd_t *out = plan_output(buf, dst, rows, cols);
+    assert(out != x);
 
-  matd_t *rhs = matd_create(rows, cols);
+    if (!tx) {
+        for (int i = 0; i < rows*cols; i++)
+            out->data[i] = s * x->data[i];
+    } else {
+        for (int i = 0; i < rows; i++)
+            for (int j = 0; j < cols; j++)
+                MATD_EL(out, i, j) = s * MATD_EL(x, j, i);
+    }
 
-  break;
-  }
-*/
-                // a constant (SCALAR) defined inline. Treat just like M, creating a matd_t on the fly.
-            case '0':
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-            case '5':
-            case '6':
-            case '7':
-            case '8':
-            case '9':
-            case '.': {
-                const char *start = &expr[*pos];
-                char *end;
-                double s = strtod(start, &end);
-                (*pos) += (end - start);
-                matd_t *rhs = matd_create_scalar(s);
-                garb[*garbpos] = rhs;
-                (*garbpos)++;
-
-                rhs = matd_op_gobble_right(expr, pos, rhs, garb, garbpos);
-
-                if (acc == NULL) {
-                    acc = rhs;
-                } else {
-                    matd_t *res = matd_multiply(acc, rhs);
-                    garb[*garbpos] = res;
-                    (*garbpos)++;
-                    acc = res;
-                }
+    return out;
+}
 
-                break;
-            }
+// Evaluates node idx. The result goes into dst if it is not NULL, and
+// otherwise into the node's buffer; arguments are returned as-is.
+static const matd_t *plan_eval(matd_plan_t *plan, int idx, matd_t **args, matd_t *dst)
+{
+    struct matd_plan_node *node = &plan->nodes[idx];
+    int ta, tb;
 
-            case '+': {
-                if (oneterm && acc != NULL)
-                    return acc;
+    switch (node->type) {
 
-                // don't support unary plus
-                assert(acc != NULL);
-                (*pos)++;
-                matd_t *rhs = matd_op_recurse(expr, pos, NULL, args, argpos, garb, garbpos, 1);
-                rhs = matd_op_gobble_right(expr, pos, rhs, garb, garbpos);
+        case MATD_PLAN_ARG:
+        case MATD_PLAN_CONST: {
+            const matd_t *x = node->type == MATD_PLAN_ARG ? args[node->arg] : node->res;
+            if (dst == NULL)
+                return x;
+            return plan_scale(NULL, dst, x, 0, 1);
+        }
 
-                matd_t *res = matd_add(acc, rhs);
+        case MATD_PLAN_TRANS:
+        case MATD_PLAN_NEG: {
+            int ia = plan_peel(plan, node->type == MATD_PLAN_NEG ? node->a : idx, &ta);
+            const matd_t *a = plan_eval(plan, ia, args, NULL);
+            if (node->type == MATD_PLAN_TRANS && !ta && dst == NULL)
+                return a; // M''
+            return plan_scale(&node->res, dst, a, ta, node->type == MATD_PLAN_NEG ? -1 : 1);
+        }
 
-                garb[*garbpos] = res;
-                (*garbpos)++;
-                acc = res;
-                break;
-            }
+        case MATD_PLAN_MUL: {
+            int ia = plan_peel(plan, node->a, &ta);
+            int ib = plan_peel(plan, node->b, &tb);
+            const matd_t *a = plan_eval(plan, ia, args, NULL);
+            const matd_t *b = plan_eval(plan, ib, args, NULL);
+
+            if (matd_is_scalar(a))
+                return plan_scale(&node->res, dst, b, tb, a->data[0]);
+            if (matd_is_scalar(b))
+                return plan_scale(&node->res, dst, a, ta, b->data[0]);
+
+            int rows = ta ? a->ncols : a->nrows;
+            int cols = tb ? b->nrows : b->ncols;
+            matd_t *out = plan_output(&node->res, dst, rows, cols);
+            matd_gemm(out, 1, a, ta, b, tb, 0);
+            return out;
+        }
 
-            case '-': {
-                if (oneterm && acc != NULL)
-                    return acc;
-
-                if (acc == NULL) {
-                    // unary minus
-                    (*pos)++;
-                    matd_t *rhs = matd_op_recurse(expr, pos, NULL, args, argpos, garb, garbpos, 1);
-                    rhs = matd_op_gobble_right(expr, pos, rhs, garb, garbpos);
-
-                    matd_t *res = matd_scale(rhs, -1);
-                    garb[*garbpos] = res;
-                    (*garbpos)++;
-                    acc = res;
-                } else {
-                    // subtract
-                    (*pos)++;
-                    matd_t *rhs = matd_op_recurse(expr, pos, NULL, args, argpos, garb, garbpos, 1);
-                    rhs = matd_op_gobble_right(expr, pos, rhs, garb, garbpos);
-
-                    matd_t *res = matd_subtract(acc, rhs);
-                    garb[*garbpos] = res;
-                    (*garbpos)++;
-                    acc = res;
-                }
-                break;
+        case MATD_PLAN_ADD:
+        case MATD_PLAN_SUB: {
+            int ia = plan_peel(plan, node->a, &ta);
+            int ib = plan_peel(plan, node->b, &tb);
+            const matd_t *a = plan_eval(plan, ia, args, NULL);
+            const matd_t *b = plan_eval(plan, ib, args, NULL);
+            double sign = node->type == MATD_PLAN_ADD ? 1 : -1;
+
+            if (matd_is_scalar(a) && matd_is_scalar(b)) {
+                matd_t *out = plan_output(&node->res, dst, 0, 0);
+                out->data[0] = a->data[0] + sign * b->data[0];
+                return out;
             }
 
-            case ' ': {
-                // nothing to do. spaces are meaningless.
-                (*pos)++;
-                break;
+            int rows = ta ? a->ncols : a->nrows;
+            int cols = ta ? a->nrows : a->ncols;
+            assert(rows == (tb ? b->ncols : b->nrows));
+            assert(cols == (tb ? b->nrows : b->ncols));
+
+            matd_t *out = plan_output(&node->res, dst, rows, cols);
+            assert(out != a && out != b);
+
+            if (!ta && !tb) {
+                for (int i = 0; i < rows*cols; i++)
+                    out->data[i] = a->data[i] + sign * b->data[i];
+            } else {
+                for (int i = 0; i < rows; i++)
+                    for (int j = 0; j < cols; j++)
+                        MATD_EL(out, i, j) = PLAN_EL(a, ta, i, j) + sign * PLAN_EL(b, tb, i, j);
             }
+            return out;
+        }
 
-            default: {
-                fprintf(stderr, "matd_op(): Unknown character: '%c'\n", expr[*pos]);
-                assert(expr[*pos] != expr[*pos]);
-            }
+        case MATD_PLAN_INV: {
+            const matd_t *a = plan_eval(plan, node->a, args, NULL);
+            matd_t *inv = matd_inverse(a);
+            const matd_t *out = plan_scale(&node->res, dst, inv, 0, 1);
+            matd_destroy(inv);
+            return out;
         }
     }
-    return acc;
+
+    assert(0);
+    return NULL;
 }
 
-// always returns a new matrix.
-matd_t *matd_op(const char *expr, ...)
+static const matd_t *plan_evalv(matd_plan_t *plan, matd_t *dst, va_list ap)
 {
-    int nargs = 0;
-    int exprlen = 0;
+    matd_t *args[plan->nargs > 0 ? plan->nargs : 1];
+    for (int i = 0; i < plan->nargs; i++)
+        args[i] = va_arg(ap, matd_t*);
 
-    assert(expr != NULL);
+    const matd_t *res = plan_eval(plan, plan->root, args, dst);
 
-    for (const char *p = expr; *p != 0; p++) {
-        if (*p == 'M' || *p == 'F')
-            nargs++;
-        exprlen++;
+    // a bare argument, e.g. "F" or "M''", must still be copied out
+    for (int i = 0; i < plan->nargs; i++) {
+        if (res == args[i]) {
+            res = plan_scale(&plan->result, NULL, res, 0, 1);
+            break;
+        }
     }
 
-    if (!exprlen) // expr = ""
-        return NULL;
+    for (int i = 0; i < plan->nargs; i++)
+        if (plan->free_arg[i])
+            matd_destroy(args[i]);
 
-    va_list ap;
-    va_start(ap, expr);
+    return res;
+}
 
-    matd_t *args[nargs];
-    for (int i = 0; i < nargs; i++) {
-        args[i] = va_arg(ap, matd_t*);
-        // XXX: sanity check argument; emit warning/error if args[i]
-        // doesn't look like a matd_t*.
-    }
+const matd_t *matd_plan_eval(matd_plan_t *plan, ...)
+{
+    assert(plan != NULL);
 
+    va_list ap;
+    va_start(ap, plan);
+    const matd_t *res = plan_evalv(plan, NULL, ap);
     va_end(ap);
 
-    int pos = 0;
-    int argpos = 0;
-    int garbpos = 0;
+    return res;
+}
 
-    matd_t *garb[2*exprlen]; // can't create more than 2 new result per character
-                             // one result, and possibly one argument to free
+void matd_plan_eval_into(matd_plan_t *plan, matd_t *out, ...)
+{
+    assert(plan != NULL);
+    assert(out != NULL);
 
-    matd_t *res = matd_op_recurse(expr, &pos, NULL, args, &argpos, garb, &garbpos, 0);
+    va_list ap;
+    va_start(ap, out);
+    plan_evalv(plan, out, ap);
+    va_end(ap);
+}
 
-    // 'res' may need to be freed as part of garbage collection (i.e. expr = "F")
-    matd_t *res_copy = (res ? matd_copy(res) : NULL);
+// always returns a new matrix.
+matd_t *matd_op(const char *expr, ...)
+{
+    assert(expr != NULL);
+
+    matd_plan_t *plan = matd_plan_create(expr);
+    if (plan == NULL) // expr = "" (or a syntax error)
+        return NULL;
 
-    for (int i = 0; i < garbpos; i++) {
-        matd_destroy(garb[i]);
+    va_list ap;
+    va_start(ap, expr);
+    const matd_t *res = plan_evalv(plan, NULL, ap);
+    va_end(ap);
+
+    // take ownership of the result instead of copying it.
+    matd_t *ret = NULL;
+    if (res == plan->result) {
+        ret = plan->result;
+        plan->result = NULL;
+    } else {
+        for (int i = 0; i < plan->nnodes; i++) {
+            if (plan->nodes[i].res == res) {
+                ret = plan->nodes[i].res;
+                plan->nodes[i].res = NULL;
+                break;
+            }
+        }
     }
+    assert(ret != NULL);
 
-    return res_copy;
+    matd_plan_destroy(plan);
+    return ret;
 }
 
 static inline double sq(double v)
@@ -1332,12 +2076,20 @@ static matd_svd_t matd_svd_tall(matd_t *A)
     // we've factored:
     // LP*(something)*RP'
 
-    // solve for (something)
-    B = matd_op("M'*F*M", LP, B, RP);
+    // solve for (something): B = LP'*B*RP
+    matd_t *LPtB = matd_multiply_at_b(LP, B);
+    matd_destroy(B);
+    B = matd_multiply(LPtB, RP);
+    matd_destroy(LPtB);
 
     // update LS and RS, remembering that RS will be transposed.
-    LS = matd_op("F*M", LS, LP);
-    RS = matd_op("F*M", RS, RP);
+    matd_t *tmp = matd_multiply(LS, LP);
+    matd_destroy(LS);
+    LS = tmp;
+
+    tmp = matd_multiply(RS, RP);
+    matd_destroy(RS);
+    RS = tmp;
 
     matd_destroy(LP);
     matd_destroy(RP);
@@ -1411,11 +2163,11 @@ matd_svd_t matd_svd(matd_t *A)
 
 matd_lu_t *matd_lu(const matd_t *a)
 {
-    int *piv = calloc(a->nrows, sizeof(int));
+    int *piv = matd_alloc(a->nrows * sizeof(int));
     int pivsign = 1;
     matd_t *lu = matd_copy(a);
 
-    matd_lu_t *mlu = calloc(1, sizeof(matd_lu_t));
+    matd_lu_t *mlu = matd_alloc(sizeof(matd_lu_t));
 
     for (int i = 0; i < a->nrows; i++)
         piv[i] = i;
@@ -1487,9 +2239,9 @@ matd_lu_t *matd_lu(const matd_t *a)
 void matd_lu_destroy(matd_lu_t *mlu)
 {
     matd_destroy(mlu->lu);
-    free(mlu->piv);
+    matd_free(mlu->piv);
     memset(mlu, 0, sizeof(matd_lu_t));
-    free(mlu);
+    matd_free(mlu);
 }
 
 double matd_lu_det(const matd_lu_t *mlu)
@@ -1543,7 +2295,7 @@ matd_t *matd_lu_solve(const matd_lu_t *mlu, const matd_t *b)
 
     // permute right hand side
     for (int i = 0; i < mlu->lu->nrows; i++)
-        memcpy(&MATD_EL(x, mlu->piv[i], 0), &MATD_EL(b, i, 0), sizeof(TYPE) * b->ncols);
+        memcpy(&MATD_EL(x, i, 0), &MATD_EL(b, mlu->piv[i], 0), sizeof(TYPE) * b->ncols);
 
     // solve Ly = b
     for (int k = 0; k < mlu->lu->nrows; k++) {
@@ -1572,6 +2324,39 @@ matd_t *matd_lu_solve(const matd_lu_t *mlu, const matd_t *b)
 
 matd_t *matd_solve(matd_t *A, matd_t *b)
 {
+    int n = A->nrows;
+
+    if (n == A->ncols && n <= MATD_SMALL_MAX && !matd_is_scalar(A) && !matd_is_scalar(b)) {
+        assert(b->nrows == n);
+
+        TYPE lu[MATD_SMALL_MAX*MATD_SMALL_MAX];
+        int perm[MATD_SMALL_MAX], pivsign;
+        memcpy(lu, A->data, n*n*sizeof(TYPE));
+
+        switch (n) {
+            case 2: lu_inplace(2, lu, perm, &pivsign); break;
+            case 3: lu_inplace(3, lu, perm, &pivsign); break;
+            case 4: lu_inplace(4, lu, perm, &pivsign); break;
+            case 6: lu_inplace(6, lu, perm, &pivsign); break;
+            default: lu_inplace(n, lu, perm, &pivsign); break;
+        }
+
+        int nrhs = b->ncols;
+        matd_t *x = matd_create(n, nrhs);
+        for (int i = 0; i < n; i++)
+            memcpy(&MATD_EL(x, i, 0), &MATD_EL(b, perm[i], 0), nrhs*sizeof(TYPE));
+
+        switch (n) {
+            case 2: lu_solve_inplace(2, nrhs, lu, x->data); break;
+            case 3: lu_solve_inplace(3, nrhs, lu, x->data); break;
+            case 4: lu_solve_inplace(4, nrhs, lu, x->data); break;
+            case 6: lu_solve_inplace(6, nrhs, lu, x->data); break;
+            default: lu_solve_inplace(n, nrhs, lu, x->data); break;
+        }
+
+        return x;
+    }
+
     matd_lu_t *mlu = matd_lu(A);
     matd_t *x = matd_lu_solve(mlu, b);
 
@@ -1745,32 +2530,17 @@ MATD_EL(U, i, j) = 0;
 }
 }
 */
-    int is_spd = 1; // (A->nrows == A->ncols);
-
-    for (int i = 0; i < N; i++) {
-        double d = MATD_EL(U, i, i);
-        is_spd &= (d > 0);
-
-        if (d < MATD_EPS)
-            d = MATD_EPS;
-        d = 1.0 / sqrt(d);
-
-        for (int j = i; j < N; j++)
-            MATD_EL(U, i, j) *= d;
-
-        for (int j = i+1; j < N; j++) {
-            double s = MATD_EL(U, i, j);
-
-            if (s == 0)
-                continue;
-
-            for (int k = j; k < N; k++) {
-                MATD_EL(U, j, k) -= MATD_EL(U, i, k)*s;
-            }
-        }
+    int is_spd;
+
+    switch (N) {
+        case 2: is_spd = chol_inplace(2, U->data); break;
+        case 3: is_spd = chol_inplace(3, U->data); break;
+        case 4: is_spd = chol_inplace(4, U->data); break;
+        case 6: is_spd = chol_inplace(6, U->data); break;
+        default: is_spd = chol_inplace(N, U->data); break;
     }
 
-    matd_chol_t *chol = calloc(1, sizeof(matd_chol_t));
+    matd_chol_t *chol = matd_alloc(sizeof(matd_chol_t));
     chol->is_spd = is_spd;
     chol->u = U;
     return chol;
@@ -1779,7 +2549,7 @@ MATD_EL(U, i, j) = 0;
 void matd_chol_destroy(matd_chol_t *chol)
 {
     matd_destroy(chol->u);
-    free(chol);
+    matd_free(chol);
 }
 
 // Solve: (U')x = b, U is upper triangular
@@ -1834,35 +2604,12 @@ matd_t *matd_chol_solve(const matd_chol_t *chol, const matd_t *b)
     matd_t *x = matd_copy(b);
 
     // LUx = b
-
-    // solve Ly = b ==> (U')y = b
-
-    for (int i = 0; i < u->nrows; i++) {
-        for (int j = 0; j < i; j++) {
-            // b[i] -= L[i,j]*x[j]... replicated across columns of b
-            //   ==> i.e., ==>
-            // b[i,k] -= L[i,j]*x[j,k]
-            for (int k = 0; k < b->ncols; k++) {
-                MATD_EL(x, i, k) -= MATD_EL(u, j, i)*MATD_EL(x, j, k);
-            }
-        }
-        // x[i] = b[i] / L[i,i]
-        for (int k = 0; k < b->ncols; k++) {
-            MATD_EL(x, i, k) /= MATD_EL(u, i, i);
-        }
-    }
-
-    // solve Ux = y
-    for (int k = u->ncols-1; k >= 0; k--) {
-        double LUkk = 1.0 / MATD_EL(u, k, k);
-        for (int t = 0; t < b->ncols; t++)
-            MATD_EL(x, k, t) *= LUkk;
-
-        for (int i = 0; i < k; i++) {
-            double LUik = -MATD_EL(u, i, k);
-            for (int t = 0; t < b->ncols; t++)
-                MATD_EL(x, i, t) += MATD_EL(x, k, t) *LUik;
-        }
+    switch (u->nrows) {
+        case 2: chol_solve_inplace(2, b->ncols, u->data, x->data); break;
+        case 3: chol_solve_inplace(3, b->ncols, u->data, x->data); break;
+        case 4: chol_solve_inplace(4, b->ncols, u->data, x->data); break;
+        case 6: chol_solve_inplace(6, b->ncols, u->data, x->data); break;
+        default: chol_solve_inplace(u->nrows, b->ncols, u->data, x->data); break;
     }
 
     return x;
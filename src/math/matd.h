@@ -186,6 +186,49 @@ void matd_scale_inplace(matd_t *a, double s);
  */
 matd_t *matd_multiply(const matd_t *a, const matd_t *b);
 
+/**
+ * Same as matd_multiply(), but writes the product into the existing matrix
+ * 'c', which must already have the dimensions of the result and must not
+ * be 'a' or 'b'.
+ */
+void matd_multiply_into(matd_t *c, const matd_t *a, const matd_t *b);
+
+/**
+ * Computes a'*b without forming the transpose of 'a'. rows(a) must equal
+ * rows(b). It is the caller's responsibility to call matd_destroy() on the
+ * returned matrix.
+ */
+matd_t *matd_multiply_at_b(const matd_t *a, const matd_t *b);
+
+/**
+ * Computes a*b' without forming the transpose of 'b'. columns(a) must equal
+ * columns(b). It is the caller's responsibility to call matd_destroy() on
+ * the returned matrix.
+ */
+matd_t *matd_multiply_a_bt(const matd_t *a, const matd_t *b);
+
+/**
+ * Computes a'*w*b, e.g. the J'*W*J and J'*W*r terms of weighted least
+ * squares, without forming any transposes. The cheaper of (a'w)b and
+ * a'(wb) is used. It is the caller's responsibility to call matd_destroy()
+ * on the returned matrix.
+ */
+matd_t *matd_multiply_at_w_b(const matd_t *a, const matd_t *w, const matd_t *b);
+
+/**
+ * General matrix product in the style of BLAS dgemm:
+ *
+ *   C = alpha*op(A)*op(B) + beta*C
+ *
+ * where op(X) is X' if the corresponding trans flag is non-zero and X
+ * otherwise. C must already have the dimensions of the product and must
+ * not be A or B. If beta is zero, the previous contents of C are ignored.
+ * None of the arguments may be scalars. The kernel is cache-blocked and
+ * written so that the compiler can vectorize it.
+ */
+void matd_gemm(matd_t *C, double alpha, const matd_t *A, int transA,
+               const matd_t *B, int transB, double beta);
+
 /**
  * Creates a matrix which is the transpose of the supplied matrix 'a'. It is the
  * caller's responsibility to call matd_destroy() on the returned matrix.
@@ -202,7 +245,8 @@ double matd_det(const matd_t *a);
  * a new matrix. This is strictly only possible if the determinant of 'a' is
  * non-zero (matd_det(a) != 0). If the determinant of 'a' is zero or very small,
  * an approximation of the inverse will be returned using MATD_EPS as the
- * determinant. matd_det(a) can be checked beforehand to determine the matrix's
+ * determinant (for matrices larger than 4x4, which are inverted by LU, as each
+ * pivot). matd_det(a) can be checked beforehand to determine the matrix's
  * suitability for inversion. It is the caller's responsibility to call
  * matd_destroy() on the returned matrix.
  */
@@ -318,12 +362,104 @@ double matd_err_inf(const matd_t *a, const matd_t *b);
  */
 matd_t *matd_op(const char *expr, ...);
 
+/**
+ * A matd_op() expression compiled for repeated use. matd_op() parses its
+ * expression and allocates every intermediate on each call; a plan parses
+ * once and keeps its intermediates, so evaluating it again with arguments
+ * of the same dimensions allocates nothing (except for ^-1). Products
+ * involving transposes, e.g. "M'*M*M", are evaluated without forming
+ * the transposes.
+ *
+ *   matd_plan_t *plan = matd_plan_create("M'*M*M");
+ *   for (...) {
+ *       const matd_t *JtWJ = matd_plan_eval(plan, J, W, J);
+ *       ...
+ *   }
+ *   matd_plan_destroy(plan);
+ *
+ * Returns NULL if the expression is empty or malformed. 'F' arguments are
+ * destroyed after every evaluation, as in matd_op().
+ */
+typedef struct matd_plan matd_plan_t;
+
+matd_plan_t *matd_plan_create(const char *expr);
+void matd_plan_destroy(matd_plan_t *plan);
+
+/**
+ * The number of matrix arguments (M or F placeholders) the plan takes.
+ */
+int matd_plan_nargs(const matd_plan_t *plan);
+
+/**
+ * Evaluates the plan with one matrix per placeholder. The result belongs
+ * to the plan and is only valid until its next evaluation or destruction;
+ * do not call matd_destroy() on it.
+ */
+const matd_t *matd_plan_eval(matd_plan_t *plan, ...);
+
+/**
+ * Evaluates the plan, writing the result into 'out', which must already
+ * have the result's dimensions and must not be one of the arguments.
+ */
+void matd_plan_eval_into(matd_plan_t *plan, matd_t *out, ...);
+
 /**
  * Frees the memory associated with matrix 'm', being the result of an earlier
  * call to a matd_*() function, after which 'm' will no longer be usable.
  */
 void matd_destroy(matd_t *m);
 
+/**
+ * A scratch allocator for matd temporaries. Between matd_arena_push() and
+ * the matching matd_arena_pop(), every matrix created by a matd_*()
+ * function on the calling thread (and the matd_lu_t / matd_chol_t
+ * structures and internal scratch) is carved out of the arena instead of
+ * the heap, and matd_destroy() on it does nothing. Popping the frame
+ * releases all of it at once. The arena keeps its memory for the next
+ * frame, so a loop that pushes and pops once per iteration stops calling
+ * malloc after the first few iterations:
+ *
+ *   matd_arena_t *arena = matd_arena_create(0);
+ *   for (...) {
+ *       matd_arena_push(arena);
+ *       matd_svd_t svd = matd_svd(A);     // temporaries and results
+ *       matd_multiply_into(out, svd.U, svd.V); // 'out' created outside
+ *       matd_arena_pop(arena);
+ *   }
+ *   matd_arena_destroy(arena);
+ *
+ * Anything that must outlive the frame has to be created before it was
+ * pushed; pass it to the *_into() variants. Frames nest, also across
+ * arenas, and must be popped in reverse order on the thread that pushed
+ * them. Matrices from the heap, or from any arena with a frame pushed on
+ * this thread, may be destroyed whichever frame is active.
+ * Plans (matd_plan_t) and matd_op() results always use the heap.
+ */
+typedef struct matd_arena matd_arena_t;
+
+/**
+ * Creates an arena whose first chunk holds 'capacity' bytes (0 for a
+ * default); it grows as needed.
+ */
+matd_arena_t *matd_arena_create(size_t capacity);
+void matd_arena_destroy(matd_arena_t *arena);
+
+void matd_arena_push(matd_arena_t *arena);
+void matd_arena_pop(matd_arena_t *arena);
+
+/**
+ * Total bytes the arena holds, in use or not.
+ */
+size_t matd_arena_size(const matd_arena_t *arena);
+
+/**
+ * Send allocations to the heap until matd_arena_resume(), for objects
+ * that must outlive whatever frame the caller may have pushed. Returns
+ * the active arena (possibly NULL), which must be passed to resume.
+ */
+matd_arena_t *matd_arena_suspend(void);
+void matd_arena_resume(matd_arena_t *arena);
+
 typedef struct
 {
     matd_t *U;
@@ -11,6 +11,7 @@
 //#include "timeprofile.h"
 
 #include "smatd.h"
+#include "bsmatd.h"
 
 // make future smatf/smati implementations easier.
 #define TYPE double
@@ -519,7 +520,7 @@ smatd_t *smatd_upper_right(smatd_t *a)
 // of matrix M (due to the product of Y' and Y). So we subtract these
 // contributions from C and then recursively factor C.
 
-smatd_chol_t *smatd_chol(smatd_t *a)
+static smatd_chol_t *smatd_chol_rowwise(smatd_t *a)
 {
     // create a new matrix that is the upper-right of A.
     smatd_t *u = smatd_upper_right(a);
@@ -556,6 +557,94 @@ smatd_chol_t *smatd_chol(smatd_t *a)
     return chol;
 }
 
+// The factorization itself is done by the supernodal code in bsmatd,
+// treating every variable as a 1x1 block. The blocks are left in A's
+// order, so the panels are rows of U and are copied back into svecds.
+// Matrices that turn out not to be SPD are refactored row-wise.
+smatd_chol_t *smatd_chol(smatd_t *a)
+{
+    if (a->nrows != a->ncols)
+        return smatd_chol_rowwise(a);
+
+    int n = a->nrows;
+
+    int nedges = 0;
+    for (int i = 0; i < n; i++) {
+        svecd_t *av = &a->rows[i];
+        for (int pos = 0; pos < av->nz; pos++)
+            if (av->indices[pos] > i)
+                nedges++;
+    }
+
+    int *bsize = calloc(n > 0 ? n : 1, sizeof(int));
+    int *edges = calloc(nedges > 0 ? 2*nedges : 2, sizeof(int));
+    for (int i = 0; i < n; i++)
+        bsize[i] = 1;
+
+    nedges = 0;
+    for (int i = 0; i < n; i++) {
+        svecd_t *av = &a->rows[i];
+        for (int pos = 0; pos < av->nz; pos++) {
+            if (av->indices[pos] > i) {
+                edges[2*nedges+0] = i;
+                edges[2*nedges+1] = av->indices[pos];
+                nedges++;
+            }
+        }
+    }
+
+    bsmatd_t *b = bsmatd_create(n, bsize, nedges, edges);
+    for (int i = 0; i < n; i++) {
+        svecd_t *av = &a->rows[i];
+        for (int pos = 0; pos < av->nz; pos++)
+            if (av->indices[pos] >= i)
+                *bsmatd_block(b, i, av->indices[pos]) = av->values[pos];
+    }
+
+    bsmatd_chol_t *bchol = bsmatd_chol_analyze(b, 0);
+    int is_spd = bsmatd_chol_factor(bchol, b, 1);
+
+    // bsmatd clamps non-positive pivots to keep going, smatd_chol has
+    // always taken their square root. Redo those with the row-wise code
+    // so callers still get the same (non-finite) U and is_spd == 0.
+    if (!is_spd) {
+        bsmatd_chol_destroy(bchol);
+        bsmatd_destroy(b);
+        free(bsize);
+        free(edges);
+        return smatd_chol_rowwise(a);
+    }
+
+    smatd_t *u = smatd_create(n, n);
+    for (int s = 0; s < bchol->nsuper; s++) {
+        int nk = bchol->super_nrows[s], m = bchol->super_ncols[s];
+        const TYPE *P = &bchol->values[bchol->panel_ptr[s]];
+        const int *idx = &bchol->panel_idx[bchol->panel_idx_ptr[s]];
+
+        for (int i = 0; i < nk; i++) {
+            svecd_t *urow = &u->rows[idx[i]];
+            svecd_ensure_capacity(urow, m - i);
+            for (int j = i; j < m; j++) {
+                if (P[i*m + j] == 0)
+                    continue;
+                urow->indices[urow->nz] = idx[j];
+                urow->values[urow->nz] = P[i*m + j];
+                urow->nz++;
+            }
+        }
+    }
+
+    bsmatd_chol_destroy(bchol);
+    bsmatd_destroy(b);
+    free(bsize);
+    free(edges);
+
+    smatd_chol_t *chol = calloc(1, sizeof(smatd_chol_t));
+    chol->is_spd = is_spd;
+    chol->u = u;
+    return chol;
+}
+
 void smatd_chol_destroy(smatd_chol_t *chol)
 {
     smatd_destroy(chol->u);
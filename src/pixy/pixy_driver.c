@@ -1,131 +1,235 @@
 /** \file
-   SPI driver for the CMUcam5 Pixy on Beaglebone Black.
+   SPI driver for the CMUcam5 Pixy on Beaglebone Black. Publishes every
+   frame's blocks as a pixy_block_list_t.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 
+#include <lcm/lcm.h>
+#include "lcmtypes/pixy_block_list_t.h"
+
+#include "common/getopt.h"
+#include "common/timestamp.h"
+
+// The Pixy sends 16-bit big-endian words. Every word read should be
+// clocked out with the sync byte first so the Pixy can keep its word
+// alignment; it answers 0x0000 when it has nothing to send.
+#define PIXY_SYNC_BYTE      0x5a
+#define PIXY_START_NORMAL   0xaa55
+#define PIXY_START_CC       0xaa56
+#define PIXY_FRAME_USEC     20000   // 50 Hz
+
+// Words following the start word of a block
+#define BLOCK_WORDS_NORMAL  6       // checksum, signature, x, y, width, height
+#define BLOCK_WORDS_CC      7       // ... and angle
+
 enum {
-    TYPE_NORMAL,
-    TYPE_COLOR_CODE,
+    PARSE_UNSYNCED,     // looking for a start word at any byte offset
+    PARSE_IDLE,         // aligned, between blocks
+    PARSE_BLOCK,        // collecting the words of a block
 };
 
-typedef struct {
-    uint8_t type;
-    uint16_t checksum;
-    uint16_t signature;
-    uint16_t x;
-    uint16_t y;
-    uint16_t width;
-    uint16_t height;
-    int16_t angle;
-} pixy_t;
-
-int debug = 0;
-uint8_t mode = 0; //SPI_NO_CS; - this causes an error when trying to set mode
-uint8_t bits = 8;           // bits per data word
-uint32_t speed = 1000000;   // in Hz
+typedef struct pixy pixy_t;
+struct pixy
+{
+    int fd;
+    uint32_t speed;
+    int debug;
+
+    // One SPI message per burst
+    int burst_len;
+    uint8_t *tx;
+    uint8_t *rx;
+
+    // Stream parser. Persists across bursts so frames may straddle them.
+    int state;
+    int have_byte;
+    uint8_t byte;
+    int block_type;
+    int block_have;
+    uint16_t block[BLOCK_WORDS_CC];
+
+    // Frame being assembled
+    int max_blocks;
+    pixy_block_list_t frame;
+
+    // Statistics for debug output
+    int64_t stats_utime;
+    int nframes;
+    int nbursts;
+    int nbytes_used;
+    int sync_losses;
+
+    lcm_t *lcm;
+    const char *channel;
+};
 
 /** Perform a bidirectional SPI transfer of len bytes. The bytes in txbuf are
     sent to the slave device while the bytes received are placed in rxbuf */
-void spi_transfer(int fd, uint8_t *txbuf, uint8_t *rxbuf, int len)
+static int
+spi_transfer(pixy_t *pixy, const uint8_t *txbuf, uint8_t *rxbuf, int len)
 {
     struct spi_ioc_transfer tfer = {
         .tx_buf = (uintptr_t)txbuf,
         .rx_buf = (uintptr_t)rxbuf,
         .len = len,
         .delay_usecs = 0,
-        .speed_hz = speed,
-        .bits_per_word = bits,
+        .speed_hz = pixy->speed,
+        .bits_per_word = 8,
     };
 
-    int ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tfer);
+    int ret = ioctl(pixy->fd, SPI_IOC_MESSAGE(1), &tfer);
     if (ret < 1) {
         perror("spi transfer failed");
-        abort();
+        return -1;
     }
+    return 0;
 }
 
-/*
-void spi_read_buffered(int fd, uint8_t *dst, int len)
+static void
+publish_frame(pixy_t *pixy, int64_t utime)
 {
-    static uint8_t buf[100];
-    static const int bufsize = 100;
-    static int bufidx = 100;
-
-    // Fill buffer
-    while (len) {
-	// Fill buffer if necessary
-	if (bufidx >= bufsize) {
-	    spi_transfer(fd, NULL, buf, bufsize);
-	    bufidx = 0;
-	}
-
-	// Copy n bytes to dst
-	int n = (len < (bufsize-bufidx)) ? len : bufsize-bufidx;
-	while (n--) {
-	    *dst++ = buf[bufidx++];
-	    len--;
-	}
-    }
-}
-*/
+    pixy->frame.utime = utime;
+    pixy_block_list_t_publish(pixy->lcm, pixy->channel, &pixy->frame);
 
-/** Read a 16-bit int in big-endian byte order */
-uint16_t readu16(int fd)
-{
-    uint8_t rx[2];
-    spi_transfer(fd, NULL, rx, 2);
-    return (rx[1] | rx[0] << 8);
+    pixy->nframes++;
+    pixy->frame.nblocks = 0;
+    pixy->frame.checksum_errors = 0;
+    pixy->frame.dropped_blocks = 0;
 }
 
-/** Read a 8-bit int */
-uint8_t readu8(int fd)
+static void
+finish_block(pixy_t *pixy)
 {
-    uint8_t rx[1];
-    spi_transfer(fd, NULL, rx, 1);
-    return rx[0];
+    uint16_t *w = pixy->block;
+    int nwords = pixy->block_type == PIXY_BLOCK_T_TYPE_COLOR_CODE ?
+        BLOCK_WORDS_CC : BLOCK_WORDS_NORMAL;
+
+    uint16_t checksum = 0;
+    for (int i = 1; i < nwords; i++)
+        checksum += w[i];
+    if (checksum != w[0]) {
+        if (pixy->debug)
+            printf("failed checksum: received %x, computed %x\n", w[0], checksum);
+        pixy->frame.checksum_errors++;
+        return;
+    }
+
+    if (pixy->frame.nblocks == pixy->max_blocks) {
+        pixy->frame.dropped_blocks++;
+        return;
+    }
+
+    pixy_block_t *b = &pixy->frame.blocks[pixy->frame.nblocks++];
+    b->type = pixy->block_type;
+    b->signature = w[1];
+    b->x = w[2];
+    b->y = w[3];
+    b->width = w[4];
+    b->height = w[5];
+    b->angle = pixy->block_type == PIXY_BLOCK_T_TYPE_COLOR_CODE ? (int16_t) w[6] : 0;
 }
 
-int main(int argc, char *argv[])
+/** Consume one aligned word */
+static void
+parse_word(pixy_t *pixy, uint16_t w, int64_t utime)
 {
-    // so that redirected stdout won't be insanely buffered.
-    setvbuf (stdout, (char *) NULL, _IONBF, 0);
+    switch (pixy->state) {
+        case PARSE_BLOCK:
+            pixy->block[pixy->block_have++] = w;
+
+            // A start word where the checksum belongs: the block header was
+            // preceded by the frame start word. Begin the frame here.
+            if (pixy->block_have == 1 && (w == PIXY_START_NORMAL || w == PIXY_START_CC)) {
+                if (pixy->frame.nblocks > 0 || pixy->frame.checksum_errors > 0)
+                    publish_frame(pixy, utime);
+                pixy->block_type = w == PIXY_START_CC ?
+                    PIXY_BLOCK_T_TYPE_COLOR_CODE : PIXY_BLOCK_T_TYPE_NORMAL;
+                pixy->block_have = 0;
+                break;
+            }
 
-    int opt;
-    while ((opt = getopt(argc, argv, "dh")) != -1) {
-        switch (opt) {
-        case 'd':
-            printf("Debug messages on\n");
-            debug = 1;
+            if (pixy->block_have == (pixy->block_type == PIXY_BLOCK_T_TYPE_COLOR_CODE ?
+                                     BLOCK_WORDS_CC : BLOCK_WORDS_NORMAL)) {
+                finish_block(pixy);
+                pixy->state = PARSE_IDLE;
+            }
             break;
 
-        case 'h':
-            printf("Usage: pixy_driver [options] [/path/to/spidev]\n");
-            printf("-d\tTurn on debug messages\n");
-            printf("-h\tPrint this help and exit\n");
-            exit(1);
-        }
+        case PARSE_IDLE:
+            if (w == PIXY_START_NORMAL || w == PIXY_START_CC) {
+                pixy->block_type = w == PIXY_START_CC ?
+                    PIXY_BLOCK_T_TYPE_COLOR_CODE : PIXY_BLOCK_T_TYPE_NORMAL;
+                pixy->block_have = 0;
+                pixy->state = PARSE_BLOCK;
+            }
+            else if (w == 0) {
+                // The Pixy goes quiet once the frame is sent
+                if (pixy->frame.nblocks > 0 || pixy->frame.checksum_errors > 0)
+                    publish_frame(pixy, utime);
+            }
+            else {
+                pixy->sync_losses++;
+                pixy->state = PARSE_UNSYNCED;
+            }
+            break;
     }
+}
 
-    char *port = "/dev/spidev1.0";
-    if (argc > optind)
-        port = argv[optind];
+/** Feed a burst through the parser. Returns the number of bytes that
+    weren't idle padding. */
+static int
+parse_burst(pixy_t *pixy, const uint8_t *buf, int len, int64_t utime)
+{
+    int used = 0;
+
+    for (int i = 0; i < len; i++) {
+        uint8_t b = buf[i];
+
+        if (pixy->state == PARSE_UNSYNCED) {
+            // Look for a start word at any offset
+            if (pixy->have_byte && pixy->byte == 0xaa && (b == 0x55 || b == 0x56)) {
+                pixy->have_byte = 0;
+                pixy->state = PARSE_IDLE;
+                parse_word(pixy, 0xaa00 | b, utime);
+                used += 2;
+            }
+            else {
+                pixy->byte = b;
+                pixy->have_byte = 1;
+            }
+            continue;
+        }
 
-    printf("Opening device %s\n", port);
+        if (!pixy->have_byte) {
+            pixy->byte = b;
+            pixy->have_byte = 1;
+            continue;
+        }
+        pixy->have_byte = 0;
 
-    // Open SPI port and set mode
-    int fd = open(port, O_RDWR);
-    if (fd == -1) {
-        perror("can't open SPI device");
-        abort();
+        uint16_t w = (pixy->byte << 8) | b;
+        if (w != 0 || pixy->state == PARSE_BLOCK)
+            used += 2;
+        parse_word(pixy, w, utime);
     }
 
+    return used;
+}
+
+static int
+spi_configure(int fd, uint32_t speed)
+{
+    uint8_t mode = 0; //SPI_NO_CS; - this causes an error when trying to set mode
+    uint8_t bits = 8;
+
     if (ioctl(fd, SPI_IOC_WR_MODE, &mode) == -1)
         perror("can't set spi mode");
     if (ioctl(fd, SPI_IOC_RD_MODE, &mode) == -1)
@@ -143,91 +247,106 @@ int main(int argc, char *argv[])
 
     printf("SPI config: mode %d, %d bits per word, %d Hz max\n",
            mode, bits, speed);
+    return 0;
+}
 
-    int valid_blocks = 0;
-    int checksum_errors = 0;
+int main(int argc, char *argv[])
+{
+    // so that redirected stdout won't be insanely buffered.
+    setvbuf (stdout, (char *) NULL, _IONBF, 0);
 
-    while (1) {
-        int i;
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt, 'h', "help", 0, "Show this help screen");
+    getopt_add_bool(gopt, 'd', "debug", 0, "Turn on debug messages");
+    getopt_add_string(gopt, '\0', "device", "/dev/spidev1.0", "SPI device");
+    getopt_add_int(gopt, 's', "speed", "1000000", "SPI clock [Hz]");
+    getopt_add_string(gopt, 'c', "channel", "PIXY_BLOCKS", "LCM channel name");
+    getopt_add_int(gopt, 'm', "max-blocks", "32", "Blocks kept per frame; sizes the SPI burst");
+
+    if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help")) {
+        printf("Usage: %s [options]\n\n", argv[0]);
+        getopt_do_usage(gopt);
+        exit(1);
+    }
 
-        // IMPORTANT: data appears to be big-endian, despite the documentation
-        // Wait for sync pattern 0xaa55
-        while ((i = readu8(fd)) != 0xaa) {
-            //printf("%02x ", i);
-            usleep(2000);
+    if (getopt_get_int(gopt, "speed") <= 0 || getopt_get_int(gopt, "max-blocks") <= 0) {
+        printf("ERR: --speed and --max-blocks must be positive\n");
+        getopt_do_usage(gopt);
+        exit(1);
+    }
+
+    pixy_t *pixy = calloc(1, sizeof(*pixy));
+    pixy->debug = getopt_get_bool(gopt, "debug");
+    pixy->speed = getopt_get_int(gopt, "speed");
+    pixy->channel = getopt_get_string(gopt, "channel");
+    pixy->max_blocks = getopt_get_int(gopt, "max-blocks");
+    pixy->frame.blocks = calloc(pixy->max_blocks, sizeof(*pixy->frame.blocks));
+    pixy->state = PARSE_UNSYNCED;
+
+    // A full frame of color codes: frame start word plus 8 words per block
+    pixy->burst_len = 2 + 2*(1 + BLOCK_WORDS_CC)*pixy->max_blocks;
+    pixy->tx = malloc(pixy->burst_len);
+    pixy->rx = malloc(pixy->burst_len);
+    for (int i = 0; i < pixy->burst_len; i += 2) {
+        pixy->tx[i] = PIXY_SYNC_BYTE;
+        pixy->tx[i+1] = 0;
+    }
+
+    pixy->lcm = lcm_create(NULL);
+    if (!pixy->lcm)
+        exit(1);
+
+    const char *port = getopt_get_string(gopt, "device");
+    printf("Opening device %s\n", port);
+
+    // Open SPI port and set mode
+    pixy->fd = open(port, O_RDWR);
+    if (pixy->fd == -1) {
+        perror("can't open SPI device");
+        exit(1);
+    }
+    spi_configure(pixy->fd, pixy->speed);
+
+    // Time to clock one burst, so an idle Pixy isn't polled any faster
+    // than useful
+    int64_t burst_usec = (int64_t) pixy->burst_len * 8 * 1000000 / pixy->speed;
+    pixy->stats_utime = utime_now();
+
+    while (1) {
+        if (spi_transfer(pixy, pixy->tx, pixy->rx, pixy->burst_len) < 0)
+            break;
+        int64_t now = utime_now();
+        pixy->nbursts++;
+
+        int used = parse_burst(pixy, pixy->rx, pixy->burst_len, now);
+        pixy->nbytes_used += used;
+
+        // Nothing pending: sleep for a good part of a frame before polling
+        // again instead of clocking zeros
+        if (used == 0 && pixy->state != PARSE_BLOCK) {
+            int64_t idle = PIXY_FRAME_USEC/8 - burst_usec;
+            if (idle > 0)
+                usleep(idle);
         }
-        if ((i = readu8(fd)) == 0x55) {
-            // Read blocks until zero byte is encountered
-            // Blocks will begin with pattern 0xaa55 or 0xaa56
-            while ((i = readu8(fd)) == 0xaa) {
-                if (debug) printf("%02x ", i);
-
-                // Decode packet
-                pixy_t msg = {};
-                int i = readu8(fd);
-                if (debug) printf("%02x ", i);
-                if (i == 0x55)
-                    msg.type = TYPE_NORMAL;
-                else if (i == 0x56)
-                    msg.type = TYPE_COLOR_CODE;
-                else
-                    break;
-
-                msg.checksum = readu16(fd);
-                // Stupid packet format is ambiguous: pixy will send 0xAA55
-                // BEFORE the block header to indicate the start of a frame.
-                // Handle this case here:
-                if (msg.checksum == 0xAA55) {
-                    msg.type = TYPE_NORMAL;
-                    msg.checksum = readu16(fd);
-                } else if (msg.checksum == 0xAA56) {
-                    msg.type = TYPE_COLOR_CODE;
-                    msg.checksum = readu16(fd);
-                }
-
-                msg.signature = readu16(fd);
-                msg.x = readu16(fd);
-                msg.y = readu16(fd);
-                msg.width = readu16(fd);
-                msg.height = readu16(fd);
-                if (msg.type == TYPE_COLOR_CODE)
-                    msg.angle = readu16(fd);
-                else
-                    msg.angle = 0;
-
-                if (debug)
-                    printf("%d %d %d %d %d %d %d\n",
-                           msg.checksum, msg.signature,
-                           msg.x, msg.y, msg.width, msg.height, msg.angle);
-
-                // Verify checksum
-                uint16_t checksum = msg.signature + msg.x + msg.y + msg.width +
-                    msg.height + msg.angle;
-                if (msg.checksum != checksum) {
-                    printf("failed checksum: received %x, computed %x\n",
-			   msg.checksum, checksum);
-                    checksum_errors += 1;
-                    continue;
-                }
-
-                // Valid packet received
-                // TODO: Publish to LCM
-                valid_blocks += 1;
-                if (msg.type == TYPE_COLOR_CODE) {
-                    printf("Color code %d (octal %o) at (%d, %d) size (%d, %d)"
-                           " angle %d\n", msg.signature, msg.signature,
-                           msg.x, msg.y, msg.width, msg.height, msg.angle);
-                } else {
-                    printf("Signature %d at (%d, %d) size (%d, %d)\n",
-                           msg.signature, msg.x, msg.y, msg.width, msg.height);
-                }
-            }
 
-            if (debug) printf("%d valid blocks read, %d failed checksum\n",
-                              valid_blocks, checksum_errors);
+        if (pixy->debug && now - pixy->stats_utime > 1000000) {
+            double dt = (now - pixy->stats_utime) * 1.0e-6;
+            printf("%.1f frames/s, %.1f bursts/s, %.0f%% of SPI bytes used, %d sync losses\n",
+                   pixy->nframes / dt, pixy->nbursts / dt,
+                   100.0 * pixy->nbytes_used / ((double) pixy->nbursts * pixy->burst_len + 1),
+                   pixy->sync_losses);
+            pixy->stats_utime = now;
+            pixy->nframes = pixy->nbursts = pixy->nbytes_used = pixy->sync_losses = 0;
         }
     }
 
     printf("Exiting\n");
-    close(fd);
+    close(pixy->fd);
+    lcm_destroy(pixy->lcm);
+    free(pixy->frame.blocks);
+    free(pixy->tx);
+    free(pixy->rx);
+    free(pixy);
+    getopt_destroy(gopt);
+    return 0;
 }
@@ -25,6 +25,13 @@ axseries_get_max_position_radians(dynamixel_device_t *device)
     return to_radians(150);
 }
 
+// Speed register full scale, 0x3ff * 0.111 rpm
+static double
+axseries_get_max_speed_radians(dynamixel_device_t *device)
+{
+    return 0x3ff * 0.111 * 2 * M_PI / 60;
+}
+
 static void
 axseries_set_joint_goal(dynamixel_device_t *device,
                         double radians,
@@ -38,23 +45,29 @@ axseries_set_joint_goal(dynamixel_device_t *device,
                                      torquefrac);
 }
 
-static dynamixel_device_status_t *
-axseries_get_status(dynamixel_device_t *device)
+static int
+axseries_encode_goal(dynamixel_device_t *device,
+                     double radians,
+                     double speedfrac,
+                     double torquefrac,
+                     uint8_t *buf)
 {
-    dynamixel_msg_t *msg = dynamixel_msg_create(2);
-    msg->buf[0] = 0x24;
-    msg->buf[1] = 8;
-    dynamixel_msg_t *resp = device->bus->send_command(device->bus,
-                                                      device->id,
-                                                      INST_READ_DATA,
-                                                      msg,
-                                                      1);
-    dynamixel_msg_destroy(msg);
+    return dynamixel_encode_goal_default(device,
+                                         0x3ff,
+                                         radians,
+                                         speedfrac,
+                                         torquefrac,
+                                         buf);
+}
 
-    if (resp == NULL)
-        return NULL;
+static int
+axseries_decode_status(dynamixel_device_t *device,
+                        const dynamixel_msg_t *resp,
+                        dynamixel_device_status_t *stat)
+{
+    if (resp->len != STATUS_LEN+2)
+        return -1;
 
-    dynamixel_device_status_t *stat = dynamixel_device_status_create();
     stat->position_radians = ((resp->buf[1] & 0xff) +
                               ((resp->buf[2] & 0x3) << 8)) *
                              to_radians(300) / 1024.0 - to_radians(150);
@@ -76,6 +89,32 @@ axseries_get_status(dynamixel_device_t *device)
     stat->continuous = device->rotation_mode;
     stat->error_flags = (resp->buf[0] & 0xff);
 
+    return 0;
+}
+
+static dynamixel_device_status_t *
+axseries_get_status(dynamixel_device_t *device)
+{
+    dynamixel_msg_t *msg = dynamixel_msg_create(2);
+    msg->buf[0] = STATUS_ADDR;
+    msg->buf[1] = STATUS_LEN;
+    dynamixel_msg_t *resp = device->bus->send_command(device->bus,
+                                                      device->id,
+                                                      INST_READ_DATA,
+                                                      msg,
+                                                      1);
+    dynamixel_msg_destroy(msg);
+
+    if (resp == NULL)
+        return NULL;
+
+    dynamixel_device_status_t *stat = dynamixel_device_status_create();
+    if (device->decode_status(device, resp, stat) < 0) {
+        dynamixel_device_status_destroy(stat);
+        stat = NULL;
+    }
+    dynamixel_msg_destroy(resp);
+
     return stat;
 }
 
@@ -114,8 +153,11 @@ dynamixel_axseries_create(dynamixel_bus_t *bus, uint8_t id)
     device->is_address_EEPROM = axseries_is_address_EEPROM;
     device->get_min_position_radians = axseries_get_min_position_radians;
     device->get_max_position_radians = axseries_get_max_position_radians;
+    device->get_max_speed_radians = axseries_get_max_speed_radians;
     device->set_joint_goal = axseries_set_joint_goal;
+    device->encode_goal = axseries_encode_goal;
     device->get_status = axseries_get_status;
+    device->decode_status = axseries_decode_status;
     device->set_rotation_mode = axseries_set_rotation_mode;
     device->get_name = axseries_get_name;
 
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "dynamixel_bus.h"
 #include "dynamixel_axseries.h"
@@ -27,6 +28,10 @@ dynamixel_msg_destroy(dynamixel_msg_t *msg)
 void
 dynamixel_msg_dump(dynamixel_msg_t *msg)
 {
+    if (msg == NULL) {
+        printf("(no response)\n");
+        return;
+    }
     for (int i = 0; i < msg->len; i++)
         printf("%02x ", msg->buf[i] & 0xff);
     printf("\n");
@@ -35,6 +40,92 @@ dynamixel_msg_dump(dynamixel_msg_t *msg)
 
 // === Bus Default Implementation =============
 
+// Adapter for buses that only implement send_command
+int
+dynamixel_bus_send_command_buf(dynamixel_bus_t *bus,
+                               int id,
+                               int instruction,
+                               const dynamixel_msg_t *params,
+                               int retry,
+                               dynamixel_msg_t *resp,
+                               int maxlen)
+{
+    dynamixel_msg_t *r = bus->send_command(bus,
+                                           id,
+                                           instruction,
+                                           (dynamixel_msg_t *) params,
+                                           retry);
+    if (r == NULL)
+        return -1;
+
+    int ok = r->len <= maxlen;
+    if (ok) {
+        memcpy(resp->buf, r->buf, r->len);
+        resp->len = r->len;
+    }
+    dynamixel_msg_destroy(r);
+
+    return ok ? 0 : -1;
+}
+
+void
+dynamixel_bus_sync_write(dynamixel_bus_t *bus,
+                         uint8_t addr,
+                         int len,
+                         const uint8_t *ids,
+                         const uint8_t *data,
+                         int count)
+{
+    // Packet length field is a single byte: (len+1)*count + 4 <= 255
+    assert (len > 0 && count > 0 && (len+1)*count + 4 <= 0xff);
+
+    dynamixel_msg_t *msg = dynamixel_msg_create(2 + (len+1)*count);
+    msg->buf[0] = addr;
+    msg->buf[1] = len;
+    uint8_t *p = msg->buf + 2;
+    for (int i = 0; i < count; i++) {
+        *p++ = ids[i];
+        for (int j = 0; j < len; j++)
+            *p++ = data[i*len + j];
+    }
+
+    dynamixel_msg_t *resp = bus->send_command(bus,
+                                              BROADCAST_ID,
+                                              INST_SYNC_WRITE,
+                                              msg,
+                                              0);
+    dynamixel_msg_destroy(msg);
+    if (resp != NULL)
+        dynamixel_msg_destroy(resp);
+}
+
+// Default bulk read: one READ_DATA round trip per servo
+int
+dynamixel_bus_bulk_read(dynamixel_bus_t *bus,
+                        uint8_t addr,
+                        int len,
+                        const uint8_t *ids,
+                        int count,
+                        dynamixel_msg_t **resps,
+                        int use_bulk)
+{
+    uint8_t params_buf[2] = { addr, len };
+    dynamixel_msg_t params = { .len = 2, .buf = params_buf };
+
+    int have = 0;
+    for (int i = 0; i < count; i++) {
+        if (bus->send_command_buf(bus, ids[i], INST_READ_DATA, &params, 1,
+                                  resps[i], len+2) < 0 ||
+            resps[i]->len != len+2) {
+            resps[i]->len = 0;
+            continue;
+        }
+        have++;
+    }
+
+    return have;
+}
+
 void
 dynamixel_bus_set_retry_enable(dynamixel_bus_t *bus, int retry_enable)
 {
@@ -93,6 +184,9 @@ dynamixel_bus_create(void)
     bus->retry_enable = 1;
 
     // Set default functions
+    bus->send_command_buf = dynamixel_bus_send_command_buf;
+    bus->sync_write = dynamixel_bus_sync_write;
+    bus->bulk_read = dynamixel_bus_bulk_read;
     bus->set_retry_enable = dynamixel_bus_set_retry_enable;
     bus->get_servo_model = dynamixel_bus_get_servo_model;
     bus->get_servo = dynamixel_bus_get_servo;
@@ -10,6 +10,12 @@
 #define INST_ACTION         0x05
 #define INST_RESET_DATA     0x06
 #define INST_SYNC_WRITE     0x83
+#define INST_BULK_READ      0x92    // MX series only
+
+#define BROADCAST_ID        0xfe
+
+// Header, id, length, instruction, 253 parameter bytes and checksum
+#define DYNAMIXEL_MAX_PACKET 259
 
 // Forward declarations
 typedef struct dynamixel_device dynamixel_device_t;
@@ -34,6 +40,41 @@ struct dynamixel_bus
                                       dynamixel_msg_t *msg,
                                       int retry);
 
+    // As send_command, but the response is stored in the caller's resp,
+    // whose buffer holds maxlen bytes. Returns 0 on success, -1 if no
+    // usable response arrived (always the case for broadcasts).
+    int (*send_command_buf)(dynamixel_bus_t *bus,
+                            int id,
+                            int instruction,
+                            const dynamixel_msg_t *params,
+                            int retry,
+                            dynamixel_msg_t *resp,
+                            int maxlen);
+
+    // Write len bytes starting at addr on count servos with one broadcast
+    // packet. data holds len bytes per servo, in the same order as ids.
+    // Servos do not reply to a sync write.
+    void (*sync_write)(dynamixel_bus_t *bus,
+                       uint8_t addr,
+                       int len,
+                       const uint8_t *ids,
+                       const uint8_t *data,
+                       int count);
+
+    // Read len bytes starting at addr from count servos. Each response
+    // (error code, data and checksum, as from send_command) is copied into
+    // the caller's resps[i], whose buffer must hold len+2 bytes; a servo
+    // that did not answer gets len 0. use_bulk allows a single BULK_READ
+    // instruction when every listed servo supports it. Returns the number
+    // of servos that answered.
+    int (*bulk_read)(dynamixel_bus_t *bus,
+                     uint8_t addr,
+                     int len,
+                     const uint8_t *ids,
+                     int count,
+                     dynamixel_msg_t **resps,
+                     int use_bulk);
+
     void (*set_retry_enable)(dynamixel_bus_t *bus, int retry_enable);
     int (*get_servo_model)(dynamixel_bus_t *bus, uint8_t id);
 
@@ -49,6 +90,13 @@ void dynamixel_msg_destroy(dynamixel_msg_t *msg);
 void dynamixel_msg_dump(dynamixel_msg_t *msg);
 
 // === Default bus stuff ======================================
+int dynamixel_bus_send_command_buf(dynamixel_bus_t *bus, int id, int instruction,
+                                   const dynamixel_msg_t *params, int retry,
+                                   dynamixel_msg_t *resp, int maxlen);
+void dynamixel_bus_sync_write(dynamixel_bus_t *bus, uint8_t addr, int len,
+                              const uint8_t *ids, const uint8_t *data, int count);
+int dynamixel_bus_bulk_read(dynamixel_bus_t *bus, uint8_t addr, int len, const uint8_t *ids,
+                            int count, dynamixel_msg_t **resps, int use_bulk);
 void dynamixel_bus_set_retry_enable(dynamixel_bus_t *bus, int retry_enable);
 int dynamixel_bus_get_servo_model(dynamixel_bus_t *bus, uint8_t id);
 dynamixel_device_t * dynamixel_bus_get_servo(dynamixel_bus_t *bus, uint8_t id);
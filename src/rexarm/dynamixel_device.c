@@ -112,15 +112,15 @@ dynamixel_set_goal(dynamixel_device_t *device,
         device->set_joint_goal(device, radians, speedfrac, torquefrac);
 }
 
-// radians [-pi, pi]
-// speedfrac [0,1]
-// torquefrac [0,1]
-void
-dynamixel_set_joint_goal_default(dynamixel_device_t *device,
-                                 int pmask,
-                                 double radians,
-                                 double speedfrac,
-                                 double torquefrac)
+// Encode a joint mode goal as the GOAL_LEN bytes at GOAL_ADDR.
+// Returns 1 if the goal is a stop (speed == 0), else 0
+static int
+encode_joint_goal(dynamixel_device_t *device,
+                  int pmask,
+                  double radians,
+                  double speedfrac,
+                  double torquefrac,
+                  uint8_t *buf)
 {
     assert (!device->rotation_mode && (pmask == 0xfff || pmask == 0x3ff));
 
@@ -140,18 +140,56 @@ dynamixel_set_joint_goal_default(dynamixel_device_t *device,
     int speedv = stop ? 0x1 : (int)(speedfrac * 0x3ff);
     int torquev = (int)(torquefrac * 0x3ff);
 
-    dynamixel_msg_t *msg = dynamixel_msg_create(7);
-    msg->buf[0] = 0x1e;
-    msg->buf[1] = posv & 0xff;
-    msg->buf[2] = (posv >> 8) & 0xff;
-    msg->buf[3] = speedv & 0xff;
-    msg->buf[4] = (speedv >> 8) & 0xff;
-    msg->buf[5] = torquev & 0xff;
-    msg->buf[6] = (torquev >> 8) & 0xff;
+    buf[0] = posv & 0xff;
+    buf[1] = (posv >> 8) & 0xff;
+    buf[2] = speedv & 0xff;
+    buf[3] = (speedv >> 8) & 0xff;
+    buf[4] = torquev & 0xff;
+    buf[5] = (torquev >> 8) & 0xff;
+
+    return stop;
+}
+
+// Encode a wheel mode goal as the 4 speed and torque bytes
+static void
+encode_continuous_goal(dynamixel_device_t *device,
+                       double speedfrac,
+                       double torquefrac,
+                       uint8_t *buf)
+{
+    assert (device->rotation_mode);
+
+    speedfrac = dmax(-1, dmin(1, speedfrac));
+    torquefrac = dmax(0, dmin(1, torquefrac));
+
+    int speedv = (int)abs(speedfrac * 0x3ff);
+    if (speedfrac < 0)
+        speedv |= 0x400;    // CW direction
+    int torquev = (int)(0x3ff * torquefrac);
+
+    buf[0] = speedv & 0xff;
+    buf[1] = (speedv >> 8) & 0xff;
+    buf[2] = torquev & 0xff;
+    buf[3] = (torquev >> 8) & 0xff;
+}
+
+// radians [-pi, pi]
+// speedfrac [0,1]
+// torquefrac [0,1]
+void
+dynamixel_set_joint_goal_default(dynamixel_device_t *device,
+                                 int pmask,
+                                 double radians,
+                                 double speedfrac,
+                                 double torquefrac)
+{
+    dynamixel_msg_t *msg = dynamixel_msg_create(1 + GOAL_LEN);
+    msg->buf[0] = GOAL_ADDR;
+    int stop = encode_joint_goal(device, pmask, radians, speedfrac, torquefrac, msg->buf+1);
     dynamixel_msg_t *resp = device->write_to_RAM(device, msg, 1);
 
     dynamixel_msg_destroy(msg);
-    if (resp != NULL);
+    if (resp != NULL)
         dynamixel_msg_destroy(resp);
 
     // Handle speed == 0 case (after slowing down, above) by relaying current
@@ -168,13 +206,14 @@ dynamixel_set_joint_goal_default(dynamixel_device_t *device,
                                          1);
         dynamixel_msg_destroy(msg);
         if (resp != NULL) {
+            int posv = (resp->buf[1] & 0xff) + ((resp->buf[2] & 0xff) << 8);
             dynamixel_msg_destroy(resp);
-            posv = (resp->buf[1] & 0xff) + ((resp->buf[2] & 0xff) << 8);
             msg = dynamixel_msg_create(3);
-            msg->buf[0] = 0x1e;
+            msg->buf[0] = GOAL_ADDR;
             msg->buf[1] = posv & 0xff;
-            msg->buf[2] = (posv > 8) & 0xff;
+            msg->buf[2] = (posv >> 8) & 0xff;
             resp = device->write_to_RAM(device, msg, 1);
+            dynamixel_msg_destroy(msg);
         }
 
         if (resp != NULL)
@@ -182,6 +221,28 @@ dynamixel_set_joint_goal_default(dynamixel_device_t *device,
     }
 }
 
+// Encode the goal registers for either rotation mode. In wheel mode the
+// goal position is ignored by the servo, so it is left at zero.
+int
+dynamixel_encode_goal_default(dynamixel_device_t *device,
+                              int pmask,
+                              double radians,
+                              double speedfrac,
+                              double torquefrac,
+                              uint8_t *buf)
+{
+    if (device->rotation_mode) {
+        buf[0] = 0;
+        buf[1] = 0;
+        encode_continuous_goal(device, speedfrac, torquefrac, buf+2);
+        return 0;
+    }
+
+    if (encode_joint_goal(device, pmask, radians, speedfrac, torquefrac, buf))
+        return -1;
+    return 0;
+}
+
 // speedfrac [-1,1] pos for CCW, neg for CW
 // torquefrac [0,1]
 void
@@ -189,22 +250,9 @@ dynamixel_set_continuous_goal(dynamixel_device_t *device,
                               double speedfrac,
                               double torquefrac)
 {
-    assert (device->rotation_mode);
-
-    speedfrac = dmax(-1, dmin(1, speedfrac));
-    torquefrac = dmax(0, dmin(1, torquefrac));
-
-    int speedv = (int)abs(speedfrac * 0x3ff);
-    if (speedfrac < 0)
-        speedv |= 0x400;    // CW direction
-    int torquev = (int)(0x3ff * torquefrac);
-
     dynamixel_msg_t *msg = dynamixel_msg_create(5);
     msg->buf[0] = 0x20;
-    msg->buf[1] = speedv & 0xff;
-    msg->buf[2] = (speedv >> 8) & 0xff;
-    msg->buf[3] = torquev & 0xff;
-    msg->buf[4] = (torquev >> 8) & 0xff;
+    encode_continuous_goal(device, speedfrac, torquefrac, msg->buf+1);
 
     dynamixel_msg_t *resp = device->write_to_RAM(device, msg, 1);
     dynamixel_msg_destroy(msg);
@@ -385,6 +433,7 @@ dynamixel_device_create(uint8_t id)
     dynamixel_device_t *device = malloc(sizeof(*device));
     device->id = id;
     device->rotation_mode = 0;
+    device->bulk_read = 0;
 
     device->destroy = dynamixel_device_destroy;
 
@@ -411,6 +460,7 @@ dynamixel_device_create(uint8_t id)
     // device->get_max_position_radians
     // device->set_joint_goal (feel free to use the partial implementation provided)
     // device->get_status
+    // device->decode_status
     // device->set_rotation_mode
     //
     // device->bus
@@ -13,6 +13,14 @@
 #define ERROR_ANGLE_LIMIT (1 << 1)
 #define ERROR_VOLTAGE     (1 << 0)
 
+// Goal position, moving speed and torque limit registers, 2 bytes each
+#define GOAL_ADDR         0x1e
+#define GOAL_LEN          6
+
+// Present position, speed, load, voltage and temperature registers
+#define STATUS_ADDR       0x24
+#define STATUS_LEN        8
+
 typedef struct dynamixel_device_status dynamixel_device_status_t;
 struct dynamixel_device_status
 {
@@ -36,6 +44,7 @@ struct dynamixel_device
     dynamixel_bus_t *bus;
     int id;
     int rotation_mode;
+    int bulk_read;      // understands INST_BULK_READ
 
     void (*destroy)(dynamixel_device_t *device);
 
@@ -61,6 +70,10 @@ struct dynamixel_device
     void (*set_id)(dynamixel_device_t *device, int newid);
     // Set goal in joint mode
     void (*set_joint_goal)(dynamixel_device_t *device, double radians, double speedfrac, double torquefrac);
+    // Encode the goal set_goal would send as the GOAL_LEN bytes at
+    // GOAL_ADDR, e.g. for a sync write. Returns -1 if the goal needs more
+    // than a register write (a joint mode stop) and set_goal must be used.
+    int (*encode_goal)(dynamixel_device_t *device, double radians, double speedfrac, double torquefrac, uint8_t *buf);
 
 
 
@@ -69,12 +82,17 @@ struct dynamixel_device
     // and write if different from desired
     double (*get_min_position_radians)(dynamixel_device_t *device);
     double (*get_max_position_radians)(dynamixel_device_t *device);
+    // Joint speed at speedfrac 1 [rad/s]
+    double (*get_max_speed_radians)(dynamixel_device_t *device);
     int (*read_rotation_mode)(dynamixel_device_t *device);
     void (*set_rotation_mode)(dynamixel_device_t *device, int mode);
     void (*set_continuous_goal)(dynamixel_device_t *device, double speedfrac, double torquefrac);
     void (*set_continuous_mode)(dynamixel_device_t *device, int mode);
 
     dynamixel_device_status_t * (*get_status)(dynamixel_device_t *device);
+    // Fill stat from a response to a STATUS_LEN byte read at STATUS_ADDR.
+    // Returns -1 if the response is malformed
+    int (*decode_status)(dynamixel_device_t *device, const dynamixel_msg_t *resp, dynamixel_device_status_t *stat);
 };
 
 // === Available general purpose functionality =================
@@ -84,6 +102,7 @@ int dynamixel_get_firmware_version(dynamixel_device_t *device);
 int dynamixel_ping(dynamixel_device_t *device);
 void dynamixel_set_goal(dynamixel_device_t *device, double radians, double speedfrac, double torquefrac);
 void dynamixel_set_joint_goal_default(dynamixel_device_t *device, int pmask, double radians, double speedfrac, double torquefrac);
+int dynamixel_encode_goal_default(dynamixel_device_t *device, int pmask, double radians, double speedfrac, double torquefrac, uint8_t *buf);
 void dynamixel_set_continuous_goal(dynamixel_device_t *device, double speedfrac, double torquefrac);
 void dynamixel_idle(dynamixel_device_t *device);
 dynamixel_msg_t * dynamixel_read(dynamixel_device_t *device, dynamixel_msg_t *params, int retry);
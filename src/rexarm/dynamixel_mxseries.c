@@ -26,6 +26,13 @@ mxseries_get_max_position_radians(dynamixel_device_t *device)
     return M_PI;
 }
 
+// Speed register full scale, 0x3ff * 0.114 rpm
+static double
+mxseries_get_max_speed_radians(dynamixel_device_t *device)
+{
+    return 0x3ff * 0.114 * 2 * M_PI / 60;
+}
+
 // XXX PID controls currently not supported
 
 static void
@@ -41,23 +48,29 @@ mxseries_set_joint_goal(dynamixel_device_t *device,
                                      torquefrac);
 }
 
-static dynamixel_device_status_t *
-mxseries_get_status(dynamixel_device_t *device)
+static int
+mxseries_encode_goal(dynamixel_device_t *device,
+                     double radians,
+                     double speedfrac,
+                     double torquefrac,
+                     uint8_t *buf)
 {
-    dynamixel_msg_t *msg = dynamixel_msg_create(2);
-    msg->buf[0] = 0x24;
-    msg->buf[1] = 8;
-    dynamixel_msg_t *resp = device->bus->send_command(device->bus,
-                                                      device->id,
-                                                      INST_READ_DATA,
-                                                      msg,
-                                                      1);
-    dynamixel_msg_destroy(msg);
+    return dynamixel_encode_goal_default(device,
+                                         0xfff,
+                                         radians,
+                                         speedfrac,
+                                         torquefrac,
+                                         buf);
+}
 
-    if (resp == NULL)
-        return NULL;
+static int
+mxseries_decode_status(dynamixel_device_t *device,
+                        const dynamixel_msg_t *resp,
+                        dynamixel_device_status_t *stat)
+{
+    if (resp->len != STATUS_LEN+2)
+        return -1;
 
-    dynamixel_device_status_t *stat = dynamixel_device_status_create();
     stat->position_radians = ((resp->buf[1] & 0xff) +
                               ((resp->buf[2] & 0xf) << 8)) *
                               2 * M_PI / 0xfff - M_PI;
@@ -79,8 +92,31 @@ mxseries_get_status(dynamixel_device_t *device)
     stat->continuous = device->rotation_mode;
     stat->error_flags = (resp->buf[0] & 0xff);
 
-    // foo
-    //stat->voltage = 5.0;
+    return 0;
+}
+
+static dynamixel_device_status_t *
+mxseries_get_status(dynamixel_device_t *device)
+{
+    dynamixel_msg_t *msg = dynamixel_msg_create(2);
+    msg->buf[0] = STATUS_ADDR;
+    msg->buf[1] = STATUS_LEN;
+    dynamixel_msg_t *resp = device->bus->send_command(device->bus,
+                                                      device->id,
+                                                      INST_READ_DATA,
+                                                      msg,
+                                                      1);
+    dynamixel_msg_destroy(msg);
+
+    if (resp == NULL)
+        return NULL;
+
+    dynamixel_device_status_t *stat = dynamixel_device_status_create();
+    if (device->decode_status(device, resp, stat) < 0) {
+        dynamixel_device_status_destroy(stat);
+        stat = NULL;
+    }
+    dynamixel_msg_destroy(resp);
 
     return stat;
 }
@@ -117,12 +153,16 @@ dynamixel_mxseries_create(dynamixel_bus_t *bus,
 
     // Bus stuff
     device->bus = bus;
+    device->bulk_read = 1;
 
     device->is_address_EEPROM = mxseries_is_address_EEPROM;
     device->get_min_position_radians = mxseries_get_min_position_radians;
     device->get_max_position_radians = mxseries_get_max_position_radians;
+    device->get_max_speed_radians = mxseries_get_max_speed_radians;
     device->set_joint_goal = mxseries_set_joint_goal;
+    device->encode_goal = mxseries_encode_goal;
     device->get_status = mxseries_get_status;
+    device->decode_status = mxseries_decode_status;
     device->set_rotation_mode = mxseries_set_rotation_mode;
     device->get_name = mxseries_get_name;
 
@@ -1,10 +1,12 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "common/serial.h"
 #include "common/ioutils.h"
+#include "common/timestamp.h"
 
 #include "dynamixel_serial_bus.h"
 #include "dynamixel_device.h"
@@ -12,133 +14,186 @@
 #define TIMEOUT_MS 50
 #define VERBOSE 0
 
+// Status packet parser states
+enum { PARSE_SYNC0, PARSE_SYNC1, PARSE_ID, PARSE_LEN, PARSE_BODY };
+
 // === Bus specific implementation ===================
-// Send an instruction with the specified parameters. The error code,
-// body, and checksum of the response are returned (while the initial 4
-// bytes of the header are removed)
-static dynamixel_msg_t *
-send_command_raw(dynamixel_bus_t *bus,
-                 uint8_t id,
-                 int instruction,
-                 dynamixel_msg_t *params)
+// Start a new instruction packet in the transmit buffer. Parameters are
+// appended at impl->tx+5. Returns a pointer to the parameter area.
+static uint8_t *
+begin_command(dynamixel_serial_bus_impl_t *impl, uint8_t id, int instruction)
 {
-    dynamixel_serial_bus_impl_t *impl = (bus->impl);
+    impl->tx[0] = 255;  // MAGIC
+    impl->tx[1] = 255;  // MAGIC
+    impl->tx[2] = id;   // servo id
+    impl->tx[4] = (uint8_t)(instruction & 0xff);
+    return impl->tx + 5;
+}
 
-    // Missing synchronization
-    int parameterlen = (params == NULL) ? 0 : params->len;
-    uint8_t *cmd = malloc((6+parameterlen)*sizeof(uint8_t));
-    cmd[0] = 255;   // MAGIC
-    cmd[1] = 255;   // MAGIC
-    cmd[2] = id;    // servo id
-    cmd[3] = (uint8_t)(parameterlen+2) & 0xff;  // Length
-    cmd[4] = (uint8_t)(instruction & 0xff);
-
-    if (params != NULL) {
-        for (int i = 0; i < params->len; i++)
-            cmd[5+i] = params->buf[i];
-    }
+// Fill in length and checksum, then write the packet. Anything left in
+// the receive buffer belongs to an earlier transaction and is dropped.
+static void
+finish_command(dynamixel_serial_bus_impl_t *impl, int parameterlen)
+{
+    assert (parameterlen + 6 <= DYNAMIXEL_MAX_PACKET);
+
+    impl->tx[3] = (uint8_t)(parameterlen+2) & 0xff;  // Length
 
     int checksum = 0;
-    for (int i = 2; i < parameterlen+6-1; i++) {
-        checksum += (cmd[i] & 0xff);
-    }
-    cmd[5+parameterlen] = (uint8_t)((checksum ^ 0xff) & 0xff);
+    for (int i = 2; i < parameterlen+6-1; i++)
+        checksum += impl->tx[i];
+    impl->tx[5+parameterlen] = (uint8_t)((checksum ^ 0xff) & 0xff);
 
-    int res = write(impl->fd, cmd, 6+parameterlen);
-    if (VERBOSE) {
-        // XXX Dump cmd...which isn't a msg
-    }
-    free(cmd);
-
-    // Read response. The header is really 5 bytes, but we put the
-    // error code in the body so that the caller knows what went wrong
-    // if something bad happens. Synchronize on the first two 0xffff
-    // characters.
-    dynamixel_msg_t *header = dynamixel_msg_create(4);
-    int header_have = 0;
-    while (header_have < 4) {
-        res = read_fully_timeout(impl->fd,
-                                 (header->buf)+header_have,
-                                 4 - header_have,
-                                 TIMEOUT_MS);
-
-        if (VERBOSE) {
-            printf("READ:  res = %d : ", res);
-            dynamixel_msg_dump(header);
-        }
+    impl->rx_head = impl->rx_tail = 0;
+    impl->state = PARSE_SYNC0;
 
-        if (res < 1)
-            return NULL;
+    int res = write(impl->fd, impl->tx, 6+parameterlen);
+    if (res != 6+parameterlen)
+        printf("serial_bus: Short write of %d bytes\n", res);
+}
 
-        assert (res <= (4 - header_have));
-        //assert (res + header_have == 4);
+static void
+write_command(dynamixel_serial_bus_impl_t *impl,
+              uint8_t id,
+              int instruction,
+              const dynamixel_msg_t *params)
+{
+    int parameterlen = (params == NULL) ? 0 : params->len;
+    uint8_t *p = begin_command(impl, id, instruction);
+    if (params != NULL)
+        memcpy(p, params->buf, params->len);
+    finish_command(impl, parameterlen);
+}
 
-        // If the first two bytes are the sync bytes, we're done
-        if ((header->buf[0] & 0xff) == 0xff && (header->buf[1] & 0xff) == 0xff)
-            break;
+// Advance the status packet parser by one byte. Returns 1 when a packet
+// with a valid checksum is complete in impl->pkt. Anything malformed puts
+// the parser back to hunting for the 0xffff sync, so line noise costs
+// only the bytes it corrupted.
+static int
+parse_byte(dynamixel_serial_bus_impl_t *impl, uint8_t b)
+{
+    switch (impl->state) {
+        case PARSE_SYNC0:
+            if (b == 0xff)
+                impl->state = PARSE_SYNC1;
+            return 0;
+
+        case PARSE_SYNC1:
+            impl->state = (b == 0xff) ? PARSE_ID : PARSE_SYNC0;
+            return 0;
+
+        case PARSE_ID:
+            if (b == 0xff)      // extra sync byte
+                return 0;
+            impl->pkt_id = b;
+            impl->pkt_sum = b;
+            impl->state = PARSE_LEN;
+            return 0;
+
+        case PARSE_LEN:
+            if (b < 2) {
+                impl->state = PARSE_SYNC0;
+                return 0;
+            }
+            impl->pkt_len = b;
+            impl->pkt_sum += b;
+            impl->pkt_have = 0;
+            impl->state = PARSE_BODY;
+            return 0;
+
+        case PARSE_BODY:
+            impl->pkt[impl->pkt_have++] = b;
+            if (impl->pkt_have < impl->pkt_len) {
+                impl->pkt_sum += b;
+                return 0;
+            }
 
-        // Shift buffer, read one more character
-        header_have = 3;
-        for (int i = 0; i < 3; i++)
-            header->buf[i] = header->buf[i+1];
+            impl->state = PARSE_SYNC0;
+            if (((impl->pkt_sum & 0xff) ^ 0xff) != b) {
+                printf("serial_bus: Bad checksum %02x %02x\n",
+                       b, (impl->pkt_sum & 0xff) ^ 0xff);
+                return 0;
+            }
+            return 1;
     }
 
-    if ((header->buf[2] & 0xff) != id) {
-        printf("serial_bus: Received response for wrong servo %d\n",
-               header->buf[2] & 0xff);
-        return NULL;
-    }
+    impl->state = PARSE_SYNC0;
+    return 0;
+}
 
-    //int thisid = header->buf[2] & 0xff;
-    int length = header->buf[3] & 0xff;
+// Read the status packet from servo id into resp, whose buffer holds
+// maxlen bytes. The error code, body, and checksum of the response are
+// returned (while the initial 4 bytes of the header are removed).
+// Returns 0 on success, -1 on timeout or an oversized response.
+static int
+read_response(dynamixel_serial_bus_impl_t *impl,
+              uint8_t id,
+              dynamixel_msg_t *resp,
+              int maxlen)
+{
+    const int mask = SERIAL_BUS_RX_SIZE - 1;
+    int64_t start = utime_now();
 
-    if (length < 2)
-        return NULL;
+    while (1) {
+        while (impl->rx_tail != impl->rx_head) {
+            uint8_t b = impl->rx[impl->rx_tail];
+            impl->rx_tail = (impl->rx_tail + 1) & mask;
 
-    dynamixel_msg_t *body = dynamixel_msg_create(length);
-    res = read_fully_timeout(impl->fd,
-                             body->buf,
-                             body->len,
-                             TIMEOUT_MS);
+            if (!parse_byte(impl, b))
+                continue;
 
-    if (VERBOSE) {
-        printf("READ:  res = %d : ", res);
-        dynamixel_msg_dump(body);
-    }
+            // A late reply to an earlier, timed out request
+            if (impl->pkt_id != id) {
+                if (VERBOSE)
+                    printf("serial_bus: Skipping response for servo %d\n", impl->pkt_id);
+                continue;
+            }
+
+            if (impl->pkt_len > maxlen)
+                return -1;
 
-    if (1) {
-        int checksum = 0;
-        for (int i = 2; i < header->len; i++)
-            checksum += (header->buf[i] & 0xff);
-        for (int i = 0; i < body->len-1; i++)
-            checksum += (body->buf[i] & 0xff);
-        checksum = (checksum & 0xff) ^ 0xff;
-        if ((body->buf[body->len - 1] & 0xff) != checksum) {
-            printf("serial_bus: Bad checksum %02x %02x\n",
-                   body->buf[body->len - 1] & 0xff,
-                   checksum);
-            return NULL;
+            memcpy(resp->buf, impl->pkt, impl->pkt_len);
+            resp->len = impl->pkt_len;
+            return 0;
         }
-    }
 
-    dynamixel_msg_destroy(header);
-    return body;
+        // Noise that never forms our packet must not keep us here forever
+        if (utime_now() - start > TIMEOUT_MS*1000)
+            return -1;
+
+        // Buffer drained: refill with whatever the port has, up to the end
+        // of the contiguous free space. One slot stays free so a full ring
+        // is distinguishable from an empty one.
+        int space = SERIAL_BUS_RX_SIZE - impl->rx_head;
+        if (impl->rx_tail == 0)
+            space--;
+
+        int res = read_timeout(impl->fd, impl->rx + impl->rx_head, space, TIMEOUT_MS);
+        if (res < 1)
+            return -1;
+        impl->rx_head = (impl->rx_head + res) & mask;
+    }
 }
 
-dynamixel_msg_t *
-serial_bus_send_command(dynamixel_bus_t *bus,
-                        int id,
-                        int instruction,
-                        dynamixel_msg_t *params,
-                        int retry)
+int
+serial_bus_send_command_buf(dynamixel_bus_t *bus,
+                            int id,
+                            int instruction,
+                            const dynamixel_msg_t *params,
+                            int retry,
+                            dynamixel_msg_t *resp,
+                            int maxlen)
 {
+    dynamixel_serial_bus_impl_t *impl = (bus->impl);
+
     do {
-        dynamixel_msg_t *resp = send_command_raw(bus,
-                                                 id,
-                                                 instruction,
-                                                 params);
+        write_command(impl, id, instruction, params);
 
-        if (resp == NULL || resp->len < 1) {
+        // Nobody answers a broadcast
+        if (id == BROADCAST_ID)
+            return -1;
+
+        if (read_response(impl, id, resp, maxlen) < 0 || resp->len < 1) {
             if (VERBOSE) {
                 printf("serial_bus id=%d error: short response.\n", id);
             }
@@ -157,10 +212,102 @@ serial_bus_send_command(dynamixel_bus_t *bus,
                 continue;
         }
 
-        return resp;
+        return 0;
     } while (retry && bus->retry_enable);
 
-    return NULL;
+    return -1;
+}
+
+dynamixel_msg_t *
+serial_bus_send_command(dynamixel_bus_t *bus,
+                        int id,
+                        int instruction,
+                        dynamixel_msg_t *params,
+                        int retry)
+{
+    uint8_t buf[256];
+    dynamixel_msg_t resp = { .len = 0, .buf = buf };
+
+    if (serial_bus_send_command_buf(bus, id, instruction, params, retry, &resp, sizeof(buf)) < 0)
+        return NULL;
+
+    dynamixel_msg_t *msg = dynamixel_msg_create(resp.len);
+    memcpy(msg->buf, resp.buf, resp.len);
+    return msg;
+}
+
+void
+serial_bus_sync_write(dynamixel_bus_t *bus,
+                      uint8_t addr,
+                      int len,
+                      const uint8_t *ids,
+                      const uint8_t *data,
+                      int count)
+{
+    dynamixel_serial_bus_impl_t *impl = (bus->impl);
+
+    // Packet length field is a single byte: (len+1)*count + 4 <= 255
+    assert (len > 0 && count > 0 && (len+1)*count + 4 <= 0xff);
+
+    uint8_t *p = begin_command(impl, BROADCAST_ID, INST_SYNC_WRITE);
+    *p++ = addr;
+    *p++ = len;
+    for (int i = 0; i < count; i++) {
+        *p++ = ids[i];
+        memcpy(p, data + i*len, len);
+        p += len;
+    }
+    finish_command(impl, 2 + (len+1)*count);
+}
+
+// MX series servos answer a BULK_READ one after another, in the order
+// they are listed, each waiting for the previous servo's reply. A missing
+// reply stalls the rest of the chain, so those servos are read one by one.
+int
+serial_bus_bulk_read(dynamixel_bus_t *bus,
+                     uint8_t addr,
+                     int len,
+                     const uint8_t *ids,
+                     int count,
+                     dynamixel_msg_t **resps,
+                     int use_bulk)
+{
+    dynamixel_serial_bus_impl_t *impl = (bus->impl);
+
+    if (!use_bulk)
+        return dynamixel_bus_bulk_read(bus, addr, len, ids, count, resps, 0);
+
+    // Packet length field is a single byte: 3*count + 3 <= 255
+    assert (count > 0 && 3*count + 3 <= 0xff);
+
+    uint8_t *p = begin_command(impl, BROADCAST_ID, INST_BULK_READ);
+    *p++ = 0x00;
+    for (int i = 0; i < count; i++) {
+        *p++ = len;
+        *p++ = ids[i];
+        *p++ = addr;
+    }
+    finish_command(impl, 1 + 3*count);
+
+    for (int i = 0; i < count; i++)
+        resps[i]->len = 0;
+
+    int have = 0;
+    for (; have < count; have++) {
+        if (read_response(impl, ids[have], resps[have], len+2) < 0 ||
+            resps[have]->len != len+2) {
+            resps[have]->len = 0;
+            break;
+        }
+    }
+
+    if (have == count)
+        return count;
+
+    if (VERBOSE)
+        printf("serial_bus: bulk read stalled at id %d\n", ids[have]);
+
+    return have + dynamixel_bus_bulk_read(bus, addr, len, ids+have, count-have, resps+have, 0);
 }
 
 // === Bus creation and destruction ==================
@@ -170,8 +317,9 @@ serial_bus_create(const char *device, int baud)
     dynamixel_bus_t *bus = dynamixel_bus_create();
 
     // Implementation stuff
-    dynamixel_serial_bus_impl_t *impl = malloc(sizeof(*impl));
+    dynamixel_serial_bus_impl_t *impl = calloc(1, sizeof(*impl));
     impl->baud = baud;
+    impl->state = PARSE_SYNC0;
     int fd = serial_open(device, baud, 1);
 
     // Check to see if we opened a file
@@ -185,6 +333,9 @@ serial_bus_create(const char *device, int baud)
 
     // Fill in functions
     bus->send_command = serial_bus_send_command;
+    bus->send_command_buf = serial_bus_send_command_buf;
+    bus->sync_write = serial_bus_sync_write;
+    bus->bulk_read = serial_bus_bulk_read;
     bus->destroy = serial_bus_destroy;
 
     return bus;
@@ -3,11 +3,28 @@
 
 #include "dynamixel_bus.h"
 
+#define SERIAL_BUS_RX_SIZE 1024     // must be a power of 2
+
 typedef struct dynamixel_serial_bus_impl dynamixel_serial_bus_impl_t;
 struct dynamixel_serial_bus_impl
 {
     int fd;         // file descriptor
     int baud;       // baud rate
+
+    // Outgoing packets are encoded in place
+    uint8_t tx[DYNAMIXEL_MAX_PACKET];
+
+    // Received bytes not yet consumed by the parser
+    uint8_t rx[SERIAL_BUS_RX_SIZE];
+    int rx_head, rx_tail;
+
+    // Status packet parser. Resumable, so a packet may span many reads
+    int state;
+    uint8_t pkt_id;
+    int pkt_len;        // error code + params + checksum
+    int pkt_have;
+    int pkt_sum;
+    uint8_t pkt[256];
 };
 
 dynamixel_msg_t * serial_bus_send_command(dynamixel_bus_t *bus,
@@ -16,6 +33,29 @@ dynamixel_msg_t * serial_bus_send_command(dynamixel_bus_t *bus,
                                           dynamixel_msg_t *params,
                                           int retry);
 
+int serial_bus_send_command_buf(dynamixel_bus_t *bus,
+                                int id,
+                                int instruction,
+                                const dynamixel_msg_t *params,
+                                int retry,
+                                dynamixel_msg_t *resp,
+                                int maxlen);
+
+void serial_bus_sync_write(dynamixel_bus_t *bus,
+                           uint8_t addr,
+                           int len,
+                           const uint8_t *ids,
+                           const uint8_t *data,
+                           int count);
+
+int serial_bus_bulk_read(dynamixel_bus_t *bus,
+                         uint8_t addr,
+                         int len,
+                         const uint8_t *ids,
+                         int count,
+                         dynamixel_msg_t **resps,
+                         int use_bulk);
+
 dynamixel_bus_t * serial_bus_create(const char *device, int baud);
 void serial_bus_destroy(dynamixel_bus_t *bus);
 
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <termios.h>
+
+#include "common/getopt.h"
+
+#include "dynamixel_serial_bus.h"
+#include "dynamixel_device.h"
+
+// Exercises the serial transport against a fake servo chain on a pty.
+// The fake answers READ_DATA and BULK_READ with data derived from the
+// id and address, and regularly puts line noise and stale status packets
+// for an unknown id ahead of its replies. Every sweep must still return
+// the right bytes for every servo.
+
+#define STALE_ID 0xfd
+
+static int master_fd;
+static int noise_every;
+
+static uint8_t
+servo_byte(int id, int addr)
+{
+    return (addr + id) & 0xff;
+}
+
+static void
+write_status(uint8_t *out, int *k, int id, const uint8_t *data, int n)
+{
+    int sum = id + n + 2;
+    out[(*k)++] = 0xff;
+    out[(*k)++] = 0xff;
+    out[(*k)++] = id;
+    out[(*k)++] = n + 2;
+    out[(*k)++] = 0;
+    for (int i = 0; i < n; i++) {
+        out[(*k)++] = data[i];
+        sum += data[i];
+    }
+    out[(*k)++] = ~sum & 0xff;
+}
+
+static void
+reply(int id, int addr, int n)
+{
+    static int count = 0;
+    uint8_t data[256], out[2*DYNAMIXEL_MAX_PACKET + 8];
+    int k = 0;
+
+    if (noise_every > 0 && ++count % noise_every == 0) {
+        // A lone 0xff, then a complete packet nobody asked for
+        out[k++] = 0x13;
+        out[k++] = 0xff;
+        out[k++] = 0x42;
+        memset(data, 0x55, n);
+        write_status(out, &k, STALE_ID, data, n);
+    }
+
+    for (int i = 0; i < n; i++)
+        data[i] = servo_byte(id, addr + i);
+    write_status(out, &k, id, data, n);
+
+    if (write(master_fd, out, k) != k)
+        printf("WRN: short write on pty\n");
+}
+
+static void *
+servo_loop(void *user)
+{
+    uint8_t buf[2*DYNAMIXEL_MAX_PACKET];
+    int have = 0;
+
+    while (1) {
+        int res = read(master_fd, buf + have, sizeof(buf) - have);
+        if (res <= 0)
+            continue;
+        have += res;
+
+        while (have >= 6) {
+            if (buf[0] != 0xff || buf[1] != 0xff) {
+                memmove(buf, buf + 1, --have);
+                continue;
+            }
+            int len = buf[3];
+            if (have < len + 4)
+                break;
+
+            int id = buf[2];
+            const uint8_t *params = buf + 5;
+            switch (buf[4]) {
+                case INST_PING:
+                case INST_WRITE_DATA:
+                    reply(id, 0, 0);
+                    break;
+                case INST_READ_DATA:
+                    if (len == 4)
+                        reply(id, params[0], params[1]);
+                    break;
+                case INST_BULK_READ:
+                    // 0x00, then (len, id, addr) per servo
+                    for (int i = 1; i + 2 < len - 2; i += 3)
+                        reply(params[i+1], params[i+2], params[i]);
+                    break;
+                default:
+                    break;
+            }
+
+            memmove(buf, buf + len + 4, have - len - 4);
+            have -= len + 4;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+check(const dynamixel_msg_t *resp, int id, int addr, int len)
+{
+    if (resp == NULL || resp->len != len + 2 || resp->buf[0] != 0)
+        return -1;
+    for (int i = 0; i < len; i++)
+        if (resp->buf[1+i] != servo_byte(id, addr + i))
+            return -1;
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    setvbuf (stdout, (char *) NULL, _IONBF, 0);
+
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt, 'h', "help", 0, "Show this help screen");
+    getopt_add_int(gopt, 'n', "num-servos", "6", "Number of fake servos");
+    getopt_add_int(gopt, 'i', "iterations", "1000", "Sweeps per read pattern");
+    getopt_add_int(gopt, '\0', "noise-every", "3", "Put noise ahead of every Nth reply, 0 disables");
+
+    if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help")) {
+        getopt_do_usage(gopt);
+        exit(-1);
+    }
+
+    int num_servos = getopt_get_int(gopt, "num-servos");
+    int iters = getopt_get_int(gopt, "iterations");
+    noise_every = getopt_get_int(gopt, "noise-every");
+
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd < 0 || grantpt(master_fd) || unlockpt(master_fd)) {
+        printf("ERR: could not open a pty\n");
+        exit(-1);
+    }
+
+    dynamixel_bus_t *bus = serial_bus_create(ptsname(master_fd), 1000000);
+
+    struct termios tio;
+    tcgetattr(master_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master_fd, TCSANOW, &tio);
+
+    pthread_t servo_thread;
+    pthread_create(&servo_thread, NULL, servo_loop, NULL);
+
+    uint8_t *ids = calloc(num_servos, sizeof(*ids));
+    dynamixel_msg_t **resps = calloc(num_servos, sizeof(*resps));
+    for (int i = 0; i < num_servos; i++) {
+        ids[i] = i + 1;
+        resps[i] = dynamixel_msg_create(STATUS_LEN + 2);
+    }
+
+    uint8_t params_buf[2] = { STATUS_ADDR, STATUS_LEN };
+    dynamixel_msg_t params = { .len = 2, .buf = params_buf };
+
+    int failures[3] = { 0, 0, 0 };
+    for (int it = 0; it < iters; it++) {
+        for (int i = 0; i < num_servos; i++) {
+            int res = bus->send_command_buf(bus, ids[i], INST_READ_DATA, &params, 0,
+                                            resps[i], STATUS_LEN + 2);
+            if (res < 0 || check(resps[i], ids[i], STATUS_ADDR, STATUS_LEN) < 0)
+                failures[0]++;
+        }
+
+        for (int use_bulk = 0; use_bulk < 2; use_bulk++) {
+            bus->bulk_read(bus, STATUS_ADDR, STATUS_LEN, ids, num_servos, resps, use_bulk);
+            for (int i = 0; i < num_servos; i++)
+                if (check(resps[i], ids[i], STATUS_ADDR, STATUS_LEN) < 0)
+                    failures[1+use_bulk]++;
+        }
+    }
+
+    printf("%d sweeps of %d servos, noise ahead of every %d replies\n",
+           iters, num_servos, noise_every);
+    printf("sequential reads  %6d bad\n", failures[0]);
+    printf("per-servo reads   %6d bad\n", failures[1]);
+    printf("bulk reads        %6d bad\n", failures[2]);
+
+    for (int i = 0; i < num_servos; i++)
+        dynamixel_msg_destroy(resps[i]);
+    free(resps);
+    free(ids);
+    bus->destroy(bus);
+    getopt_destroy(gopt);
+
+    return (failures[0] + failures[1] + failures[2]) ? 1 : 0;
+}
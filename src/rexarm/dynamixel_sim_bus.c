@@ -0,0 +1,405 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "common/timestamp.h"
+
+#include "dynamixel_sim_bus.h"
+#include "dynamixel_device.h"
+
+// Speed register full scale, 0x3ff * 0.114 rpm
+#define FULL_SPEED_RAD_PER_SEC (0x3ff * 0.114 * 2 * M_PI / 60)
+
+// Control table addresses used by the model
+#define REG_MODEL           0x00
+#define REG_FIRMWARE        0x02
+#define REG_ID              0x03
+#define REG_BAUD            0x04
+#define REG_RETURN_DELAY    0x05
+#define REG_CW_LIMIT        0x06
+#define REG_CCW_LIMIT       0x08
+#define REG_MAX_TORQUE      0x0e
+#define REG_STATUS_RETURN   0x10
+#define REG_ALARM_SHUTDOWN  0x12
+#define REG_GOAL_POSITION   0x1e
+#define REG_MOVING_SPEED    0x20
+#define REG_TORQUE_LIMIT    0x22
+#define REG_PRESENT_POS     0x24
+#define REG_PRESENT_SPEED   0x26
+#define REG_PRESENT_LOAD    0x28
+#define REG_VOLTAGE         0x2a
+#define REG_TEMPERATURE     0x2b
+#define REG_MOVING          0x2e
+
+// === Servo model ===================================
+static int
+reg16(const sim_servo_t *servo, int addr)
+{
+    return servo->regs[addr] | (servo->regs[addr+1] << 8);
+}
+
+static void
+set_reg16(sim_servo_t *servo, int addr, int v)
+{
+    servo->regs[addr] = v & 0xff;
+    servo->regs[addr+1] = (v >> 8) & 0xff;
+}
+
+static void
+servo_init(sim_servo_t *servo, int id)
+{
+    memset(servo, 0, sizeof(*servo));
+    set_reg16(servo, REG_MODEL, 0x001d);     // MX-28
+    servo->regs[REG_FIRMWARE] = 0x24;
+    servo->regs[REG_ID] = id;
+    servo->regs[REG_BAUD] = 1;
+    servo->regs[REG_RETURN_DELAY] = 2;       // as configured by the driver
+    set_reg16(servo, REG_CCW_LIMIT, 0xfff);
+    set_reg16(servo, REG_MAX_TORQUE, 0x3ff);
+    servo->regs[REG_STATUS_RETURN] = 2;
+    servo->regs[REG_ALARM_SHUTDOWN] = 36;
+    set_reg16(servo, REG_GOAL_POSITION, 0x800);
+    set_reg16(servo, REG_PRESENT_POS, 0x800);
+    set_reg16(servo, REG_TORQUE_LIMIT, 0x3ff);
+    servo->regs[REG_VOLTAGE] = 120;
+    servo->regs[REG_TEMPERATURE] = 40;
+    servo->utime = utime_now();
+}
+
+// Advance the motion model to now and refresh the present-value registers.
+// Joint mode slews toward the goal at the moving speed (0 means top
+// speed); wheel mode turns at the moving speed.
+static void
+servo_update(dynamixel_sim_bus_impl_t *impl, sim_servo_t *servo, int64_t now)
+{
+    double dt = (now - servo->utime) * 1.0e-6;
+    servo->utime = now;
+    if (dt <= 0)
+        return;
+
+    int speedv = reg16(servo, REG_MOVING_SPEED);
+    double vmax = (speedv & 0x3ff) * FULL_SPEED_RAD_PER_SEC / 0x3ff;
+    if ((speedv & 0x3ff) == 0 || vmax > impl->params.max_speed)
+        vmax = impl->params.max_speed;
+
+    if (reg16(servo, REG_CW_LIMIT) == 0 && reg16(servo, REG_CCW_LIMIT) == 0) {
+        servo->velocity = (speedv & 0x400) ? -vmax : vmax;
+        if ((speedv & 0x3ff) == 0)
+            servo->velocity = 0;
+        servo->position += servo->velocity * dt;
+        servo->position = fmod(servo->position + 3*M_PI, 2*M_PI) - M_PI;
+    }
+    else {
+        double goal = reg16(servo, REG_GOAL_POSITION) * 2 * M_PI / 0xfff - M_PI;
+        double err = goal - servo->position;
+        double step = vmax * dt;
+        if (fabs(err) <= step) {
+            servo->velocity = err / dt;
+            servo->position = goal;
+        }
+        else {
+            servo->velocity = (err > 0) ? vmax : -vmax;
+            servo->position += servo->velocity * dt;
+        }
+    }
+
+    int posv = (int) round((servo->position + M_PI) * 0xfff / (2 * M_PI));
+    posv = posv < 0 ? 0 : (posv > 0xfff ? 0xfff : posv);
+    set_reg16(servo, REG_PRESENT_POS, posv);
+
+    int spd = (int) round(fabs(servo->velocity) / FULL_SPEED_RAD_PER_SEC * 0x3ff);
+    spd = spd > 0x3ff ? 0x3ff : spd;
+    set_reg16(servo, REG_PRESENT_SPEED, spd | (servo->velocity < 0 ? 0x400 : 0));
+    set_reg16(servo, REG_PRESENT_LOAD, 0);
+    servo->regs[REG_MOVING] = spd > 0;
+}
+
+// Execute an instruction. The response (error code, data, checksum) is
+// written to out and its length returned; -1 means no response.
+static int
+servo_execute(dynamixel_sim_bus_impl_t *impl,
+              sim_servo_t *servo,
+              int instruction,
+              const uint8_t *params,
+              int plen,
+              uint8_t *out)
+{
+    servo_update(impl, servo, utime_now());
+
+    int n = 1;
+    out[0] = 0;
+
+    switch (instruction) {
+        case INST_PING:
+            break;
+
+        case INST_READ_DATA: {
+            if (plen != 2 || params[0] + params[1] > SIM_BUS_REGS) {
+                out[0] = ERROR_RANGE;
+                break;
+            }
+            int addr = params[0], len = params[1];
+            memcpy(out+1, servo->regs + addr, len);
+            n += len;
+            break;
+        }
+
+        case INST_WRITE_DATA: {
+            if (plen < 2 || params[0] + plen - 1 > SIM_BUS_REGS) {
+                out[0] = ERROR_RANGE;
+                break;
+            }
+            int addr = params[0], len = plen - 1;
+            memcpy(servo->regs + addr, params+1, len);
+            break;
+        }
+
+        default:
+            out[0] = ERROR_INSTRUCTION;
+            break;
+    }
+
+    int checksum = servo->regs[REG_ID] + (n+1);
+    for (int i = 0; i < n; i++)
+        checksum += out[i];
+    out[n] = (checksum & 0xff) ^ 0xff;
+    return n+1;
+}
+
+static sim_servo_t *
+find_servo(dynamixel_sim_bus_impl_t *impl, int id)
+{
+    for (int i = 0; i < impl->params.num_servos; i++) {
+        if (impl->servos[i].regs[REG_ID] == id)
+            return &impl->servos[i];
+    }
+    return NULL;
+}
+
+// Make the caller wait for the modelled bus time
+static void
+charge(dynamixel_sim_bus_impl_t *impl, int nbytes, int extra_us)
+{
+    int64_t us = impl->params.latency_us + extra_us +
+        (int64_t) nbytes * 10 * 1000000 / impl->params.baud;
+
+    impl->stats.transactions++;
+    impl->stats.bytes += nbytes;
+    impl->stats.busy_us += us;
+    if (us > 0)
+        usleep(us);
+}
+
+static int
+roll(dynamixel_sim_bus_impl_t *impl, double p)
+{
+    return p > 0 && rand_r(&impl->rand_state) < p * ((double) RAND_MAX + 1);
+}
+
+// Deliver a response through the error model. Returns 0 if it arrived.
+static int
+deliver(dynamixel_sim_bus_impl_t *impl, int txbytes, int rxbytes)
+{
+    if (roll(impl, impl->params.drop_rate)) {
+        impl->stats.dropped++;
+        charge(impl, txbytes, impl->params.timeout_us);
+        return -1;
+    }
+    charge(impl, txbytes + rxbytes, 0);
+    if (roll(impl, impl->params.error_rate)) {
+        impl->stats.corrupted++;
+        return -1;
+    }
+    return 0;
+}
+
+// === Bus implementation ============================
+static void
+sim_bus_broadcast(dynamixel_sim_bus_impl_t *impl,
+                  int instruction,
+                  const dynamixel_msg_t *params)
+{
+    int plen = params == NULL ? 0 : params->len;
+    charge(impl, 6 + plen, 0);
+
+    if (instruction != INST_SYNC_WRITE || plen < 2)
+        return;
+
+    int addr = params->buf[0], len = params->buf[1];
+    uint8_t wparams[SIM_BUS_REGS+1], out[SIM_BUS_REGS+2];
+    for (int p = 2; p + len + 1 <= plen; p += len + 1) {
+        sim_servo_t *servo = find_servo(impl, params->buf[p]);
+        if (servo == NULL || len > SIM_BUS_REGS)
+            continue;
+        wparams[0] = addr;
+        memcpy(wparams+1, params->buf + p + 1, len);
+        servo_execute(impl, servo, INST_WRITE_DATA, wparams, len+1, out);
+    }
+}
+
+int
+sim_bus_send_command_buf(dynamixel_bus_t *bus,
+                         int id,
+                         int instruction,
+                         const dynamixel_msg_t *params,
+                         int retry,
+                         dynamixel_msg_t *resp,
+                         int maxlen)
+{
+    dynamixel_sim_bus_impl_t *impl = (bus->impl);
+    int plen = params == NULL ? 0 : params->len;
+
+    if (id == BROADCAST_ID) {
+        sim_bus_broadcast(impl, instruction, params);
+        return -1;
+    }
+
+    do {
+        sim_servo_t *servo = find_servo(impl, id);
+        if (servo == NULL) {
+            charge(impl, 6 + plen, impl->params.timeout_us);
+            continue;
+        }
+
+        uint8_t out[256];
+        int n = servo_execute(impl, servo, instruction,
+                              params == NULL ? NULL : params->buf, plen, out);
+        if (deliver(impl, 6 + plen, 4 + n) < 0 || n > maxlen)
+            continue;
+
+        memcpy(resp->buf, out, n);
+        resp->len = n;
+
+        // Same retry policy as the serial bus
+        int errormask = ERROR_ANGLE_LIMIT | ERROR_VOLTAGE | ERROR_OVERLOAD;
+        if ((out[0] & ~errormask) != 0)
+            continue;
+
+        return 0;
+    } while (retry && bus->retry_enable);
+
+    return -1;
+}
+
+dynamixel_msg_t *
+sim_bus_send_command(dynamixel_bus_t *bus,
+                     int id,
+                     int instruction,
+                     dynamixel_msg_t *params,
+                     int retry)
+{
+    uint8_t buf[256];
+    dynamixel_msg_t resp = { .len = 0, .buf = buf };
+
+    if (sim_bus_send_command_buf(bus, id, instruction, params, retry, &resp, sizeof(buf)) < 0)
+        return NULL;
+
+    dynamixel_msg_t *msg = dynamixel_msg_create(resp.len);
+    memcpy(msg->buf, resp.buf, resp.len);
+    return msg;
+}
+
+// One BULK_READ transaction; as on the real bus, a lost reply stalls the
+// rest of the chain, which is then read one servo at a time
+int
+sim_bus_bulk_read(dynamixel_bus_t *bus,
+                  uint8_t addr,
+                  int len,
+                  const uint8_t *ids,
+                  int count,
+                  dynamixel_msg_t **resps,
+                  int use_bulk)
+{
+    dynamixel_sim_bus_impl_t *impl = (bus->impl);
+
+    if (!use_bulk)
+        return dynamixel_bus_bulk_read(bus, addr, len, ids, count, resps, 0);
+
+    uint8_t params[2] = { addr, len };
+    int txbytes = 6 + 1 + 3*count;
+    int rxbytes = 0;
+    int have = 0;
+
+    for (int i = 0; i < count; i++)
+        resps[i]->len = 0;
+
+    for (; have < count; have++) {
+        sim_servo_t *servo = find_servo(impl, ids[have]);
+        if (servo == NULL || roll(impl, impl->params.drop_rate))
+            break;
+
+        int n = servo_execute(impl, servo, INST_READ_DATA, params, 2, resps[have]->buf);
+        resps[have]->len = n;
+        if (roll(impl, impl->params.error_rate)) {
+            impl->stats.corrupted++;
+            break;
+        }
+        rxbytes += 4 + n;
+    }
+
+    if (have == count) {
+        charge(impl, txbytes + rxbytes, 0);
+        return count;
+    }
+
+    if (resps[have]->len == 0)
+        impl->stats.dropped++;
+    resps[have]->len = 0;
+    charge(impl, txbytes + rxbytes, impl->params.timeout_us);
+    return have + dynamixel_bus_bulk_read(bus, addr, len, ids+have, count-have, resps+have, 0);
+}
+
+const sim_bus_stats_t *
+sim_bus_get_stats(dynamixel_bus_t *bus)
+{
+    dynamixel_sim_bus_impl_t *impl = (bus->impl);
+    return &impl->stats;
+}
+
+// === Bus creation and destruction ==================
+void
+sim_bus_params_init(sim_bus_params_t *params, int num_servos)
+{
+    memset(params, 0, sizeof(*params));
+    params->num_servos = num_servos;
+    params->baud = 1000000;
+    params->latency_us = 100;
+    params->timeout_us = 50000;
+    params->max_speed = 55 * 2 * M_PI / 60;     // MX-28 at 12V
+    params->seed = 1;
+}
+
+dynamixel_bus_t *
+sim_bus_create(const sim_bus_params_t *params)
+{
+    dynamixel_bus_t *bus = dynamixel_bus_create();
+
+    dynamixel_sim_bus_impl_t *impl = calloc(1, sizeof(*impl));
+    impl->params = *params;
+    impl->rand_state = params->seed;
+    impl->servos = calloc(params->num_servos, sizeof(*impl->servos));
+    for (int i = 0; i < params->num_servos; i++)
+        servo_init(&impl->servos[i], i);
+
+    bus->impl = impl;
+
+    // Fill in functions
+    bus->send_command = sim_bus_send_command;
+    bus->send_command_buf = sim_bus_send_command_buf;
+    bus->bulk_read = sim_bus_bulk_read;
+    bus->destroy = sim_bus_destroy;
+
+    return bus;
+}
+
+void
+sim_bus_destroy(dynamixel_bus_t *bus)
+{
+    dynamixel_sim_bus_impl_t *impl = (bus->impl);
+    free(impl->servos);
+    free(impl);
+    dynamixel_bus_destroy(bus);
+}
@@ -0,0 +1,84 @@
+#ifndef __DYNAMIXEL_SIM_BUS_H__
+#define __DYNAMIXEL_SIM_BUS_H__
+
+#include <stdint.h>
+
+#include "dynamixel_bus.h"
+
+#define SIM_BUS_REGS 0x32
+
+// Simulated bus parameters. Transaction cost is modelled as a fixed
+// latency plus 10 bit times per byte, and the caller is actually made to
+// wait that long so that timing measurements are meaningful.
+typedef struct sim_bus_params sim_bus_params_t;
+struct sim_bus_params
+{
+    int num_servos;         // MX-28s with ids 0..num_servos-1
+    int baud;               // for byte time
+    int latency_us;         // per transaction: USB, return delay, etc.
+    int timeout_us;         // charged when a reply is dropped
+    double max_speed;       // [rad/s] servo top speed
+    double drop_rate;       // probability a reply is lost
+    double error_rate;      // probability a reply is corrupted
+    unsigned int seed;
+};
+
+typedef struct sim_servo sim_servo_t;
+struct sim_servo
+{
+    uint8_t regs[SIM_BUS_REGS];     // control table
+    double position;                // [rad]
+    double velocity;                // [rad/s]
+    int64_t utime;                  // dynamics last advanced
+};
+
+typedef struct sim_bus_stats sim_bus_stats_t;
+struct sim_bus_stats
+{
+    int64_t transactions;
+    int64_t bytes;
+    int64_t dropped;
+    int64_t corrupted;
+    int64_t busy_us;        // simulated time the bus was in use
+};
+
+typedef struct dynamixel_sim_bus_impl dynamixel_sim_bus_impl_t;
+struct dynamixel_sim_bus_impl
+{
+    sim_bus_params_t params;
+    sim_servo_t *servos;
+    sim_bus_stats_t stats;
+    unsigned int rand_state;
+};
+
+// Fill in defaults: 1 Mbps, 100 usec latency, no errors
+void sim_bus_params_init(sim_bus_params_t *params, int num_servos);
+
+dynamixel_bus_t * sim_bus_create(const sim_bus_params_t *params);
+void sim_bus_destroy(dynamixel_bus_t *bus);
+
+dynamixel_msg_t * sim_bus_send_command(dynamixel_bus_t *bus,
+                                       int id,
+                                       int instruction,
+                                       dynamixel_msg_t *params,
+                                       int retry);
+
+int sim_bus_send_command_buf(dynamixel_bus_t *bus,
+                             int id,
+                             int instruction,
+                             const dynamixel_msg_t *params,
+                             int retry,
+                             dynamixel_msg_t *resp,
+                             int maxlen);
+
+int sim_bus_bulk_read(dynamixel_bus_t *bus,
+                      uint8_t addr,
+                      int len,
+                      const uint8_t *ids,
+                      int count,
+                      dynamixel_msg_t **resps,
+                      int use_bulk);
+
+const sim_bus_stats_t * sim_bus_get_stats(dynamixel_bus_t *bus);
+
+#endif
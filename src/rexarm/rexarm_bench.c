@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common/getopt.h"
+#include "common/timestamp.h"
+
+#include "dynamixel_sim_bus.h"
+#include "dynamixel_device.h"
+
+// Compares bus access patterns against the simulated bus: per-servo goal
+// writes vs SYNC_WRITE, and sequential status reads vs BULK_READ.
+
+static void
+report(const char *name, dynamixel_bus_t *bus, int64_t utime0, int iters,
+       sim_bus_stats_t *last)
+{
+    const sim_bus_stats_t *stats = sim_bus_get_stats(bus);
+    double dt = (utime_now() - utime0) * 1.0e-6;
+
+    printf("%-16s %8.1f Hz  %6.2f transactions  %7.1f bytes  %4ld dropped  %4ld corrupted\n",
+           name, iters / dt,
+           (double) (stats->transactions - last->transactions) / iters,
+           (double) (stats->bytes - last->bytes) / iters,
+           (long) (stats->dropped - last->dropped),
+           (long) (stats->corrupted - last->corrupted));
+    *last = *stats;
+}
+
+int
+main(int argc, char *argv[])
+{
+    setvbuf (stdout, (char *) NULL, _IONBF, 0);
+
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt, 'h', "help", 0, "Show this help screen");
+    getopt_add_int(gopt, 'n', "num-servos", "6", "Number of simulated servos");
+    getopt_add_int(gopt, 'i', "iterations", "200", "Sweeps per test");
+    getopt_add_int(gopt, 'b', "baud", "1000000", "Simulated baud rate");
+    getopt_add_int(gopt, '\0', "latency", "100", "Per-transaction latency [us]");
+    getopt_add_double(gopt, '\0', "drop-rate", "0", "Probability a reply is lost");
+    getopt_add_double(gopt, '\0', "error-rate", "0", "Probability a reply is corrupted");
+
+    if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help")) {
+        getopt_do_usage(gopt);
+        exit(-1);
+    }
+
+    int num_servos = getopt_get_int(gopt, "num-servos");
+    int iters = getopt_get_int(gopt, "iterations");
+
+    sim_bus_params_t params;
+    sim_bus_params_init(&params, num_servos);
+    params.baud = getopt_get_int(gopt, "baud");
+    params.latency_us = getopt_get_int(gopt, "latency");
+    params.drop_rate = getopt_get_double(gopt, "drop-rate");
+    params.error_rate = getopt_get_double(gopt, "error-rate");
+
+    dynamixel_bus_t *bus = sim_bus_create(&params);
+
+    dynamixel_device_t **servos = calloc(num_servos, sizeof(*servos));
+    uint8_t *ids = calloc(num_servos, sizeof(*ids));
+    uint8_t *goals = calloc(num_servos, GOAL_LEN);
+    dynamixel_msg_t **resps = calloc(num_servos, sizeof(*resps));
+    dynamixel_device_status_t stat;
+
+    for (int id = 0; id < num_servos; id++) {
+        servos[id] = bus->get_servo(bus, id);
+        if (servos[id] == NULL) {
+            printf("ERR: simulated servo %d did not respond\n", id);
+            exit(-1);
+        }
+        ids[id] = id;
+        resps[id] = dynamixel_msg_create(STATUS_LEN + 2);
+    }
+
+    sim_bus_stats_t last = *sim_bus_get_stats(bus);
+    printf("%d servos, %d baud, %d us latency\n", num_servos, params.baud, params.latency_us);
+
+    int64_t utime0 = utime_now();
+    for (int k = 0; k < iters; k++) {
+        for (int id = 0; id < num_servos; id++)
+            servos[id]->set_goal(servos[id], 0.1 * (k & 1), 0.5, 0.5);
+    }
+    report("set_goal", bus, utime0, iters, &last);
+
+    utime0 = utime_now();
+    for (int k = 0; k < iters; k++) {
+        for (int id = 0; id < num_servos; id++)
+            servos[id]->encode_goal(servos[id], 0.1 * (k & 1), 0.5, 0.5, goals + id*GOAL_LEN);
+        bus->sync_write(bus, GOAL_ADDR, GOAL_LEN, ids, goals, num_servos);
+    }
+    report("sync_write", bus, utime0, iters, &last);
+
+    for (int use_bulk = 0; use_bulk <= 1; use_bulk++) {
+        int ok = 0;
+        utime0 = utime_now();
+        for (int k = 0; k < iters; k++) {
+            bus->bulk_read(bus, STATUS_ADDR, STATUS_LEN, ids, num_servos, resps, use_bulk);
+            for (int id = 0; id < num_servos; id++)
+                ok += servos[id]->decode_status(servos[id], resps[id], &stat) == 0;
+        }
+        report(use_bulk ? "bulk_read" : "sequential read", bus, utime0, iters, &last);
+        if (ok != iters * num_servos)
+            printf("WRN: %d of %d status reads failed\n", iters * num_servos - ok, iters * num_servos);
+    }
+
+    for (int id = 0; id < num_servos; id++) {
+        servos[id]->destroy(servos[id]);
+        dynamixel_msg_destroy(resps[id]);
+    }
+    free(servos);
+    free(ids);
+    free(goals);
+    free(resps);
+    bus->destroy(bus);
+    getopt_destroy(gopt);
+    return 0;
+}
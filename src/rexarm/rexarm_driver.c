@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <math.h>
 #include <sys/select.h>
@@ -13,6 +14,7 @@
 #include "lcmtypes/dynamixel_command_t.h"
 #include "lcmtypes/dynamixel_status_list_t.h"
 #include "lcmtypes/dynamixel_status_t.h"
+#include "lcmtypes/dynamixel_trajectory_t.h"
 
 #include "common/getopt.h"
 #include "common/timestamp.h"
@@ -20,11 +22,19 @@
 
 #include "dynamixel_device.h"
 #include "dynamixel_serial_bus.h"
+#include "dynamixel_sim_bus.h"
+#include "rexarm_trajectory.h"
 
 #define dmax(A, B) (A > B ? A : B)
 #define dmin(A, B) (A < B ? A : B)
 #define dabs(A) (A < 0 ? -A : A)
 
+// While streaming a trajectory, each servo's speed limit is its planned
+// speed plus a margin, so it can track the setpoint, with a floor so a
+// momentarily still joint still settles (and avoids the stop read-back)
+#define TRAJ_SPEED_MARGIN 1.25
+#define TRAJ_MIN_SPEEDFRAC 0.05
+
 typedef struct arm_state arm_state_t;
 struct arm_state
 {
@@ -35,24 +45,35 @@ struct arm_state
 
     // LCM
     lcm_t *lcm;
-    pthread_mutex_t cmd_lock;
-    dynamixel_command_list_t *cmds;
     const char *command_channel;
     const char *status_channel;
+    const char *trajectory_channel;
+    int status_hz;
 
-    // Threading
-    pthread_mutex_t serial_lock;
-    pthread_t status_thread;
-    pthread_t driver_thread;
+    // Latest commands from LCM, waiting for the bus thread. Signalling
+    // cmd_cond wakes the bus thread so commands go out ahead of reads.
+    pthread_mutex_t cmd_lock;
+    pthread_cond_t cmd_cond;
+    dynamixel_command_t *cmds;
+    int num_cmds;
+    int cmds_pending;
+    dynamixel_trajectory_t *traj;   // latest trajectory, until the bus thread takes it
+
+    // Threading. Only the bus thread touches the serial port.
+    pthread_t bus_thread;
+    pthread_t lcm_thread;
 };
 
 static arm_state_t *
-arm_state_create (const char *busname, const int baud, const int num_servos)
+arm_state_create (dynamixel_bus_t *bus, const int num_servos)
 {
     arm_state_t *arm_state = calloc (1, sizeof (*arm_state));
-    arm_state->bus = serial_bus_create (busname, baud);
+    arm_state->bus = bus;
     arm_state->servos = calloc (num_servos, sizeof (*arm_state->servos));
     arm_state->num_servos = num_servos;
+    arm_state->cmds = calloc (num_servos, sizeof (*arm_state->cmds));
+    pthread_mutex_init (&arm_state->cmd_lock, NULL);
+    pthread_cond_init (&arm_state->cmd_cond, NULL);
 
     // Create the servos
     for (int id = 0; id < num_servos; id++) {
@@ -78,135 +99,363 @@ arm_state_destroy (arm_state_t *arm_state)
     }
     arm_state->bus->destroy (arm_state->bus);
     free (arm_state->servos);
+    free (arm_state->cmds);
     lcm_destroy (arm_state->lcm);
     free (arm_state);
 }
 
 
+// === LCM Handler ==============
+static void
+command_handler (const lcm_recv_buf_t *rbuf,
+                 const char *channel,
+                 const dynamixel_command_list_t *msg,
+                 void *user)
+{
+    arm_state_t *arm_state = user;
+
+    int len = msg->len;
+    if (len > arm_state->num_servos) {
+        printf ("error: cmds_len %d > num_servos %d, consuming only the first num_servos cmds\n",
+                msg->len, arm_state->num_servos);
+        len = arm_state->num_servos;
+    }
+
+    pthread_mutex_lock (&arm_state->cmd_lock);
+    memcpy (arm_state->cmds, msg->commands, len * sizeof (*arm_state->cmds));
+    arm_state->num_cmds = len;
+    arm_state->cmds_pending = 1;
+    pthread_cond_signal (&arm_state->cmd_cond);
+    pthread_mutex_unlock (&arm_state->cmd_lock);
+}
+
+static void
+trajectory_handler (const lcm_recv_buf_t *rbuf,
+                    const char *channel,
+                    const dynamixel_trajectory_t *msg,
+                    void *user)
+{
+    arm_state_t *arm_state = user;
+
+    if (msg->nservos != arm_state->num_servos || msg->npoints < 1) {
+        printf ("error: trajectory has %d servos and %d points, need %d servos\n",
+                msg->nservos, msg->npoints, arm_state->num_servos);
+        return;
+    }
+
+    dynamixel_trajectory_t *traj = dynamixel_trajectory_t_copy (msg);
+
+    pthread_mutex_lock (&arm_state->cmd_lock);
+    dynamixel_trajectory_t *old = arm_state->traj;
+    arm_state->traj = traj;
+    pthread_cond_signal (&arm_state->cmd_cond);
+    pthread_mutex_unlock (&arm_state->cmd_lock);
+
+    if (old != NULL)
+        dynamixel_trajectory_t_destroy (old);
+}
+
 void *
-status_loop (void *user)
+lcm_loop (void *user)
 {
-    printf ("NFO: Starting status loop.\n");
     arm_state_t *arm_state = user;
 
+    while (1)
+        lcm_handle (arm_state->lcm);
+
+    return NULL;
+}
+
+// === Bus scheduling ===========
+// The bus thread owns the serial port. Time is divided into status slots
+// at status_hz; while waiting for the next slot it sleeps on cmd_cond,
+// so a command is written as soon as it arrives. Reads are split at
+// transaction granularity (one bulk read, or one servo at a time without
+// bulk support) and pending commands are written between transactions,
+// so a command never waits behind a whole status sweep.
+typedef struct bus_sched bus_sched_t;
+struct bus_sched
+{
+    arm_state_t *arm_state;
+
+    // Commands
+    dynamixel_command_t *cmds;
+    dynamixel_command_t *last_cmds;
+    uint8_t *sync_ids;
+    uint8_t *sync_goals;
+
+    // Status
+    int use_bulk;
+    uint8_t *ids;
+    dynamixel_msg_t **resps;
+    dynamixel_device_status_t *stat;
     dynamixel_status_list_t stats;
-    stats.len = arm_state->num_servos;
-    stats.statuses = calloc (arm_state->num_servos, sizeof (*stats.statuses));
-    while (1) {
-        int64_t utime = utime_now ();
 
-        pthread_mutex_lock (&arm_state->serial_lock);
-        for (int id = 0; id < arm_state->num_servos; id++) {
-            stats.statuses[id].utime = utime_now ();
+    // Trajectory being streamed
+    rexarm_trajectory_t *traj;
+    int traj_running;
+    double traj_torque;
+    double *traj_pos;
+    double *traj_vel;
+    double *traj_start;
+};
 
-            dynamixel_device_status_t *stat = arm_state->servos[id]->get_status (arm_state->servos[id]);
+static bus_sched_t *
+bus_sched_create (arm_state_t *arm_state)
+{
+    int num_servos = arm_state->num_servos;
+
+    // Everything the bus thread touches is allocated up front
+    bus_sched_t *sched = calloc (1, sizeof (*sched));
+    sched->arm_state = arm_state;
+    sched->cmds = calloc (num_servos, sizeof (*sched->cmds));
+    sched->last_cmds = calloc (num_servos, sizeof (*sched->last_cmds));
+    sched->sync_ids = malloc (num_servos * sizeof (*sched->sync_ids));
+    sched->sync_goals = malloc (num_servos * GOAL_LEN * sizeof (*sched->sync_goals));
+
+    sched->use_bulk = 1;
+    sched->ids = malloc (num_servos * sizeof (*sched->ids));
+    sched->resps = malloc (num_servos * sizeof (*sched->resps));
+    sched->stat = dynamixel_device_status_create ();
+    sched->stats.len = num_servos;
+    sched->stats.statuses = calloc (num_servos, sizeof (*sched->stats.statuses));
+    for (int id = 0; id < num_servos; id++) {
+        sched->ids[id] = arm_state->servos[id]->id;
+        sched->resps[id] = dynamixel_msg_create (STATUS_LEN + 2);
+        sched->use_bulk &= arm_state->servos[id]->bulk_read;
+    }
 
-            stats.statuses[id].error_flags = stat->error_flags;
-            stats.statuses[id].position_radians = stat->position_radians;
-            stats.statuses[id].speed = stat->speed;
-            stats.statuses[id].load = stat->load;
-            stats.statuses[id].voltage = stat->voltage;
-            stats.statuses[id].temperature = stat->temperature;
+    sched->traj = rexarm_trajectory_create (num_servos);
+    sched->traj_pos = calloc (num_servos, sizeof (*sched->traj_pos));
+    sched->traj_vel = calloc (num_servos, sizeof (*sched->traj_vel));
+    sched->traj_start = calloc (num_servos, sizeof (*sched->traj_start));
 
-            dynamixel_device_status_destroy (stat);
-        }
-        pthread_mutex_unlock (&arm_state->serial_lock);
+    return sched;
+}
 
-        // Publish
-        dynamixel_status_list_t_publish (arm_state->lcm, arm_state->status_channel, &stats);
+// Resend goals that changed, and refresh unchanged ones once a second
+static int
+command_changed (const dynamixel_command_t *cmd, const dynamixel_command_t *last_cmd)
+{
+    return ((cmd->utime - last_cmd->utime) > 1000000 ||
+            last_cmd->position_radians != cmd->position_radians ||
+            last_cmd->speed != cmd->speed ||
+            last_cmd->max_torque != cmd->max_torque);
+}
 
-        // Attempt to send messages at a fixed rate
-        int hz = 15;
-        int64_t max_delay = (1000000 / hz);
-        int64_t now = utime_now ();
-        int64_t delay = imin64 (now - utime, max_delay);
-        utime = now;
-        usleep (max_delay - delay);
+static void
+send_commands (bus_sched_t *sched, int num_cmds)
+{
+    arm_state_t *arm_state = sched->arm_state;
+    dynamixel_command_t *cmds = sched->cmds;
+    dynamixel_command_t *last_cmds = sched->last_cmds;
+
+    int nupdate = 0;
+    for (int id = 0; id < num_cmds; id++)
+        nupdate += command_changed (&cmds[id], &last_cmds[id]);
+
+    // A single servo is cheaper to command directly, since a sync write
+    // carries the overhead of the per-servo id fields
+    int batch = nupdate > 1;
+    int nsync = 0;
+
+    for (int id = 0; id < num_cmds; id++) {
+        dynamixel_command_t cmd = cmds[id];
+        if (!command_changed (&cmd, &last_cmds[id]))
+            continue;
+
+        dynamixel_device_t *servo = arm_state->servos[id];
+        double speed = dmax(0.0, dmin(1.0, cmd.speed));
+        double torque = dmax(0.0, dmin(1.0, cmd.max_torque));
+
+        // Stops need a position read-back, so they always go out alone
+        if (batch && servo->encode_goal (servo, cmd.position_radians, speed, torque,
+                                         sched->sync_goals + nsync*GOAL_LEN) == 0)
+            sched->sync_ids[nsync++] = servo->id;
+        else
+            servo->set_goal (servo, cmd.position_radians, speed, torque);
+
+        last_cmds[id] = cmd;
     }
 
-    return NULL;
+    if (nsync > 0)
+        arm_state->bus->sync_write (arm_state->bus, GOAL_ADDR, GOAL_LEN,
+                                    sched->sync_ids, sched->sync_goals, nsync);
 }
 
-// === LCM Handler ==============
+// Start streaming a trajectory from the arm's last known position
 static void
-command_handler (const lcm_recv_buf_t *rbuf,
-                 const char *channel,
-                 const dynamixel_command_list_t *msg,
-                 void *user)
+load_trajectory (bus_sched_t *sched, const dynamixel_trajectory_t *msg)
 {
-    arm_state_t *arm_state = user;
-    pthread_mutex_lock (&arm_state->cmd_lock);
-    if (arm_state->cmds != NULL)
-        dynamixel_command_list_t_destroy (arm_state->cmds);
+    int num_servos = sched->arm_state->num_servos;
 
-    if (msg->len > arm_state->num_servos) {
-        printf ("error: cmds_len %d > num_servos %d, consuming only the first num_servos cmds\n",
-                msg->len, arm_state->num_servos);
+    int have_status = 1;
+    for (int id = 0; id < num_servos; id++) {
+        sched->traj_start[id] = sched->stats.statuses[id].position_radians;
+        have_status &= sched->stats.statuses[id].utime != 0;
+    }
 
-        int cmds_len = msg->len;
-        dynamixel_command_list_t *msg_tmp = dynamixel_command_list_t_copy (msg);
-        msg_tmp->len = arm_state->num_servos;
-        arm_state->cmds = dynamixel_command_list_t_copy (msg_tmp);
-        msg_tmp->len = cmds_len;
-        dynamixel_command_list_t_destroy (msg_tmp);
+    double *positions = malloc (msg->npoints * num_servos * sizeof (*positions));
+    for (int i = 0; i < msg->npoints; i++)
+        memcpy (positions + i*num_servos, msg->positions[i], num_servos * sizeof (*positions));
+
+    int64_t utime0 = msg->utime ? msg->utime : utime_now ();
+    int interp = (msg->interpolation == DYNAMIXEL_TRAJECTORY_T_INTERP_QUINTIC) ?
+        REXARM_INTERP_QUINTIC : REXARM_INTERP_CUBIC;
+    if (rexarm_trajectory_set (sched->traj, utime0, msg->npoints, msg->times, positions,
+                               have_status ? sched->traj_start : NULL, interp) < 0) {
+        printf ("error: ignoring trajectory with bad waypoint times\n");
+        rexarm_trajectory_clear (sched->traj);
+        sched->traj_running = 0;
     }
-    else
-        arm_state->cmds = dynamixel_command_list_t_copy (msg);
+    else {
+        sched->traj_running = 1;
+        sched->traj_torque = dmax(0.0, dmin(1.0, msg->max_torque));
+    }
+
+    free (positions);
+}
+
+// Send the current trajectory setpoint. Once the trajectory ends, its
+// final point is sent one last time and streaming stops.
+static void
+stream_trajectory (bus_sched_t *sched)
+{
+    int num_servos = sched->arm_state->num_servos;
+    int64_t now = utime_now ();
+
+    if (!sched->traj_running)
+        return;
 
+    if (!rexarm_trajectory_active (sched->traj, now))
+        sched->traj_running = 0;
+
+    rexarm_trajectory_eval (sched->traj, now, sched->traj_pos, sched->traj_vel);
+    for (int id = 0; id < num_servos; id++) {
+        dynamixel_device_t *servo = sched->arm_state->servos[id];
+        double speed = fabs (sched->traj_vel[id]) * TRAJ_SPEED_MARGIN /
+            servo->get_max_speed_radians (servo);
+
+        sched->cmds[id].utime = now;
+        sched->cmds[id].position_radians = sched->traj_pos[id];
+        sched->cmds[id].speed = dmax(TRAJ_MIN_SPEEDFRAC, speed);
+        sched->cmds[id].max_torque = sched->traj_torque;
+    }
+    send_commands (sched, num_servos);
+
+    if (!sched->traj_running)
+        rexarm_trajectory_clear (sched->traj);
+}
+
+// Wait until commands or a trajectory arrive, or the deadline passes.
+// Commands, if any, are copied into sched->cmds and their count is
+// returned. A new trajectory is loaded for streaming.
+static int
+take_commands (bus_sched_t *sched, int64_t deadline)
+{
+    arm_state_t *arm_state = sched->arm_state;
+
+    pthread_mutex_lock (&arm_state->cmd_lock);
+    while (!arm_state->cmds_pending && arm_state->traj == NULL && utime_now () < deadline) {
+        struct timespec ts = {
+            .tv_sec = deadline / 1000000,
+            .tv_nsec = (deadline % 1000000) * 1000,
+        };
+        pthread_cond_timedwait (&arm_state->cmd_cond, &arm_state->cmd_lock, &ts);
+    }
+
+    int num_cmds = 0;
+    if (arm_state->cmds_pending) {
+        num_cmds = arm_state->num_cmds;
+        memcpy (sched->cmds, arm_state->cmds, num_cmds * sizeof (*sched->cmds));
+        arm_state->cmds_pending = 0;
+    }
+    dynamixel_trajectory_t *msg = arm_state->traj;
+    arm_state->traj = NULL;
     pthread_mutex_unlock (&arm_state->cmd_lock);
+
+    if (msg != NULL) {
+        load_trajectory (sched, msg);
+        dynamixel_trajectory_t_destroy (msg);
+    }
+
+    // Direct commands take over from any trajectory
+    if (num_cmds > 0) {
+        rexarm_trajectory_clear (sched->traj);
+        sched->traj_running = 0;
+    }
+
+    return num_cmds;
+}
+
+// Read status for servos [first, first+count) and fill in the status list
+static void
+read_status (bus_sched_t *sched, int first, int count)
+{
+    arm_state_t *arm_state = sched->arm_state;
+
+    arm_state->bus->bulk_read (arm_state->bus, STATUS_ADDR, STATUS_LEN,
+                               sched->ids + first, count, sched->resps + first,
+                               sched->use_bulk);
+
+    int64_t now = utime_now ();
+    for (int id = first; id < first + count; id++) {
+        dynamixel_device_t *servo = arm_state->servos[id];
+
+        // Servos that did not answer keep their last status
+        if (servo->decode_status (servo, sched->resps[id], sched->stat) < 0)
+            continue;
+
+        dynamixel_status_t *st = &sched->stats.statuses[id];
+        st->utime = now;
+        st->error_flags = sched->stat->error_flags;
+        st->position_radians = sched->stat->position_radians;
+        st->speed = sched->stat->speed;
+        st->load = sched->stat->load;
+        st->voltage = sched->stat->voltage;
+        st->temperature = sched->stat->temperature;
+    }
 }
 
 void *
-driver_loop (void *user)
+bus_loop (void *user)
 {
-    printf ("NFO: Starting driver loop.\n");
     arm_state_t *arm_state = user;
+    bus_sched_t *sched = bus_sched_create (arm_state);
+    int num_servos = arm_state->num_servos;
 
-    dynamixel_command_list_t last_cmds;
-    last_cmds.len = arm_state->num_servos;
-    last_cmds.commands = malloc (arm_state->num_servos * sizeof (dynamixel_command_t));
-    for (int id = 0; id < arm_state->num_servos; id++) {
-        last_cmds.commands[id].utime = 0;
-        last_cmds.commands[id].position_radians = 0.0;
-        last_cmds.commands[id].speed = 0.0;
-        last_cmds.commands[id].max_torque = 0.0;
-    }
+    printf ("NFO: Starting bus loop, reading status %s at %d Hz\n",
+            sched->use_bulk ? "with bulk reads" : "one servo at a time",
+            arm_state->status_hz);
 
-    // Handle messages as they come in from the arm
+    int64_t period = 1000000 / arm_state->status_hz;
+    int64_t next_slot = utime_now ();
     while (1) {
-        int hz = 100;
-        int ret = lcm_handle_timeout (arm_state->lcm, 1000/hz);
-        if (ret < 0) {
-            printf ("error: lcm_handle_timeout()\n");
-            continue;
-        }
-        else if (ret == 0) // timeout
-            continue;
+        // Idle until the next status slot, writing commands as they arrive
+        int num_cmds;
+        while ((num_cmds = take_commands (sched, next_slot)) > 0)
+            send_commands (sched, num_cmds);
+
+        // Trajectories are streamed at the slot rate
+        stream_trajectory (sched);
+
+        // Status sweep, one transaction at a time
+        int step = sched->use_bulk ? num_servos : 1;
+        for (int first = 0; first < num_servos; first += step) {
+            read_status (sched, first, step);
 
-        // Get commands from somewhere
-        pthread_mutex_lock (&arm_state->cmd_lock);
-        dynamixel_command_list_t *cmds = arm_state->cmds;
-        pthread_mutex_unlock (&arm_state->cmd_lock);
-
-        pthread_mutex_lock (&arm_state->serial_lock);
-        for (int id = 0; id < cmds->len; id++) {
-            dynamixel_command_t cmd = cmds->commands[id];
-            dynamixel_command_t last_cmd = last_cmds.commands[id];
-
-            int update = ((cmd.utime - last_cmd.utime) > 1000000 ||
-                          last_cmd.position_radians != cmd.position_radians ||
-                          last_cmd.speed != cmd.speed ||
-                          last_cmd.max_torque != cmd.max_torque);
-
-            if (update) {
-                arm_state->servos[id]->set_goal (arm_state->servos[id],
-                                                 cmd.position_radians,
-                                                 dmax(0.0, dmin(1.0, cmd.speed)),
-                                                 dmax(0.0, dmin(1.0, cmd.max_torque)));
-                last_cmds.commands[id] = cmd;
-            }
+            if ((num_cmds = take_commands (sched, 0)) > 0)
+                send_commands (sched, num_cmds);
         }
-        pthread_mutex_unlock (&arm_state->serial_lock);
+
+        dynamixel_status_list_t_publish (arm_state->lcm, arm_state->status_channel, &sched->stats);
+
+        // Keep the slot plan fixed; if we overran, start again from now
+        // rather than bursting to catch up
+        next_slot += period;
+        int64_t now = utime_now ();
+        if (next_slot < now)
+            next_slot = now;
     }
 
     return NULL;
@@ -223,35 +472,62 @@ main (int argc, char *argv[])
     getopt_add_string (gopt, 'd', "device", "/dev/ttyUSB0", "Device name");
     getopt_add_int (gopt, 'b', "baud", "1000000", "Device baud rate");
     getopt_add_int (gopt, 'n', "num_servos", "4", "Number of servos");
+    getopt_add_int (gopt, '\0', "status-hz", "100", "Status publish rate");
     getopt_add_string (gopt, '\0', "status-channel", "ARM_STATUS", "LCM status channel");
     getopt_add_string (gopt, '\0', "command-channel", "ARM_COMMAND", "LCM command channel");
+    getopt_add_string (gopt, '\0', "trajectory-channel", "ARM_TRAJECTORY", "LCM trajectory channel");
+    getopt_add_bool (gopt, '\0', "sim", 0, "Run against a simulated bus instead of the device");
+    getopt_add_int (gopt, '\0', "sim-latency", "100", "Simulated per-transaction latency [us]");
+    getopt_add_double (gopt, '\0', "sim-drop-rate", "0", "Simulated probability of a lost reply");
 
     if (!getopt_parse (gopt, argc, argv, 1) || getopt_get_bool (gopt, "help")) {
         getopt_do_usage (gopt);
         exit (-1);
     }
 
-    arm_state_t *arm_state = arm_state_create (getopt_get_string (gopt, "device"),
-                                               getopt_get_int (gopt, "baud"),
-                                               getopt_get_int (gopt, "num_servos"));
+    if (getopt_get_int (gopt, "status-hz") <= 0) {
+        printf ("ERR: --status-hz must be positive\n");
+        exit (-1);
+    }
+
+    dynamixel_bus_t *bus;
+    if (getopt_get_bool (gopt, "sim")) {
+        sim_bus_params_t params;
+        sim_bus_params_init (&params, getopt_get_int (gopt, "num_servos"));
+        params.baud = getopt_get_int (gopt, "baud");
+        params.latency_us = getopt_get_int (gopt, "sim-latency");
+        params.drop_rate = getopt_get_double (gopt, "sim-drop-rate");
+        bus = sim_bus_create (&params);
+    }
+    else
+        bus = serial_bus_create (getopt_get_string (gopt, "device"),
+                                 getopt_get_int (gopt, "baud"));
+
+    arm_state_t *arm_state = arm_state_create (bus, getopt_get_int (gopt, "num_servos"));
 
     // LCM Initialization
     arm_state->lcm = lcm_create (NULL);
     arm_state->command_channel = getopt_get_string (gopt, "command-channel");
     arm_state->status_channel = getopt_get_string (gopt, "status-channel");
+    arm_state->trajectory_channel = getopt_get_string (gopt, "trajectory-channel");
+    arm_state->status_hz = getopt_get_int (gopt, "status-hz");
     if (!arm_state->lcm)
         return -1;
     dynamixel_command_list_t_subscribe (arm_state->lcm,
                                         arm_state->command_channel,
                                         command_handler,
                                         arm_state);
+    dynamixel_trajectory_t_subscribe (arm_state->lcm,
+                                      arm_state->trajectory_channel,
+                                      trajectory_handler,
+                                      arm_state);
 
-    pthread_create (&arm_state->status_thread, NULL, status_loop, arm_state);
-    pthread_create (&arm_state->driver_thread, NULL, driver_loop, arm_state);
+    pthread_create (&arm_state->bus_thread, NULL, bus_loop, arm_state);
+    pthread_create (&arm_state->lcm_thread, NULL, lcm_loop, arm_state);
 
     // Probably not needed, given how this operates
-    pthread_join (arm_state->status_thread, NULL);
-    pthread_join (arm_state->driver_thread, NULL);
+    pthread_join (arm_state->bus_thread, NULL);
+    pthread_join (arm_state->lcm_thread, NULL);
 
     // Cleanup
     arm_state_destroy (arm_state);
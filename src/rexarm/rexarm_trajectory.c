@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rexarm_trajectory.h"
+
+struct rexarm_trajectory
+{
+    int nservos;
+    int interpolation;
+
+    int64_t utime0;
+    int npoints;
+    int capacity;
+    double *t;      // [s] since utime0, npoints
+    double *p;      // [rad] npoints x nservos
+    double *v;      // [rad/s] npoints x nservos
+};
+
+rexarm_trajectory_t *
+rexarm_trajectory_create(int nservos)
+{
+    rexarm_trajectory_t *traj = calloc(1, sizeof(*traj));
+    traj->nservos = nservos;
+    return traj;
+}
+
+void
+rexarm_trajectory_destroy(rexarm_trajectory_t *traj)
+{
+    free(traj->t);
+    free(traj->p);
+    free(traj->v);
+    free(traj);
+}
+
+static void
+ensure_capacity(rexarm_trajectory_t *traj, int npoints)
+{
+    if (npoints <= traj->capacity)
+        return;
+
+    traj->capacity = npoints;
+    traj->t = realloc(traj->t, npoints * sizeof(*traj->t));
+    traj->p = realloc(traj->p, npoints * traj->nservos * sizeof(*traj->p));
+    traj->v = realloc(traj->v, npoints * traj->nservos * sizeof(*traj->v));
+}
+
+int
+rexarm_trajectory_set(rexarm_trajectory_t *traj,
+                      int64_t utime0,
+                      int npoints,
+                      const int64_t *times,
+                      const double *positions,
+                      const double *start,
+                      int interpolation)
+{
+    int n = traj->nservos;
+    int first = (start != NULL);
+    int total = npoints + first;
+
+    if (npoints < 1 || (first && times[0] <= 0))
+        return -1;
+    for (int i = 1; i < npoints; i++) {
+        if (times[i] <= times[i-1])
+            return -1;
+    }
+
+    ensure_capacity(traj, total);
+
+    if (first) {
+        traj->t[0] = 0;
+        memcpy(traj->p, start, n * sizeof(*traj->p));
+    }
+    for (int i = 0; i < npoints; i++)
+        traj->t[first+i] = times[i] * 1.0e-6;
+    memcpy(traj->p + first*n, positions, npoints * n * sizeof(*traj->p));
+
+    // Waypoint velocities
+    for (int j = 0; j < n; j++) {
+        traj->v[j] = 0;
+        traj->v[(total-1)*n + j] = 0;
+        for (int i = 1; i+1 < total; i++) {
+            double m0 = (traj->p[i*n+j] - traj->p[(i-1)*n+j]) / (traj->t[i] - traj->t[i-1]);
+            double m1 = (traj->p[(i+1)*n+j] - traj->p[i*n+j]) / (traj->t[i+1] - traj->t[i]);
+            traj->v[i*n+j] = (m0*m1 > 0) ? (m0 + m1) / 2 : 0;
+        }
+    }
+
+    traj->utime0 = utime0;
+    traj->npoints = total;
+    traj->interpolation = interpolation;
+    return 0;
+}
+
+void
+rexarm_trajectory_clear(rexarm_trajectory_t *traj)
+{
+    traj->npoints = 0;
+}
+
+int
+rexarm_trajectory_active(const rexarm_trajectory_t *traj, int64_t utime)
+{
+    if (traj->npoints == 0)
+        return 0;
+    return (utime - traj->utime0) * 1.0e-6 <= traj->t[traj->npoints-1];
+}
+
+int
+rexarm_trajectory_eval(const rexarm_trajectory_t *traj,
+                       int64_t utime,
+                       double *pos,
+                       double *vel)
+{
+    int n = traj->nservos;
+    int last = traj->npoints - 1;
+
+    if (traj->npoints == 0)
+        return -1;
+
+    double t = (utime - traj->utime0) * 1.0e-6;
+
+    // Hold the end points
+    if (t <= traj->t[0] || last == 0 || t >= traj->t[last]) {
+        int i = (t <= traj->t[0]) ? 0 : last;
+        memcpy(pos, traj->p + i*n, n * sizeof(*pos));
+        if (vel != NULL)
+            memset(vel, 0, n * sizeof(*vel));
+        return 0;
+    }
+
+    // Segment lookup. Waypoint counts are small, so a linear scan is fine
+    int i = 0;
+    while (t >= traj->t[i+1])
+        i++;
+
+    double h = traj->t[i+1] - traj->t[i];
+    double s = (t - traj->t[i]) / h;
+    double s2 = s*s, s3 = s2*s;
+
+    // Hermite basis for p0, v0, p1, v1 and derivatives wrt s
+    double b[4], db[4];
+    if (traj->interpolation == REXARM_INTERP_QUINTIC) {
+        // Zero acceleration at the waypoints, so segments join C2
+        double s4 = s3*s, s5 = s4*s;
+        b[0] = 1 - 10*s3 + 15*s4 - 6*s5;
+        b[1] = s - 6*s3 + 8*s4 - 3*s5;
+        b[2] = 10*s3 - 15*s4 + 6*s5;
+        b[3] = -4*s3 + 7*s4 - 3*s5;
+        db[0] = -30*s2 + 60*s3 - 30*s4;
+        db[1] = 1 - 18*s2 + 32*s3 - 15*s4;
+        db[2] = 30*s2 - 60*s3 + 30*s4;
+        db[3] = -12*s2 + 28*s3 - 15*s4;
+    }
+    else {
+        b[0] = 2*s3 - 3*s2 + 1;
+        b[1] = s3 - 2*s2 + s;
+        b[2] = -2*s3 + 3*s2;
+        b[3] = s3 - s2;
+        db[0] = 6*s2 - 6*s;
+        db[1] = 3*s2 - 4*s + 1;
+        db[2] = -6*s2 + 6*s;
+        db[3] = 3*s2 - 2*s;
+    }
+
+    const double *p0 = traj->p + i*n, *p1 = p0 + n;
+    const double *v0 = traj->v + i*n, *v1 = v0 + n;
+    for (int j = 0; j < n; j++) {
+        pos[j] = b[0]*p0[j] + b[1]*h*v0[j] + b[2]*p1[j] + b[3]*h*v1[j];
+        if (vel != NULL)
+            vel[j] = (db[0]*p0[j] + db[1]*h*v0[j] + db[2]*p1[j] + db[3]*h*v1[j]) / h;
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef __REXARM_TRAJECTORY_H__
+#define __REXARM_TRAJECTORY_H__
+
+#include <stdint.h>
+
+#define REXARM_INTERP_CUBIC     0
+#define REXARM_INTERP_QUINTIC   1
+
+// Joint space trajectory through timestamped waypoints. Each joint is
+// interpolated independently with piecewise cubic (C1) or quintic (C2)
+// Hermite segments. Waypoint velocities are the mean of the adjacent
+// segment slopes, or zero at local extrema so the arm does not overshoot
+// a waypoint; the trajectory starts and ends at rest.
+typedef struct rexarm_trajectory rexarm_trajectory_t;
+
+rexarm_trajectory_t *rexarm_trajectory_create(int nservos);
+void rexarm_trajectory_destroy(rexarm_trajectory_t *traj);
+
+// Load a trajectory starting at utime0. times [usec] are relative to
+// utime0 and strictly increasing; positions is npoints x nservos, row
+// major. If start is non-NULL, the trajectory begins there at utime0 (and
+// times[0] must be > 0). Returns -1 if the waypoints are invalid.
+int rexarm_trajectory_set(rexarm_trajectory_t *traj,
+                          int64_t utime0,
+                          int npoints,
+                          const int64_t *times,
+                          const double *positions,
+                          const double *start,
+                          int interpolation);
+
+// Stop following the current trajectory
+void rexarm_trajectory_clear(rexarm_trajectory_t *traj);
+
+// 1 while a trajectory is loaded and not yet finished at utime
+int rexarm_trajectory_active(const rexarm_trajectory_t *traj, int64_t utime);
+
+// Evaluate the setpoint at utime. pos [rad] and vel [rad/s] hold one
+// entry per servo; vel may be NULL. Before the start and after the end,
+// the first and last points are held with zero velocity. Returns -1 if no
+// trajectory is loaded.
+int rexarm_trajectory_eval(const rexarm_trajectory_t *traj,
+                           int64_t utime,
+                           double *pos,
+                           double *vel);
+
+#endif
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "common/getopt.h"
+
+#include "rexarm_trajectory.h"
+
+// Checks the trajectory interpolator on random waypoint sets: every
+// waypoint must be hit, the reported velocity must match central
+// differences of the position, and the arm must start and end at rest.
+
+#define UTIME0 1000000
+#define FD_STEP 100         // [usec]
+
+static double
+urand(double lo, double hi)
+{
+    return lo + (hi - lo) * rand() / (double) RAND_MAX;
+}
+
+int
+main(int argc, char *argv[])
+{
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt, 'h', "help", 0, "Show this help screen");
+    getopt_add_int(gopt, 'n', "num-servos", "6", "Joints per trajectory");
+    getopt_add_int(gopt, 'p', "num-points", "8", "Waypoints per trajectory");
+    getopt_add_int(gopt, 'i', "iterations", "100", "Random trajectories per interpolation");
+    getopt_add_int(gopt, '\0', "seed", "1", "Random seed");
+
+    if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help")) {
+        getopt_do_usage(gopt);
+        exit(-1);
+    }
+
+    int nservos = getopt_get_int(gopt, "num-servos");
+    int npoints = getopt_get_int(gopt, "num-points");
+    int iters = getopt_get_int(gopt, "iterations");
+    srand(getopt_get_int(gopt, "seed"));
+
+    rexarm_trajectory_t *traj = rexarm_trajectory_create(nservos);
+    int64_t *times = calloc(npoints, sizeof(*times));
+    double *positions = calloc(npoints * nservos, sizeof(*positions));
+    double *start = calloc(nservos, sizeof(*start));
+    double *pos = calloc(nservos, sizeof(*pos));
+    double *vel = calloc(nservos, sizeof(*vel));
+    double *pos_lo = calloc(nservos, sizeof(*pos_lo));
+    double *pos_hi = calloc(nservos, sizeof(*pos_hi));
+
+    int failed = 0;
+    for (int interp = REXARM_INTERP_CUBIC; interp <= REXARM_INTERP_QUINTIC; interp++) {
+        double max_wp_err = 0, max_vel_err = 0, max_rest_vel = 0;
+
+        for (int it = 0; it < iters; it++) {
+            int64_t t = 0;
+            for (int i = 0; i < npoints; i++) {
+                t += (int64_t) urand(100000, 1500000);
+                times[i] = t;
+                for (int j = 0; j < nservos; j++)
+                    positions[i*nservos + j] = urand(-M_PI/2, M_PI/2);
+            }
+            for (int j = 0; j < nservos; j++)
+                start[j] = urand(-M_PI/2, M_PI/2);
+
+            if (rexarm_trajectory_set(traj, UTIME0, npoints, times, positions,
+                                      start, interp) < 0) {
+                printf("ERR: trajectory %d was rejected\n", it);
+                failed = 1;
+                continue;
+            }
+
+            for (int i = 0; i < npoints; i++) {
+                rexarm_trajectory_eval(traj, UTIME0 + times[i], pos, NULL);
+                for (int j = 0; j < nservos; j++)
+                    max_wp_err = fmax(max_wp_err, fabs(pos[j] - positions[i*nservos + j]));
+            }
+
+            rexarm_trajectory_eval(traj, UTIME0, pos, vel);
+            for (int j = 0; j < nservos; j++)
+                max_wp_err = fmax(max_wp_err, fabs(pos[j] - start[j]));
+            for (int j = 0; j < nservos; j++)
+                max_rest_vel = fmax(max_rest_vel, fabs(vel[j]));
+            rexarm_trajectory_eval(traj, UTIME0 + times[npoints-1], pos, vel);
+            for (int j = 0; j < nservos; j++)
+                max_rest_vel = fmax(max_rest_vel, fabs(vel[j]));
+
+            // Cubic segments join with a jump in acceleration, so only
+            // difference within a segment
+            int seg = 0;
+            for (int64_t u = UTIME0 + FD_STEP; u < UTIME0 + times[npoints-1]; u += 997) {
+                while (seg < npoints && UTIME0 + times[seg] < u - FD_STEP)
+                    seg++;
+                if (seg < npoints && UTIME0 + times[seg] <= u + FD_STEP)
+                    continue;
+
+                rexarm_trajectory_eval(traj, u, pos, vel);
+                rexarm_trajectory_eval(traj, u - FD_STEP, pos_lo, NULL);
+                rexarm_trajectory_eval(traj, u + FD_STEP, pos_hi, NULL);
+                for (int j = 0; j < nservos; j++) {
+                    double fd = (pos_hi[j] - pos_lo[j]) / (2 * FD_STEP * 1.0e-6);
+                    max_vel_err = fmax(max_vel_err, fabs(fd - vel[j]));
+                }
+            }
+        }
+
+        printf("%-8s waypoint err %8.2e  velocity err %8.2e rad/s  rest velocity %8.2e rad/s\n",
+               interp == REXARM_INTERP_CUBIC ? "cubic" : "quintic",
+               max_wp_err, max_vel_err, max_rest_vel);
+        if (max_wp_err > 1e-9 || max_vel_err > 1e-3 || max_rest_vel > 1e-9)
+            failed = 1;
+    }
+
+    free(times);
+    free(positions);
+    free(start);
+    free(pos);
+    free(vel);
+    free(pos_lo);
+    free(pos_hi);
+    rexarm_trajectory_destroy(traj);
+    getopt_destroy(gopt);
+
+    return failed;
+}